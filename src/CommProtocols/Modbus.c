@@ -9,6 +9,8 @@
  */
 #include <pthread.h>
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -20,6 +22,7 @@ SDB_THREAD_ARENAS_REGISTER(Modbus, 2);
 #include <src/Common/SensorDataPipe.h>
 #include <src/Common/Socket.h>
 #include <src/Common/Thread.h>
+#include <src/Common/Time.h>
 
 
 void
@@ -56,7 +59,7 @@ MbReceiveTcpFrame(int Sockfd, u8 *Frame, size_t BufferSize)
 
     u16 Length = (Frame[4] << 8) | Frame[5]; // Length from Modbus TCP header
 
-    ssize_t TotalFrameSize = MODBUS_TCP_HEADER_LEN + Length;
+    ssize_t TotalFrameSize = MODBUS_TCP_LENGTH_OFFSET + Length;
 
     if(TotalFrameSize > BufferSize) {
         SdbLogDebug("Frame too large for buffer. Total frame size: %zd\n", TotalFrameSize);
@@ -127,69 +130,1110 @@ MbParseTcpFrame(const u8 *Frame, u16 *UnitId, u16 *DataLength)
 /**
  * @brief Prepares Modbus context from configuration file
  *
- * Reads IP address and port from configuration file and initializes
- * connections. Creates and configures sockets for each connection.
+ * Reads the IP address and port of every endpoint from the configuration file. An endpoint is
+ * completed by each `port=` line and uses the most recent `ipv4Addr=` line, so a file may list
+ * any number of sensors. Creates the epoll instance used to serve all connections, but does not
+ * open them.
+ *
+ * With shards, every connection is described in the context, but only the worker's share gets a
+ * receive buffer and is served. The others are marked as foreign.
  *
  * @param MbArena Memory arena for allocations
+ * @param ConnCount Number of connections, 0 for one per configured endpoint
+ * @param Shards Shard table of the thread group, NULL to serve every connection
+ * @param Worker Index of the worker the context is for
  * @return Initialized context or NULL on failure
  */
 modbus_ctx *
-MbPrepareCtx(sdb_arena *MbArena)
+MbPrepareCtx(sdb_arena *MbArena, u64 ConnCount, mb_shard_table *Shards, u32 Worker)
 {
-    modbus_ctx *MbCtx = SdbPushStruct(MbArena, modbus_ctx);
-    MbCtx->ConnCount  = 1;
-    MbCtx->Conns      = SdbPushArray(MbArena, mb_conn, MbCtx->ConnCount);
-
-
     sdb_scratch_arena Scratch = SdbScratchGet(NULL, 0);
     if(!Scratch.Arena) {
         SdbLogError("Failed to get scratch arena");
         return NULL;
     }
 
-
-    sdb_file_data *ConfFile = SdbLoadFileIntoMemory(MODBUS_CONF_FS_PATH, MbArena);
+    sdb_file_data *ConfFile = SdbLoadFileIntoMemory(MODBUS_CONF_FS_PATH, Scratch.Arena);
     if(ConfFile == NULL) {
         SdbLogError("Failed to open config file");
         SdbScratchRelease(Scratch);
         return NULL;
     }
 
+    u64    MaxEndpoints  = ConfFile->Size / SdbStrlen("port=") + 1;
+    char **EndpointIps   = SdbPushArray(Scratch.Arena, char *, MaxEndpoints);
+    int   *EndpointPorts = SdbPushArray(Scratch.Arena, int, MaxEndpoints);
+    u64    EndpointCount = 0;
+
     char *Content = (char *)ConfFile->Data;
     char *IpAddr  = NULL;
-    int   Port    = -1;
 
     char *Line = strtok(Content, "\n");
     while(Line != NULL) {
         if(strncmp(Line, "ipv4Addr=", 9) == 0) {
             IpAddr = Line + 9;
-        } else if(strncmp(Line, "port=", 5) == 0) {
-            Port = atoi(Line + 5);
+        } else if(strncmp(Line, "port=", 5) == 0 && IpAddr != NULL) {
+            EndpointIps[EndpointCount]   = IpAddr;
+            EndpointPorts[EndpointCount] = atoi(Line + 5);
+            ++EndpointCount;
         }
         Line = strtok(NULL, "\n");
     }
 
-    if(IpAddr == NULL || Port == -1) {
+    if(EndpointCount == 0) {
         SdbLogError("Failed to parse IP or port from config file");
         SdbScratchRelease(Scratch);
         return NULL;
     }
 
+    modbus_ctx *MbCtx     = SdbPushStruct(MbArena, modbus_ctx);
+    MbCtx->ConnCount      = (ConnCount > 0) ? ConnCount : EndpointCount;
+    MbCtx->ConnectedCount = 0;
+    MbCtx->OwnedCount     = 0;
+    MbCtx->Worker         = Worker;
+    MbCtx->Shards         = Shards;
+
+    struct timespec Seed;
+    SdbTimeMonotonic(&Seed);
+    MbCtx->JitterState = ((u64)Seed.tv_nsec ^ (Worker + 1) * 0x9E3779B97F4A7C15ULL) | 1;
+    MbCtx->Conns          = SdbPushArrayZero(MbArena, mb_conn, MbCtx->ConnCount);
+    if(MbCtx->Conns == NULL) {
+        SdbLogError("Insufficient memory for %lu Modbus connections", MbCtx->ConnCount);
+        SdbScratchRelease(Scratch);
+        return NULL;
+    }
+
+    MbCtx->EpollFd = epoll_create1(0);
+    if(MbCtx->EpollFd == -1) {
+        SdbLogError("Failed to create epoll: %s", strerror(errno));
+        SdbScratchRelease(Scratch);
+        return NULL;
+    }
 
     mb_conn *Conns = MbCtx->Conns;
     for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
-        Conns[i].Port = Port;
-        Conns[i].Ip   = SdbStringMake(MbArena, IpAddr);
+        u64 Endpoint    = i % EndpointCount;
+        Conns[i].Idx    = i;
+        Conns[i].Port   = EndpointPorts[Endpoint];
+        Conns[i].Ip     = SdbStringMake(MbArena, EndpointIps[Endpoint]);
+        Conns[i].SockFd = -1;
+        Conns[i].State  = MbConn_Disconnected;
+        if(Shards && i % Shards->WorkerCount != Worker) {
+            Conns[i].State = MbConn_Foreign;
+            continue;
+        }
+        ++MbCtx->OwnedCount;
 
-        Conns[i].SockFd = SocketCreate(Conns[i].Ip, Conns[i].Port);
-        if(Conns[i].SockFd == -1) {
-            SdbLogError("Failed to create socket for sensor index %lu", i);
+        Conns[i].RecvBuf = SdbPushArray(MbArena, u8, MB_RECV_BUF_SIZE);
+        if(Conns[i].RecvBuf == NULL) {
+            SdbLogError("Insufficient memory for the receive buffer of connection %lu", i);
+            close(MbCtx->EpollFd);
+            SdbScratchRelease(Scratch);
             return NULL;
-        } else {
-            SdbLogDebug("Modbus thread %lu successfully connected to server %s:%d", i, Conns[i].Ip,
-                        Conns[i].Port);
         }
     }
 
+    SdbLogInfo("Prepared %lu of %lu Modbus connections to %lu endpoints", MbCtx->OwnedCount,
+               MbCtx->ConnCount, EndpointCount);
+    SdbScratchRelease(Scratch);
     return MbCtx;
 }
+
+void
+MbDestroyCtx(modbus_ctx *MbCtx)
+{
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        if(MbCtx->Conns[i].SockFd != -1) {
+            close(MbCtx->Conns[i].SockFd);
+            MbCtx->Conns[i].SockFd = -1;
+        }
+    }
+    if(MbCtx->EpollFd != -1) {
+        close(MbCtx->EpollFd);
+    }
+}
+
+sdb_errno
+MbShardsInit(mb_shard_table *Shards, u64 ConnCount)
+{
+    Shards->ConnCount = ConnCount;
+    Shards->Owners    = malloc(ConnCount * sizeof(*Shards->Owners));
+    if(!Shards->Owners) {
+        return -ENOMEM;
+    }
+
+    for(u64 i = 0; i < ConnCount; ++i) {
+        atomic_init(&Shards->Owners[i], i % Shards->WorkerCount);
+    }
+    for(u32 w = 0; w < Shards->WorkerCount; ++w) {
+        u64 Share = ConnCount / Shards->WorkerCount + (w < ConnCount % Shards->WorkerCount);
+        atomic_init(&Shards->Loads[w].OwnedCount, Share);
+    }
+    atomic_init(&Shards->UnownedCount, 0);
+
+    return 0;
+}
+
+/**
+ * @brief Forgets every queued and outstanding poll, since a new connection can not receive the
+ * responses to requests sent on the old one
+ */
+static void
+PollReset(mb_poller *Poller)
+{
+    for(u32 t = 0; t < MB_POLL_MAX_IN_FLIGHT; ++t) {
+        Poller->Txns[t].InUse = false;
+    }
+    for(u32 g = 0; g < Poller->Conf->GroupCount; ++g) {
+        Poller->Busy[g] = false;
+    }
+    Poller->InFlight     = 0;
+    Poller->BacklogHead  = 0;
+    Poller->BacklogCount = 0;
+    Poller->SendLen      = 0;
+}
+
+/**
+ * @brief Marks a connection as disconnected, forgetting everything received on it
+ */
+static void
+ConnReset(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    if(Conn->State == MbConn_Connected || Conn->State == MbConn_Closing) {
+        --MbCtx->ConnectedCount;
+    }
+    Conn->State    = MbConn_Disconnected;
+    Conn->RecvHead = 0;
+    Conn->RecvTail = 0;
+    if(Conn->Poller) {
+        PollReset(Conn->Poller);
+    }
+}
+
+/**
+ * @brief xorshift64* step of the reconnect jitter
+ */
+static u64
+JitterNext(modbus_ctx *MbCtx)
+{
+    u64 X = MbCtx->JitterState;
+    X ^= X >> 12;
+    X ^= X << 25;
+    X ^= X >> 27;
+    MbCtx->JitterState = X;
+    return X * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief Marks a connection as disconnected and sets the time of its next attempt from its
+ * backoff
+ *
+ * @return Delay until the next attempt
+ */
+static sdb_timediff
+ScheduleReconnect(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    ConnReset(MbCtx, Conn);
+
+    struct timespec Now;
+    SdbTimeMonotonic(&Now);
+
+    sdb_timediff Delay = 0;
+    if(Conn->FailCount++ == 0) {
+        /**< The connection was healthy, so this is likely a blip. Retry at once */
+        Conn->Backoff   = MB_RECONNECT_MIN_DELAY;
+        Conn->DownSince = Now;
+    } else {
+        sdb_timediff Half = Conn->Backoff / 2;
+        Delay             = Half + JitterNext(MbCtx) % (Half + 1);
+        Conn->Backoff     = SdbMin(2 * Conn->Backoff, MB_RECONNECT_MAX_DELAY);
+    }
+
+    Conn->ReconnectAt = Now;
+    SdbTimeAdd(&Conn->ReconnectAt, Delay);
+    return Delay;
+}
+
+void
+MbConnRecovered(mb_conn *Conn)
+{
+    struct timespec Now;
+    SdbTimeMonotonic(&Now);
+    sdb_timediff Downtime = SdbTimeDiff(&Now, &Conn->DownSince);
+
+    ++Conn->RecoveryCount;
+    Conn->RecoveryTotal += Downtime;
+    Conn->RecoveryMax = SdbMax(Conn->RecoveryMax, Downtime);
+    Conn->FailCount   = 0;
+    Conn->Backoff     = MB_RECONNECT_MIN_DELAY;
+    SdbLogDebug("Connection %lu delivered data %lu us after going down", Conn->Idx,
+                SDB_TIME_TO_US(Downtime));
+}
+
+void
+MbShardRelease(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    mb_shard_table *Shards = MbCtx->Shards;
+    if(!Shards || !Shards->Owners || Shards->WorkerCount < 2) {
+        return;
+    }
+
+    SdbAssert(Conn->State == MbConn_Disconnected, "Released connection %lu is open", Conn->Idx);
+    if(Conn->FailCount > 1) {
+        /**< Keep retrying a connection that keeps failing here, under its backoff */
+        return;
+    }
+    Conn->State = MbConn_Foreign;
+    --MbCtx->OwnedCount;
+
+    atomic_fetch_sub(&Shards->Loads[MbCtx->Worker].OwnedCount, 1);
+    atomic_store(&Shards->Owners[Conn->Idx], MB_CONN_UNOWNED);
+    atomic_fetch_add(&Shards->UnownedCount, 1);
+}
+
+mb_conn *
+MbShardClaim(sdb_arena *MbArena, modbus_ctx *MbCtx)
+{
+    mb_shard_table *Shards = MbCtx->Shards;
+    if(!Shards || !Shards->Owners || atomic_load(&Shards->UnownedCount) == 0) {
+        return NULL;
+    }
+
+    u64 Load = atomic_load(&Shards->Loads[MbCtx->Worker].OwnedCount);
+    for(u32 w = 0; w < Shards->WorkerCount; ++w) {
+        if(atomic_load(&Shards->Loads[w].OwnedCount) < Load) {
+            return NULL;
+        }
+    }
+
+    for(u64 i = 0; i < Shards->ConnCount; ++i) {
+        u32 Expected = MB_CONN_UNOWNED;
+        if(atomic_load(&Shards->Owners[i]) != MB_CONN_UNOWNED
+           || !atomic_compare_exchange_strong(&Shards->Owners[i], &Expected, MbCtx->Worker)) {
+            continue;
+        }
+
+        mb_conn *Conn = &MbCtx->Conns[i];
+        if(!Conn->RecvBuf) {
+            Conn->RecvBuf = SdbPushArray(MbArena, u8, MB_RECV_BUF_SIZE);
+            if(!Conn->RecvBuf) {
+                SdbLogWarning("Insufficient memory to take over connection %lu", i);
+                atomic_store(&Shards->Owners[i], MB_CONN_UNOWNED);
+                return NULL;
+            }
+        }
+
+        atomic_fetch_sub(&Shards->UnownedCount, 1);
+        atomic_fetch_add(&Shards->Loads[MbCtx->Worker].OwnedCount, 1);
+        ++MbCtx->OwnedCount;
+
+        /**< Released after its first failure, which is retried at once */
+        ConnReset(MbCtx, Conn);
+        SdbTimeMonotonic(&Conn->ReconnectAt);
+        Conn->DownSince = Conn->ReconnectAt;
+        Conn->FailCount = 1;
+        Conn->Backoff   = MB_RECONNECT_MIN_DELAY;
+        SdbLogDebug("Worker %u took over connection %lu", MbCtx->Worker, i);
+        return Conn;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Switches a connection whose handshake has ended to receiving
+ */
+static sdb_errno
+ConnEstablished(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    if(MbCtx->EpollFd != -1) {
+        struct epoll_event Event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = Conn };
+        if(epoll_ctl(MbCtx->EpollFd, EPOLL_CTL_MOD, Conn->SockFd, &Event) == -1) {
+            SdbLogError("Failed to watch connection %lu for data: %s", Conn->Idx,
+                        strerror(errno));
+            return -errno;
+        }
+    }
+
+    Conn->State    = MbConn_Connected;
+    Conn->RecvHead = 0;
+    Conn->RecvTail = 0;
+    ++MbCtx->ConnectedCount;
+    SdbLogDebug("Modbus connection %lu successfully connected to server %s:%d", Conn->Idx,
+                Conn->Ip, Conn->Port);
+    return 0;
+}
+
+sdb_errno
+MbConnOpen(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    sdb_errno Ret = SocketConnectNonBlocking(Conn->Ip, Conn->Port, &Conn->SockFd);
+    if(Ret != 0 && Ret != -EINPROGRESS) {
+        sdb_timediff Delay = ScheduleReconnect(MbCtx, Conn);
+        SdbLogDebug("Failed to connect connection %lu to %s:%d: %s. Retrying in %lu ms",
+                    Conn->Idx, Conn->Ip, Conn->Port, strerror(-Ret), SDB_TIME_TO_MS(Delay));
+        return Ret;
+    }
+
+    bool Pending = (Ret == -EINPROGRESS);
+    Ret          = 0;
+
+    // NOTE(ingar): Lets the receives read the kernel's receive time of the data with it
+    int On = 1;
+    if(setsockopt(Conn->SockFd, SOL_SOCKET, SO_TIMESTAMPNS, &On, sizeof(On)) == -1) {
+        SdbLogDebug("Failed to enable receive timestamps on connection %lu: %s", Conn->Idx,
+                    strerror(errno));
+    }
+    Conn->RecvStampNs = 0;
+
+    if(MbCtx->EpollFd != -1) {
+        // NOTE(ingar): Registered for writability until the handshake has ended, see
+        // MbConnFinishConnect
+        struct epoll_event Event = { .events = EPOLLOUT | EPOLLRDHUP, .data.ptr = Conn };
+        if(epoll_ctl(MbCtx->EpollFd, EPOLL_CTL_ADD, Conn->SockFd, &Event) == -1) {
+            SdbLogError("Failed to add connection %lu to epoll: %s", Conn->Idx, strerror(errno));
+            Ret = -errno;
+        }
+    }
+
+    Conn->State = MbConn_Connecting;
+    SdbTimeMonotonic(&Conn->ConnectDeadline);
+    SdbTimeAdd(&Conn->ConnectDeadline, MB_CONNECT_TIMEOUT);
+    if(Ret == 0 && !Pending) {
+        Ret = ConnEstablished(MbCtx, Conn);
+    }
+
+    if(Ret != 0) {
+        close(Conn->SockFd);
+        Conn->SockFd = -1;
+        ScheduleReconnect(MbCtx, Conn);
+        return Ret;
+    }
+
+    return 0;
+}
+
+sdb_errno
+MbConnFinishConnect(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    sdb_errno Ret = SocketConnectResult(Conn->SockFd);
+    if(Ret == 0) {
+        Ret = ConnEstablished(MbCtx, Conn);
+    } else {
+        SdbLogDebug("Failed to connect connection %lu to %s:%d: %s", Conn->Idx, Conn->Ip,
+                    Conn->Port, strerror(-Ret));
+    }
+
+    if(Ret != 0) {
+        MbConnClose(MbCtx, Conn);
+    }
+    return Ret;
+}
+
+void
+MbConnClose(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    if(Conn->SockFd != -1) {
+        // NOTE(ingar): Closing the fd removes it from the epoll set
+        close(Conn->SockFd);
+        Conn->SockFd = -1;
+    }
+
+    bool         WasUp = Conn->State == MbConn_Connected || Conn->State == MbConn_Closing;
+    sdb_timediff Delay = ScheduleReconnect(MbCtx, Conn);
+    if(WasUp) {
+        SdbLogInfo("Connection %lu to %s:%d closed. Will attempt reconnection in %lu ms",
+                   Conn->Idx, Conn->Ip, Conn->Port, SDB_TIME_TO_MS(Delay));
+    } else {
+        SdbLogDebug("Connection attempt %lu to %s:%d failed. Retrying in %lu ms", Conn->Idx,
+                    Conn->Ip, Conn->Port, SDB_TIME_TO_MS(Delay));
+    }
+}
+
+void
+MbReconnectDue(modbus_ctx *MbCtx, struct timespec *Now)
+{
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        mb_conn *Conn = &MbCtx->Conns[i];
+        if(Conn->State == MbConn_Disconnected && SdbTimeoutExpired(&Conn->ReconnectAt, Now)) {
+            if(MbConnOpen(MbCtx, Conn) == 0) {
+                ++Conn->ReconnectCount;
+            }
+        } else if(Conn->State == MbConn_Connecting
+                  && SdbTimeoutExpired(&Conn->ConnectDeadline, Now)) {
+            SdbLogDebug("Connection attempt %lu to %s:%d timed out", Conn->Idx, Conn->Ip,
+                        Conn->Port);
+            MbConnClose(MbCtx, Conn);
+        }
+    }
+}
+
+/**
+ * @brief Receives into Dst, and records when the kernel received the data
+ *
+ * The time comes from the SO_TIMESTAMPNS control message, so no clock is read here.
+ */
+static inline ssize_t
+ConnRecv(mb_conn *Conn, u8 *Dst, u64 Size)
+{
+    union
+    {
+        u8             Buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr Align;
+    } Control;
+
+    struct iovec  Iov = { .iov_base = Dst, .iov_len = Size };
+    struct msghdr Msg = {
+        .msg_iov        = &Iov,
+        .msg_iovlen     = 1,
+        .msg_control    = Control.Buf,
+        .msg_controllen = sizeof(Control.Buf),
+    };
+
+    ssize_t BytesRead = recvmsg(Conn->SockFd, &Msg, 0);
+    if(BytesRead > 0) {
+        struct cmsghdr *Cmsg = CMSG_FIRSTHDR(&Msg);
+        if(Cmsg && Cmsg->cmsg_level == SOL_SOCKET && Cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec Stamp;
+            SdbMemcpy(&Stamp, CMSG_DATA(Cmsg), sizeof(Stamp));
+            Conn->RecvStampNs = SdbTimespecNs(&Stamp);
+        }
+    }
+
+    return BytesRead;
+}
+
+/**
+ * @brief Reads as many bytes as are available on a non-blocking connection
+ *
+ * The unparsed tail of the receive buffer, which is at most one partial frame, is moved to the
+ * front so the single recv call can use the rest of the buffer.
+ *
+ * @param Conn Connection to read from
+ * @return Number of bytes read, 0 if the socket would block, negative on failure
+ */
+i64
+MbConnFill(mb_conn *Conn)
+{
+    u32 Unparsed = Conn->RecvTail - Conn->RecvHead;
+    if(Conn->RecvHead > 0) {
+        if(Unparsed > 0) {
+            memmove(Conn->RecvBuf, Conn->RecvBuf + Conn->RecvHead, Unparsed);
+        }
+        Conn->RecvHead = 0;
+        Conn->RecvTail = Unparsed;
+    }
+
+    for(;;) {
+        ++Conn->RecvCount;
+        ssize_t BytesRead = ConnRecv(Conn, Conn->RecvBuf + Conn->RecvTail,
+                                     MB_RECV_BUF_SIZE - Conn->RecvTail);
+        if(BytesRead > 0) {
+            MbConnGotData(Conn);
+            Conn->RecvTail += BytesRead;
+            return BytesRead;
+        } else if(BytesRead == 0) {
+            SdbLogWarning("Server closed connection %lu", Conn->Idx);
+            return -SDBE_CONN_CLOSED_SUCS;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if(errno != EINTR) {
+            SdbLogError("Recv failed on connection %lu: %s", Conn->Idx, strerror(errno));
+            return -SDBE_CONN_CLOSED_ERR;
+        }
+    }
+}
+
+/**
+ * @brief Gets the next complete frame from a connection's receive buffer
+ *
+ * @param Conn Connection to parse
+ * @param Frame Set to the start of the frame
+ * @return Frame length, 0 if no complete frame is buffered, negative on an invalid frame
+ */
+i64
+MbConnNextFrame(mb_conn *Conn, const u8 **Frame)
+{
+    u32 Unparsed = Conn->RecvTail - Conn->RecvHead;
+    if(Unparsed < MODBUS_TCP_HEADER_LEN) {
+        return 0;
+    }
+
+    const u8 *Head   = Conn->RecvBuf + Conn->RecvHead;
+    u16       Length = (Head[4] << 8) | Head[5];
+    if(Length < 3 || Length > MODBUS_TCP_FRAME_MAX_SIZE - MODBUS_TCP_LENGTH_OFFSET) {
+        SdbLogError("Invalid frame length on connection %lu: %u", Conn->Idx, Length);
+        return -1;
+    }
+
+    u32 FrameLen = MODBUS_TCP_LENGTH_OFFSET + Length;
+    if(Unparsed < FrameLen) {
+        return 0;
+    }
+
+    *Frame = Head;
+    Conn->RecvHead += FrameLen;
+    ++Conn->PacketCount;
+    return FrameLen;
+}
+
+/**
+ * @brief Reads as many bytes as are available on a non-blocking connection into caller memory
+ *
+ * @param Conn Connection to read from
+ * @param Dst Destination memory
+ * @param DstSize Size of Dst
+ * @return Bytes in Dst including the carried partial frame, 0 if the socket would block,
+ * negative on failure
+ */
+i64
+MbConnRecvInto(mb_conn *Conn, u8 *Dst, u64 DstSize)
+{
+    u32 Carry = Conn->RecvTail - Conn->RecvHead;
+    SdbAssert(DstSize > Carry, "Receive destination too small: %lu", DstSize);
+
+    if(Carry > 0) {
+        SdbMemcpy(Dst, Conn->RecvBuf + Conn->RecvHead, Carry);
+    }
+
+    for(;;) {
+        ++Conn->RecvCount;
+        ssize_t BytesRead = ConnRecv(Conn, Dst + Carry, DstSize - Carry);
+        if(BytesRead > 0) {
+            MbConnGotData(Conn);
+            Conn->RecvHead = 0;
+            Conn->RecvTail = 0;
+            return Carry + BytesRead;
+        } else if(BytesRead == 0) {
+            SdbLogWarning("Server closed connection %lu", Conn->Idx);
+            return -SDBE_CONN_CLOSED_SUCS;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if(errno != EINTR) {
+            SdbLogError("Recv failed on connection %lu: %s", Conn->Idx, strerror(errno));
+            return -SDBE_CONN_CLOSED_ERR;
+        }
+    }
+}
+
+/**
+ * @brief Strips the Modbus headers from the frames in a buffer in place
+ *
+ * Each payload is moved down over the headers before it, so the payload bytes are copied once
+ * and the headers are never copied.
+ *
+ * @param Conn Connection the data was read from
+ * @param Buf Received data
+ * @param Len Number of bytes in Buf
+ * @param PayloadSize Expected payload size
+ * @return Number of payload bytes packed at the start of Buf, negative on an invalid frame
+ */
+i64
+MbConnCompactFrames(mb_conn *Conn, u8 *Buf, u64 Len, u16 PayloadSize)
+{
+    u64 In  = 0;
+    u64 Out = 0;
+    while(Len - In >= MODBUS_TCP_HEADER_LEN) {
+        u16 Length = (Buf[In + 4] << 8) | Buf[In + 5];
+        if(Length < 3 || Length > MODBUS_TCP_FRAME_MAX_SIZE - MODBUS_TCP_LENGTH_OFFSET) {
+            SdbLogError("Invalid frame length on connection %lu: %u", Conn->Idx, Length);
+            return -1;
+        }
+
+        // NOTE(ingar): Checked before the frame is complete so a carried frame is never larger
+        // than the frames the caller sized its buffer for
+        if(Length != PayloadSize + 3) {
+            SdbLogError("Size mismatch on connection %lu: got %u expected %u", Conn->Idx,
+                        Length - 3, PayloadSize);
+            return -1;
+        }
+
+        u32 FrameLen = MODBUS_TCP_LENGTH_OFFSET + Length;
+        if(Len - In < FrameLen) {
+            break;
+        }
+
+        u16       UnitId, DataLength;
+        const u8 *Data = MbParseTcpFrame(Buf + In, &UnitId, &DataLength);
+        if(!Data) {
+            SdbLogError("Failed to parse frame on connection %lu", Conn->Idx);
+            return -1;
+        }
+
+        memmove(Buf + Out, Data, DataLength);
+        Out += DataLength;
+        In += FrameLen;
+        ++Conn->PacketCount;
+    }
+
+    u32 Carry = Len - In;
+    if(Carry > 0) {
+        SdbMemcpy(Conn->RecvBuf, Buf + In, Carry);
+    }
+    Conn->RecvHead = 0;
+    Conn->RecvTail = Carry;
+
+    return Out;
+}
+
+/**
+ * @brief Checks the length field of the frame header at Head
+ *
+ * @return Frame length, or -1 if the length field is invalid
+ */
+static inline i64
+FrameLenFromHeader(mb_conn *Conn, const u8 *Head)
+{
+    u16 Length = (Head[4] << 8) | Head[5];
+    if(Length < 3 || Length > MODBUS_TCP_FRAME_MAX_SIZE - MODBUS_TCP_LENGTH_OFFSET) {
+        SdbLogError("Invalid frame length on connection %lu: %u", Conn->Idx, Length);
+        return -1;
+    }
+    return MODBUS_TCP_LENGTH_OFFSET + Length;
+}
+
+/**
+ * @brief Gets the next complete frame from received data owned by the caller
+ *
+ * A partial frame left by the previous buffer is completed first, by copying only the missing
+ * bytes into the connection's receive buffer. After that, frames are returned in place.
+ *
+ * @param Conn Connection the data was received on
+ * @param Buf Received data
+ * @param Len Number of bytes in Buf
+ * @param Offset Position in Buf
+ * @param Frame Set to the start of the frame
+ * @return Frame length, 0 when Buf is used up, negative on an invalid frame
+ */
+i64
+MbConnNextFrameIn(mb_conn *Conn, const u8 *Buf, u64 Len, u64 *Offset, const u8 **Frame)
+{
+    while(Conn->RecvTail > 0) {
+        i64 Want = MODBUS_TCP_HEADER_LEN;
+        if(Conn->RecvTail >= MODBUS_TCP_HEADER_LEN) {
+            Want = FrameLenFromHeader(Conn, Conn->RecvBuf);
+            if(Want < 0) {
+                return Want;
+            }
+        }
+
+        if(Conn->RecvTail == Want && Want > MODBUS_TCP_HEADER_LEN) {
+            Conn->RecvTail = 0;
+            *Frame         = Conn->RecvBuf;
+            ++Conn->PacketCount;
+            return Want;
+        }
+
+        u64 Take = SdbMin((u64)Want - Conn->RecvTail, Len - *Offset);
+        if(Take == 0) {
+            return 0;
+        }
+        SdbMemcpy(Conn->RecvBuf + Conn->RecvTail, Buf + *Offset, Take);
+        Conn->RecvTail += Take;
+        *Offset += Take;
+    }
+
+    u64 Left = Len - *Offset;
+    if(Left >= MODBUS_TCP_HEADER_LEN) {
+        i64 FrameLen = FrameLenFromHeader(Conn, Buf + *Offset);
+        if(FrameLen < 0) {
+            return FrameLen;
+        }
+
+        if(Left >= (u64)FrameLen) {
+            *Frame = Buf + *Offset;
+            *Offset += FrameLen;
+            ++Conn->PacketCount;
+            return FrameLen;
+        }
+    }
+
+    if(Left > 0) {
+        SdbMemcpy(Conn->RecvBuf, Buf + *Offset, Left);
+        Conn->RecvHead = 0;
+        Conn->RecvTail = Left;
+        *Offset        = Len;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Orders routes by how much of a frame they match on, so applying them in this order
+ * lets the more specific routes overwrite the less specific ones
+ */
+static inline u32
+RouteSpecificity(const mb_route_conf *Conf)
+{
+    return (Conf->Conn != -1) * 4 + (Conf->UnitId != -1) * 2 + (Conf->Function != -1);
+}
+
+/**
+ * @brief Routes every function code of a unit to Route
+ */
+static void
+RouteSetUnit(mb_route_table *Table, u8 UnitId, u16 Route)
+{
+    u16 Entry = Table->ByUnit[UnitId];
+    if(Entry != MB_ROUTE_NONE && (Entry & MB_ROUTE_BY_FUNCTION)) {
+        u16 *FnTable = Table->FnTables[Entry & ~MB_ROUTE_BY_FUNCTION];
+        for(u32 f = 0; f < 256; ++f) {
+            FnTable[f] = Route;
+        }
+    } else {
+        Table->ByUnit[UnitId] = Route;
+    }
+}
+
+/**
+ * @brief Routes one function code of a unit to Route, giving the unit a function table first
+ * if it does not have one
+ */
+static void
+RouteSetUnitFunction(mb_route_table *Table, u8 UnitId, u8 Function, u16 Route)
+{
+    u16 Entry = Table->ByUnit[UnitId];
+    if(Entry == MB_ROUTE_NONE || !(Entry & MB_ROUTE_BY_FUNCTION)) {
+        u16  FnIdx   = Table->FnTableCount++;
+        u16 *FnTable = Table->FnTables[FnIdx];
+        for(u32 f = 0; f < 256; ++f) {
+            FnTable[f] = Entry;
+        }
+        Table->ByUnit[UnitId] = MB_ROUTE_BY_FUNCTION | FnIdx;
+        Entry                 = Table->ByUnit[UnitId];
+    }
+
+    Table->FnTables[Entry & ~MB_ROUTE_BY_FUNCTION][Function] = Route;
+}
+
+/**
+ * @brief Builds the route table of one connection
+ *
+ * @param ConnIdx Connection index, or -1 for the table shared by connections without routes of
+ * their own
+ */
+static mb_route_table *
+RouteTableBuild(sdb_arena *MbArena, const mb_route_conf *Confs, u64 RouteCount, i64 ConnIdx)
+{
+    bool NeedsFnTable[256] = { 0 };
+    for(u64 r = 0; r < RouteCount; ++r) {
+        const mb_route_conf *Conf = &Confs[r];
+        if(Conf->Function == -1 || (Conf->Conn != -1 && Conf->Conn != ConnIdx)) {
+            continue;
+        }
+        for(u32 u = 0; u < 256; ++u) {
+            NeedsFnTable[u] |= (Conf->UnitId == -1 || Conf->UnitId == (i16)u);
+        }
+    }
+
+    u32 FnTableMax = 0;
+    for(u32 u = 0; u < 256; ++u) {
+        FnTableMax += NeedsFnTable[u];
+    }
+
+    mb_route_table *Table = SdbPushStruct(MbArena, mb_route_table);
+    if(!Table) {
+        return NULL;
+    }
+    Table->FnTableCount = 0;
+    Table->FnTables     = NULL;
+    if(FnTableMax > 0) {
+        Table->FnTables = SdbArenaPush(MbArena, FnTableMax * sizeof(*Table->FnTables));
+        if(!Table->FnTables) {
+            return NULL;
+        }
+    }
+    for(u32 u = 0; u < 256; ++u) {
+        Table->ByUnit[u] = MB_ROUTE_NONE;
+    }
+
+    for(u32 Level = 0; Level < 8; ++Level) {
+        for(u64 r = 0; r < RouteCount; ++r) {
+            const mb_route_conf *Conf = &Confs[r];
+            if(RouteSpecificity(Conf) != Level
+               || (Conf->Conn != -1 && Conf->Conn != ConnIdx)) {
+                continue;
+            }
+
+            for(u32 u = 0; u < 256; ++u) {
+                if(Conf->UnitId != -1 && Conf->UnitId != (i16)u) {
+                    continue;
+                }
+                if(Conf->Function == -1) {
+                    RouteSetUnit(Table, u, r);
+                } else {
+                    RouteSetUnitFunction(Table, u, Conf->Function, r);
+                }
+            }
+        }
+    }
+
+    return Table;
+}
+
+sdb_errno
+MbRoutesInit(sdb_arena *MbArena, modbus_ctx *MbCtx, const mb_route_conf *Confs,
+             sensor_data_pipe **Pipes, u64 RouteCount)
+{
+    SdbAssert(RouteCount > 0 && RouteCount < MB_ROUTE_BY_FUNCTION, "Invalid route count %lu",
+              RouteCount);
+
+    MbCtx->RouteCount = RouteCount;
+    MbCtx->Routes     = SdbPushArrayZero(MbArena, mb_route, RouteCount);
+    if(!MbCtx->Routes) {
+        return -ENOMEM;
+    }
+
+    bool HasConnRoutes = false;
+    for(u64 r = 0; r < RouteCount; ++r) {
+        mb_route *Route = &MbCtx->Routes[r];
+        Route->Name     = Confs[r].Name;
+        Route->Pipe     = Pipes[(Confs[r].Into != -1) ? (u64)Confs[r].Into : r];
+        Route->CurBuf   = SdPipeCurrentWriteBuffer(Route->Pipe);
+        Route->OwnPipe  = Pipes[r];
+        Route->SchemaId = r;
+
+        if(Confs[r].Conn >= (i64)MbCtx->ConnCount) {
+            SdbLogWarning("Sensor %s is routed from connection %ld, but there are only %lu "
+                          "connections",
+                          Confs[r].Name, Confs[r].Conn, MbCtx->ConnCount);
+        }
+        HasConnRoutes |= Confs[r].Conn != -1;
+    }
+
+    mb_route_table *Shared = RouteTableBuild(MbArena, Confs, RouteCount, -1);
+    if(!Shared) {
+        return -ENOMEM;
+    }
+
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        mb_conn *Conn = &MbCtx->Conns[i];
+        Conn->Routes  = Shared;
+        if(!HasConnRoutes) {
+            continue;
+        }
+
+        for(u64 r = 0; r < RouteCount; ++r) {
+            if(Confs[r].Conn == (i64)i) {
+                Conn->Routes = RouteTableBuild(MbArena, Confs, RouteCount, i);
+                if(!Conn->Routes) {
+                    return -ENOMEM;
+                }
+                break;
+            }
+        }
+    }
+
+    MbCtx->SoleRoute = NULL;
+    if(RouteCount == 1 && Confs[0].Conn == -1 && Confs[0].UnitId == -1
+       && Confs[0].Function == -1) {
+        MbCtx->SoleRoute = &MbCtx->Routes[0];
+    }
+
+    return 0;
+}
+
+u64
+MbWriteReadRequest(u8 *Buf, u16 Tid, const mb_poll_group *Group)
+{
+    Buf[0]  = (Tid >> 8) & 0xFF;
+    Buf[1]  = Tid & 0xFF;
+    Buf[2]  = 0x00; // Protocol ID high
+    Buf[3]  = 0x00; // Protocol ID low
+    Buf[4]  = 0x00; // Length high
+    Buf[5]  = 0x06; // Length low: unit id, function code, address and quantity
+    Buf[6]  = Group->UnitId;
+    Buf[7]  = Group->Function;
+    Buf[8]  = (Group->Address >> 8) & 0xFF;
+    Buf[9]  = Group->Address & 0xFF;
+    Buf[10] = (Group->Quantity >> 8) & 0xFF;
+    Buf[11] = Group->Quantity & 0xFF;
+
+    return MODBUS_READ_REQUEST_LEN;
+}
+
+sdb_errno
+MbPollInit(sdb_arena *MbArena, modbus_ctx *MbCtx, const mb_poll_conf *Conf)
+{
+    SdbAssert(Conf->MaxInFlight > 0 && Conf->MaxInFlight <= MB_POLL_MAX_IN_FLIGHT,
+              "Invalid poll window %u", Conf->MaxInFlight);
+
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        mb_poller *Poller = SdbPushStructZero(MbArena, mb_poller);
+        if(Poller) {
+            Poller->Backlog = SdbPushArray(MbArena, u32, Conf->GroupCount);
+            Poller->Busy    = SdbPushArrayZero(MbArena, bool, Conf->GroupCount);
+        }
+        if(!Poller || !Poller->Backlog || !Poller->Busy) {
+            SdbLogError("Insufficient memory for the poll state of connection %lu", i);
+            return -ENOMEM;
+        }
+
+        Poller->Conf          = Conf;
+        MbCtx->Conns[i].Poller = Poller;
+    }
+
+    return 0;
+}
+
+bool
+MbPollQueue(mb_conn *Conn, u32 Group)
+{
+    mb_poller *Poller = Conn->Poller;
+    if(Poller->Busy[Group]) {
+        ++Poller->OverrunCount;
+        return false;
+    }
+
+    u32 Tail              = (Poller->BacklogHead + Poller->BacklogCount) % Poller->Conf->GroupCount;
+    Poller->Backlog[Tail] = Group;
+    Poller->Busy[Group]   = true;
+    ++Poller->BacklogCount;
+    return true;
+}
+
+/**
+ * @brief Moves queued polls into free transaction slots and sends them
+ *
+ * Transaction ids are handed out in order, skipping any id whose slot still holds an older
+ * request that was answered out of order. Requests the socket does not accept right away stay
+ * in the send buffer and go out with the next call.
+ *
+ * @param Conn Connection to send on
+ * @param Now Current monotonic time
+ * @return Number of requests added to the window, negative on failure
+ */
+i64
+MbPollSend(mb_conn *Conn, struct timespec *Now)
+{
+    mb_poller *Poller = Conn->Poller;
+    u32        Mask   = MB_POLL_MAX_IN_FLIGHT - 1;
+    i64        Queued = 0;
+
+    while(Poller->BacklogCount > 0 && Poller->InFlight < Poller->Conf->MaxInFlight
+          && Poller->SendLen + MODBUS_READ_REQUEST_LEN <= sizeof(Poller->SendBuf)) {
+        while(Poller->Txns[Poller->NextTid & Mask].InUse) {
+            ++Poller->NextTid;
+        }
+
+        u32 Group           = Poller->Backlog[Poller->BacklogHead];
+        Poller->BacklogHead = (Poller->BacklogHead + 1) % Poller->Conf->GroupCount;
+        --Poller->BacklogCount;
+
+        mb_txn *Txn = &Poller->Txns[Poller->NextTid & Mask];
+        Txn->InUse  = true;
+        Txn->Tid    = Poller->NextTid++;
+        Txn->Group  = Group;
+        Txn->SentAt = *Now;
+        ++Poller->InFlight;
+        ++Queued;
+
+        Poller->SendLen += MbWriteReadRequest(Poller->SendBuf + Poller->SendLen, Txn->Tid,
+                                              &Poller->Conf->Groups[Group]);
+    }
+
+    while(Poller->SendLen > 0) {
+        ssize_t Sent = send(Conn->SockFd, Poller->SendBuf, Poller->SendLen, MSG_NOSIGNAL);
+        if(Sent > 0) {
+            Poller->SendLen -= Sent;
+            if(Poller->SendLen > 0) {
+                memmove(Poller->SendBuf, Poller->SendBuf + Sent, Poller->SendLen);
+            }
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if(errno != EINTR) {
+            SdbLogError("Send failed on connection %lu: %s", Conn->Idx, strerror(errno));
+            return -SDBE_CONN_CLOSED_ERR;
+        }
+    }
+
+    Poller->RequestCount += Queued;
+    return Queued;
+}
+
+/**
+ * @brief Matches a response frame with its outstanding request
+ *
+ * Response to a read holding/input registers request:
+ * ~~~~~~~~
+ * | Field         | Size    | Description                       |
+ * |---------------|---------|-----------------------------------|
+ * | MBAP header   | 7 bytes | Transaction ID echoes the request |
+ * | Function Code | 1 byte  | Request's code, | 0x80 on error   |
+ * | Byte Count    | 1 byte  | 2 * register count                |
+ * | Data          | n bytes | Big-endian registers              |
+ * ~~~~~~~~
+ *
+ * @param Conn Connection the frame was received on
+ * @param Frame Complete frame
+ * @param FrameLen Length of the frame
+ * @param Data Set to the register data
+ * @param DataLength Set to the register data length
+ * @return Group index, -1 for a frame without data, -2 for an invalid frame
+ */
+i64
+MbPollMatch(mb_conn *Conn, const u8 *Frame, u64 FrameLen, const u8 **Data, u16 *DataLength)
+{
+    mb_poller *Poller = Conn->Poller;
+    u16        Tid    = (Frame[0] << 8) | Frame[1];
+    mb_txn    *Txn    = &Poller->Txns[Tid & (MB_POLL_MAX_IN_FLIGHT - 1)];
+
+    if(!Txn->InUse || Txn->Tid != Tid) {
+        ++Poller->StaleCount;
+        return -1;
+    }
+
+    const mb_poll_group *Group    = &Poller->Conf->Groups[Txn->Group];
+    u32                  GroupIdx = Txn->Group;
+    u8                   Function = Frame[MODBUS_TCP_HEADER_LEN];
+
+    Txn->InUse = false;
+    --Poller->InFlight;
+    Poller->Busy[GroupIdx] = false;
+
+    if(Frame[6] != Group->UnitId || (Function & ~MODBUS_EXCEPTION_FLAG) != Group->Function) {
+        SdbLogError("Response on connection %lu does not match its request: unit %u function "
+                    "0x%02x",
+                    Conn->Idx, Frame[6], Function);
+        return -2;
+    }
+
+    if(Function & MODBUS_EXCEPTION_FLAG) {
+        ++Poller->ExceptionCount;
+        SdbLogDebug("Exception 0x%02x polling unit %u address %u on connection %lu",
+                    Frame[MODBUS_TCP_HEADER_LEN + 1], Group->UnitId, Group->Address, Conn->Idx);
+        return -1;
+    }
+
+    u16 ByteCount = Frame[MODBUS_TCP_HEADER_LEN + 1];
+    if(ByteCount != 2 * Group->Quantity || FrameLen != MODBUS_TCP_HEADER_LEN + 2u + ByteCount) {
+        SdbLogError("Response on connection %lu has %u bytes of data, expected %u", Conn->Idx,
+                    ByteCount, 2 * Group->Quantity);
+        return -2;
+    }
+
+    ++Poller->ResponseCount;
+    *Data       = Frame + MODBUS_TCP_HEADER_LEN + 2;
+    *DataLength = ByteCount;
+    return GroupIdx;
+}
+
+u64
+MbPollExpire(mb_conn *Conn, struct timespec *Now)
+{
+    mb_poller *Poller  = Conn->Poller;
+    u64        Expired = 0;
+
+    for(u32 t = 0; t < MB_POLL_MAX_IN_FLIGHT && Poller->InFlight > 0; ++t) {
+        mb_txn *Txn = &Poller->Txns[t];
+        if(Txn->InUse && SdbTimeDiff(Now, &Txn->SentAt) > Poller->Conf->Timeout) {
+            Txn->InUse               = false;
+            Poller->Busy[Txn->Group] = false;
+            --Poller->InFlight;
+            ++Expired;
+        }
+    }
+
+    Poller->TimeoutCount += Expired;
+    return Expired;
+}
@@ -25,6 +25,13 @@ SDB_BEGIN_EXTERN_C
 /** @brief Length of Modbus TCP header in bytes */
 #define MODBUS_TCP_HEADER_LEN (7)
 
+/**
+ * @brief Number of header bytes before the unit id
+ * @note The header's Length field counts the unit id and everything after it, so a frame is
+ * MODBUS_TCP_LENGTH_OFFSET + Length bytes long
+ */
+#define MODBUS_TCP_LENGTH_OFFSET (6)
+
 /** @brief Maximum size of Modbus Protocol Data Unit */
 #define MODBUS_PDU_MAX_SIZE (253)
 
@@ -34,18 +41,331 @@ SDB_BEGIN_EXTERN_C
 /** @brief Function code for reading holding registers */
 #define MODBUS_READ_HOLDING_REGISTERS (0x03)
 
+/** @brief Function code for reading input registers */
+#define MODBUS_READ_INPUT_REGISTERS (0x04)
+
+/** @brief Bit set in the function code of an exception response */
+#define MODBUS_EXCEPTION_FLAG (0x80)
+
+/** @brief Maximum number of registers in one read request */
+#define MODBUS_READ_MAX_REGISTERS (125)
+
+/** @brief Size of a read holding/input registers request frame */
+#define MODBUS_READ_REQUEST_LEN (12)
+
 /** @brief Path to Modbus configuration file */
 #define MODBUS_CONF_FS_PATH "./configs/modbus-conf"
 
+/** @brief Maximum number of epoll events handled per wakeup of the Modbus thread */
+#ifndef MB_EPOLL_BATCH
+#define MB_EPOLL_BATCH 64
+#endif
+
+/** @brief Size of the receive buffer of each connection. Must hold at least one full frame */
+#ifndef MB_RECV_BUF_SIZE
+#define MB_RECV_BUF_SIZE SdbKibiByte(8)
+#endif
+
+/** @brief Maximum number of recv calls made on one connection per readiness event */
+#ifndef MB_MAX_RECVS_PER_EVENT
+#define MB_MAX_RECVS_PER_EVENT 4
+#endif
+
+/** @brief Submission queue size of the io_uring backend */
+#ifndef MB_URING_ENTRIES
+#define MB_URING_ENTRIES 256
+#endif
+
+/** @brief Number of provided receive buffers of the io_uring backend. Must be a power of two */
+#ifndef MB_URING_BUF_COUNT
+#define MB_URING_BUF_COUNT 256
+#endif
+
+/** @brief Size of each provided receive buffer of the io_uring backend */
+#ifndef MB_URING_BUF_SIZE
+#define MB_URING_BUF_SIZE SdbKibiByte(16)
+#endif
+
+/** @brief Buffer group id of the io_uring backend's provided buffer ring */
+#define MB_URING_BGID 0
+
+/**
+ * @brief Reconnect backoff of a failing connection
+ *
+ * The first failure of a connection that has delivered data is retried at once. Every further
+ * failure waits a random time between half and all of the backoff, which starts at
+ * MB_RECONNECT_MIN_DELAY and doubles up to MB_RECONNECT_MAX_DELAY. The jitter keeps the
+ * connections to a restarted server from reconnecting in lockstep.
+ */
+#ifndef MB_RECONNECT_MIN_DELAY
+#define MB_RECONNECT_MIN_DELAY SDB_TIME_MS(100)
+#endif
+#ifndef MB_RECONNECT_MAX_DELAY
+#define MB_RECONNECT_MAX_DELAY SDB_TIME_S(30)
+#endif
+
+/** @brief Time a connection attempt may take before it counts as failed */
+#ifndef MB_CONNECT_TIMEOUT
+#define MB_CONNECT_TIMEOUT SDB_TIME_S(3)
+#endif
+
+/** @brief Maximum number of outstanding poll requests per connection. Must be a power of two */
+#ifndef MB_POLL_MAX_IN_FLIGHT
+#define MB_POLL_MAX_IN_FLIGHT 16
+#endif
+
+/** @brief Resolution of the poll scheduler */
+#ifndef MB_POLL_TICK
+#define MB_POLL_TICK SDB_TIME_MS(1)
+#endif
+
+/** @brief Number of slots in the poll scheduler's timer wheel. Must be a power of two */
+#ifndef MB_POLL_WHEEL_SLOTS
+#define MB_POLL_WHEEL_SLOTS 1024
+#endif
+
+/** @brief Default time a poll request may be outstanding before it is given up on */
+#define MB_POLL_TIMEOUT SDB_TIME_S(1)
+
+/** @brief Time between logs of the per-sensor packet counts */
+#define MB_ROUTE_STATS_INTERVAL SDB_TIME_S(10)
+
+/**
+ * @brief Number of times per pipe max latency the partial buffers are checked. A buffer is
+ * flushed one check early, so its data waits at most the max latency
+ */
+#define MB_FLUSH_CHECKS_PER_LATENCY 4
+
+/**
+ * @enum mb_conn_state
+ * @brief Lifecycle state of a single Modbus TCP connection
+ */
+typedef enum
+{
+    MbConn_Disconnected = 0, /**< No socket; waiting for the reconnect time */
+    MbConn_Connecting,       /**< Non-blocking connect in progress */
+    MbConn_Connected,        /**< Socket open and being received from */
+    MbConn_Closing,          /**< Socket shut down; waiting for outstanding receives to end */
+    MbConn_Foreign,          /**< Served by another ingest worker */
+} mb_conn_state;
+
+/** @brief Owner of a connection that has been released and not yet claimed by a worker */
+#define MB_CONN_UNOWNED (UINT32_MAX)
+
+/**
+ * @struct mb_worker_load
+ * @brief Number of connections an ingest worker owns, on a cache line of its own
+ */
+typedef struct
+{
+    atomic_ulong OwnedCount;
+} __attribute__((aligned(SDB_CACHE_LINE_SIZE))) mb_worker_load;
+
+/**
+ * @struct mb_shard_table
+ * @brief Assignment of the connections to the ingest workers of a thread group
+ *
+ * Connection i starts out with worker i % WorkerCount. A worker releases a connection that
+ * drops, and the worker owning the fewest connections claims it when it is due for reconnection,
+ * so the connections spread evenly over the workers as they come and go. Only ownership changes
+ * go through the table; each worker has its own copy of every connection.
+ */
+typedef struct
+{
+    u32             WorkerCount;
+    u64             ConnCount;
+    mb_worker_load *Loads;        /**< One per worker */
+    atomic_uint    *Owners;       /**< Worker owning each connection, or MB_CONN_UNOWNED */
+    atomic_ulong    UnownedCount; /**< Connections waiting to be claimed */
+} mb_shard_table;
+
+/**
+ * @enum mb_backend
+ * @brief I/O mechanism used to receive from the Modbus connections
+ */
+typedef enum
+{
+    MbBackend_Epoll = 0, /**< Readiness notification with epoll and one recv per drain */
+    MbBackend_IoUring,   /**< Multishot recvmsg into provided buffers with io_uring */
+} mb_backend;
+
+/**
+ * @enum mb_mode
+ * @brief How data is obtained from the Modbus servers
+ */
+typedef enum
+{
+    MbMode_Push = 0, /**< The servers send frames on their own */
+    MbMode_Poll,     /**< The servers are polled with read register requests */
+} mb_mode;
+
+/**
+ * @struct mb_poll_group
+ * @brief A block of registers that is read from every server at a fixed period
+ */
+typedef struct
+{
+    u8           UnitId;   /**< Unit id of the device */
+    u8           Function; /**< MODBUS_READ_HOLDING_REGISTERS or MODBUS_READ_INPUT_REGISTERS */
+    u16          Address;  /**< First register */
+    u16          Quantity; /**< Number of registers, at most MODBUS_READ_MAX_REGISTERS */
+    sdb_timediff Period;   /**< Time between polls */
+} mb_poll_group;
+
+/**
+ * @struct mb_poll_conf
+ * @brief Polling configuration shared by all connections
+ */
+typedef struct
+{
+    u32            MaxInFlight; /**< Outstanding requests per connection, at most MB_POLL_MAX_IN_FLIGHT */
+    sdb_timediff   Timeout;     /**< Time a request may be outstanding */
+    u32            GroupCount;
+    mb_poll_group *Groups;
+} mb_poll_conf;
+
+/**
+ * @struct mb_txn
+ * @brief An outstanding poll request
+ */
+typedef struct
+{
+    bool            InUse;
+    u16             Tid;    /**< Transaction id the response must carry */
+    u32             Group;  /**< Index into mb_poll_conf::Groups */
+    struct timespec SentAt; /**< When the request was queued for sending */
+} mb_txn;
+
+/**
+ * @struct mb_poller
+ * @brief Polling state of one connection
+ *
+ * Up to MaxInFlight requests are outstanding at once, so the round trip time is paid once per
+ * window rather than once per request. Outstanding requests are kept in a table indexed by the
+ * low bits of their transaction id, so a response is matched in O(1) even when the server
+ * answers out of order. Polls that are due while the window is full wait in the backlog, and a
+ * group is never queued twice, which bounds the backlog by the group count.
+ */
+typedef struct
+{
+    const mb_poll_conf *Conf;
+
+    mb_txn Txns[MB_POLL_MAX_IN_FLIGHT];
+    u32    InFlight;
+    u16    NextTid;
+
+    u32  BacklogHead;
+    u32  BacklogCount;
+    u32 *Backlog; /**< Ring of GroupCount group indices waiting for a free slot */
+    bool *Busy;   /**< Per group, set while it is queued or outstanding */
+
+    u32 SendLen; /**< Bytes of requests in SendBuf not yet handed to the socket */
+    u8  SendBuf[MB_POLL_MAX_IN_FLIGHT * MODBUS_READ_REQUEST_LEN];
+
+    u64 RequestCount;   /**< Requests sent */
+    u64 ResponseCount;  /**< Responses carrying register data */
+    u64 ExceptionCount; /**< Exception responses */
+    u64 TimeoutCount;   /**< Requests that were never answered */
+    u64 OverrunCount;   /**< Polls skipped because the previous poll of the group was pending */
+    u64 StaleCount;     /**< Responses that matched no outstanding request */
+} mb_poller;
+
+/** @brief Route table entry of a unit with no route */
+#define MB_ROUTE_NONE (0xFFFF)
+
+/** @brief Route table entry flag: the low bits index a per-function table of the unit */
+#define MB_ROUTE_BY_FUNCTION (0x8000)
+
+/**
+ * @struct mb_route_conf
+ * @brief Which frames go to a sensor, from the "modbus" object of its entry in sensor_schemas.json
+ *
+ * A field of -1 matches any value. When several routes match a frame, the one matching on the
+ * connection wins, then the one matching on the unit id, then the one matching on the function
+ * code.
+ */
+typedef struct
+{
+    const char *Name;     /**< Name of the sensor, for logging */
+    i64         Conn;     /**< Index of the connection, in modbus-conf order */
+    i16         UnitId;   /**< Unit id of the sensor */
+    i16         Function; /**< Function code of the frames */
+    i64         Into;     /**< Sensor whose SdpFraming_Prefixed pipe takes the frames, -1 for the
+                               sensor's own pipe */
+} mb_route_conf;
+
+/**
+ * @struct mb_route
+ * @brief Destination of the frames of one sensor
+ */
+typedef struct
+{
+    const char       *Name;
+    sensor_data_pipe *Pipe;
+    sdb_arena        *CurBuf;   /**< Current write buffer of Pipe, if it is SdpFraming_Fixed */
+    sensor_data_pipe *OwnPipe;  /**< Pipe of the sensor, whose packet size the frames must have */
+    u32               SchemaId; /**< Schema of the records if Pipe is SdpFraming_Prefixed */
+
+    u64 PacketCount;   /**< Packets pushed to the pipe */
+    u64 ByteCount;     /**< Payload bytes pushed to the pipe */
+    u64 MismatchCount; /**< Frames dropped because their size was not the pipe's packet size */
+} mb_route;
+
+/**
+ * @struct mb_route_table
+ * @brief Maps the unit id and function code of a frame to its route in O(1)
+ *
+ * Units that only have routes matching any function code map straight to the route. Units
+ * with a function specific route map to a 256-entry table of their own, so the common case
+ * costs one lookup and the worst case two.
+ */
+typedef struct
+{
+    u16 ByUnit[256];   /**< Route index, MB_ROUTE_NONE, or MB_ROUTE_BY_FUNCTION | table index */
+    u16 FnTableCount;
+    u16 (*FnTables)[256];
+} mb_route_table;
+
 /**
  * @struct mb_conn
  * @brief Represents a single Modbus TCP connection
+ *
+ * Each connection keeps its own reconnect state and receive buffer, so one bad link never stalls
+ * the others served by the same thread. The receive buffer is filled with as many bytes as the
+ * socket has in one recv call, and every complete frame in it is parsed before the next call.
+ * A partial frame at the end of the buffer is moved to the front and completed by the next read.
  */
 typedef struct
 {
     int        SockFd; /**< Socket file descriptor */
     int        Port;   /**< Connection port number */
     sdb_string Ip;     /**< IP address string */
+
+    u64             Idx;             /**< Index into modbus_ctx::Conns */
+    mb_conn_state   State;           /**< Current connection state */
+    struct timespec ReconnectAt;     /**< Monotonic time of the next connection attempt */
+    struct timespec ConnectDeadline; /**< Monotonic time a pending connect is given up at */
+    u64             ReconnectCount;  /**< Number of times the connection has been reopened */
+    u64             PacketCount;     /**< Number of frames received on this connection */
+    u64             RecvCount;       /**< Number of recv calls made on this connection */
+    u64             RecvStampNs;     /**< Kernel receive time of the last read, 0 if unknown */
+
+    u32             FailCount;     /**< Failures since the connection last delivered data */
+    sdb_timediff    Backoff;       /**< Upper bound of the next reconnect delay */
+    struct timespec DownSince;     /**< Monotonic time the connection last stopped delivering */
+    u64             RecoveryCount; /**< Number of outages ended by data arriving again */
+    sdb_timediff    RecoveryTotal; /**< Summed time from outage to first packet */
+    sdb_timediff    RecoveryMax;   /**< Longest time from outage to first packet */
+
+    // NOTE(ingar): When receiving directly into the pipe (MbConnRecvInto), RecvBuf only holds the
+    // partial frame carried over between reads
+    u32 RecvHead; /**< Offset of the first unparsed byte in RecvBuf */
+    u32 RecvTail; /**< Offset one past the last received byte in RecvBuf */
+    u8 *RecvBuf;  /**< MB_RECV_BUF_SIZE bytes of received, not yet parsed data */
+
+    mb_poller      *Poller;        /**< Polling state, NULL when the server pushes its data */
+    mb_route_table *Routes;        /**< Shared with every connection without routes of its own */
+    u64             UnroutedCount; /**< Frames dropped because no route matched */
 } mb_conn;
 
 /**
@@ -54,8 +374,19 @@ typedef struct
  */
 typedef struct
 {
-    u64      ConnCount; /**< Number of active connections */
-    mb_conn *Conns;     /**< Array of connection structures */
+    int      EpollFd;        /**< Epoll instance serving all connections, -1 if not used */
+    u64      ConnCount;      /**< Number of configured connections */
+    u64      ConnectedCount; /**< Number of connections currently open */
+    u64      OwnedCount;     /**< Number of connections served by this context */
+    mb_conn *Conns;          /**< Array of connection structures */
+
+    u32             Worker; /**< Index of the ingest worker using this context */
+    mb_shard_table *Shards; /**< NULL if the context serves every connection */
+    u64             JitterState; /**< Random state of the reconnect jitter */
+
+    u64       RouteCount;
+    mb_route *Routes;    /**< One per sensor, indexed by the route tables */
+    mb_route *SoleRoute; /**< Set if every frame of every connection goes to the same route */
     // NOTE(ingar): Keep string last so it's allocated contiguously with the context
 } modbus_ctx;
 
@@ -94,10 +425,287 @@ const u8 *MbParseTcpFrame(const u8 *Frame, u16 *UnitId, u16 *DataLength);
 /**
  * @brief Prepares Modbus context from configuration
  *
+ * Reads every endpoint from the configuration file and creates the epoll instance the
+ * connections are served from. No connections are opened.
+ *
  * @param MbArena Memory arena for allocations
+ * @param ConnCount Number of connections to create. The configured endpoints are reused
+ * round-robin if it is larger than the endpoint count. 0 means one connection per endpoint.
+ * @param Shards Shard table of the thread group, NULL to serve every connection
+ * @param Worker Index of the worker the context is for, ignored without shards
  * @return Initialized modbus context, NULL on failure
  */
-modbus_ctx *MbPrepareCtx(sdb_arena *MbArena);
+modbus_ctx *MbPrepareCtx(sdb_arena *MbArena, u64 ConnCount, mb_shard_table *Shards, u32 Worker);
+
+/**
+ * @brief Sets up the initial assignment of the connections to the workers
+ *
+ * Shards->WorkerCount and Shards->Loads must be set. Must be called by one worker before the
+ * workers start serving connections.
+ *
+ * @param Shards Shard table
+ * @param ConnCount Number of connections
+ * @return 0 on success, -ENOMEM on failure
+ */
+sdb_errno MbShardsInit(mb_shard_table *Shards, u64 ConnCount);
+
+/**
+ * @brief Hands a closed connection over to whichever worker claims it next
+ *
+ * Does nothing without shards or with a single worker.
+ *
+ * @param MbCtx Modbus context of the releasing worker
+ * @param Conn Disconnected connection
+ */
+void MbShardRelease(modbus_ctx *MbCtx, mb_conn *Conn);
+
+/**
+ * @brief Takes over a released connection if this worker owns the fewest connections
+ *
+ * The connection is reopened at once.
+ *
+ * @param MbArena Arena the connection's receive buffer is allocated from, if it has none
+ * @param MbCtx Modbus context of the claiming worker
+ * @return The claimed connection, NULL if none was claimed
+ */
+mb_conn *MbShardClaim(sdb_arena *MbArena, modbus_ctx *MbCtx);
+
+/**
+ * @brief Closes all connections and the epoll instance of a context
+ *
+ * @param MbCtx Modbus context
+ */
+void MbDestroyCtx(modbus_ctx *MbCtx);
+
+/**
+ * @brief Starts connecting a connection and registers it with the context's epoll instance, if
+ * any
+ *
+ * The connect does not block. The connection is left in MbConn_Connecting, and it is
+ * registered for writability so MbConnFinishConnect can be called once the handshake has ended.
+ * If the handshake ended at once, the connection is left in MbConn_Connected instead. On
+ * failure the connection is scheduled for a new attempt after its backoff.
+ *
+ * @param MbCtx Modbus context
+ * @param Conn Connection to open
+ * @return 0 if connected or connecting, error code on failure
+ */
+sdb_errno MbConnOpen(modbus_ctx *MbCtx, mb_conn *Conn);
+
+/**
+ * @brief Completes a pending connect once the socket has become writable
+ *
+ * On success the connection is switched to receiving. On failure it is closed and scheduled
+ * for a new attempt after its backoff.
+ *
+ * @param MbCtx Modbus context
+ * @param Conn Connection in MbConn_Connecting
+ * @return 0 if connected, error code on failure
+ */
+sdb_errno MbConnFinishConnect(modbus_ctx *MbCtx, mb_conn *Conn);
+
+/**
+ * @brief Ends the outage of a connection that has delivered data again
+ *
+ * Records the time from the start of the outage to the first packet, and resets the
+ * connection's backoff.
+ *
+ * @param Conn Connection that has received data
+ */
+void MbConnRecovered(mb_conn *Conn);
+
+/**
+ * @brief Notes that data arrived on a connection. Cheap enough to call on every receive
+ */
+static inline void
+MbConnGotData(mb_conn *Conn)
+{
+    if(Conn->FailCount > 0) {
+        MbConnRecovered(Conn);
+    }
+}
+
+/**
+ * @brief Closes a connection and schedules it for reconnection
+ *
+ * @param MbCtx Modbus context
+ * @param Conn Connection to close
+ */
+void MbConnClose(modbus_ctx *MbCtx, mb_conn *Conn);
+
+/**
+ * @brief Opens every disconnected connection whose reconnect time has passed, and gives up on
+ * pending connects that have taken longer than MB_CONNECT_TIMEOUT
+ *
+ * @param MbCtx Modbus context
+ * @param Now Current monotonic time
+ */
+void MbReconnectDue(modbus_ctx *MbCtx, struct timespec *Now);
+
+/**
+ * @brief Reads as many bytes as are available on a non-blocking connection
+ *
+ * Moves any partial frame to the start of the receive buffer first, then fills the rest of the
+ * buffer with a single recv call.
+ *
+ * @param Conn Connection to read from
+ * @return Number of bytes read, 0 if the socket has no data, or a negative value if the
+ * connection failed
+ */
+i64 MbConnFill(mb_conn *Conn);
+
+/**
+ * @brief Gets the next complete frame from a connection's receive buffer
+ *
+ * @param Conn Connection to parse
+ * @param Frame Set to the start of the frame, which stays valid until the next MbConnFill
+ * @return Length of the frame, 0 if the buffer holds no complete frame, or a negative value if
+ * the data is not a valid Modbus TCP frame
+ */
+i64 MbConnNextFrame(mb_conn *Conn, const u8 **Frame);
+
+/**
+ * @brief Reads as many bytes as are available on a non-blocking connection into caller memory
+ *
+ * The partial frame left over by the previous MbConnCompactFrames call is placed at the start
+ * of Dst, followed by the bytes read by a single recv call.
+ *
+ * @param Conn Connection to read from
+ * @param Dst Destination, e.g. the free part of a pipe buffer
+ * @param DstSize Size of Dst, at least one frame of the expected payload size
+ * @return Number of bytes in Dst, 0 if the socket has no data, or a negative value if the
+ * connection failed
+ */
+i64 MbConnRecvInto(mb_conn *Conn, u8 *Dst, u64 DstSize);
+
+/**
+ * @brief Strips the Modbus headers from the frames in a buffer in place
+ *
+ * The payloads of all complete frames are packed at the start of Buf. A trailing partial frame
+ * is kept by the connection for the next MbConnRecvInto call. Frames are rejected as soon as
+ * their header shows a payload size other than PayloadSize.
+ *
+ * @param Conn Connection the data was read from
+ * @param Buf Data returned by MbConnRecvInto
+ * @param Len Number of bytes in Buf
+ * @param PayloadSize Expected payload size of every frame
+ * @return Number of payload bytes at the start of Buf, or a negative value if a frame is invalid
+ */
+i64 MbConnCompactFrames(mb_conn *Conn, u8 *Buf, u64 Len, u16 PayloadSize);
+
+/**
+ * @brief Gets the next complete frame from received data owned by the caller
+ *
+ * Used when the data was received into memory the connection does not own, e.g. an io_uring
+ * provided buffer. Frames are returned in place where possible. A frame split across two
+ * calls is assembled in the connection's receive buffer.
+ *
+ * @param Conn Connection the data was received on
+ * @param Buf Received data
+ * @param Len Number of bytes in Buf
+ * @param Offset Position in Buf, advanced past the returned frame
+ * @param Frame Set to the start of the frame, which stays valid until the next call
+ * @return Length of the frame, 0 once Buf is used up, or a negative value if the data is not a
+ * valid Modbus TCP frame
+ */
+i64 MbConnNextFrameIn(mb_conn *Conn, const u8 *Buf, u64 Len, u64 *Offset, const u8 **Frame);
+
+/**
+ * @brief Builds the route tables of every connection
+ *
+ * Connections without connection specific routes share one table.
+ *
+ * @param MbArena Memory arena for allocations
+ * @param MbCtx Modbus context
+ * @param Confs Route of each sensor
+ * @param Pipes Pipe of each sensor. A route with an Into gets the pipe of that sensor, and
+ * pushes its frames to it as records of its own schema
+ * @param RouteCount Number of sensors
+ * @return 0 on success, -ENOMEM if the arena is too small
+ */
+sdb_errno MbRoutesInit(sdb_arena *MbArena, modbus_ctx *MbCtx, const mb_route_conf *Confs,
+                       sensor_data_pipe **Pipes, u64 RouteCount);
+
+/**
+ * @brief Finds the route of a frame
+ *
+ * @param MbCtx Modbus context
+ * @param Conn Connection the frame was received on
+ * @param UnitId Unit id of the frame
+ * @param Function Function code of the frame
+ * @return The route, NULL if the frame has none
+ */
+static inline mb_route *
+MbRouteLookup(modbus_ctx *MbCtx, mb_conn *Conn, u8 UnitId, u8 Function)
+{
+    u16 Entry = Conn->Routes->ByUnit[UnitId];
+    if(Entry != MB_ROUTE_NONE && (Entry & MB_ROUTE_BY_FUNCTION)) {
+        Entry = Conn->Routes->FnTables[Entry & ~MB_ROUTE_BY_FUNCTION][Function];
+    }
+    return (Entry == MB_ROUTE_NONE) ? NULL : &MbCtx->Routes[Entry];
+}
+
+/**
+ * @brief Writes a read holding/input registers request
+ *
+ * @param Buf Destination, at least MODBUS_READ_REQUEST_LEN bytes
+ * @param Tid Transaction id
+ * @param Group Registers to read
+ * @return Size of the request
+ */
+u64 MbWriteReadRequest(u8 *Buf, u16 Tid, const mb_poll_group *Group);
+
+/**
+ * @brief Sets up polling on every connection of a context
+ *
+ * @param MbArena Memory arena for allocations
+ * @param MbCtx Modbus context
+ * @param Conf Polling configuration, must outlive the context
+ * @return 0 on success, -ENOMEM if the arena is too small
+ */
+sdb_errno MbPollInit(sdb_arena *MbArena, modbus_ctx *MbCtx, const mb_poll_conf *Conf);
+
+/**
+ * @brief Queues a poll of a register group
+ *
+ * @param Conn Connection to poll
+ * @param Group Index into mb_poll_conf::Groups
+ * @return true if queued, false if the previous poll of the group is still pending
+ */
+bool MbPollQueue(mb_conn *Conn, u32 Group);
+
+/**
+ * @brief Moves queued polls into free transaction slots and sends them
+ *
+ * All requests are written with a single send call.
+ *
+ * @param Conn Connection to send on
+ * @param Now Current monotonic time
+ * @return Number of requests sent, or a negative value if the connection failed
+ */
+i64 MbPollSend(mb_conn *Conn, struct timespec *Now);
+
+/**
+ * @brief Matches a response frame with its outstanding request
+ *
+ * @param Conn Connection the frame was received on
+ * @param Frame Complete frame
+ * @param FrameLen Length of the frame
+ * @param Data Set to the register data
+ * @param DataLength Set to the length of the register data
+ * @return Index of the polled group, -1 if the frame carries no data (an exception or a late
+ * response), or -2 if the frame is not a valid response
+ */
+i64 MbPollMatch(mb_conn *Conn, const u8 *Frame, u64 FrameLen, const u8 **Data, u16 *DataLength);
+
+/**
+ * @brief Gives up on requests that have been outstanding for longer than the timeout
+ *
+ * @param Conn Connection to check
+ * @param Now Current monotonic time
+ * @return Number of requests given up on
+ */
+u64 MbPollExpire(mb_conn *Conn, struct timespec *Now);
 
 SDB_END_EXTERN_C
 
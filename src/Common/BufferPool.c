@@ -0,0 +1,197 @@
+/**
+ * @file BufferPool.c
+ * @brief Implementation of the shared buffer pool
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <src/Sdb.h>
+SDB_LOG_REGISTER(BufferPool);
+
+#include <src/Common/BufferPool.h>
+
+#define SDB_BUF_POOL_TAG_ONE (1ull << 32)
+#define SDB_BUF_POOL_IDX     0xffffffffull
+
+typedef struct
+{
+    sdb_buf_pool *Pool; /**< Pool the cached buffers belong to, NULL if none */
+    u32           Count;
+    u32           Idx[SDB_BUF_POOL_CACHE_SIZE];
+} sdb_buf_pool_cache;
+
+static __thread sdb_buf_pool_cache SdbBufPoolCache;
+
+static pthread_key_t  SdbBufPoolCacheKey;
+static pthread_once_t SdbBufPoolCacheOnce = PTHREAD_ONCE_INIT;
+
+static void
+SdbBufPoolCacheExit(void *Arg)
+{
+    (void)Arg;
+    SdbBufPoolFlushCache();
+}
+
+static void
+SdbBufPoolCacheKeyInit(void)
+{
+    pthread_key_create(&SdbBufPoolCacheKey, SdbBufPoolCacheExit);
+}
+
+/**
+ * @brief Push the Count buffers in Idx onto the stack with one compare-and-swap
+ */
+static void
+SdbBufPoolPush(sdb_buf_pool *Pool, const u32 *Idx, u32 Count)
+{
+    for(u32 i = 0; i + 1 < Count; ++i) {
+        atomic_store_explicit(&Pool->Next[Idx[i]], Idx[i + 1] + 1, memory_order_relaxed);
+    }
+
+    u64 Top = atomic_load_explicit(&Pool->Top, memory_order_relaxed);
+    u64 New;
+    do {
+        atomic_store_explicit(&Pool->Next[Idx[Count - 1]], Top & SDB_BUF_POOL_IDX,
+                              memory_order_relaxed);
+        New = ((Top & ~SDB_BUF_POOL_IDX) + SDB_BUF_POOL_TAG_ONE) | (Idx[0] + 1);
+    } while(!atomic_compare_exchange_weak_explicit(&Pool->Top, &Top, New, memory_order_release,
+                                                   memory_order_relaxed));
+}
+
+/**
+ * @brief Pop up to Max buffers off the stack with one compare-and-swap
+ *
+ * NOTE(ingar): The Next entries walked may change under us if another thread pops the same
+ * buffers, but then it has changed the tag as well, so the compare-and-swap fails and we walk
+ * again
+ *
+ * @return u32 Buffers popped into Idx
+ */
+static u32
+SdbBufPoolPop(sdb_buf_pool *Pool, u32 *Idx, u32 Max)
+{
+    u64 Top = atomic_load_explicit(&Pool->Top, memory_order_acquire);
+    u64 New;
+    u32 Count;
+    do {
+        u64 Cur = Top & SDB_BUF_POOL_IDX;
+        for(Count = 0; Count < Max && Cur != 0; ++Count) {
+            Idx[Count] = Cur - 1;
+            Cur        = atomic_load_explicit(&Pool->Next[Cur - 1], memory_order_relaxed);
+        }
+        if(Count == 0) {
+            return 0;
+        }
+        New = ((Top & ~SDB_BUF_POOL_IDX) + SDB_BUF_POOL_TAG_ONE) | Cur;
+    } while(!atomic_compare_exchange_weak_explicit(&Pool->Top, &Top, New, memory_order_acquire,
+                                                   memory_order_acquire));
+
+    return Count;
+}
+
+/**
+ * @brief Get the calling thread's cache, emptied into its old pool if it was used with another
+ */
+static sdb_buf_pool_cache *
+SdbBufPoolCacheFor(sdb_buf_pool *Pool)
+{
+    sdb_buf_pool_cache *Cache = &SdbBufPoolCache;
+    if(Cache->Pool != Pool) {
+        SdbBufPoolFlushCache();
+        // NOTE(ingar): The key only has a value so its destructor runs when the thread exits
+        pthread_once(&SdbBufPoolCacheOnce, SdbBufPoolCacheKeyInit);
+        pthread_setspecific(SdbBufPoolCacheKey, Cache);
+        Cache->Pool = Pool;
+    }
+
+    return Cache;
+}
+
+sdb_buf_pool *
+SdbBufPoolCreate(u64 BufCount, u64 BufSize, const sdb_page_opts *Opts)
+{
+    if(BufCount == 0 || BufCount >= UINT32_MAX) {
+        SdbLogError("Invalid buffer pool size of %lu buffers", BufCount);
+        return NULL;
+    }
+
+    sdb_buf_pool *Pool = aligned_alloc(SDB_CACHE_LINE_SIZE, sizeof(sdb_buf_pool));
+    atomic_uint  *Next = malloc(BufCount * sizeof(atomic_uint));
+    if(Pool == NULL || Next == NULL) {
+        SdbLogError("Failed to allocate buffer pool of %lu buffers", BufCount);
+        free(Pool);
+        free(Next);
+        return NULL;
+    }
+
+    Pool->BufCount = BufCount;
+    Pool->BufSize  = BufSize;
+    Pool->Stride   = (BufSize + SDB_CACHE_LINE_SIZE - 1) & ~(u64)(SDB_CACHE_LINE_SIZE - 1);
+    Pool->Next     = Next;
+    if(SdbPagesMap(&Pool->Pages, BufCount * Pool->Stride, Opts) != 0) {
+        free(Pool);
+        free(Next);
+        return NULL;
+    }
+
+    for(u64 b = 0; b < BufCount; ++b) {
+        atomic_init(&Next[b], (b + 1 < BufCount) ? b + 2 : 0);
+    }
+    atomic_init(&Pool->Top, 1);
+    atomic_init(&Pool->DryCount, 0);
+
+    return Pool;
+}
+
+void
+SdbBufPoolDestroy(sdb_buf_pool *Pool)
+{
+    if(SdbBufPoolCache.Pool == Pool) {
+        SdbBufPoolFlushCache();
+    }
+    SdbPagesUnmap(&Pool->Pages);
+    free(Pool->Next);
+    free(Pool);
+}
+
+u8 *
+SdbBufPoolGet(sdb_buf_pool *Pool)
+{
+    sdb_buf_pool_cache *Cache = SdbBufPoolCacheFor(Pool);
+    if(Cache->Count == 0) {
+        Cache->Count = SdbBufPoolPop(Pool, Cache->Idx, SDB_BUF_POOL_CACHE_SIZE / 2);
+        if(Cache->Count == 0) {
+            atomic_fetch_add_explicit(&Pool->DryCount, 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+
+    u32 Idx = Cache->Idx[--Cache->Count];
+    return Pool->Pages.Mem + Idx * Pool->Stride;
+}
+
+void
+SdbBufPoolPut(sdb_buf_pool *Pool, u8 *Buf)
+{
+    SdbAssert(Buf >= Pool->Pages.Mem && Buf < Pool->Pages.Mem + Pool->BufCount * Pool->Stride,
+              "Buffer %p is not from pool %p", Buf, Pool);
+
+    sdb_buf_pool_cache *Cache = SdbBufPoolCacheFor(Pool);
+    if(Cache->Count == SDB_BUF_POOL_CACHE_SIZE) {
+        Cache->Count -= SDB_BUF_POOL_CACHE_SIZE / 2;
+        SdbBufPoolPush(Pool, &Cache->Idx[Cache->Count], SDB_BUF_POOL_CACHE_SIZE / 2);
+    }
+    Cache->Idx[Cache->Count++] = (Buf - Pool->Pages.Mem) / Pool->Stride;
+}
+
+void
+SdbBufPoolFlushCache(void)
+{
+    sdb_buf_pool_cache *Cache = &SdbBufPoolCache;
+    if(Cache->Pool != NULL && Cache->Count > 0) {
+        SdbBufPoolPush(Cache->Pool, Cache->Idx, Cache->Count);
+    }
+    Cache->Pool  = NULL;
+    Cache->Count = 0;
+}
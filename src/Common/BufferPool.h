@@ -0,0 +1,81 @@
+/**
+ * @file BufferPool.h
+ * @brief Pool of fixed-size buffers shared by any number of threads
+ *
+ * The free buffers are kept on a lock-free stack of buffer indices, whose top carries a tag that
+ * is bumped on every change so a compare-and-swap cannot mistake a popped and pushed again top
+ * for the one it read. Every thread keeps a small cache of buffers in front of the stack, so it
+ * only touches the shared top once per SDB_BUF_POOL_CACHE_SIZE / 2 buffers it takes or gives
+ * back. A thread's cache goes back to the pool when the thread exits.
+ *
+ * Buffers in the caches of other threads cannot be taken, so a pool should hold
+ * SDB_BUF_POOL_CACHE_SIZE buffers per thread using it on top of what the threads need.
+ */
+
+#ifndef SDB_BUFFER_POOL_H
+#define SDB_BUFFER_POOL_H
+
+#include <stdatomic.h>
+
+#include <src/Sdb.h>
+
+#include <src/Common/Pages.h>
+#include <src/Common/Thread.h>
+
+SDB_BEGIN_EXTERN_C
+
+/** @brief Buffers each thread keeps in its cache at most */
+#define SDB_BUF_POOL_CACHE_SIZE 8
+
+typedef struct
+{
+    u64          BufCount;
+    u64          BufSize;
+    u64          Stride; /**< Cache line aligned distance between the buffers */
+    sdb_pages    Pages;  /**< Memory of the buffers */
+    atomic_uint *Next;   /**< Index plus one of the buffer below each on the stack, 0 for none */
+
+    // NOTE(ingar): Tag in the upper half, index plus one of the top buffer in the lower
+    atomic_uint_fast64_t Top __attribute__((aligned(SDB_CACHE_LINE_SIZE)));
+    atomic_uint_fast64_t DryCount; /**< Times a thread wanted a buffer and found none */
+
+} __attribute__((aligned(SDB_CACHE_LINE_SIZE))) sdb_buf_pool;
+
+/**
+ * @brief Create a pool of BufCount buffers of BufSize bytes
+ *
+ * @param BufCount Number of buffers
+ * @param BufSize Size of each buffer
+ * @param Opts How to back the buffers, NULL for the defaults
+ * @return sdb_buf_pool* Pool with every buffer free, or NULL on failure
+ */
+sdb_buf_pool *SdbBufPoolCreate(u64 BufCount, u64 BufSize, const sdb_page_opts *Opts);
+
+/**
+ * @brief Destroy a pool
+ *
+ * Every buffer must have been given back, and every other thread that used the pool must have
+ * exited. The calling thread's cache is emptied.
+ */
+void SdbBufPoolDestroy(sdb_buf_pool *Pool);
+
+/**
+ * @brief Take a buffer from the pool
+ *
+ * @return u8* Buffer of Pool->BufSize bytes, or NULL if the pool is empty
+ */
+u8 *SdbBufPoolGet(sdb_buf_pool *Pool);
+
+/**
+ * @brief Give a buffer back to the pool it was taken from
+ */
+void SdbBufPoolPut(sdb_buf_pool *Pool, u8 *Buf);
+
+/**
+ * @brief Give the buffers in the calling thread's cache back to their pool
+ */
+void SdbBufPoolFlushCache(void);
+
+SDB_END_EXTERN_C
+
+#endif
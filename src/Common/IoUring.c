@@ -0,0 +1,275 @@
+/**
+ * @file IoUring.c
+ * @brief Implementation of the minimal io_uring interface
+ *
+ * Resources:
+ * Efficient IO with io_uring. Describes the ring layout and memory ordering rules.
+ * @link https://kernel.dk/io_uring.pdf
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <src/Sdb.h>
+SDB_LOG_REGISTER(IoUring);
+
+#include <src/Common/IoUring.h>
+#include <src/Common/Time.h>
+
+
+static int
+UringSetup(u32 Entries, struct io_uring_params *Params)
+{
+    return syscall(__NR_io_uring_setup, Entries, Params);
+}
+
+static int
+UringEnter(int RingFd, u32 ToSubmit, u32 MinComplete, u32 Flags, void *Arg, size_t ArgSize)
+{
+    return syscall(__NR_io_uring_enter, RingFd, ToSubmit, MinComplete, Flags, Arg, ArgSize);
+}
+
+static int
+UringRegister(int RingFd, u32 Opcode, void *Arg, u32 ArgCount)
+{
+    return syscall(__NR_io_uring_register, RingFd, Opcode, Arg, ArgCount);
+}
+
+/**
+ * @brief Creates an io_uring instance
+ *
+ * Maps the submission queue, completion queue and submission entries. The entries of the
+ * submission array are set once to the identity mapping, so entry i is always submitted
+ * from slot i.
+ *
+ * @param Ring Ring to initialize
+ * @param Entries Submission queue size
+ * @return 0 on success, negative errno on failure
+ */
+sdb_errno
+SdbUringInit(sdb_uring *Ring, u32 Entries)
+{
+    SdbMemset(Ring, 0, sizeof(*Ring));
+
+    struct io_uring_params Params = { 0 };
+    Params.flags                  = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+
+    Ring->RingFd = UringSetup(Entries, &Params);
+    if(Ring->RingFd == -1 && errno == EINVAL) {
+        // NOTE(ingar): The flags are only optimizations, so kernels that lack them are fine
+        SdbMemset(&Params, 0, sizeof(Params));
+        Ring->RingFd = UringSetup(Entries, &Params);
+    }
+    if(Ring->RingFd == -1) {
+        sdb_errno Err = -errno;
+        SdbLogWarning("io_uring is not available: %s", strerror(errno));
+        return Err;
+    }
+
+    Ring->Features = Params.features;
+    if(!(Ring->Features & IORING_FEAT_EXT_ARG)) {
+        SdbLogWarning("io_uring lacks IORING_FEAT_EXT_ARG, kernel is too old");
+        close(Ring->RingFd);
+        return -ENOSYS;
+    }
+
+    Ring->SqRingSize = Params.sq_off.array + Params.sq_entries * sizeof(u32);
+    Ring->CqRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+    if(Ring->Features & IORING_FEAT_SINGLE_MMAP) {
+        Ring->SqRingSize = SdbMax(Ring->SqRingSize, Ring->CqRingSize);
+        Ring->CqRingSize = Ring->SqRingSize;
+    }
+
+    Ring->SqRing = mmap(NULL, Ring->SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        Ring->RingFd, IORING_OFF_SQ_RING);
+    if(Ring->SqRing == MAP_FAILED) {
+        goto error;
+    }
+
+    if(Ring->Features & IORING_FEAT_SINGLE_MMAP) {
+        Ring->CqRing = Ring->SqRing;
+    } else {
+        Ring->CqRing = mmap(NULL, Ring->CqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, Ring->RingFd, IORING_OFF_CQ_RING);
+        if(Ring->CqRing == MAP_FAILED) {
+            goto error;
+        }
+    }
+
+    Ring->SqesSize = Params.sq_entries * sizeof(struct io_uring_sqe);
+    Ring->Sqes     = mmap(NULL, Ring->SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          Ring->RingFd, IORING_OFF_SQES);
+    if(Ring->Sqes == MAP_FAILED) {
+        goto error;
+    }
+
+    u8 *Sq            = Ring->SqRing;
+    Ring->SqHead      = (u32 *)(Sq + Params.sq_off.head);
+    Ring->SqTail      = (u32 *)(Sq + Params.sq_off.tail);
+    Ring->SqMask      = *(u32 *)(Sq + Params.sq_off.ring_mask);
+    Ring->SqEntries   = Params.sq_entries;
+    Ring->SqLocalTail = *Ring->SqTail;
+
+    u32 *SqArray = (u32 *)(Sq + Params.sq_off.array);
+    for(u32 i = 0; i < Ring->SqEntries; ++i) {
+        SqArray[i] = i;
+    }
+
+    u8 *Cq       = Ring->CqRing;
+    Ring->CqHead = (u32 *)(Cq + Params.cq_off.head);
+    Ring->CqTail = (u32 *)(Cq + Params.cq_off.tail);
+    Ring->CqMask = *(u32 *)(Cq + Params.cq_off.ring_mask);
+    Ring->Cqes   = (struct io_uring_cqe *)(Cq + Params.cq_off.cqes);
+
+    return 0;
+
+error:
+    {
+        sdb_errno Err = -errno;
+        SdbLogError("Failed to map io_uring queues: %s", strerror(errno));
+        SdbUringDeinit(Ring);
+        return Err;
+    }
+}
+
+void
+SdbUringDeinit(sdb_uring *Ring)
+{
+    if(Ring->Sqes && Ring->Sqes != MAP_FAILED) {
+        munmap(Ring->Sqes, Ring->SqesSize);
+    }
+    if(Ring->CqRing && Ring->CqRing != MAP_FAILED && Ring->CqRing != Ring->SqRing) {
+        munmap(Ring->CqRing, Ring->CqRingSize);
+    }
+    if(Ring->SqRing && Ring->SqRing != MAP_FAILED) {
+        munmap(Ring->SqRing, Ring->SqRingSize);
+    }
+    if(Ring->RingFd >= 0) {
+        close(Ring->RingFd);
+    }
+    Ring->RingFd = -1;
+}
+
+struct io_uring_sqe *
+SdbUringGetSqe(sdb_uring *Ring)
+{
+    u32 Head = __atomic_load_n(Ring->SqHead, __ATOMIC_ACQUIRE);
+    if(Ring->SqLocalTail - Head >= Ring->SqEntries) {
+        return NULL;
+    }
+
+    struct io_uring_sqe *Sqe = &Ring->Sqes[Ring->SqLocalTail & Ring->SqMask];
+    SdbMemset(Sqe, 0, sizeof(*Sqe));
+    ++Ring->SqLocalTail;
+    return Sqe;
+}
+
+/**
+ * @brief Submits pending entries and waits for completions
+ *
+ * Publishes the local submission tail and makes a single io_uring_enter call. When nothing
+ * is pending and no completions are wanted, no system call is made.
+ *
+ * @param Ring Ring instance
+ * @param WaitCount Number of completions to wait for
+ * @param Timeout Maximum time to wait
+ * @return Number of entries submitted or negative errno
+ */
+i64
+SdbUringSubmitAndWait(sdb_uring *Ring, u32 WaitCount, sdb_timediff Timeout)
+{
+    u32 ToSubmit = Ring->SqLocalTail - *Ring->SqTail;
+    if(ToSubmit > 0) {
+        __atomic_store_n(Ring->SqTail, Ring->SqLocalTail, __ATOMIC_RELEASE);
+    }
+
+    if(ToSubmit == 0 && WaitCount == 0) {
+        return 0;
+    }
+
+    struct __kernel_timespec      Ts;
+    struct io_uring_getevents_arg Arg = { 0 };
+    u32                           Flags = 0;
+    if(WaitCount > 0) {
+        Ts.tv_sec  = SDB_TIME_TO_S(Timeout);
+        Ts.tv_nsec = SDB_TIME_TO_NS(Timeout) % (u64)1e9;
+        Arg.ts     = (u64)(uintptr_t)&Ts;
+        Flags      = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+
+    int Ret = UringEnter(Ring->RingFd, ToSubmit, WaitCount, Flags, &Arg, sizeof(Arg));
+    if(Ret == -1) {
+        return -errno;
+    }
+
+    return Ret;
+}
+
+/**
+ * @brief Allocates and registers a provided buffer ring
+ *
+ * The ring entries and the buffers share one anonymous mapping, with the ring first so it is
+ * page aligned as the kernel requires.
+ *
+ * @param Ring Ring instance
+ * @param BufRing Buffer ring to initialize
+ * @param Bgid Buffer group id
+ * @param Entries Number of buffers, power of two
+ * @param BufSize Size of each buffer
+ * @return 0 on success, negative errno on failure
+ */
+sdb_errno
+SdbUringBufRingInit(sdb_uring *Ring, sdb_uring_buf_ring *BufRing, u16 Bgid, u32 Entries,
+                    u32 BufSize)
+{
+    SdbAssert((Entries & (Entries - 1)) == 0, "Buffer ring size %u is not a power of two",
+              Entries);
+
+    u64 PageSize = sysconf(_SC_PAGESIZE);
+    u64 RingSize = Entries * sizeof(struct io_uring_buf);
+    RingSize     = (RingSize + PageSize - 1) & ~(PageSize - 1);
+
+    sdb_errno Ret = SdbMemMap(&BufRing->Map, NULL, RingSize + (u64)Entries * BufSize,
+                              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0, NULL, 0, 0);
+    if(Ret != 0) {
+        return Ret;
+    }
+
+    BufRing->Ring      = BufRing->Map.Data;
+    BufRing->Bufs      = (u8 *)BufRing->Map.Data + RingSize;
+    BufRing->Bgid      = Bgid;
+    BufRing->Entries   = Entries;
+    BufRing->BufSize   = BufSize;
+    BufRing->LocalTail = 0;
+
+    struct io_uring_buf_reg Reg = {
+        .ring_addr    = (u64)(uintptr_t)BufRing->Ring,
+        .ring_entries = Entries,
+        .bgid         = Bgid,
+    };
+    if(UringRegister(Ring->RingFd, IORING_REGISTER_PBUF_RING, &Reg, 1) == -1) {
+        Ret = -errno;
+        SdbLogWarning("Failed to register provided buffer ring: %s", strerror(errno));
+        SdbMemUnmap(&BufRing->Map);
+        return Ret;
+    }
+
+    for(u32 b = 0; b < Entries; ++b) {
+        SdbUringBufRingAdd(BufRing, b);
+    }
+    SdbUringBufRingPublish(BufRing);
+
+    return 0;
+}
+
+void
+SdbUringBufRingDeinit(sdb_uring *Ring, sdb_uring_buf_ring *BufRing)
+{
+    // NOTE(ingar): Destroying the ring releases its buffer rings as well
+    if(Ring->RingFd >= 0) {
+        struct io_uring_buf_reg Reg = { .bgid = BufRing->Bgid };
+        UringRegister(Ring->RingFd, IORING_UNREGISTER_PBUF_RING, &Reg, 1);
+    }
+    SdbMemUnmap(&BufRing->Map);
+}
@@ -0,0 +1,236 @@
+/**
+ * @file IoUring.h
+ * @brief Minimal io_uring interface
+ *
+ * Thin wrapper around the io_uring system calls, so the system does not depend on liburing.
+ * Only covers what the ingest backends need:
+ * - Ring setup and teardown
+ * - Getting and submitting submission queue entries
+ * - Waiting for and iterating completion queue entries
+ * - Provided buffer rings (IORING_REGISTER_PBUF_RING), used with multishot receive
+ * - The layout of multishot recvmsg completions in their provided buffers
+ *
+ * A ring must only be used by the thread that created it.
+ */
+
+#ifndef SDB_IO_URING_H
+#define SDB_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include <src/Sdb.h>
+
+SDB_BEGIN_EXTERN_C
+
+#include <src/Common/Time.h>
+
+/**
+ * @brief An io_uring instance with its mapped submission and completion queues
+ */
+typedef struct
+{
+    int RingFd;
+    u32 Features;
+
+    u32                 *SqHead;
+    u32                 *SqTail;
+    u32                  SqMask;
+    u32                  SqEntries;
+    u32                  SqLocalTail; /**< Tail including entries not yet handed to the kernel */
+    struct io_uring_sqe *Sqes;
+
+    u32                 *CqHead;
+    u32                 *CqTail;
+    u32                  CqMask;
+    struct io_uring_cqe *Cqes;
+
+    void  *SqRing;
+    size_t SqRingSize;
+    void  *CqRing;
+    size_t CqRingSize;
+    size_t SqesSize;
+} sdb_uring;
+
+/**
+ * @brief A provided buffer ring and the buffers it hands to the kernel
+ *
+ * Buffer i starts at Bufs + i * BufSize and has buffer id i.
+ */
+typedef struct
+{
+    struct io_uring_buf_ring *Ring;
+    u16                       Bgid;      /**< Buffer group id used in IOSQE_BUFFER_SELECT requests */
+    u16                       LocalTail; /**< Tail including buffers not yet published */
+    u32                       Entries;
+    u32                       BufSize;
+    u8                       *Bufs;
+    sdb_mmap                  Map;
+} sdb_uring_buf_ring;
+
+/**
+ * @brief Creates an io_uring instance
+ *
+ * @param Ring Ring to initialize
+ * @param Entries Submission queue size
+ * @return 0 on success, negative errno if io_uring is unavailable or lacks required features
+ */
+sdb_errno SdbUringInit(sdb_uring *Ring, u32 Entries);
+
+/**
+ * @brief Destroys an io_uring instance, cancelling all outstanding requests
+ *
+ * @param Ring Ring to destroy
+ */
+void SdbUringDeinit(sdb_uring *Ring);
+
+/**
+ * @brief Gets a zeroed submission queue entry
+ *
+ * @param Ring Ring instance
+ * @return Submission queue entry, NULL if the submission queue is full
+ */
+struct io_uring_sqe *SdbUringGetSqe(sdb_uring *Ring);
+
+/**
+ * @brief Submits pending entries and waits for completions
+ *
+ * @param Ring Ring instance
+ * @param WaitCount Number of completions to wait for, 0 to only submit
+ * @param Timeout Maximum time to wait
+ * @return Number of entries submitted, or negative errno. -ETIME and -EINTR mean the wait ended
+ * without completions
+ */
+i64 SdbUringSubmitAndWait(sdb_uring *Ring, u32 WaitCount, sdb_timediff Timeout);
+
+/**
+ * @brief Gets the completion queue entry at a position
+ *
+ * @param Ring Ring instance
+ * @param Head Position, from SdbUringCqHead
+ * @return Completion queue entry, NULL if Head has no completion yet
+ */
+static inline struct io_uring_cqe *
+SdbUringCqeAt(sdb_uring *Ring, u32 Head)
+{
+    if(Head == __atomic_load_n(Ring->CqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &Ring->Cqes[Head & Ring->CqMask];
+}
+
+/** @brief Position of the oldest unseen completion */
+static inline u32
+SdbUringCqHead(sdb_uring *Ring)
+{
+    return *Ring->CqHead;
+}
+
+/** @brief Marks Count completions as seen, handing their slots back to the kernel */
+static inline void
+SdbUringCqAdvance(sdb_uring *Ring, u32 Count)
+{
+    __atomic_store_n(Ring->CqHead, *Ring->CqHead + Count, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Iterates the unseen completions without consuming them
+ *
+ * Follow with SdbUringCqAdvance for the number of entries visited.
+ */
+#define SdbUringForEachCqe(ring, head, cqe)                                                        \
+    for(head = SdbUringCqHead(ring); (cqe = SdbUringCqeAt(ring, head)) != NULL; ++head)
+
+/**
+ * @brief Allocates and registers a provided buffer ring with all buffers available
+ *
+ * @param Ring Ring instance
+ * @param BufRing Buffer ring to initialize
+ * @param Bgid Buffer group id
+ * @param Entries Number of buffers, must be a power of two
+ * @param BufSize Size of each buffer
+ * @return 0 on success, negative errno on failure
+ */
+sdb_errno SdbUringBufRingInit(sdb_uring *Ring, sdb_uring_buf_ring *BufRing, u16 Bgid, u32 Entries,
+                              u32 BufSize);
+
+/**
+ * @brief Unregisters and frees a provided buffer ring
+ *
+ * May be called after SdbUringDeinit, which is the safe order while receives are outstanding.
+ *
+ * @param Ring Ring instance
+ * @param BufRing Buffer ring to free
+ */
+void SdbUringBufRingDeinit(sdb_uring *Ring, sdb_uring_buf_ring *BufRing);
+
+/** @brief Gets the memory of a buffer */
+static inline u8 *
+SdbUringBuf(sdb_uring_buf_ring *BufRing, u16 Bid)
+{
+    return BufRing->Bufs + (u64)Bid * BufRing->BufSize;
+}
+
+/**
+ * @brief Queues a buffer to be handed back to the kernel
+ *
+ * The buffer is not visible to the kernel until SdbUringBufRingPublish is called.
+ */
+static inline void
+SdbUringBufRingAdd(sdb_uring_buf_ring *BufRing, u16 Bid)
+{
+    struct io_uring_buf *Buf = &BufRing->Ring->bufs[BufRing->LocalTail & (BufRing->Entries - 1)];
+    Buf->addr                = (u64)(uintptr_t)SdbUringBuf(BufRing, Bid);
+    Buf->len                 = BufRing->BufSize;
+    Buf->bid                 = Bid;
+    ++BufRing->LocalTail;
+}
+
+/** @brief Makes the buffers queued with SdbUringBufRingAdd available to the kernel */
+static inline void
+SdbUringBufRingPublish(sdb_uring_buf_ring *BufRing)
+{
+    __atomic_store_n(&BufRing->Ring->tail, BufRing->LocalTail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Gets the header a multishot IORING_OP_RECVMSG completion wrote to its provided buffer
+ *
+ * The buffer holds the header, msg_namelen bytes of address, msg_controllen bytes of control
+ * messages and the payload, with the lengths of the msghdr the receive was queued with.
+ *
+ * @param Buf Provided buffer of the completion
+ * @param Len Result of the completion
+ * @param Msg Message header the receive was queued with
+ * @return Header, NULL if Len can not hold it
+ */
+static inline struct io_uring_recvmsg_out *
+SdbUringRecvmsgOut(u8 *Buf, i32 Len, const struct msghdr *Msg)
+{
+    u64 HeaderLen = sizeof(struct io_uring_recvmsg_out) + Msg->msg_namelen + Msg->msg_controllen;
+    return (Len >= 0 && (u64)Len >= HeaderLen) ? (struct io_uring_recvmsg_out *)Buf : NULL;
+}
+
+/**
+ * @brief Gets the control messages of a multishot recvmsg completion as a msghdr, so the CMSG
+ * macros can walk them
+ */
+static inline struct msghdr
+SdbUringRecvmsgControl(struct io_uring_recvmsg_out *Out, const struct msghdr *Msg)
+{
+    return (struct msghdr){
+        .msg_control    = (u8 *)(Out + 1) + Msg->msg_namelen,
+        .msg_controllen = Out->controllen,
+    };
+}
+
+/** @brief Gets the payload of a multishot recvmsg completion, Out->payloadlen bytes long */
+static inline u8 *
+SdbUringRecvmsgPayload(struct io_uring_recvmsg_out *Out, const struct msghdr *Msg)
+{
+    return (u8 *)(Out + 1) + Msg->msg_namelen + Msg->msg_controllen;
+}
+
+SDB_END_EXTERN_C
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * @file LatencyHistogram.c
+ * @brief Implementation of the log-linear latency histogram
+ *
+ * Values below SDB_LATENCY_SUB_BUCKETS get a bucket each. A larger value with its highest set
+ * bit at position E goes to the bucket picked by the SDB_LATENCY_SUB_BITS bits below that bit,
+ * in the group of buckets for E.
+ */
+
+#include <src/Sdb.h>
+SDB_LOG_REGISTER(LatencyHistogram);
+
+#include <src/Common/LatencyHistogram.h>
+#include <src/Common/Time.h>
+
+
+static inline u32
+BucketOf(u64 Value)
+{
+    if(Value < SDB_LATENCY_SUB_BUCKETS) {
+        return Value;
+    }
+
+    u32 Exp = 63 - __builtin_clzll(Value);
+    u32 Sub = (Value >> (Exp - SDB_LATENCY_SUB_BITS)) & (SDB_LATENCY_SUB_BUCKETS - 1);
+    return (Exp - SDB_LATENCY_SUB_BITS + 1) * SDB_LATENCY_SUB_BUCKETS + Sub;
+}
+
+static inline u64
+BucketUpperBound(u32 Bucket)
+{
+    if(Bucket < SDB_LATENCY_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    u32 Exp   = Bucket / SDB_LATENCY_SUB_BUCKETS + SDB_LATENCY_SUB_BITS - 1;
+    u64 Sub   = Bucket % SDB_LATENCY_SUB_BUCKETS;
+    u64 Width = 1ULL << (Exp - SDB_LATENCY_SUB_BITS);
+    return (SDB_LATENCY_SUB_BUCKETS + Sub) * Width + Width - 1;
+}
+
+void
+SdbLatencyHistAdd(sdb_latency_hist *Hist, sdb_timediff Latency, u64 Count)
+{
+    Hist->Buckets[BucketOf(Latency)] += Count;
+    Hist->Count += Count;
+    Hist->Max = SdbMax(Hist->Max, Latency);
+}
+
+sdb_timediff
+SdbLatencyHistPercentile(const sdb_latency_hist *Hist, double Percentile)
+{
+    if(Hist->Count == 0) {
+        return 0;
+    }
+
+    u64 Rank = (u64)(Percentile / 100.0 * Hist->Count);
+    Rank     = SdbMin(SdbMax(Rank, 1), Hist->Count);
+
+    u64 Seen = 0;
+    for(u32 b = 0; b < SDB_LATENCY_BUCKETS; ++b) {
+        Seen += Hist->Buckets[b];
+        if(Seen >= Rank) {
+            return SdbMin(BucketUpperBound(b), Hist->Max);
+        }
+    }
+
+    return Hist->Max;
+}
+
+void
+SdbLatencyHistReset(sdb_latency_hist *Hist)
+{
+    SdbMemset(Hist, 0, sizeof(*Hist));
+}
@@ -0,0 +1,62 @@
+/**
+ * @file LatencyHistogram.h
+ * @brief Log-linear histogram of latencies
+ *
+ * Each power of two range of nanoseconds is split into SDB_LATENCY_SUB_BUCKETS equal buckets,
+ * so a recorded value is known to within 1 / SDB_LATENCY_SUB_BUCKETS of itself at any scale.
+ * Recording is a few shifts and an increment, and percentiles are read by walking the buckets.
+ *
+ * A histogram is only used by the thread that owns it.
+ */
+
+#ifndef SDB_LATENCY_HISTOGRAM_H
+#define SDB_LATENCY_HISTOGRAM_H
+
+#include <src/Sdb.h>
+
+SDB_BEGIN_EXTERN_C
+
+#include <src/Common/Time.h>
+
+#define SDB_LATENCY_SUB_BITS    3
+#define SDB_LATENCY_SUB_BUCKETS (1 << SDB_LATENCY_SUB_BITS)
+#define SDB_LATENCY_BUCKETS     ((64 - SDB_LATENCY_SUB_BITS + 1) * SDB_LATENCY_SUB_BUCKETS)
+
+/**
+ * @brief Latency histogram
+ */
+typedef struct
+{
+    u64 Count; /**< Number of recorded values */
+    u64 Max;   /**< Largest recorded value */
+    u64 Buckets[SDB_LATENCY_BUCKETS];
+} sdb_latency_hist;
+
+/**
+ * @brief Records a latency
+ *
+ * @param Hist Histogram
+ * @param Latency Latency to record
+ * @param Count Number of times to record it, e.g. the number of packets it applies to
+ */
+void SdbLatencyHistAdd(sdb_latency_hist *Hist, sdb_timediff Latency, u64 Count);
+
+/**
+ * @brief Gets a percentile of the recorded latencies
+ *
+ * @param Hist Histogram
+ * @param Percentile Percentile between 0 and 100
+ * @return Upper bound of the bucket holding the percentile, 0 if nothing has been recorded
+ */
+sdb_timediff SdbLatencyHistPercentile(const sdb_latency_hist *Hist, double Percentile);
+
+/**
+ * @brief Forgets every recorded latency
+ *
+ * @param Hist Histogram
+ */
+void SdbLatencyHistReset(sdb_latency_hist *Hist);
+
+SDB_END_EXTERN_C
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * @file Pages.c
+ * @brief Implementation of page backed allocation
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <src/Sdb.h>
+SDB_LOG_REGISTER(Pages);
+
+#include <src/Common/Pages.h>
+
+// NOTE(ingar): From linux/mempolicy.h, which is not always installed
+#define SDB_MPOL_PREFERRED 1
+
+#define SDB_HUGE_PAGE_SIZE SdbMebiByte(2)
+
+/**
+ * @brief Prefer NUMA node Node for the pages of Mem not yet faulted in
+ *
+ * MPOL_PREFERRED rather than MPOL_BIND, so a full node makes the kernel fall back to another
+ * one instead of failing the allocation.
+ */
+static void
+SdbPagesPlace(void *Mem, u64 Size, i32 Node)
+{
+    if(Node >= SDB_PAGES_MAX_NODES) {
+        SdbLogWarning("NUMA node %d is above the highest supported, %d", Node,
+                      SDB_PAGES_MAX_NODES - 1);
+        return;
+    }
+
+    unsigned long Mask[SDB_PAGES_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    Mask[Node / (8 * sizeof(unsigned long))] |= 1ul << (Node % (8 * sizeof(unsigned long)));
+    if(syscall(SYS_mbind, Mem, Size, SDB_MPOL_PREFERRED, Mask, SDB_PAGES_MAX_NODES + 1, 0)
+       == -1) {
+        SdbLogWarning("Failed to place %lu bytes on NUMA node %d: %s", Size, Node,
+                      strerror(errno));
+    }
+}
+
+void
+SdbPagesApply(void *Mem, u64 Size, const sdb_page_opts *Opts)
+{
+    if(Opts->Hugepages && madvise(Mem, Size, MADV_HUGEPAGE) == -1) {
+        SdbLogWarning("Failed to advise transparent huge pages: %s", strerror(errno));
+    }
+    if(Opts->NumaNode >= 0) {
+        SdbPagesPlace(Mem, Size, Opts->NumaNode);
+    }
+    if(Opts->Lock && mlock(Mem, Size) == -1) {
+        SdbLogWarning("Failed to lock %lu bytes in memory, is RLIMIT_MEMLOCK too low? %s", Size,
+                      strerror(errno));
+    }
+}
+
+sdb_errno
+SdbPagesMap(sdb_pages *Pages, u64 Size, const sdb_page_opts *Opts)
+{
+    sdb_page_opts Default = SDB_PAGE_OPTS_DEFAULT;
+    if(Opts == NULL) {
+        Opts = &Default;
+    }
+
+    u64 PageSize = sysconf(_SC_PAGESIZE);
+    Pages->Mem   = MAP_FAILED;
+    Pages->Huge  = false;
+    if(Opts->Hugepages) {
+        Pages->Size = (Size + SDB_HUGE_PAGE_SIZE - 1) & ~(SDB_HUGE_PAGE_SIZE - 1);
+        Pages->Mem  = mmap(NULL, Pages->Size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(Pages->Mem == MAP_FAILED) {
+            SdbLogWarning("No reserved huge pages for %lu bytes, using transparent huge pages",
+                          Pages->Size);
+        } else {
+            Pages->Huge = true;
+        }
+    }
+    if(Pages->Mem == MAP_FAILED) {
+        Pages->Size = (Size + PageSize - 1) & ~(PageSize - 1);
+        Pages->Mem  = mmap(NULL, Pages->Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+        if(Pages->Mem == MAP_FAILED) {
+            sdb_errno Ret = -errno;
+            SdbLogError("Failed to map %lu bytes: %s", Pages->Size, strerror(-Ret));
+            Pages->Mem = NULL;
+            return Ret;
+        }
+    }
+
+    sdb_page_opts Apply = *Opts;
+    Apply.Hugepages     = Opts->Hugepages && !Pages->Huge;
+    SdbPagesApply(Pages->Mem, Pages->Size, &Apply);
+
+    // NOTE(ingar): Locked memory is faulted in already. Other memory is touched once per page,
+    // after it is placed, so it lands on the node and the hot path never faults on it
+    if(SdbPageOptsAny(Opts) && !Opts->Lock) {
+        for(u64 Off = 0; Off < Pages->Size; Off += PageSize) {
+            ((volatile u8 *)Pages->Mem)[Off] = 0;
+        }
+    }
+
+    return 0;
+}
+
+void
+SdbPagesUnmap(sdb_pages *Pages)
+{
+    if(Pages->Mem != NULL) {
+        munmap(Pages->Mem, Pages->Size);
+        Pages->Mem = NULL;
+    }
+}
@@ -0,0 +1,90 @@
+/**
+ * @file Pages.h
+ * @brief Page backed allocation for memory on the hot path
+ *
+ * Maps anonymous memory that can be:
+ * - Backed by huge pages, from the reserved pool or else transparent huge pages
+ * - Locked, so it is never swapped out
+ * - Placed on one NUMA node
+ *
+ * Memory with any of these is faulted in by the allocating thread before it is handed out, so
+ * the hot path does not fault. NUMA placement uses the mbind system call directly, so the
+ * system does not depend on libnuma.
+ */
+
+#ifndef SDB_PAGES_H
+#define SDB_PAGES_H
+
+#include <src/Sdb.h>
+
+SDB_BEGIN_EXTERN_C
+
+/** @brief Highest NUMA node SdbPagesMap can place memory on, plus one */
+#define SDB_PAGES_MAX_NODES 1024
+
+/**
+ * @brief How to back memory, all off by default
+ */
+typedef struct
+{
+    bool Hugepages; /**< Use huge pages, transparent ones if none are reserved */
+    bool Lock;      /**< mlock the memory */
+    i32  NumaNode;  /**< Node to place the memory on, -1 for the default policy */
+} sdb_page_opts;
+
+#define SDB_PAGE_OPTS_DEFAULT                                                                      \
+    ((sdb_page_opts){ .Hugepages = false, .Lock = false, .NumaNode = -1 })
+
+/**
+ * @brief Memory mapped by SdbPagesMap
+ */
+typedef struct
+{
+    u8  *Mem;
+    u64  Size; /**< Bytes mapped, rounded up to the page size used */
+    bool Huge; /**< Mapped from the reserved huge page pool */
+} sdb_pages;
+
+/**
+ * @brief Check whether any option is set
+ */
+static inline bool
+SdbPageOptsAny(const sdb_page_opts *Opts)
+{
+    return Opts != NULL && (Opts->Hugepages || Opts->Lock || Opts->NumaNode >= 0);
+}
+
+/**
+ * @brief Map zeroed memory backed as Opts says
+ *
+ * An option the system cannot honor, e.g. locking past RLIMIT_MEMLOCK, is logged and the
+ * memory is mapped without it.
+ *
+ * @param Pages Mapping to fill in
+ * @param Size Bytes needed
+ * @param Opts How to back the memory, NULL for the defaults
+ * @return 0 on success, negative errno if nothing could be mapped
+ */
+sdb_errno SdbPagesMap(sdb_pages *Pages, u64 Size, const sdb_page_opts *Opts);
+
+/**
+ * @brief Apply the options that work on existing memory to Mem
+ *
+ * Advises transparent huge pages, places the pages not yet faulted in on the node, and locks
+ * the memory, which faults all of it in. Used for memory SdbPagesMap does not own, like the
+ * buffers of elastic and persistent pipes.
+ *
+ * @param Mem Page aligned memory
+ * @param Size Bytes of memory
+ * @param Opts How to back the memory
+ */
+void SdbPagesApply(void *Mem, u64 Size, const sdb_page_opts *Opts);
+
+/**
+ * @brief Unmap memory from SdbPagesMap
+ */
+void SdbPagesUnmap(sdb_pages *Pages);
+
+SDB_END_EXTERN_C
+
+#endif
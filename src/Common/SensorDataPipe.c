@@ -1,5 +1,8 @@
+#include <poll.h>
 #include <stdio.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
 
 
 /**
@@ -33,32 +36,89 @@ SDB_LOG_REGISTER(SensorDataPipe);
 
 sensor_data_pipe *
 SdpCreate(u64 BufCount, u64 BufSize, sdb_arena *Arena)
+{
+    return SdpCreateElastic(BufCount, BufCount, BufSize, NULL, Arena);
+}
+
+/**
+ * @brief Create a pipe whose buffers are either allocated with it or placed in BufMem
+ *
+ * @param MinBufCount Number of buffers in circulation at first
+ * @param BufCount Number of buffers
+ * @param BufSize Size of each buffer arena
+ * @param Arena Optional memory arena for allocation
+ * @param BufMem Memory of the buffers, one every Stride bytes, or NULL to allocate them
+ * @param Stride Distance between the buffers in BufMem
+ * @param Pool Pool the buffers will be borrowed from, they are then left without memory
+ * @return sensor_data_pipe* Initialized pipeline or NULL
+ */
+static sensor_data_pipe *
+SdpCreateWithBuffers(u64 MinBufCount, u64 BufCount, u64 BufSize, sdb_arena *Arena, u8 *BufMem,
+                     u64 Stride, sdb_buf_pool *Pool)
 {
     sdb_arena TempArena;
     bool      UsingArena = Arena != NULL;
     if(!UsingArena) {
         u64 PipeSize = sizeof(sensor_data_pipe) + BufCount * sizeof(sdb_arena *)
-                     + BufCount * sizeof(sdb_arena) + BufCount * BufSize;
-        u8 *Mem = calloc(1, PipeSize);
+                     + BufCount * sizeof(sdb_arena) + BufCount * sizeof(sdp_stamps)
+                     + BufCount * sizeof(sdp_buf_header)
+                     + BufCount * (sizeof(atomic_uint) + 2 * sizeof(u32))
+                     + 2 * BufCount * sizeof(sdp_kept)
+                     + ((BufMem || Pool) ? 0 : BufCount * BufSize);
+        PipeSize     = (PipeSize + SDB_CACHE_LINE_SIZE - 1) & ~(u64)(SDB_CACHE_LINE_SIZE - 1);
+        u8 *Mem      = aligned_alloc(SDB_CACHE_LINE_SIZE, PipeSize);
+        if(Mem == NULL) {
+            SdbLogError("Failed to allocate pipe of %lu bytes", PipeSize);
+            return NULL;
+        }
+        SdbMemZero(Mem, PipeSize);
         SdbArenaInit(&TempArena, Mem, PipeSize);
         Arena = &TempArena;
     }
 
-    u64               ArenaF5 = SdbArenaGetPos(Arena);
+    // NOTE(ingar): The indices are cache line aligned, so the pipe must be too
+    u64 ArenaF5 = SdbArenaGetPos(Arena);
+    u64 Padding = -(uintptr_t)(Arena->Mem + Arena->Cur) & (SDB_CACHE_LINE_SIZE - 1);
+    SdbArenaPush(Arena, Padding);
+
     sensor_data_pipe *Pipe;
-    Pipe          = SdbPushStruct(Arena, sensor_data_pipe);
-    Pipe->Buffers = SdbPushArray(Arena, sdb_arena *, BufCount);
+    Pipe = SdbPushStructZero(Arena, sensor_data_pipe);
+    if(Pipe == NULL) {
+        SdbLogError("Arena too small for pipe");
+        SdbArenaSeek(Arena, ArenaF5);
+        return NULL;
+    }
+    Pipe->Buffers   = SdbPushArray(Arena, sdb_arena *, BufCount);
+    Pipe->Stamps    = SdbPushArrayZero(Arena, sdp_stamps, BufCount);
+    Pipe->Headers   = SdbPushArrayZero(Arena, sdp_buf_header, BufCount);
+    Pipe->Queue     = SdbPushArrayZero(Arena, atomic_uint, BufCount);
+    Pipe->FreeQueue = SdbPushArray(Arena, u32, BufCount);
+    Pipe->Spares    = SdbPushArray(Arena, u32, BufCount);
+    Pipe->Kept      = SdbPushArray(Arena, sdp_kept, 2 * BufCount);
     for(u64 b = 0; b < BufCount; ++b) {
-        sdb_arena *Buffer = SdbArenaBootstrap(Arena, NULL, BufSize);
-        Pipe->Buffers[b]  = Buffer;
+        if(BufMem || Pool) {
+            sdb_arena *Buffer = SdbPushStruct(Arena, sdb_arena);
+            SdbArenaInit(Buffer, BufMem ? BufMem + b * Stride : NULL, BufSize);
+            Pipe->Buffers[b] = Buffer;
+        } else {
+            sdb_arena *Buffer = SdbArenaBootstrap(Arena, NULL, BufSize);
+            Pipe->Buffers[b]  = Buffer;
+        }
     }
 
-    Pipe->ReadEventFd  = eventfd(0, 0 /*EFD_NONBLOCK*/);
-    Pipe->WriteEventFd = eventfd(0, 0 /*EFD_NONBLOCK*/);
-    // TODO(ingar): Is it correct to use non-block?
+    // NOTE(ingar): The eventfds are only written to wake a parked side, and the side drains its
+    // eventfd before it parks, so they must not block
+    Pipe->ReadEventFd  = eventfd(0, EFD_NONBLOCK);
+    Pipe->WriteEventFd = eventfd(0, EFD_NONBLOCK);
 
     if(Pipe->ReadEventFd == -1 || Pipe->WriteEventFd == -1) {
         SdbLogError("Failed to create event fd");
+        if(Pipe->ReadEventFd != -1) {
+            close(Pipe->ReadEventFd);
+        }
+        if(Pipe->WriteEventFd != -1) {
+            close(Pipe->WriteEventFd);
+        }
         if(UsingArena) {
             SdbArenaSeek(Arena, ArenaF5);
         } else {
@@ -67,17 +127,311 @@ SdpCreate(u64 BufCount, u64 BufSize, sdb_arena *Arena)
         return NULL;
     }
 
-    atomic_init(&Pipe->WriteBufIdx, 0);
-    atomic_init(&Pipe->ReadBufIdx, 0);
-    atomic_init(&Pipe->FullBuffersCount, 0);
+    Pipe->BufCount     = BufCount;
+    Pipe->SpinCount    = (get_nprocs() > 1) ? SDP_SPIN_COUNT : 0;
+    Pipe->Policy       = SdpPolicy_Block;
+    Pipe->DecimateStep = 2;
+    Pipe->Endian       = SDP_ENDIAN_HOST;
+    Pipe->Framing      = SdpFraming_Fixed;
+
+    Pipe->MinBufCount  = MinBufCount;
+    Pipe->BufStride    = Stride;
+    Pipe->ShrinkAfter  = SDP_SHRINK_AFTER;
+
+    // NOTE(ingar): The writer starts out with buffer 0, the rest of the first MinBufCount buffers
+    // are free, and the others are spares, popped in index order
+    for(u64 b = 1; b < MinBufCount; ++b) {
+        Pipe->FreeQueue[b - 1] = b;
+    }
+    for(u64 s = 0; s < BufCount - MinBufCount; ++s) {
+        Pipe->Spares[s] = BufCount - 1 - s;
+    }
+    Pipe->ActiveCount    = MinBufCount;
+    Pipe->WriteIdx       = 0;
+    Pipe->FreeTail       = 0;
+    Pipe->WriterFreeHead = MinBufCount - 1;
+    Pipe->WindowMinFree  = UINT64_MAX;
+    atomic_init(&Pipe->FreeHead, MinBufCount - 1);
+    atomic_init(&Pipe->Head, 0);
+    atomic_init(&Pipe->Taken, 0);
+    atomic_init(&Pipe->Released, 0);
+    atomic_init(&Pipe->WriterParked, false);
+    // NOTE(ingar): The reader starts out waiting for the first buffer, so its eventfd is only
+    // readable once there is one
+    atomic_init(&Pipe->ReaderParked, true);
+
+    return Pipe;
+}
+
+
+/**
+ * @brief Create Elastic Sensor Data Pipeline
+ *
+ * The buffers of an elastic pipe live in a region of MaxBufCount page aligned buffers that is
+ * reserved without committing memory, so only the buffers that have been in circulation take up
+ * RAM.
+ *
+ * @param MinBufCount Number of buffers in circulation when the pipe is idle
+ * @param MaxBufCount Number of buffers in circulation at most
+ * @param BufSize Size of each buffer arena
+ * @param PageOpts How to back the buffers, NULL to allocate them with the pipe
+ * @param Arena Optional memory arena for allocation
+ * @return sensor_data_pipe* Initialized pipeline or NULL
+ */
+sensor_data_pipe *
+SdpCreateElastic(u64 MinBufCount, u64 MaxBufCount, u64 BufSize, const sdb_page_opts *PageOpts,
+                 sdb_arena *Arena)
+{
+    if(MinBufCount == 0 || MinBufCount > MaxBufCount || MaxBufCount > UINT32_MAX) {
+        SdbLogError("Invalid pipe buffer counts, min %lu and max %lu", MinBufCount, MaxBufCount);
+        return NULL;
+    }
+    if(MinBufCount == MaxBufCount && !SdbPageOptsAny(PageOpts)) {
+        return SdpCreateWithBuffers(MinBufCount, MaxBufCount, BufSize, Arena, NULL, 0, NULL);
+    }
+    if(MinBufCount == MaxBufCount) {
+        u64 Stride = (BufSize + SDB_CACHE_LINE_SIZE - 1) & ~(u64)(SDB_CACHE_LINE_SIZE - 1);
+
+        sdb_pages Pages;
+        if(SdbPagesMap(&Pages, MaxBufCount * Stride, PageOpts) != 0) {
+            return NULL;
+        }
+        sensor_data_pipe *Pipe = SdpCreateWithBuffers(MinBufCount, MaxBufCount, BufSize, Arena,
+                                                      Pages.Mem, Stride, NULL);
+        if(Pipe == NULL) {
+            SdbPagesUnmap(&Pages);
+            return NULL;
+        }
+        Pipe->BufPages = Pages;
+
+        return Pipe;
+    }
+
+    u64 PageSize = sysconf(_SC_PAGESIZE);
+    u64 Stride   = (BufSize + PageSize - 1) & ~(PageSize - 1);
+    u8 *Region   = mmap(NULL, MaxBufCount * Stride, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(Region == MAP_FAILED) {
+        SdbLogError("Failed to reserve %lu bytes for pipe buffers: %s", MaxBufCount * Stride,
+                    strerror(errno));
+        return NULL;
+    }
+
+    sensor_data_pipe *Pipe
+        = SdpCreateWithBuffers(MinBufCount, MaxBufCount, BufSize, Arena, Region, Stride, NULL);
+    if(Pipe == NULL) {
+        munmap(Region, MaxBufCount * Stride);
+        return NULL;
+    }
+    Pipe->Region = Region;
+
+    // NOTE(ingar): Locking the whole region would commit memory for every buffer, so only the
+    // buffers in circulation are locked, the first MinBufCount to begin with
+    if(SdbPageOptsAny(PageOpts)) {
+        sdb_page_opts Apply = *PageOpts;
+        Apply.Lock          = false;
+        SdbPagesApply(Region, MaxBufCount * Stride, &Apply);
+        Pipe->LockBuffers = PageOpts->Lock;
+        if(Pipe->LockBuffers && mlock(Region, MinBufCount * Stride) == -1) {
+            SdbLogWarning("Failed to lock pipe buffers in memory: %s", strerror(errno));
+        }
+    }
+
+    return Pipe;
+}
+
+sensor_data_pipe *
+SdpCreatePooled(u64 MinBufCount, u64 MaxBufCount, sdb_buf_pool *Pool, sdb_arena *Arena)
+{
+    if(MinBufCount == 0 || MinBufCount > MaxBufCount || MaxBufCount > UINT32_MAX) {
+        SdbLogError("Invalid pipe buffer counts, min %lu and max %lu", MinBufCount, MaxBufCount);
+        return NULL;
+    }
+
+    sensor_data_pipe *Pipe
+        = SdpCreateWithBuffers(MinBufCount, MaxBufCount, Pool->BufSize, Arena, NULL, 0, Pool);
+    if(Pipe == NULL) {
+        return NULL;
+    }
+    Pipe->Pool = Pool;
 
-    Pipe->BufCount = BufCount;
-    u64 InitVal    = BufCount - 1;
-    write(Pipe->WriteEventFd, &InitVal, sizeof(InitVal));
+    // NOTE(ingar): The first MinBufCount buffers are the ones in circulation to begin with
+    for(u64 b = 0; b < MinBufCount; ++b) {
+        Pipe->Buffers[b]->Mem = SdbBufPoolGet(Pool);
+        if(Pipe->Buffers[b]->Mem == NULL) {
+            SdbLogError("Buffer pool has fewer than %lu buffers free for the pipe", MinBufCount);
+            SdpDestroy(Pipe, Arena != NULL);
+            return NULL;
+        }
+    }
 
     return Pipe;
 }
 
+/**
+ * @brief Wake the other side through its eventfd
+ */
+static void
+SdpSignal(int EventFd)
+{
+    u64 Val = 1;
+    if(write(EventFd, &Val, sizeof(Val)) == -1) {
+        SdbLogError("Failed to write to event fd: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Wake the other side if it has parked
+ *
+ * Called after storing the index the other side waits on. Both the store and the load of Parked
+ * are sequentially consistent, and a parking side stores Parked before it loads the index again,
+ * so either this sees Parked set or the other side sees the new index.
+ */
+static inline void
+SdpWake(atomic_bool *Parked, int EventFd)
+{
+    if(atomic_load(Parked) && atomic_exchange(Parked, false)) {
+        SdpSignal(EventFd);
+    }
+}
+
+/**
+ * @brief Take up the buffers a persistent pipe file left queued, or start the file afresh
+ *
+ * The file is only trusted if it was made for a pipe of the same shape and its queued buffers
+ * are distinct and fit in one. The first buffer not queued becomes the write buffer, and the
+ * rest are handed to the writer as if the reader had released them.
+ *
+ * @return u64 Number of buffers queued for the reader again
+ */
+static u64
+SdpPersistRestore(sensor_data_pipe *Pipe, u64 BufSize)
+{
+    sdp_persist_header *Header    = Pipe->Persist;
+    u64                 BufCount  = Pipe->BufCount;
+    u64                 Committed = atomic_load(&Header->Committed);
+    u64                 Consumed  = atomic_load(&Header->Consumed);
+
+    // NOTE(ingar): A persistent pipe never grows, so Spares is free to mark the queued buffers
+    bool Valid = Header->Magic == SDP_PERSIST_MAGIC && Header->BufCount == BufCount
+              && Header->BufSize == BufSize && Consumed <= Committed
+              && Committed - Consumed < BufCount;
+    SdbMemZero(Pipe->Spares, BufCount * sizeof(u32));
+    for(u64 Pos = Consumed; Valid && Pos < Committed; ++Pos) {
+        u32 Idx = atomic_load_explicit(&Pipe->Queue[Pos % BufCount], memory_order_relaxed);
+        Valid   = Idx < BufCount && !Pipe->Spares[Idx] && Header->Sizes[Idx] <= BufSize
+             && Pipe->Stamps[Idx].Count <= SDP_STAMP_MAX;
+        if(Valid) {
+            Pipe->Spares[Idx] = 1;
+        }
+    }
+
+    if(!Valid) {
+        if(Header->Magic != 0) {
+            SdbLogWarning("Pipe file was made for another pipe or is damaged, starting it over");
+        }
+        // NOTE(ingar): The magic goes last, so a file is never trusted half initialized
+        Header->Magic    = 0;
+        Header->BufCount = BufCount;
+        Header->BufSize  = BufSize;
+        atomic_store(&Header->Committed, 0);
+        atomic_store(&Header->Consumed, 0);
+        for(u64 b = 0; b < BufCount; ++b) {
+            Pipe->Stamps[b].Count = 0;
+        }
+        atomic_thread_fence(memory_order_release);
+        Header->Magic = SDP_PERSIST_MAGIC;
+        return 0;
+    }
+
+    u64 FreeCount = 0;
+    for(u64 b = 0; b < BufCount; ++b) {
+        if(Pipe->Spares[b]) {
+            SdbArenaSeek(Pipe->Buffers[b], Header->Sizes[b]);
+            continue;
+        }
+        if(FreeCount == 0) {
+            Pipe->WriteIdx = b;
+        } else {
+            Pipe->FreeQueue[FreeCount - 1] = b;
+        }
+        Pipe->Stamps[b].Count = 0;
+        ++FreeCount;
+    }
+    Pipe->WriterFreeHead = FreeCount - 1;
+    Pipe->ReaderHead     = Consumed;
+    Pipe->Recycled       = Consumed;
+    atomic_store(&Pipe->Released, Consumed);
+    atomic_store(&Pipe->FreeHead, FreeCount - 1);
+    atomic_store(&Pipe->Head, Committed);
+    atomic_store(&Pipe->Taken, Consumed);
+
+    return Committed - Consumed;
+}
+
+sensor_data_pipe *
+SdpCreatePersistent(u64 BufCount, u64 BufSize, sdb_string Path, const sdb_page_opts *PageOpts,
+                    sdb_arena *Arena)
+{
+    if(BufCount == 0 || BufCount > UINT32_MAX) {
+        SdbLogError("Invalid pipe buffer count %lu", BufCount);
+        return NULL;
+    }
+
+    u64 PageSize   = sysconf(_SC_PAGESIZE);
+    u64 Stride     = (BufSize + PageSize - 1) & ~(PageSize - 1);
+    u64 StampsOff  = sizeof(sdp_persist_header) + BufCount * sizeof(u64);
+    u64 HeadersOff = StampsOff + BufCount * sizeof(sdp_stamps);
+    u64 QueueOff   = HeadersOff + BufCount * sizeof(sdp_buf_header);
+    u64 HeaderSize = (QueueOff + BufCount * sizeof(atomic_uint) + PageSize - 1) & ~(PageSize - 1);
+    u64 MapSize    = HeaderSize + BufCount * Stride;
+
+    sdb_mmap  Map;
+    sdb_errno Ret = SdbMemMap(&Map, NULL, MapSize, PROT_READ | PROT_WRITE, MAP_SHARED, -2, 0,
+                              Path, O_RDWR | O_CREAT, 0644);
+    if(Ret != 0) {
+        return NULL;
+    }
+    Ret = -posix_fallocate(Map.Fd, 0, MapSize);
+    if(Ret != 0) {
+        SdbLogError("Failed to allocate %lu bytes for pipe file %s: %s", MapSize, Path,
+                    strerror(-Ret));
+        SdbMemUnmap(&Map);
+        return NULL;
+    }
+
+    u8               *File = Map.Data;
+    sensor_data_pipe *Pipe = SdpCreateWithBuffers(BufCount, BufCount, BufSize, Arena,
+                                                  File + HeaderSize, Stride, NULL);
+    if(Pipe == NULL) {
+        SdbMemUnmap(&Map);
+        return NULL;
+    }
+    // NOTE(ingar): The stamps, headers and Queue the pipe was made with go unused, the file's
+    // take over
+    Pipe->PersistMap        = Map;
+    Pipe->Persist           = (sdp_persist_header *)File;
+    Pipe->PersistHeaderSize = HeaderSize;
+    Pipe->Stamps            = (sdp_stamps *)(File + StampsOff);
+    Pipe->Headers           = (sdp_buf_header *)(File + HeadersOff);
+    Pipe->Queue             = (atomic_uint *)(File + QueueOff);
+
+    if(PageOpts != NULL && PageOpts->Lock) {
+        sdb_page_opts Apply = { .Lock = true, .NumaNode = -1 };
+        SdbPagesApply(File, MapSize, &Apply);
+    }
+
+    Pipe->ReplayCount = SdpPersistRestore(Pipe, BufSize);
+    Pipe->ReplayEnd   = atomic_load(&Pipe->Head);
+    if(Pipe->ReplayCount > 0) {
+        SdbLogInfo("Replaying %lu buffers from pipe file %s", Pipe->ReplayCount, Path);
+        // NOTE(ingar): Nothing was published to wake the reader for, so it is woken here to
+        // find the replayed buffers without waiting for new data
+        SdpWake(&Pipe->ReaderParked, Pipe->ReadEventFd);
+    }
+
+    return Pipe;
+}
 
 /**
  * @brief Destroy Sensor Data Pipeline
@@ -94,6 +448,27 @@ SdpDestroy(sensor_data_pipe *Pipe, bool AllocatedWithArena)
 {
     close(Pipe->ReadEventFd);
     close(Pipe->WriteEventFd);
+    for(u32 t = 0; t < Pipe->TapCount; ++t) {
+        close(Pipe->Taps[t]->EventFd);
+        free(Pipe->Taps[t]);
+    }
+    if(Pipe->SpillMap.Data) {
+        SdbMemUnmap(&Pipe->SpillMap);
+    }
+    if(Pipe->Region) {
+        munmap(Pipe->Region, Pipe->BufCount * Pipe->BufStride);
+    }
+    if(Pipe->PersistMap.Data) {
+        SdbMemUnmap(&Pipe->PersistMap);
+    }
+    SdbPagesUnmap(&Pipe->BufPages);
+    if(Pipe->Pool) {
+        for(u64 b = 0; b < Pipe->BufCount; ++b) {
+            if(Pipe->Buffers[b]->Mem) {
+                SdbBufPoolPut(Pipe->Pool, Pipe->Buffers[b]->Mem);
+            }
+        }
+    }
     if(!AllocatedWithArena) {
         free(Pipe);
     }
@@ -101,123 +476,1274 @@ SdpDestroy(sensor_data_pipe *Pipe, bool AllocatedWithArena)
 
 
 /**
- * @brief Acquire Write Buffer Arena
- *
- * Obtains the next available memory arena for writing,
- * blocking if no buffer is available.
+ * @brief Announce that this side is about to wait on its eventfd
  *
- * @param Pipe Pipeline instance
- * @return sdb_arena* Available write buffer arena or NULL
+ * Drains the eventfd first, so it only becomes readable again when the other side wakes us. The
+ * other side only signals after clearing Parked, so the eventfd is known to be empty while Parked
+ * is still set from the last time.
  */
-sdb_arena *
-SdPipeGetWriteBuffer(sensor_data_pipe *Pipe)
+static inline void
+SdpPark(atomic_bool *Parked, int EventFd)
 {
-    u32 CurWriteBuf  = atomic_load(&Pipe->WriteBufIdx);
-    u32 NextWriteBuf = (CurWriteBuf + 1) % Pipe->BufCount;
+    if(atomic_load_explicit(Parked, memory_order_relaxed)) {
+        return;
+    }
 
-    // Block until a slot is available
     u64 Val;
-    if(read(Pipe->WriteEventFd, &Val, sizeof(Val)) == -1) {
-        if(errno == EINTR) {
-            // Handle interrupt if needed
-            return NULL;
-        }
-        SdbLogError("Failed to read from WriteEventFd");
-        return NULL;
+    if(read(EventFd, &Val, sizeof(Val)) == -1 && errno != EAGAIN) {
+        SdbLogError("Failed to read from event fd: %s", strerror(errno));
     }
+    atomic_store(Parked, true);
+}
 
-    atomic_store(&Pipe->WriteBufIdx, NextWriteBuf);
-    atomic_fetch_add(&Pipe->FullBuffersCount, 1);
+/**
+ * @brief Block until an eventfd is readable
+ *
+ * @return 0 when readable, -EINTR if interrupted by a signal, or another negative errno
+ */
+static sdb_errno
+SdpWaitEventFd(int EventFd)
+{
+    struct pollfd Pfd = { .fd = EventFd, .events = POLLIN };
+    if(poll(&Pfd, 1, -1) == -1) {
+        return -errno;
+    }
+    return 0;
+}
 
-    // Signal reader that new data is available
-    Val = 1;
-    if(write(Pipe->ReadEventFd, &Val, sizeof(Val)) == -1) {
-        SdbLogError("Failed to write to ReadEventFd");
-        return NULL;
+/**
+ * @brief Number of whole packets in a buffer, or of records in a SdpFraming_Prefixed one
+ */
+static inline u64
+SdpPacketCount(sensor_data_pipe *Pipe, sdb_arena *Buf)
+{
+    if(Pipe->Framing == SdpFraming_Prefixed) {
+        u64 Count = 0, Offset = 0;
+        while(SdPipeNextRecord(Buf, &Offset)) {
+            ++Count;
+        }
+        return Count;
     }
+    return (Pipe->PacketSize > 0) ? SdbArenaGetPos(Buf) / Pipe->PacketSize : 0;
+}
 
-    sdb_arena *Buf = Pipe->Buffers[NextWriteBuf];
-    SdbArenaClear(Buf);
-    return Buf;
+/**
+ * @brief Describe buffer Idx, as filled by the writer, in Header
+ */
+static void
+SdpFinishHeader(sensor_data_pipe *Pipe, u32 Idx, sdp_buf_header *Header)
+{
+    sdp_stamps *Stamps  = &Pipe->Stamps[Idx];
+    Header->SchemaId    = Pipe->SchemaId;
+    Header->Endian      = Pipe->Endian;
+    Header->Framing     = Pipe->Framing;
+    Header->RecordCount = SdpPacketCount(Pipe, Pipe->Buffers[Idx]);
+    Header->FirstNs     = (Stamps->Count > 0) ? Stamps->Stamps[0].RecvNs : 0;
+    Header->LastNs      = (Stamps->Count > 0) ? Stamps->Stamps[Stamps->Count - 1].RecvNs : 0;
+}
+
+/**
+ * @brief Append the buffers published before Upto to FreeQueue, for a pipe with taps
+ */
+static void
+SdpTapRecycle(sensor_data_pipe *Pipe, u64 Upto)
+{
+    u64 FreeHead = Pipe->WriterFreeHead;
+    for(; Pipe->Recycled < Upto; ++Pipe->Recycled) {
+        Pipe->FreeQueue[FreeHead++ % Pipe->BufCount] = atomic_load_explicit(
+            &Pipe->Queue[Pipe->Recycled % Pipe->BufCount], memory_order_relaxed);
+    }
+    Pipe->WriterFreeHead = FreeHead;
+    atomic_store_explicit(&Pipe->FreeHead, FreeHead, memory_order_relaxed);
 }
 
+/**
+ * @brief Move a lossy tap that is behind Limit forward to it
+ *
+ * A tap holding no buffer is moved at once and the skipped packets are counted here. A tap
+ * holding one is told to go on from Limit when it releases it, and counts them itself.
+ */
+static void
+SdpTapSkip(sensor_data_pipe *Pipe, sdp_tap *Tap, u64 Limit)
+{
+    u64 Word = atomic_load(&Tap->Pos);
+    while((Word >> 1) < Limit) {
+        if(Word & 1) {
+            atomic_store(&Tap->SkipTo, Limit);
+            return;
+        }
+        if(atomic_compare_exchange_weak(&Tap->Pos, &Word, Limit << 1)) {
+            u64 Dropped = 0;
+            for(u64 Pos = Word >> 1; Pos < Limit; ++Pos) {
+                u32 Idx  = atomic_load_explicit(&Pipe->Queue[Pos % Pipe->BufCount],
+                                                memory_order_relaxed);
+                Dropped += SdpPacketCount(Pipe, Pipe->Buffers[Idx]);
+            }
+            atomic_fetch_add_explicit(&Tap->DroppedCount, Dropped, memory_order_relaxed);
+            return;
+        }
+    }
+}
 
 /**
- * @brief Acquire Read Buffer Arena
+ * @brief Take back the buffers that the reader and every attached tap are done with
  *
- * Obtains the next available memory arena for reading,
- * blocking until data is available.
+ * When that frees none, the lossy taps behind the reader and the lossless taps are moved
+ * forward to the slowest of them, and the buffers they skipped are taken back too.
  *
- * @param Pipe Pipeline instance
- * @return sdb_arena* Available read buffer arena or NULL
+ * @return true if there is room
  */
-sdb_arena *
-SdPipeGetReadBuffer(sensor_data_pipe *Pipe)
+static bool
+SdpTapReclaim(sensor_data_pipe *Pipe)
 {
-    // Block until data is available
-    u64 Val;
-    if(read(Pipe->ReadEventFd, &Val, sizeof(Val)) == -1) {
-        if(errno == EINTR) {
-            // Handle interrupt if needed
-            return NULL;
+    u64 Limit = atomic_load(&Pipe->Released);
+    u64 Min   = UINT64_MAX;
+    for(u32 t = 0; t < Pipe->TapCount; ++t) {
+        sdp_tap *Tap = Pipe->Taps[t];
+        if(atomic_load(&Tap->Attached)) {
+            u64 Pos = atomic_load(&Tap->Pos) >> 1;
+            if(Tap->Lossy) {
+                Min = SdbMin(Min, Pos);
+            } else {
+                Limit = SdbMin(Limit, Pos);
+            }
+        }
+    }
+    SdpTapRecycle(Pipe, SdbMin(Min, Limit));
+    if(Pipe->FreeTail != Pipe->WriterFreeHead || Min >= Limit) {
+        return Pipe->FreeTail != Pipe->WriterFreeHead;
+    }
+
+    Min = Limit;
+    for(u32 t = 0; t < Pipe->TapCount; ++t) {
+        sdp_tap *Tap = Pipe->Taps[t];
+        if(Tap->Lossy && atomic_load(&Tap->Attached)) {
+            SdpTapSkip(Pipe, Tap, Limit);
+            // NOTE(ingar): Detaching also releases, so the position of a tap detached since
+            // does not hold anything up
+            u64 Pos = atomic_load(&Tap->Pos) >> 1;
+            if(atomic_load(&Tap->Attached)) {
+                Min = SdbMin(Min, Pos);
+            }
         }
-        SdbLogError("Failed to read from ReadEventFd");
-        return NULL;
     }
+    SdpTapRecycle(Pipe, Min);
 
-    u32        CurReadBuffer = atomic_load(&Pipe->ReadBufIdx);
-    sdb_arena *Buf           = Pipe->Buffers[CurReadBuffer];
-    atomic_store(&Pipe->ReadBufIdx, (CurReadBuffer + 1) % Pipe->BufCount);
-    atomic_fetch_sub(&Pipe->FullBuffersCount, 1);
+    return Pipe->FreeTail != Pipe->WriterFreeHead;
+}
 
-    // Signal writer that a slot is available
-    Val = 1;
-    if(write(Pipe->WriteEventFd, &Val, sizeof(Val)) == -1) {
-        SdbLogError("Failed to write to WriteEventFd");
-        return NULL;
+/**
+ * @brief Check whether the reader has released a buffer the writer has not taken back
+ *
+ * Only loads FreeHead when the writer's last copy of it says there is none.
+ */
+static inline bool
+SdpWriterHasRoom(sensor_data_pipe *Pipe)
+{
+    if(Pipe->FreeTail != Pipe->WriterFreeHead) {
+        return true;
     }
+    if(Pipe->TapCount > 0) {
+        return SdpTapReclaim(Pipe);
+    }
+    Pipe->WriterFreeHead = atomic_load(&Pipe->FreeHead);
+    return Pipe->FreeTail != Pipe->WriterFreeHead;
+}
 
-    return Buf;
+/**
+ * @brief Check whether the writer has published a buffer that is not taken
+ */
+static inline bool
+SdpReaderHasData(sensor_data_pipe *Pipe, u64 Taken)
+{
+    if(Taken < Pipe->ReaderHead) {
+        return true;
+    }
+    Pipe->ReaderHead = atomic_load(&Pipe->Head);
+    return Taken < Pipe->ReaderHead;
 }
 
 /**
- * @brief Flush the current write buffer
+ * @brief Spin and then park until the reader has released a buffer
  *
- * If the current write buffer is not empty, it is marked as full and the next buffer is prepared.
- * If the next buffer is already full, the function will block until a slot is available.
+ * @return true when there is room, false on error
+ */
+static bool
+SdpWaitForRoom(sensor_data_pipe *Pipe)
+{
+    for(u32 Spin = 0; Spin < Pipe->SpinCount; ++Spin) {
+        if(SdpWriterHasRoom(Pipe)) {
+            return true;
+        }
+        SdbCpuRelax();
+    }
+
+    // NOTE(ingar): The reader only signals after releasing a buffer, so the writer stays parked
+    // until there is room
+    SdpPark(&Pipe->WriterParked, Pipe->WriteEventFd);
+    while(!SdpWriterHasRoom(Pipe)) {
+        sdb_errno Ret = SdpWaitEventFd(Pipe->WriteEventFd);
+        if(Ret != 0 && Ret != -EINTR) {
+            SdbLogError("Failed to wait on WriteEventFd: %s", strerror(-Ret));
+            return false;
+        }
+    }
+    atomic_store(&Pipe->WriterParked, false);
+
+    return true;
+}
+
+/**
+ * @brief Take back the oldest buffer released by the reader
  *
- * @param Pipe Pipeline instance
+ * The caller has checked that there is one.
  */
-void
-SdPipeFlush(sensor_data_pipe *Pipe)
+static inline u32
+SdpTakeFree(sensor_data_pipe *Pipe)
 {
-    sdb_arena *CurrentBuf = Pipe->Buffers[atomic_load(&Pipe->WriteBufIdx)];
-    if(SdbArenaGetPos(CurrentBuf) > 0) {
-        u32 CurWriteBuf  = atomic_load(&Pipe->WriteBufIdx);
-        u32 NextWriteBuf = (CurWriteBuf + 1) % Pipe->BufCount;
-
-        // Block until a slot is available
-        u64 Val;
-        if(read(Pipe->WriteEventFd, &Val, sizeof(Val)) == -1) {
-            if(errno == EINTR) {
-                SdbLogWarning("Flush interrupted while waiting for buffer");
-                return;
-            }
-            SdbLogError("Failed to read from WriteEventFd during flush: %s", strerror(errno));
-            return;
+    return Pipe->FreeQueue[Pipe->FreeTail++ % Pipe->BufCount];
+}
+
+/**
+ * @brief Take a free buffer, or bring a spare one into circulation if there is none
+ *
+ * @param[out] Idx Index of the buffer
+ * @return true if the writer got a buffer, false if the pipe is full
+ */
+static inline bool
+SdpTakeRoom(sensor_data_pipe *Pipe, u32 *Idx)
+{
+    if(SdpWriterHasRoom(Pipe)) {
+        *Idx = SdpTakeFree(Pipe);
+        return true;
+    }
+
+    u64 SpareCount = Pipe->BufCount - Pipe->ActiveCount;
+    if(SpareCount == 0) {
+        return false;
+    }
+
+    *Idx = Pipe->Spares[SpareCount - 1];
+    if(Pipe->Pool) {
+        u8 *Mem = SdbBufPoolGet(Pipe->Pool);
+        if(Mem == NULL) {
+            ++Pipe->PoolDryCount;
+            return false;
         }
+        Pipe->Buffers[*Idx]->Mem = Mem;
+    }
+    if(Pipe->LockBuffers && mlock(Pipe->Buffers[*Idx]->Mem, Pipe->BufStride) == -1) {
+        SdbLogWarning("Failed to lock pipe buffer in memory: %s", strerror(errno));
+    }
+    ++Pipe->ActiveCount;
+    ++Pipe->GrowCount;
+    return true;
+}
+
+/**
+ * @brief Take buffers that stayed free for ShrinkAfter out of circulation
+ *
+ * Called by the writer of an elastic pipe after each publish, and by SdPipeShrinkIdle between
+ * publishes. The fewest free buffers seen in the current window were not needed at any point of
+ * it, so that many are retired, and their memory is given back to the kernel, or to the pool of
+ * a pooled pipe.
+ */
+static void
+SdpElasticTick(sensor_data_pipe *Pipe)
+{
+    Pipe->WriterFreeHead = atomic_load_explicit(&Pipe->FreeHead, memory_order_acquire);
+    u64 Free             = Pipe->WriterFreeHead - Pipe->FreeTail;
+    Pipe->WindowMinFree  = SdbMin(Pipe->WindowMinFree, Free);
 
-        atomic_store(&Pipe->WriteBufIdx, NextWriteBuf);
-        atomic_fetch_add(&Pipe->FullBuffersCount, 1);
+    struct timespec Now;
+    SdbTimeMonotonic(&Now);
+    u64 NowNs = SdbTimespecNs(&Now);
+    if(NowNs - Pipe->WindowStartNs < Pipe->ShrinkAfter) {
+        return;
+    }
 
-        // Signal reader that new data is available
-        Val = 1;
-        if(write(Pipe->ReadEventFd, &Val, sizeof(Val)) == -1) {
-            SdbLogError("Failed to write to ReadEventFd during flush: %s", strerror(errno));
-            return;
+    u64 Retire = SdbMin(Pipe->WindowMinFree, Pipe->ActiveCount - Pipe->MinBufCount);
+    for(u64 r = 0; r < Retire; ++r) {
+        u32 Idx = SdpTakeFree(Pipe);
+        if(Pipe->LockBuffers) {
+            munlock(Pipe->Buffers[Idx]->Mem, Pipe->BufStride);
         }
+        if(Pipe->Pool) {
+            SdbBufPoolPut(Pipe->Pool, Pipe->Buffers[Idx]->Mem);
+            SdbArenaInit(Pipe->Buffers[Idx], NULL, Pipe->Buffers[Idx]->Cap);
+        } else if(madvise(Pipe->Buffers[Idx]->Mem, Pipe->BufStride, MADV_DONTNEED) == -1) {
+            SdbLogWarning("Failed to release pipe buffer memory: %s", strerror(errno));
+        }
+        Pipe->Spares[Pipe->BufCount - Pipe->ActiveCount] = Idx;
+        --Pipe->ActiveCount;
+    }
+    if(Retire > 0) {
+        ++Pipe->ShrinkCount;
+    }
+
+    Pipe->WindowStartNs = NowNs;
+    Pipe->WindowMinFree = UINT64_MAX;
+}
+
+/**
+ * @brief Take the oldest published buffer that is not taken yet
+ *
+ * Used by the reader, and by a SdpPolicy_DropOldest writer to drop the buffer. Every published
+ * buffer is either taken, queued, or held by the writer, so at most BufCount - 1 buffers are
+ * queued and the writer never reuses the entry of Queue at Taken before Taken has moved past it.
+ * The entry may still be overwritten by the time a side that lost the race reads it, but that
+ * side's compare-and-swap then fails.
+ *
+ * @param Head Published buffer count, as last seen by the caller
+ * @param[out] Idx Index of the taken buffer
+ * @param[out] Pos Queue position of the taken buffer
+ * @return true if a buffer was taken
+ */
+static inline bool
+SdpTakeQueued(sensor_data_pipe *Pipe, u64 Head, u32 *Idx, u64 *Pos)
+{
+    u64 Taken = atomic_load_explicit(&Pipe->Taken, memory_order_relaxed);
+    while(Taken < Head) {
+        *Idx = atomic_load_explicit(&Pipe->Queue[Taken % Pipe->BufCount], memory_order_relaxed);
+        *Pos = Taken;
+        if(atomic_compare_exchange_weak(&Pipe->Taken, &Taken, Taken + 1)) {
+            return true;
+        }
+    }
+
+    return false;
+}
 
-        sdb_arena *NextBuf = Pipe->Buffers[NextWriteBuf];
-        SdbArenaClear(NextBuf);
+/**
+ * @brief Commit the buffer just queued at Head to the pipe file
+ *
+ * Its size is written before Committed moves past it, so the file never holds a queued buffer
+ * of unknown size. With PersistSync, the buffer reaches the disk before the header does.
+ */
+static void
+SdpPersistCommit(sensor_data_pipe *Pipe, u64 Head)
+{
+    sdb_arena *Buf                        = Pipe->Buffers[Pipe->WriteIdx];
+    Pipe->Persist->Sizes[Pipe->WriteIdx] = SdbArenaGetPos(Buf);
+    if(Pipe->PersistSync) {
+        msync(Buf->Mem, SdbArenaGetPos(Buf), MS_SYNC);
+    }
+    atomic_store_explicit(&Pipe->Persist->Committed, Head + 1, memory_order_release);
+    if(Pipe->PersistSync) {
+        msync(Pipe->Persist, Pipe->PersistHeaderSize, MS_SYNC);
+    }
+}
+
+/**
+ * @brief Publish the current write buffer and make Next, emptied, the current one
+ *
+ * The caller owns Next.
+ */
+static sdb_arena *
+SdpPublish(sensor_data_pipe *Pipe, u32 Next)
+{
+    u64 Head = atomic_load_explicit(&Pipe->Head, memory_order_relaxed);
+    SdpFinishHeader(Pipe, Pipe->WriteIdx, &Pipe->Headers[Pipe->WriteIdx]);
+    atomic_store_explicit(&Pipe->Queue[Head % Pipe->BufCount], Pipe->WriteIdx,
+                          memory_order_relaxed);
+    if(Pipe->Persist) {
+        SdpPersistCommit(Pipe, Head);
+    }
+
+    sdb_arena *Buf = Pipe->Buffers[Next];
+    SdbArenaClear(Buf);
+    Pipe->Stamps[Next].Count = 0;
+    Pipe->WriteIdx           = Next;
+    Pipe->UnstampedNs        = 0;
+
+    atomic_store(&Pipe->Head, Head + 1);
+    SdpWake(&Pipe->ReaderParked, Pipe->ReadEventFd);
+    for(u32 t = 0; t < Pipe->TapCount; ++t) {
+        SdpWake(&Pipe->Taps[t]->Parked, Pipe->Taps[t]->EventFd);
+    }
+
+    if(Pipe->Region || Pipe->Pool) {
+        SdpElasticTick(Pipe);
+    }
+
+    return Buf;
+}
+
+/**
+ * @brief Drop the oldest published buffer the reader has not taken and publish in its place
+ *
+ * @return sdb_arena* Next write buffer arena, or NULL if the reader has taken every buffer
+ */
+static sdb_arena *
+SdpDropOldest(sensor_data_pipe *Pipe)
+{
+    u32 Idx;
+    u64 Pos;
+    u64 Head = atomic_load_explicit(&Pipe->Head, memory_order_relaxed);
+    if(!SdpTakeQueued(Pipe, Head, &Idx, &Pos)) {
+        return NULL;
+    }
+
+    Pipe->DroppedCount += SdpPacketCount(Pipe, Pipe->Buffers[Idx]);
+    return SdpPublish(Pipe, Idx);
+}
+
+/**
+ * @brief Empty the current write buffer
+ */
+static sdb_arena *
+SdpDropNewest(sensor_data_pipe *Pipe)
+{
+    sdb_arena *Buf = Pipe->Buffers[Pipe->WriteIdx];
+    Pipe->DroppedCount += SdpPacketCount(Pipe, Buf);
+    SdbArenaClear(Buf);
+    Pipe->Stamps[Pipe->WriteIdx].Count = 0;
+    Pipe->UnstampedNs                  = 0;
+
+    return Buf;
+}
+
+/**
+ * @brief Keep every DecimateStep-th packet of the current write buffer
+ *
+ * The kept packets are moved to the front of the buffer, in order. A stamp moves with the first
+ * packet it covers that is kept, and stamps that cover no kept packet are removed, so every kept
+ * packet keeps its receive time.
+ */
+static sdb_arena *
+SdpDecimate(sensor_data_pipe *Pipe)
+{
+    sdb_arena  *Buf    = Pipe->Buffers[Pipe->WriteIdx];
+    sdp_stamps *Stamps = &Pipe->Stamps[Pipe->WriteIdx];
+    u64         Size   = Pipe->PacketSize;
+    u64         Step   = Pipe->DecimateStep;
+    u64         Count  = SdpPacketCount(Pipe, Buf);
+    if(Step < 2 || Count < 2 || Pipe->Framing == SdpFraming_Prefixed) {
+        return SdpDropNewest(Pipe);
+    }
+    SdbAssert(SdbArenaGetPos(Buf) == Count * Size, "Buffer %p holds a partial packet",
+              (void *)Buf);
+
+    u64 Kept = 0;
+    for(u64 p = 0; p < Count; p += Step, ++Kept) {
+        memmove(Buf->Mem + Kept * Size, Buf->Mem + p * Size, Size);
+    }
+
+    u32 StampCount = 0;
+    for(u32 s = 0; s < Stamps->Count; ++s) {
+        u64 First = (Stamps->Stamps[s].Offset / Size + Step - 1) / Step;
+        if(First >= Kept) {
+            break;
+        }
+        if(StampCount > 0 && Stamps->Stamps[StampCount - 1].Offset == First * Size) {
+            --StampCount;
+        }
+        Stamps->Stamps[StampCount++]
+            = (sdp_stamp){ .RecvNs = Stamps->Stamps[s].RecvNs, .Offset = First * Size };
+    }
+    Stamps->Count = StampCount;
+
+    Pipe->DecimatedCount += Count - Kept;
+    SdbArenaSeek(Buf, Kept * Size);
+
+    return Buf;
+}
+
+/**
+ * @brief Get a slot of the spill file
+ */
+static inline sdp_spill_slot *
+SdpSpillSlot(sensor_data_pipe *Pipe, u64 Pos)
+{
+    return (sdp_spill_slot *)((u8 *)Pipe->SpillMap.Data
+                              + (Pos % Pipe->SpillSlotCount) * Pipe->SpillSlotSize);
+}
+
+/**
+ * @brief Unmap the pages of a spill slot from the process
+ *
+ * The data stays in the file, and the kernel writes dirty pages back and reclaims them like any
+ * other page cache, so a long outage does not pile the spilled data up in the process's memory.
+ */
+static inline void
+SdpSpillEvict(sensor_data_pipe *Pipe, sdp_spill_slot *Slot)
+{
+    if(madvise(Slot, Pipe->SpillSlotSize, MADV_DONTNEED) == -1) {
+        SdbLogWarning("Failed to unmap spill slot: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Check whether the writer may publish, or must keep spilling
+ *
+ * A spilling writer stops once the reader has released every spilled buffer, so that the
+ * reader never sees a published buffer that is newer than a spilled one. Only the reader knows
+ * what it has taken, and it releases a spilled buffer no earlier than it takes it.
+ */
+static inline bool
+SdpWriterMayPublish(sensor_data_pipe *Pipe)
+{
+    if(Pipe->Spilling
+       && atomic_load(&Pipe->SpillTail)
+              == atomic_load_explicit(&Pipe->SpillHead, memory_order_relaxed)) {
+        Pipe->Spilling = false;
+    }
+    return !Pipe->Spilling;
+}
+
+/**
+ * @brief Copy the current write buffer to the spill file and empty it
+ *
+ * @return sdb_arena* The emptied buffer, or NULL if the spill file is full
+ */
+static sdb_arena *
+SdpSpill(sensor_data_pipe *Pipe)
+{
+    u64 SpillHead = atomic_load_explicit(&Pipe->SpillHead, memory_order_relaxed);
+    if(SpillHead - atomic_load(&Pipe->SpillTail) == Pipe->SpillSlotCount) {
+        return NULL;
+    }
+
+    sdb_arena      *Buf    = Pipe->Buffers[Pipe->WriteIdx];
+    sdp_stamps     *Stamps = &Pipe->Stamps[Pipe->WriteIdx];
+    sdp_spill_slot *Slot   = SdpSpillSlot(Pipe, SpillHead);
+    Slot->Size             = SdbArenaGetPos(Buf);
+    Slot->Stamps.Count     = Stamps->Count;
+    SdbMemcpy(Slot->Stamps.Stamps, Stamps->Stamps, Stamps->Count * sizeof(sdp_stamp));
+    SdpFinishHeader(Pipe, Pipe->WriteIdx, &Slot->Header);
+    SdbMemcpy(Slot->Data, Buf->Mem, Slot->Size);
+    SdpSpillEvict(Pipe, Slot);
+
+    Pipe->Spilling = true;
+    Pipe->SpilledCount += SdpPacketCount(Pipe, Buf);
+    SdbArenaClear(Buf);
+    Stamps->Count     = 0;
+    Pipe->UnstampedNs = 0;
+
+    atomic_store(&Pipe->SpillHead, SpillHead + 1);
+    SdpWake(&Pipe->ReaderParked, Pipe->ReadEventFd);
+
+    return Buf;
+}
+
+sdb_errno
+SdpSpillInit(sensor_data_pipe *Pipe, sdb_string Path, u64 Size)
+{
+    u64 PageSize        = sysconf(_SC_PAGESIZE);
+    u64 SlotSize        = sizeof(sdp_spill_slot) + SdbArenaRemaining(Pipe->Buffers[0]);
+    Pipe->SpillSlotSize = (SlotSize + PageSize - 1) & ~(PageSize - 1);
+    Pipe->SpillSlotCount = Size / Pipe->SpillSlotSize;
+    if(Pipe->SpillSlotCount == 0) {
+        SdbLogError("Spill file %s of %lu bytes cannot hold a buffer of %lu bytes", Path, Size,
+                    Pipe->SpillSlotSize);
+        return -EINVAL;
+    }
+
+    u64       MapSize = Pipe->SpillSlotCount * Pipe->SpillSlotSize;
+    sdb_errno Ret     = SdbMemMap(&Pipe->SpillMap, NULL, MapSize, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, -2, 0, Path, O_RDWR | O_CREAT, 0644);
+    if(Ret != 0) {
+        Pipe->SpillMap.Data = NULL;
+        return Ret;
+    }
+
+    Ret = -posix_fallocate(Pipe->SpillMap.Fd, 0, MapSize);
+    if(Ret != 0) {
+        SdbLogError("Failed to allocate %lu bytes for spill file %s: %s", MapSize, Path,
+                    strerror(-Ret));
+        SdbMemUnmap(&Pipe->SpillMap);
+        Pipe->SpillMap.Data = NULL;
+        return Ret;
+    }
+
+    atomic_init(&Pipe->SpillHead, 0);
+    atomic_init(&Pipe->SpillTail, 0);
+
+    return 0;
+}
+
+
+/**
+ * @brief Acquire Write Buffer Arena
+ *
+ * Publishes the current write buffer and returns the next one. If the pipe is full and cannot
+ * grow, the pipe's Policy decides whether to wait for the reader or to drop data.
+ *
+ * @param Pipe Pipeline instance
+ * @return sdb_arena* Available write buffer arena or NULL
+ */
+sdb_arena *
+SdPipeGetWriteBuffer(sensor_data_pipe *Pipe)
+{
+    u32 Idx;
+    bool MayPublish = SdpWriterMayPublish(Pipe);
+    if(MayPublish && SdpTakeRoom(Pipe, &Idx)) {
+        return SdpPublish(Pipe, Idx);
+    }
+
+    if(MayPublish) {
+        ++Pipe->FullCount;
+    }
+    switch(Pipe->Policy) {
+        case SdpPolicy_Block:
+            {
+                if(!SdpWaitForRoom(Pipe)) {
+                    return NULL;
+                }
+                return SdpPublish(Pipe, SdpTakeFree(Pipe));
+            }
+        case SdpPolicy_DropOldest:
+            {
+                sdb_arena *Buf = SdpDropOldest(Pipe);
+                return (Buf != NULL) ? Buf : SdpDropNewest(Pipe);
+            }
+        case SdpPolicy_DropNewest:
+            return SdpDropNewest(Pipe);
+        case SdpPolicy_Decimate:
+            return SdpDecimate(Pipe);
+        case SdpPolicy_Spill:
+            {
+                sdb_arena *Buf = SdpSpill(Pipe);
+                return (Buf != NULL) ? Buf : SdpDropNewest(Pipe);
+            }
+    }
+
+    SdbAssert(0, "Unknown pipe policy %d", Pipe->Policy);
+    return NULL;
+}
+
+/**
+ * @brief Try to acquire write buffer arena
+ *
+ * @param Pipe Pipeline instance
+ * @return sdb_arena* Next write buffer arena, or NULL if the pipe is full or spilling
+ */
+sdb_arena *
+SdPipeTryGetWriteBuffer(sensor_data_pipe *Pipe)
+{
+    u32 Idx;
+    if(!SdpWriterMayPublish(Pipe) || !SdpTakeRoom(Pipe, &Idx)) {
+        return NULL;
+    }
+
+    return SdpPublish(Pipe, Idx);
+}
+
+/**
+ * @brief Append a length prefixed record to the current write buffer
+ *
+ * Every policy hands back an emptied buffer for a SdpFraming_Prefixed pipe, since
+ * SdpPolicy_Decimate drops the newest records instead, so a record that fits in a buffer fits
+ * in the one SdPipeGetWriteBuffer returns.
+ */
+sdb_arena *
+SdPipePushRecord(sensor_data_pipe *Pipe, u32 SchemaId, const void *Data, u32 Size, u64 RecvNs)
+{
+    SdbAssert(Pipe->Framing == SdpFraming_Prefixed, "Pipe does not take prefixed records");
+
+    u64 RecordSize
+        = (sizeof(sdp_record) + Size + SDP_RECORD_ALIGN - 1) & ~(u64)(SDP_RECORD_ALIGN - 1);
+    sdb_arena *Buf = SdPipeCurrentWriteBuffer(Pipe);
+    if(RecordSize > SdbArenaRemaining(Buf)) {
+        if(RecordSize > Buf->Cap) {
+            SdbLogError("Record of %u bytes does not fit in a pipe buffer", Size);
+            return NULL;
+        }
+        Buf = SdPipeGetWriteBuffer(Pipe);
+        if(Buf == NULL) {
+            return NULL;
+        }
+    }
+
+    SdPipeStamp(Pipe, Buf, RecvNs);
+    sdp_record *Record = SdbArenaPush(Buf, RecordSize);
+    Record->Size       = Size;
+    Record->SchemaId   = SchemaId;
+    SdbMemcpy(Record->Data, Data, Size);
+
+    return Buf;
+}
+
+/**
+ * @brief Check whether the writer has spilled a buffer that is not taken
+ */
+static inline bool
+SdpReaderHasSpill(sensor_data_pipe *Pipe, u64 SpillTail)
+{
+    if(SpillTail != Pipe->ReaderSpillHead) {
+        return true;
+    }
+    Pipe->ReaderSpillHead = atomic_load(&Pipe->SpillHead);
+    return SpillTail != Pipe->ReaderSpillHead;
+}
+
+/**
+ * @brief Take the oldest buffer for the reader, if there is one
+ *
+ * SpillHead is loaded before Head. The writer publishes nothing while there are spilled
+ * buffers the reader has not taken, so a published buffer seen after a spilled one is older
+ * than it, and is taken first.
+ *
+ * @return sdb_arena* The buffer, or NULL if there is none
+ */
+static sdb_arena *
+SdpReaderTake(sensor_data_pipe *Pipe)
+{
+    u64  SpillTail = Pipe->ReaderSpillTail;
+    bool Spilled   = Pipe->SpillMap.Data != NULL && SdpReaderHasSpill(Pipe, SpillTail);
+
+    u64 Taken = atomic_load_explicit(&Pipe->Taken, memory_order_relaxed);
+    if(SdpReaderHasData(Pipe, Taken)) {
+        // NOTE(ingar): Only a SdpPolicy_DropOldest writer can take the buffer first, and then it
+        // has published another one
+        while(!SdpTakeQueued(Pipe, Pipe->ReaderHead, &Pipe->HeldIdx, &Pipe->HeldPos)) {
+            SdbCpuRelax();
+            SdpReaderHasData(Pipe, Pipe->ReaderHead);
+        }
+        Pipe->ReaderHolds = true;
+        return Pipe->Buffers[Pipe->HeldIdx];
+    }
+
+    if(Spilled) {
+        sdp_spill_slot *Slot = SdpSpillSlot(Pipe, SpillTail);
+        SdbArenaInit(&Pipe->SpillBuf, Slot->Data, Pipe->SpillSlotSize - sizeof(sdp_spill_slot));
+        SdbArenaSeek(&Pipe->SpillBuf, Slot->Size);
+        Pipe->HeldPos          = Pipe->ReaderSpillTail++;
+        Pipe->ReaderHoldsSpill = true;
+        return &Pipe->SpillBuf;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Try to acquire read buffer arena
+ *
+ * When the pipe looks empty, the reader parks before it checks Head a last time. If the writer
+ * published in between without seeing the reader park, ReadEventFd has already been drained, so
+ * the reader signals it itself to keep it readable for the buffers after this one.
+ *
+ * @param Pipe Pipeline instance
+ * @return sdb_arena* Oldest full buffer arena, or NULL if the pipe is empty
+ */
+sdb_arena *
+SdPipeTryGetReadBuffer(sensor_data_pipe *Pipe)
+{
+    SdPipeReleaseReadBuffer(Pipe);
+
+    sdb_arena *Buf = SdpReaderTake(Pipe);
+    if(Buf == NULL) {
+        SdpPark(&Pipe->ReaderParked, Pipe->ReadEventFd);
+        Buf = SdpReaderTake(Pipe);
+        if(Buf == NULL) {
+            return NULL;
+        }
+        if(atomic_exchange(&Pipe->ReaderParked, false)) {
+            SdpSignal(Pipe->ReadEventFd);
+        }
+    }
+
+    return Buf;
+}
+
+
+/**
+ * @brief Acquire Read Buffer Arena
+ *
+ * Obtains the next available memory arena for reading,
+ * spinning and then blocking until data is available.
+ *
+ * @param Pipe Pipeline instance
+ * @return sdb_arena* Available read buffer arena or NULL
+ */
+sdb_arena *
+SdPipeGetReadBuffer(sensor_data_pipe *Pipe)
+{
+    SdPipeReleaseReadBuffer(Pipe);
+
+    for(u32 Spin = 0; Spin < Pipe->SpinCount; ++Spin) {
+        sdb_arena *Buf = SdpReaderTake(Pipe);
+        if(Buf != NULL) {
+            return Buf;
+        }
+        SdbCpuRelax();
+    }
+
+    for(;;) {
+        sdb_arena *Buf = SdPipeTryGetReadBuffer(Pipe);
+        if(Buf != NULL) {
+            return Buf;
+        }
+
+        sdb_errno Ret = SdpWaitEventFd(Pipe->ReadEventFd);
+        if(Ret == -EINTR) {
+            return NULL;
+        } else if(Ret != 0) {
+            SdbLogError("Failed to wait on ReadEventFd: %s", strerror(-Ret));
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Hand a spilled buffer back to the writer
+ */
+static void
+SdpReleaseSpill(sensor_data_pipe *Pipe, sdp_spill_slot *Slot, u64 Pos)
+{
+    // NOTE(ingar): A spilling writer never waits for the reader, so there is nobody to wake
+    SdpSpillEvict(Pipe, Slot);
+    atomic_store(&Pipe->SpillTail, Pos + 1);
+}
+
+/**
+ * @brief Hand a buffer taken from Queue back to the writer
+ *
+ * At most BufCount - 1 buffers are released and not taken back, since the writer always has
+ * one, so the entry written never holds one the writer has yet to take.
+ */
+static void
+SdpReleaseQueued(sensor_data_pipe *Pipe, u32 Idx, u64 Pos)
+{
+    if(Pipe->Persist) {
+        // NOTE(ingar): Before the writer can reuse the buffer, so a file never has a buffer
+        // queued that was overwritten
+        atomic_store_explicit(&Pipe->Persist->Consumed, Pos + 1, memory_order_release);
+    }
+    if(Pipe->TapCount > 0) {
+        atomic_store(&Pipe->Released, Pos + 1);
+        SdpWake(&Pipe->WriterParked, Pipe->WriteEventFd);
+        return;
+    }
+    u64 FreeHead = atomic_load_explicit(&Pipe->FreeHead, memory_order_relaxed);
+    Pipe->FreeQueue[FreeHead % Pipe->BufCount] = Idx;
+    atomic_store(&Pipe->FreeHead, FreeHead + 1);
+    SdpWake(&Pipe->WriterParked, Pipe->WriteEventFd);
+}
+
+/**
+ * @brief Hand the current read buffer back to the writer
+ *
+ * @param Pipe Pipeline instance
+ */
+void
+SdPipeReleaseReadBuffer(sensor_data_pipe *Pipe)
+{
+    if(Pipe->ReaderHoldsSpill) {
+        Pipe->ReaderHoldsSpill = false;
+        SdpReleaseSpill(Pipe, (sdp_spill_slot *)(Pipe->SpillBuf.Mem - sizeof(sdp_spill_slot)),
+                        Pipe->HeldPos);
+    } else if(Pipe->ReaderHolds) {
+        Pipe->ReaderHolds = false;
+        SdpReleaseQueued(Pipe, Pipe->HeldIdx, Pipe->HeldPos);
+    }
+}
+
+/**
+ * @brief Keep the current read buffer past the next take
+ *
+ * NOTE(ingar): The buffers are released in the order they were taken, so a kept buffer is
+ * released before any buffer taken after it, and SpillTail and Consumed only move forward
+ *
+ * @param Pipe Pipeline instance
+ * @return u64 Sequence number of the kept buffer
+ */
+u64
+SdPipeKeepReadBuffer(sensor_data_pipe *Pipe)
+{
+    SdbAssert(Pipe->ReaderHolds || Pipe->ReaderHoldsSpill, "Reader holds no buffer to keep");
+    SdbAssert(!SdPipeKeptFull(Pipe), "Reader keeps too many buffers");
+
+    u64       Seq  = Pipe->KeptHead++;
+    sdp_kept *Kept = &Pipe->Kept[Seq % (2 * Pipe->BufCount)];
+    Kept->Pos      = Pipe->HeldPos;
+    Kept->Spilled  = Pipe->ReaderHoldsSpill;
+    if(Kept->Spilled) {
+        sdp_spill_slot *Slot = (sdp_spill_slot *)(Pipe->SpillBuf.Mem - sizeof(sdp_spill_slot));
+        Kept->SpillBuf       = Pipe->SpillBuf;
+        Kept->Buf            = &Kept->SpillBuf;
+        Kept->Stamps         = &Slot->Stamps;
+        Kept->Header         = &Slot->Header;
+        ++Pipe->KeptSpillCount;
+    } else {
+        Kept->Idx    = Pipe->HeldIdx;
+        Kept->Buf    = Pipe->Buffers[Pipe->HeldIdx];
+        Kept->Stamps = &Pipe->Stamps[Pipe->HeldIdx];
+        Kept->Header = &Pipe->Headers[Pipe->HeldIdx];
+    }
+    Pipe->ReaderHolds      = false;
+    Pipe->ReaderHoldsSpill = false;
+
+    return Seq;
+}
+
+sdp_kept *
+SdPipeGetKept(sensor_data_pipe *Pipe, u64 Seq)
+{
+    SdbAssert(Seq >= Pipe->KeptTail && Seq < Pipe->KeptHead, "Buffer %lu is not kept", Seq);
+    return &Pipe->Kept[Seq % (2 * Pipe->BufCount)];
+}
+
+/**
+ * @brief Hand the oldest kept buffer back to the writer
+ *
+ * @param Pipe Pipeline instance
+ */
+void
+SdPipeReleaseKept(sensor_data_pipe *Pipe)
+{
+    sdp_kept *Kept = SdPipeGetKept(Pipe, Pipe->KeptTail);
+    if(Kept->Spilled) {
+        SdpReleaseSpill(Pipe, (sdp_spill_slot *)(Kept->SpillBuf.Mem - sizeof(sdp_spill_slot)),
+                        Kept->Pos);
+        --Pipe->KeptSpillCount;
+    } else {
+        SdpReleaseQueued(Pipe, Kept->Idx, Kept->Pos);
+    }
+    ++Pipe->KeptTail;
+}
+
+sdp_tap *
+SdpTapAttach(sensor_data_pipe *Pipe, bool Lossy)
+{
+    if(Pipe->Policy == SdpPolicy_DropOldest) {
+        SdbLogError("Pipes that drop the oldest buffers cannot have taps");
+        return NULL;
+    }
+    if(Pipe->TapCount == SDP_MAX_TAPS) {
+        SdbLogError("Pipe already has %d taps", SDP_MAX_TAPS);
+        return NULL;
+    }
+
+    sdp_tap *Tap = aligned_alloc(SDB_CACHE_LINE_SIZE, sizeof(sdp_tap));
+    if(Tap == NULL) {
+        SdbLogError("Failed to allocate pipe tap");
+        return NULL;
+    }
+    SdbMemZero(Tap, sizeof(*Tap));
+    Tap->EventFd = eventfd(0, EFD_NONBLOCK);
+    if(Tap->EventFd == -1) {
+        SdbLogError("Failed to create event fd");
+        free(Tap);
+        return NULL;
+    }
+
+    // NOTE(ingar): A persistent pipe may have buffers queued already, and the tap sees them too
+    u64 Head        = atomic_load(&Pipe->Head);
+    Tap->Lossy      = Lossy;
+    Tap->ReaderHead = Head;
+    atomic_init(&Tap->Pos, Pipe->Recycled << 1);
+    atomic_init(&Tap->SkipTo, 0);
+    atomic_init(&Tap->DroppedCount, 0);
+    atomic_init(&Tap->Attached, true);
+    atomic_init(&Tap->Parked, Pipe->Recycled == Head);
+
+    Pipe->Taps[Pipe->TapCount++] = Tap;
+    return Tap;
+}
+
+void
+SdpTapDetach(sensor_data_pipe *Pipe, sdp_tap *Tap)
+{
+    SdPipeTapReleaseReadBuffer(Pipe, Tap);
+    atomic_store(&Tap->Attached, false);
+    SdpWake(&Pipe->WriterParked, Pipe->WriteEventFd);
+}
+
+/**
+ * @brief Take the buffer at the tap's position, if the writer has published it
+ *
+ * Claims the buffer by setting the low bit of Pos, which keeps the writer from moving a lossy
+ * tap past it.
+ *
+ * @return sdb_arena* The buffer, or NULL if there is none
+ */
+static sdb_arena *
+SdpTapTake(sensor_data_pipe *Pipe, sdp_tap *Tap)
+{
+    u64 Word = atomic_load_explicit(&Tap->Pos, memory_order_relaxed);
+    do {
+        if((Word >> 1) >= Tap->ReaderHead) {
+            Tap->ReaderHead = atomic_load(&Pipe->Head);
+            if((Word >> 1) >= Tap->ReaderHead) {
+                return NULL;
+            }
+        }
+    } while(!atomic_compare_exchange_weak(&Tap->Pos, &Word, Word | 1));
+
+    Tap->Holds   = true;
+    Tap->HeldIdx = atomic_load_explicit(&Pipe->Queue[(Word >> 1) % Pipe->BufCount],
+                                        memory_order_relaxed);
+    return Pipe->Buffers[Tap->HeldIdx];
+}
+
+sdb_arena *
+SdPipeTapTryGetReadBuffer(sensor_data_pipe *Pipe, sdp_tap *Tap)
+{
+    SdPipeTapReleaseReadBuffer(Pipe, Tap);
+
+    sdb_arena *Buf = SdpTapTake(Pipe, Tap);
+    if(Buf == NULL) {
+        SdpPark(&Tap->Parked, Tap->EventFd);
+        Buf = SdpTapTake(Pipe, Tap);
+        if(Buf == NULL) {
+            return NULL;
+        }
+        if(atomic_exchange(&Tap->Parked, false)) {
+            SdpSignal(Tap->EventFd);
+        }
+    }
+
+    return Buf;
+}
+
+sdb_arena *
+SdPipeTapGetReadBuffer(sensor_data_pipe *Pipe, sdp_tap *Tap)
+{
+    SdPipeTapReleaseReadBuffer(Pipe, Tap);
+
+    for(u32 Spin = 0; Spin < Pipe->SpinCount; ++Spin) {
+        sdb_arena *Buf = SdpTapTake(Pipe, Tap);
+        if(Buf != NULL) {
+            return Buf;
+        }
+        SdbCpuRelax();
+    }
+
+    for(;;) {
+        sdb_arena *Buf = SdPipeTapTryGetReadBuffer(Pipe, Tap);
+        if(Buf != NULL) {
+            return Buf;
+        }
+
+        sdb_errno Ret = SdpWaitEventFd(Tap->EventFd);
+        if(Ret == -EINTR) {
+            return NULL;
+        } else if(Ret != 0) {
+            SdbLogError("Failed to wait on tap EventFd: %s", strerror(-Ret));
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Release the current buffer of a tap
+ *
+ * A lossy tap the writer wanted to move forward while it held the buffer goes on from SkipTo,
+ * and counts the buffers it skips before it lets the writer have them.
+ */
+void
+SdPipeTapReleaseReadBuffer(sensor_data_pipe *Pipe, sdp_tap *Tap)
+{
+    if(!Tap->Holds) {
+        return;
+    }
+
+    Tap->Holds  = false;
+    u64 Next    = (atomic_load_explicit(&Tap->Pos, memory_order_relaxed) >> 1) + 1;
+    u64 SkipTo  = atomic_load(&Tap->SkipTo);
+    u64 Dropped = 0;
+    for(; Next < SkipTo; ++Next) {
+        u32 Idx  = atomic_load_explicit(&Pipe->Queue[Next % Pipe->BufCount], memory_order_relaxed);
+        Dropped += SdpPacketCount(Pipe, Pipe->Buffers[Idx]);
+    }
+    if(Dropped > 0) {
+        atomic_fetch_add_explicit(&Tap->DroppedCount, Dropped, memory_order_relaxed);
+    }
+    atomic_store(&Tap->Pos, Next << 1);
+    SdpWake(&Pipe->WriterParked, Pipe->WriteEventFd);
+}
+
+sdp_stamps *
+SdPipeGetStamps(sensor_data_pipe *Pipe, sdb_arena *Buf)
+{
+    if(Buf == &Pipe->SpillBuf) {
+        return &((sdp_spill_slot *)(Buf->Mem - sizeof(sdp_spill_slot)))->Stamps;
+    }
+
+    // NOTE(ingar): Reads the reader's state, so the writer stamps through SdPipeStamp instead
+    SdbAssert(Pipe->ReaderHolds && Pipe->Buffers[Pipe->HeldIdx] == Buf,
+              "Buffer %p is not held by the reader", (void *)Buf);
+    return &Pipe->Stamps[Pipe->HeldIdx];
+}
+
+sdp_buf_header *
+SdPipeGetHeader(sensor_data_pipe *Pipe, sdb_arena *Buf)
+{
+    if(Buf == &Pipe->SpillBuf) {
+        return &((sdp_spill_slot *)(Buf->Mem - sizeof(sdp_spill_slot)))->Header;
+    }
+
+    SdbAssert(Pipe->ReaderHolds && Pipe->Buffers[Pipe->HeldIdx] == Buf,
+              "Buffer %p is not held by the reader", (void *)Buf);
+    return &Pipe->Headers[Pipe->HeldIdx];
+}
+
+sdp_buf_header *
+SdPipeTapGetHeader(sensor_data_pipe *Pipe, sdp_tap *Tap)
+{
+    SdbAssert(Tap->Holds, "Tap holds no buffer");
+    return &Pipe->Headers[Tap->HeldIdx];
+}
+
+/**
+ * @brief Record the latency of every stamped packet of a buffer
+ *
+ * The packets of a stamp all get the same latency, so each stamp is recorded once with its
+ * packet count.
+ */
+void
+SdpStampsRecordLatency(sdp_stamps *Stamps, sdb_arena *Buf, u64 PacketSize, u64 NowNs,
+                       sdb_latency_hist *Hist)
+{
+    for(u32 s = 0; s < Stamps->Count; ++s) {
+        sdp_stamp *Stamp = &Stamps->Stamps[s];
+        u64        End   = (s + 1 < Stamps->Count) ? Stamps->Stamps[s + 1].Offset : Buf->Cur;
+        u64        Count = (End - Stamp->Offset) / PacketSize;
+
+        // NOTE(ingar): The realtime clock can be stepped back between receive and now
+        sdb_timediff Latency = (NowNs > Stamp->RecvNs) ? NowNs - Stamp->RecvNs : 0;
+        if(Count > 0) {
+            SdbLatencyHistAdd(Hist, Latency, Count);
+        }
+    }
+}
+
+/**
+ * @brief Record the latency of every stamped packet in a buffer
+ */
+void
+SdPipeRecordLatency(sensor_data_pipe *Pipe, sdb_arena *Buf, u64 NowNs, sdb_latency_hist *Hist)
+{
+    sdp_stamps *Stamps = SdPipeGetStamps(Pipe, Buf);
+    if(Pipe->Framing == SdpFraming_Fixed) {
+        SdpStampsRecordLatency(Stamps, Buf, Pipe->PacketSize, NowNs, Hist);
+        return;
+    }
+
+    // NOTE(ingar): Records differ in size, so they are counted one by one against the stamp
+    // they start under
+    u64 Offset = 0, Start = 0;
+    u32 s      = 0;
+    while(Stamps->Count > 0 && SdPipeNextRecord(Buf, &Offset)) {
+        while(s + 1 < Stamps->Count && Stamps->Stamps[s + 1].Offset <= Start) {
+            ++s;
+        }
+        sdp_stamp *Stamp = &Stamps->Stamps[s];
+        if(Stamp->Offset <= Start) {
+            SdbLatencyHistAdd(Hist, (NowNs > Stamp->RecvNs) ? NowNs - Stamp->RecvNs : 0, 1);
+        }
+        Start = Offset;
+    }
+}
+
+/**
+ * @brief Flush the current write buffer
+ *
+ * If the current write buffer is not empty, it is published and the next buffer is prepared.
+ * If the reader holds every other buffer and the pipe cannot grow, SdpPolicy_Block waits until
+ * one is released, SdpPolicy_DropOldest drops the oldest buffer, and SdpPolicy_Spill spills
+ * the current one. The other policies keep the data where it is.
+ *
+ * @param Pipe Pipeline instance
+ */
+void
+SdPipeFlush(sensor_data_pipe *Pipe)
+{
+    if(SdbArenaGetPos(Pipe->Buffers[Pipe->WriteIdx]) == 0) {
+        return;
+    }
+
+    u32 Idx;
+    if(SdpWriterMayPublish(Pipe) && SdpTakeRoom(Pipe, &Idx)) {
+        SdpPublish(Pipe, Idx);
+    } else if(Pipe->Policy == SdpPolicy_Spill) {
+        if(!Pipe->Spilling) {
+            ++Pipe->FullCount;
+        }
+        SdpSpill(Pipe);
+    } else if(Pipe->Policy == SdpPolicy_Block) {
+        ++Pipe->FullCount;
+        if(SdpWaitForRoom(Pipe)) {
+            SdpPublish(Pipe, SdpTakeFree(Pipe));
+        }
+    } else if(Pipe->Policy == SdpPolicy_DropOldest) {
+        ++Pipe->FullCount;
+        SdpDropOldest(Pipe);
+    }
+}
+
+/**
+ * @brief Flush the partial write buffer if its oldest data is due
+ *
+ * @param Pipe Pipeline instance
+ * @param NowNs CLOCK_REALTIME nanoseconds
+ * @param Slack Time until the writer checks again
+ * @return true if the buffer was published or spilled
+ */
+bool
+SdPipeFlushDue(sensor_data_pipe *Pipe, u64 NowNs, sdb_timediff Slack)
+{
+    u32 Cur = Pipe->WriteIdx;
+    if(Pipe->MaxLatency == 0 || SdbArenaGetPos(Pipe->Buffers[Cur]) == 0) {
+        return false;
+    }
+
+    // NOTE(ingar): Data written without a stamp, e.g. by a writer that has no receive times,
+    // is dated by the first check that finds it, so it is not due on every check
+    sdp_stamps *Stamps  = &Pipe->Stamps[Cur];
+    u64         FirstNs = 0;
+    if(Stamps->Count > 0 && Stamps->Stamps[0].Offset == 0) {
+        FirstNs = Stamps->Stamps[0].RecvNs;
+    } else {
+        if(Pipe->UnstampedNs == 0) {
+            Pipe->UnstampedNs = (NowNs > Slack) ? NowNs - Slack : 1;
+        }
+        FirstNs = Pipe->UnstampedNs;
+    }
+    if(NowNs + Slack < FirstNs + Pipe->MaxLatency) {
+        return false;
+    }
+
+    if(SdPipeTryGetWriteBuffer(Pipe) != NULL) {
+        return true;
+    }
+
+    // NOTE(ingar): A spilling writer may not publish until the reader has drained the spill
+    // file, so the due data joins it there instead of waiting for the spill to end
+    if(Pipe->Policy == SdpPolicy_Spill) {
+        if(!Pipe->Spilling) {
+            ++Pipe->FullCount;
+        }
+        return SdpSpill(Pipe) != NULL;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Check whether the reader has released every replayed buffer
+ *
+ * @param Pipe Pipeline instance
+ * @return true if there is nothing left to replay
+ */
+bool
+SdPipeReplayed(sensor_data_pipe *Pipe)
+{
+    return Pipe->Persist == NULL
+        || atomic_load_explicit(&Pipe->Persist->Consumed, memory_order_acquire)
+               >= Pipe->ReplayEnd;
+}
+
+/**
+ * @brief Retire the buffers of an elastic pipe that stayed free
+ *
+ * @param Pipe Pipeline instance
+ */
+void
+SdPipeShrinkIdle(sensor_data_pipe *Pipe)
+{
+    if(Pipe->Region || Pipe->Pool) {
+        SdpElasticTick(Pipe);
     }
 }
@@ -4,11 +4,16 @@
  * @brief Lock-Free Data Pipeline
  *
  * Key Features:
- * - Lock-free buffer management
+ * - Lock-free single-producer/single-consumer buffer ring
+ * - Selectable policy for a full pipe: block, drop oldest, drop newest, decimate or spill
  * - Dynamic arena allocation
- * - Event-driven synchronization
- *
+ * - Spin-then-park waiting, with eventfds only used by a parked side
  *
+ * A pipe has one writer and one reader by design, plus any taps. Data that several threads
+ * produce or consume is spread over several pipes instead: every Modbus worker has a lane of
+ * pipes of its own, one per sensor, and the pipes of a table are only read by the Postgres
+ * writer that owns the table. Rows thereby reach each table in the order they were received,
+ * with no compare-and-swap between workers or writers on the hot path.
  */
 
 
@@ -21,17 +26,236 @@
 
 SDB_BEGIN_EXTERN_C
 
+#include <src/Common/BufferPool.h>
+#include <src/Common/LatencyHistogram.h>
+#include <src/Common/Pages.h>
 #include <src/Common/Thread.h>
 
-// TODO(ingar): Some way of tagging buffers for priorities or similar
-// TODO(ingar): We might want to add a flag for the endianness of the data
+/** @brief Maximum number of receive timestamps kept per buffer */
+#ifndef SDP_STAMP_MAX
+#define SDP_STAMP_MAX 128
+#endif
+
+/**
+ * @brief Receive time of the packets from Offset up to the next stamp's Offset
+ */
+typedef struct
+{
+    u64 RecvNs; /**< CLOCK_REALTIME nanoseconds the data was received by the kernel */
+    u64 Offset; /**< Byte offset of the first packet in the buffer */
+} sdp_stamp;
+
+/**
+ * @brief Receive timestamps of one buffer, in buffer order
+ *
+ * One stamp covers all packets from one receive, so there are far fewer stamps than packets.
+ * Once a buffer has SDP_STAMP_MAX stamps, later packets are counted with the last stamp, which
+ * makes their latency look longer, never shorter.
+ */
+typedef struct
+{
+    u32       Count;
+    sdp_stamp Stamps[SDP_STAMP_MAX];
+} sdp_stamps;
+
+/**
+ * @brief Byte order of the data in a buffer
+ */
+typedef enum
+{
+    SdpEndian_Little,
+    SdpEndian_Big,
+} sdp_endian;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SDP_ENDIAN_HOST SdpEndian_Big
+#else
+#define SDP_ENDIAN_HOST SdpEndian_Little
+#endif
+
+/**
+ * @brief How the records in a buffer are laid out
+ */
+typedef enum
+{
+    SdpFraming_Fixed,    /**< Records of PacketSize bytes, back to back */
+    SdpFraming_Prefixed, /**< sdp_record after sdp_record, so records may differ */
+} sdp_framing;
+
+/**
+ * @brief Record of a SdpFraming_Prefixed buffer
+ *
+ * Records start on SDP_RECORD_ALIGN byte boundaries, so their data is aligned for any field.
+ */
+typedef struct
+{
+    u32 Size;     /**< Bytes of Data, without the padding up to the next record */
+    u32 SchemaId; /**< What Data is, so records of several kinds can share a buffer */
+    u8  Data[];
+} sdp_record;
+
+#define SDP_RECORD_ALIGN 8
+
+/**
+ * @brief Description of the data in one buffer
+ *
+ * Written by the writer when it publishes the buffer, so a reader can skip, route or index a
+ * buffer without looking at its data. It is kept beside the buffer like its stamps, so the data
+ * itself stays exactly the rows the writer pushed.
+ */
+typedef struct
+{
+    u32 SchemaId;    /**< What the records are, the pipe's SchemaId */
+    u8  Endian;      /**< sdp_endian of the records */
+    u8  Framing;     /**< sdp_framing of the records */
+    u32 RecordCount; /**< Whole records in the buffer */
+    u64 FirstNs;     /**< Receive time of the first stamped record, 0 if none is stamped */
+    u64 LastNs;      /**< Receive time of the last stamp */
+} sdp_buf_header;
+
+
+/**
+ * @brief Times a waiting side polls the other side's index before it parks on its eventfd
+ *
+ * Spinning only pays off when the other side runs on another CPU, so pipes created on a single
+ * CPU park at once.
+ */
+#ifndef SDP_SPIN_COUNT
+#define SDP_SPIN_COUNT 256
+#endif
+
+/**
+ * @brief How long an elastic pipe keeps buffers it did not need before giving their memory back
+ */
+#ifndef SDP_SHRINK_AFTER
+#define SDP_SHRINK_AFTER SDB_TIME_S(10)
+#endif
+
+/** @brief First bytes of a persistent pipe file, "SDPIPE" and the layout version */
+#define SDP_PERSIST_MAGIC 0x0002455049504453ull
+
+/**
+ * @brief Header of a persistent pipe file
+ *
+ * Followed by the stamps, headers and Queue of the pipe, and then by the buffers, each on its
+ * own pages. The buffers at the Queue positions from Consumed up to Committed were published and
+ * not yet released by the reader when the pipe was last used.
+ */
+typedef struct
+{
+    u64                  Magic;
+    u64                  BufCount;
+    u64                  BufSize;
+    atomic_uint_fast64_t Committed; /**< Queue position after the last published buffer */
+    atomic_uint_fast64_t Consumed;  /**< Queue position after the last released buffer */
+    u64                  Sizes[];   /**< Bytes of data in each buffer when it was published */
+} sdp_persist_header;
+
+/**
+ * @brief What the writer does when it needs a new buffer and the reader holds every other one
+ *
+ * Every policy but SdpPolicy_Block keeps the writer going, so a slow reader costs data instead
+ * of stalling the writer. The data lost is counted exactly, in packets, in the pipe.
+ */
+typedef enum
+{
+    SdpPolicy_Block,      /**< Wait for the reader to release a buffer */
+    SdpPolicy_DropOldest, /**< Overwrite the oldest buffer the reader has not taken yet */
+    SdpPolicy_DropNewest, /**< Empty the current write buffer and keep filling it */
+    SdpPolicy_Decimate,   /**< Keep every DecimateStep-th packet of the current write buffer */
+    SdpPolicy_Spill,      /**< Copy the current write buffer to the spill file and reuse it */
+} sdp_policy;
+
+/**
+ * @brief Buffer copied to the spill file, one per page aligned slot
+ */
+typedef struct
+{
+    u64            Size;   /**< Bytes of data */
+    sdp_stamps     Stamps; /**< Receive timestamps of the data */
+    sdp_buf_header Header; /**< Description of the data */
+    u8             Data[];
+} sdp_spill_slot;
+
+/** @brief Taps a pipe can have besides its reader */
+#define SDP_MAX_TAPS 4
+
+/**
+ * @brief Extra consumer of a pipe, with a read cursor of its own
+ *
+ * Pos is only written by the tap, except that the writer moves a lossy tap that holds no
+ * buffer forward with a compare-and-swap. A lossy tap that holds a buffer is moved forward
+ * through SkipTo when it releases it instead.
+ */
+typedef struct
+{
+    atomic_uint_fast64_t Pos;          /**< Queue position times two, plus one while held */
+    atomic_uint_fast64_t SkipTo;       /**< Position a lossy tap goes on from on release */
+    atomic_uint_fast64_t DroppedCount; /**< Packets a lossy tap was moved past */
+    atomic_bool          Attached;
+    atomic_bool          Parked;     /**< Tap found the pipe empty and waits on EventFd */
+    bool                 Lossy;      /**< The writer skips the tap instead of waiting for it */
+    bool                 Holds;      /**< Tap has the buffer at Pos and not released it */
+    u32                  HeldIdx;    /**< Index of the buffer at Pos while Holds */
+    u64                  ReaderHead; /**< Last Head seen by the tap */
+    int                  EventFd;
+} __attribute__((aligned(SDB_CACHE_LINE_SIZE))) sdp_tap;
 
+/**
+ * @brief Buffer the reader keeps after taking the next one, until SdPipeReleaseKept hands it
+ * back
+ */
+typedef struct
+{
+    sdb_arena      *Buf;      /**< Data of the buffer */
+    sdp_stamps     *Stamps;   /**< Receive timestamps of the data */
+    sdp_buf_header *Header;   /**< Description of the data */
+    u64             Pos;      /**< Queue position, or spill file position if Spilled */
+    u32             Idx;      /**< Index of the buffer, unused if Spilled */
+    bool            Spilled;  /**< Buffer is a slot of the spill file */
+    sdb_arena       SpillBuf; /**< Arena over the data of the slot if Spilled */
+} sdp_kept;
 
 /**
  * @brief Sensor Data Pipeline Structure
  *
- * Manages a set of memory arenas for efficient,
- * zero-copy sensor data transmission between threads.
+ * Single-producer/single-consumer pipe of memory arenas for zero-copy sensor data transmission
+ * between two threads. The buffers are handed around by index through two rings: the writer
+ * appends the buffers it publishes to Queue and advances Head, and the reader takes them by
+ * advancing Taken. Released buffers go back to the writer through FreeQueue, which the reader
+ * appends to by advancing FreeHead. Each side only writes its own indices, and the indices of
+ * each side live on cache lines of their own. The one exception is a SdpPolicy_DropOldest
+ * writer, which takes the oldest published buffer back by advancing Taken itself, so both sides
+ * advance Taken with a compare-and-swap.
+ *
+ * A handoff is a pair of atomic stores. The eventfds are only touched when a side has found the
+ * pipe empty (reader) or full (writer) and parked: ReadEventFd is readable while the reader may
+ * have buffers to take, so a reader can poll several pipes with epoll.
+ *
+ * An elastic pipe has ActiveCount buffers in circulation, between MinBufCount and BufCount. The
+ * writer brings a spare buffer into circulation instead of finding the pipe full, and retires
+ * the buffers that stayed free for ShrinkAfter. Only the writer moves buffers in and out of
+ * circulation, so the reader never knows the difference. The spare buffers of a pooled pipe
+ * have no memory: the writer borrows it from a shared pool when it brings one into circulation,
+ * and gives it back when it retires the buffer, so BufCount is the pipe's quota of the pool.
+ *
+ * A SdpPolicy_Spill writer that finds the pipe full copies its buffers to a ring of slots in a
+ * memory mapped file instead, and keeps doing so until the reader has taken every spilled
+ * buffer, so the spilled buffers are always newer than the published ones the reader has not
+ * taken. The reader takes published buffers first and spilled ones when there are none.
+ *
+ * The buffers and Queue of a persistent pipe live in a MAP_SHARED file, whose header the writer
+ * updates when it publishes and the reader when it releases. Publishing costs one more store,
+ * and a process that dies leaves the file in a state that SdpCreatePersistent picks up again.
+ *
+ * A reader that is not done with a buffer when it takes the next one, e.g. because its rows are
+ * not committed yet, keeps it with SdPipeKeepReadBuffer and releases the kept buffers in order
+ * later. Releases stay in Queue order, so keeping changes nothing for the writer or the file.
+ *
+ * A pipe with taps hands every published buffer to the reader and to each tap. The reader then
+ * stores the position after the buffer it released in Released instead of appending to
+ * FreeQueue, and the writer appends the buffers that the reader and every tap are done with to
+ * FreeQueue itself, in Queue order.
  */
 typedef struct
 {
@@ -39,17 +263,93 @@ typedef struct
     size_t PacketSize;    // Filled by db during init
     u64    ItemMaxCount;  // --||--
 
-    atomic_uint WriteBufIdx;
-    atomic_uint ReadBufIdx;
-    atomic_uint FullBuffersCount;
+    u32         SchemaId; // Written to the header of every buffer
+    sdp_endian  Endian;   // Byte order of the writer's records, SDP_ENDIAN_HOST by default
+    sdp_framing Framing;  // NOTE(ingar): Fixed before the writer starts
+
+    sdb_timediff MaxLatency;   // Longest data may wait in a partial buffer, 0 for no limit
+    sdp_policy   Policy;       // What the writer does when the pipe is full
+    u32          DecimateStep; // Packets per packet kept by SdpPolicy_Decimate
 
     int ReadEventFd;
     int WriteEventFd;
 
-    u64         BufCount;
-    sdb_arena **Buffers;
+    u64          BufCount;    // Buffers in circulation at most
+    u64          MinBufCount; // Buffers in circulation when idle, BufCount unless elastic
+    sdb_arena  **Buffers;
+    sdp_stamps  *Stamps;    // Receive timestamps of each buffer, filled by the writer
+    atomic_uint *Queue;     // Indices of the published buffers, BufCount entries
+    u32         *FreeQueue; // Indices of the released buffers, BufCount entries
+    u32         *Spares;    // Indices of the buffers out of circulation, used as a stack
+    u8          *Region;    // Reserved memory of an elastic pipe's buffers, NULL if not elastic
+    bool         LockBuffers; // mlock the buffers of an elastic pipe while in circulation
+    sdb_pages    BufPages;    // Buffers mapped for the pipe with page options, Mem NULL if none
+    u64          BufStride; // Page aligned distance between the buffers in Region
+    sdb_timediff ShrinkAfter; // How long a buffer must stay free before it is retired
+
+    sdb_buf_pool *Pool; // Pool the buffers are borrowed from, NULL if they are the pipe's own
+
+    sdp_buf_header *Headers; // Header of each buffer, written by the writer when it publishes it
+
+    sdb_mmap SpillMap;       // Spill file of a SdpPolicy_Spill pipe, Data is NULL if none
+    u64      SpillSlotCount; // Buffers the spill file holds
+    u64      SpillSlotSize;  // Page aligned size of a sdp_spill_slot
+
+    sdb_mmap            PersistMap;        // File of a persistent pipe, Data is NULL if none
+    sdp_persist_header *Persist;           // Header of PersistMap
+    u64                 PersistHeaderSize; // Page aligned size of the header and Queue
+    bool                PersistSync;       // msync each buffer and the header when publishing
+    u64                 ReplayCount;       // Buffers found unread when the file was opened
+    u64                 ReplayEnd;         // Queue position one past the last replayed buffer
+
+    sdp_tap *Taps[SDP_MAX_TAPS];
+    u32      TapCount; // NOTE(ingar): Fixed once the writer has started
+
+    u32 SpinCount; // SDP_SPIN_COUNT, or 0 on a single CPU
 
-} sensor_data_pipe;
+    // NOTE(ingar): Written by the writer only
+    atomic_uint_fast64_t Head __attribute__((aligned(SDB_CACHE_LINE_SIZE)));
+    u64                  FreeTail;       /**< Released buffers taken back by the writer */
+    u64                  WriterFreeHead; /**< Last FreeHead seen by the writer */
+    u32                  WriteIdx;       /**< Buffer being filled by the writer */
+    atomic_bool          WriterParked; /**< Writer found the pipe full and waits on WriteEventFd */
+    u64                  DroppedCount;   /**< Packets thrown away by the drop policies */
+    u64                  DecimatedCount; /**< Packets thinned out by SdpPolicy_Decimate */
+    u64                  FullCount; /**< Times the writer needed a buffer and found none free */
+    u64                  ActiveCount;   /**< Buffers in circulation */
+    u64                  GrowCount;     /**< Buffers brought into circulation */
+    u64                  ShrinkCount;   /**< Times buffers were retired */
+    u64                  PoolDryCount;  /**< Times a spare buffer found Pool empty */
+    u64                  WindowStartNs; /**< Start of the window free buffers are counted over */
+    u64                  WindowMinFree; /**< Fewest free buffers seen in the window */
+    u64                  UnstampedNs;   /**< Date of the unstamped data being filled, 0 if none */
+    atomic_uint_fast64_t SpillHead;     /**< Buffers copied to the spill file */
+    bool                 Spilling;      /**< Writer spills until the reader has caught up */
+    u64                  SpilledCount;  /**< Packets copied to the spill file */
+    u64                  Recycled;      /**< Queue position up to which buffers are free again */
+
+    // NOTE(ingar): Written by the reader, and by a SdpPolicy_DropOldest writer
+    atomic_uint_fast64_t Taken __attribute__((aligned(SDB_CACHE_LINE_SIZE)));
+
+    // NOTE(ingar): Written by the reader only
+    atomic_uint_fast64_t FreeHead;     /**< Buffers released by the reader */
+    u64                  ReaderHead;   /**< Last Head seen by the reader */
+    u32                  HeldIdx;      /**< Buffer taken by the reader */
+    u64                  HeldPos;      /**< Queue position of the buffer taken by the reader */
+    bool                 ReaderHolds;  /**< Reader has Buffers[HeldIdx] and not released it */
+    atomic_bool          ReaderParked; /**< Reader found the pipe empty and waits on ReadEventFd */
+    atomic_uint_fast64_t SpillTail;        /**< Spilled buffers released by the reader */
+    u64                  ReaderSpillHead;  /**< Last SpillHead seen by the reader */
+    u64                  ReaderSpillTail;  /**< Spilled buffers taken by the reader */
+    bool                 ReaderHoldsSpill; /**< Reader has SpillBuf and not released it */
+    sdb_arena            SpillBuf;         /**< Arena over the data of the slot it holds */
+    sdp_kept            *Kept;             /**< Ring of the kept buffers, 2 * BufCount entries */
+    u64                  KeptHead;         /**< Buffers kept by the reader */
+    u64                  KeptTail;         /**< Kept buffers released by the reader */
+    u64                  KeptSpillCount;   /**< Kept buffers that are spill file slots */
+    atomic_uint_fast64_t Released; /**< Queue position after the last buffer released, with taps */
+
+} __attribute__((aligned(SDB_CACHE_LINE_SIZE))) sensor_data_pipe;
 
 /**
  * @brief Create a Sensor Data Pipeline
@@ -64,6 +364,29 @@ typedef struct
  */
 sensor_data_pipe *SdpCreate(u64 BufCount, u64 BufSize, sdb_arena *Arena);
 
+/**
+ * @brief Create an Elastic Sensor Data Pipeline
+ *
+ * Starts out with MinBufCount buffers in circulation and grows up to MaxBufCount while the
+ * reader falls behind. Memory is only committed for the buffers that have been in circulation,
+ * and given back with madvise(MADV_DONTNEED) when they are retired. With MinBufCount equal to
+ * MaxBufCount the pipe is the same as one from SdpCreate.
+ *
+ * With PageOpts, the buffers get pages of their own, backed as it says and faulted in up front.
+ * An elastic pipe only gets transparent huge pages, and locks its buffers while they are in
+ * circulation, so that retired buffers still give their memory back.
+ *
+ * @param MinBufCount Number of buffers in circulation when the pipe is idle
+ * @param MaxBufCount Number of buffers in circulation at most
+ * @param BufSize Size of each buffer arena
+ * @param PageOpts How to back the buffers, NULL to allocate them with the pipe
+ * @param Arena Optional memory arena for allocation, the buffers of an elastic pipe or a pipe
+ * with PageOpts are never allocated from it
+ * @return sensor_data_pipe* Initialized pipeline or NULL on failure
+ */
+sensor_data_pipe *SdpCreateElastic(u64 MinBufCount, u64 MaxBufCount, u64 BufSize,
+                                   const sdb_page_opts *PageOpts, sdb_arena *Arena);
+
 /**
  * @brief Destroy Sensor Data Pipeline
  *
@@ -74,39 +397,441 @@ sensor_data_pipe *SdpCreate(u64 BufCount, u64 BufSize, sdb_arena *Arena);
  */
 void SdpDestroy(sensor_data_pipe *Pipe, bool AllocatedWithArena);
 
+/**
+ * @brief Create a Pooled Sensor Data Pipeline
+ *
+ * An elastic pipe whose buffers are borrowed from Pool. MinBufCount buffers are borrowed up
+ * front and kept, and up to MaxBufCount are held while the reader falls behind. A writer that
+ * finds the pool empty finds the pipe full, and handles it as its policy says.
+ *
+ * @param MinBufCount Number of buffers in circulation when the pipe is idle
+ * @param MaxBufCount Number of buffers the pipe may borrow at most
+ * @param Pool Pool of the buffers, must outlive the pipe. Its buffer size is the pipe's
+ * @param Arena Optional memory arena for allocation
+ * @return sensor_data_pipe* Initialized pipeline or NULL on failure, e.g. if the pool does not
+ * have MinBufCount buffers free
+ */
+sensor_data_pipe *SdpCreatePooled(u64 MinBufCount, u64 MaxBufCount, sdb_buf_pool *Pool,
+                                  sdb_arena *Arena);
+
+/**
+ * @brief Create a Persistent Sensor Data Pipeline
+ *
+ * Keeps the buffers in the file at Path, so that published buffers survive the process. If the
+ * file holds buffers that were published but not released by the reader, for the same buffer
+ * count and size, they are queued again ahead of any new data, so the reader replays them
+ * first. Data the writer had not published yet is lost. A buffer the reader took but had not
+ * released is replayed, so the reader sees it at least once.
+ *
+ * Without PersistSync, the file survives the process being killed. With it, every publish
+ * waits for the buffer and the header to reach the disk, so it also survives power loss.
+ *
+ * SdpPolicy_DropOldest and SdpPolicy_Spill must not be used with a persistent pipe, since they
+ * take buffers out of Queue order.
+ *
+ * @param BufCount Number of buffers in the pipeline
+ * @param BufSize Size of each buffer arena
+ * @param Path Path of the pipe file, must stay valid as long as the pipe
+ * @param PageOpts How to back the buffers, NULL for the defaults. Only Lock applies, since the
+ * pages belong to the file
+ * @param Arena Optional memory arena for allocation, the buffers are never allocated from it
+ * @return sensor_data_pipe* Initialized pipeline or NULL on failure
+ */
+sensor_data_pipe *SdpCreatePersistent(u64 BufCount, u64 BufSize, sdb_string Path,
+                                      const sdb_page_opts *PageOpts, sdb_arena *Arena);
+
+/**
+ * @brief Give a Pipe a Spill File
+ *
+ * Creates or reuses the file at Path, sized to hold as many buffers as fit in Size, and
+ * allocates its blocks up front so that spilling never runs out of disk space. Must be called
+ * before the pipe is used, and does not set the pipe's Policy.
+ *
+ * @param Pipe Pipeline instance
+ * @param Path Path of the spill file, must stay valid as long as the pipe
+ * @param Size Size of the spill file
+ * @return sdb_errno 0 on success, negative errno on failure
+ */
+sdb_errno SdpSpillInit(sensor_data_pipe *Pipe, sdb_string Path, u64 Size);
+
 /**
  * @brief Acquire Write Buffer Arena
  *
- * Obtains the next available memory arena for writing,
- * blocking if no buffer is available.
+ * Publishes the current write buffer to the reader and returns the next one, emptied. When the
+ * reader holds every other buffer, the pipe's Policy decides:
+ * - SdpPolicy_Block spins and then blocks until the reader releases one
+ * - SdpPolicy_DropOldest takes back the oldest buffer the reader has not taken, counts its
+ *   packets as dropped, and publishes the current buffer in its place
+ * - SdpPolicy_DropNewest counts the packets of the current buffer as dropped and returns it
+ *   emptied, without publishing anything
+ * - SdpPolicy_Decimate keeps every DecimateStep-th packet of the current buffer, counts the rest
+ *   as decimated, and returns it partly filled. The buffer is thinned again every time the pipe
+ *   is found full, so the longer the reader stalls the sparser the oldest data gets
+ *
+ * - SdpPolicy_Spill copies the current buffer to the spill file and returns it emptied. Every
+ *   buffer after it is spilled too, until the reader has taken all spilled buffers
+ *
+ * SdpPolicy_DropOldest falls back to dropping the newest data while the reader holds the only
+ * other buffer, SdpPolicy_Decimate while the buffer has too few packets to thin, and
+ * SdpPolicy_Spill while the spill file is full.
  *
  * @param Pipe Pipeline instance
- * @return sdb_arena* Available write buffer arena or NULL
+ * @return sdb_arena* Available write buffer arena or NULL on error
  */
 sdb_arena *SdPipeGetWriteBuffer(sensor_data_pipe *Pipe);
 
+/**
+ * @brief Try to Acquire Write Buffer Arena
+ *
+ * Same as SdPipeGetWriteBuffer, but never waits or drops data, whatever the pipe's Policy. If
+ * the pipe is full, nothing is published and the writer keeps the current buffer.
+ *
+ * @param Pipe Pipeline instance
+ * @return sdb_arena* Next write buffer arena, or NULL if the pipe is full
+ */
+sdb_arena *SdPipeTryGetWriteBuffer(sensor_data_pipe *Pipe);
+
+/**
+ * @brief Get the Buffer the Writer is Filling
+ *
+ * @param Pipe Pipeline instance
+ * @return sdb_arena* Current write buffer arena
+ */
+static inline sdb_arena *
+SdPipeCurrentWriteBuffer(sensor_data_pipe *Pipe)
+{
+    return Pipe->Buffers[Pipe->WriteIdx];
+}
+
+/**
+ * @brief Get the Number of Published Buffers the Reader has not Taken
+ *
+ * Safe to call from any thread, but only a snapshot.
+ *
+ * @param Pipe Pipeline instance
+ * @return u64 Buffers waiting for the reader
+ */
+static inline u64
+SdPipeQueuedCount(sensor_data_pipe *Pipe)
+{
+    u64 Taken = atomic_load_explicit(&Pipe->Taken, memory_order_relaxed);
+    u64 Head  = atomic_load_explicit(&Pipe->Head, memory_order_relaxed);
+    return (Head > Taken) ? Head - Taken : 0;
+}
+
 /**
  * @brief Acquire Read Buffer Arena
  *
- * Obtains the next available memory arena for reading,
- * blocking until data is available.
+ * Returns the oldest full buffer, spinning and then blocking until one is available. The buffer
+ * stays with the reader until SdPipeReleaseReadBuffer or the next acquire.
  *
  * @param Pipe Pipeline instance
- * @return sdb_arena* Available read buffer arena or NULL
+ * @return sdb_arena* Available read buffer arena or NULL if interrupted
  */
 sdb_arena *SdPipeGetReadBuffer(sensor_data_pipe *Pipe);
 
+/**
+ * @brief Try to Acquire Read Buffer Arena
+ *
+ * Same as SdPipeGetReadBuffer, but never waits. When the pipe is empty, ReadEventFd is reset so
+ * that it becomes readable when the writer publishes the next buffer.
+ *
+ * @param Pipe Pipeline instance
+ * @return sdb_arena* Oldest full buffer arena, or NULL if the pipe is empty
+ */
+sdb_arena *SdPipeTryGetReadBuffer(sensor_data_pipe *Pipe);
+
+/**
+ * @brief Hand the Current Read Buffer Back to the Writer
+ *
+ * Does nothing if the reader holds no buffer.
+ *
+ * @param Pipe Pipeline instance
+ */
+void SdPipeReleaseReadBuffer(sensor_data_pipe *Pipe);
+
+/**
+ * @brief Keep the Current Read Buffer Past the Next Take
+ *
+ * The buffer stays out of the writer's reach, with its data, stamps and header, until
+ * SdPipeReleaseKept releases it. The reader must not keep a buffer while SdPipeKeptFull.
+ *
+ * @param Pipe Pipeline instance
+ * @return u64 Sequence number of the kept buffer, for SdPipeGetKept
+ */
+u64 SdPipeKeepReadBuffer(sensor_data_pipe *Pipe);
+
+/**
+ * @brief Hand the Oldest Kept Buffer Back to the Writer
+ *
+ * @param Pipe Pipeline instance
+ */
+void SdPipeReleaseKept(sensor_data_pipe *Pipe);
+
+/**
+ * @brief Get a Kept Buffer
+ *
+ * @param Pipe Pipeline instance
+ * @param Seq Sequence number from SdPipeKeepReadBuffer, of a buffer not released yet
+ * @return sdp_kept* The kept buffer, valid until it is released
+ */
+sdp_kept *SdPipeGetKept(sensor_data_pipe *Pipe, u64 Seq);
+
+/**
+ * @brief Check whether the Reader Must Release Kept Buffers Before Keeping More
+ *
+ * True once the writer could be left without a free buffer, or the spill file without a free
+ * slot, by the buffers the reader keeps.
+ *
+ * @param Pipe Pipeline instance
+ */
+static inline bool
+SdPipeKeptFull(sensor_data_pipe *Pipe)
+{
+    u64 KeptQueued = Pipe->KeptHead - Pipe->KeptTail - Pipe->KeptSpillCount;
+    return KeptQueued + 1 >= Pipe->BufCount || Pipe->KeptSpillCount >= Pipe->BufCount
+        || (Pipe->SpillSlotCount > 0 && Pipe->KeptSpillCount >= Pipe->SpillSlotCount);
+}
+
+/**
+ * @brief Attach a Tap to a Pipe
+ *
+ * A tap sees every buffer the writer publishes after it is attached, in order, besides the
+ * reader, and a buffer is only reused once the reader and every attached tap are done with it.
+ * The writer treats a lossless tap that falls behind like a slow reader, so the pipe's Policy
+ * applies. A lossy tap that falls behind is moved forward to the slowest of the others instead,
+ * and the packets it skips are counted in its DroppedCount, so it only holds the writer up for
+ * as long as it holds a buffer. Taps do not see buffers from the spill file.
+ *
+ * Must be called before the writer starts. A pipe with SdpPolicy_DropOldest cannot have taps,
+ * since it takes back published buffers.
+ *
+ * @param Pipe Pipeline instance
+ * @param Lossy Whether the writer skips the tap instead of waiting for it
+ * @return sdp_tap* The tap, or NULL on failure or if the pipe has SDP_MAX_TAPS
+ */
+sdp_tap *SdpTapAttach(sensor_data_pipe *Pipe, bool Lossy);
+
+/**
+ * @brief Detach a Tap From its Pipe
+ *
+ * Releases the tap's buffer, and the writer stops waiting for it. Called from the tap's thread,
+ * which must not use the tap afterwards. The tap is freed with the pipe.
+ *
+ * @param Pipe Pipeline instance
+ * @param Tap Tap returned by SdpTapAttach
+ */
+void SdpTapDetach(sensor_data_pipe *Pipe, sdp_tap *Tap);
+
+/**
+ * @brief Acquire the Next Buffer of a Tap
+ *
+ * Same as SdPipeGetReadBuffer, for a tap. The buffer must only be read.
+ *
+ * @param Pipe Pipeline instance
+ * @param Tap Tap returned by SdpTapAttach
+ * @return sdb_arena* Next full buffer arena or NULL if interrupted
+ */
+sdb_arena *SdPipeTapGetReadBuffer(sensor_data_pipe *Pipe, sdp_tap *Tap);
+
+/**
+ * @brief Try to Acquire the Next Buffer of a Tap
+ *
+ * Same as SdPipeTryGetReadBuffer, for a tap. Tap->EventFd becomes readable when the writer
+ * publishes the next buffer.
+ *
+ * @param Pipe Pipeline instance
+ * @param Tap Tap returned by SdpTapAttach
+ * @return sdb_arena* Next full buffer arena, or NULL if the tap has seen every buffer
+ */
+sdb_arena *SdPipeTapTryGetReadBuffer(sensor_data_pipe *Pipe, sdp_tap *Tap);
+
+/**
+ * @brief Release the Current Buffer of a Tap
+ *
+ * Does nothing if the tap holds no buffer.
+ *
+ * @param Pipe Pipeline instance
+ * @param Tap Tap returned by SdpTapAttach
+ */
+void SdPipeTapReleaseReadBuffer(sensor_data_pipe *Pipe, sdp_tap *Tap);
+
+/**
+ * @brief Get the Header of the Current Buffer of a Tap
+ *
+ * @param Pipe Pipeline instance
+ * @param Tap Tap holding a buffer from SdPipeTapGetReadBuffer
+ * @return sdp_buf_header* Header of the buffer, valid until the tap releases it
+ */
+sdp_buf_header *SdPipeTapGetHeader(sensor_data_pipe *Pipe, sdp_tap *Tap);
+
+
+/**
+ * @brief Get the Receive Timestamps of a Buffer
+ *
+ * @param Pipe Pipeline instance
+ * @param Buf Buffer returned by SdPipeGetReadBuffer
+ * @return sdp_stamps* Timestamps of the buffer, valid as long as its data
+ */
+sdp_stamps *SdPipeGetStamps(sensor_data_pipe *Pipe, sdb_arena *Buf);
+
+/**
+ * @brief Get the Header of a Buffer
+ *
+ * @param Pipe Pipeline instance
+ * @param Buf Buffer returned by SdPipeGetReadBuffer
+ * @return sdp_buf_header* Header of the buffer, valid as long as its data
+ */
+sdp_buf_header *SdPipeGetHeader(sensor_data_pipe *Pipe, sdb_arena *Buf);
+
+/**
+ * @brief Append a Length Prefixed Record to the Current Write Buffer
+ *
+ * For SdpFraming_Prefixed pipes. Gets a new write buffer with SdPipeGetWriteBuffer first if the
+ * record does not fit in the current one, so the pipe's Policy applies.
+ *
+ * @param Pipe Pipeline instance
+ * @param SchemaId What the record is
+ * @param Data Record data
+ * @param Size Bytes of data
+ * @param RecvNs CLOCK_REALTIME nanoseconds the data was received, 0 if unknown
+ * @return sdb_arena* Current write buffer, or NULL if the record is larger than a buffer or
+ * getting a new buffer failed
+ */
+sdb_arena *SdPipePushRecord(sensor_data_pipe *Pipe, u32 SchemaId, const void *Data, u32 Size,
+                            u64 RecvNs);
+
+/**
+ * @brief Get the Record of a SdpFraming_Prefixed Buffer at Offset
+ *
+ * @param Buf Buffer of the pipe
+ * @param[in,out] Offset Offset of the record, 0 for the first one, moved to the next one
+ * @return sdp_record* The record, or NULL after the last one
+ */
+static inline sdp_record *
+SdPipeNextRecord(sdb_arena *Buf, u64 *Offset)
+{
+    if(*Offset + sizeof(sdp_record) > Buf->Cur) {
+        return NULL;
+    }
+    sdp_record *Record = (sdp_record *)(Buf->Mem + *Offset);
+    *Offset += (sizeof(sdp_record) + Record->Size + SDP_RECORD_ALIGN - 1)
+             & ~(u64)(SDP_RECORD_ALIGN - 1);
+    return Record;
+}
+
+/**
+ * @brief Record the Latency of Every Stamped Packet in a Buffer
+ *
+ * Each packet's latency is NowNs minus its receive time. Reads no clock, so the caller takes
+ * NowNs once for the whole buffer.
+ *
+ * @param Pipe Pipeline instance
+ * @param Buf Buffer returned by SdPipeGetReadBuffer
+ * @param NowNs CLOCK_REALTIME nanoseconds, e.g. when the buffer was committed
+ * @param Hist Histogram to record the latencies in
+ */
+void SdPipeRecordLatency(sensor_data_pipe *Pipe, sdb_arena *Buf, u64 NowNs,
+                         sdb_latency_hist *Hist);
+
+/**
+ * @brief Add a Stamp for the Data Written Next to a Buffer
+ *
+ * Data received at the same time as the previous data in the buffer needs no new stamp.
+ *
+ * @param Stamps Timestamps of the buffer
+ * @param Buf Buffer the data is written to
+ * @param RecvNs CLOCK_REALTIME nanoseconds the data was received, 0 if unknown
+ */
+static inline void
+SdpStampsAdd(sdp_stamps *Stamps, sdb_arena *Buf, u64 RecvNs)
+{
+    if(RecvNs == 0 || Stamps->Count == SDP_STAMP_MAX
+       || (Stamps->Count > 0 && Stamps->Stamps[Stamps->Count - 1].RecvNs == RecvNs)) {
+        return;
+    }
+
+    Stamps->Stamps[Stamps->Count++] = (sdp_stamp){ .RecvNs = RecvNs, .Offset = Buf->Cur };
+}
+
+/**
+ * @brief Record the Latency of Every Stamped Packet of a Buffer
+ *
+ * @param Stamps Timestamps of the buffer
+ * @param Buf Buffer the stamps belong to
+ * @param PacketSize Size of the packets in the buffer
+ * @param NowNs CLOCK_REALTIME nanoseconds, e.g. when the buffer was committed
+ * @param Hist Histogram to record the latencies in
+ */
+void SdpStampsRecordLatency(sdp_stamps *Stamps, sdb_arena *Buf, u64 PacketSize, u64 NowNs,
+                            sdb_latency_hist *Hist);
+
+/**
+ * @brief Stamp the Data Written Next with its Receive Time
+ *
+ * Called by the writer before it adds data to the current write buffer. Data received at the
+ * same time as the previous data in the buffer needs no new stamp.
+ *
+ * @param Pipe Pipeline instance
+ * @param Buf Current write buffer
+ * @param RecvNs CLOCK_REALTIME nanoseconds the data was received, 0 if unknown
+ */
+static inline void
+SdPipeStamp(sensor_data_pipe *Pipe, sdb_arena *Buf, u64 RecvNs)
+{
+    SdpStampsAdd(&Pipe->Stamps[Pipe->WriteIdx], Buf, RecvNs);
+}
 
 /**
  * @brief Flush Partial Buffer Arena
  *
- * Signals and transitions a partially filled buffer arena
- * to the read side of the pipeline.
+ * Publishes the current write buffer if it holds any data. If the pipe is full, SdpPolicy_Block
+ * waits for the reader and SdpPolicy_DropOldest drops the oldest buffer, while the other
+ * policies leave the data in the current buffer. The writer continues with
+ * SdPipeCurrentWriteBuffer.
  *
  * @param Pipe Pipeline instance
  */
 void SdPipeFlush(sensor_data_pipe *Pipe);
 
+/**
+ * @brief Flush the Partial Write Buffer if its Oldest Data is Due
+ *
+ * The data is due when its receive time plus the pipe's MaxLatency is less than Slack away.
+ * Data without a receive time is dated Slack before the first check that finds it, which is no
+ * later than it was written if the writer checks every Slack. Never waits: while the reader
+ * holds every other buffer, the reader has data to work on anyway, and the buffer keeps filling.
+ * A SdpPolicy_Spill pipe that cannot publish spills the due data instead, since the reader
+ * drains the spill file before it sees the buffers published after it.
+ *
+ * @param Pipe Pipeline instance
+ * @param NowNs CLOCK_REALTIME nanoseconds
+ * @param Slack Time until the writer checks again
+ * @return true if the buffer was published or spilled
+ */
+bool SdPipeFlushDue(sensor_data_pipe *Pipe, u64 NowNs, sdb_timediff Slack);
+
+/**
+ * @brief Retire the Buffers of an Elastic Pipe that Stayed Free
+ *
+ * Publishing does this as well, so a writer only needs it to let a pipe it no longer publishes
+ * to shrink. Called by the writer at least once per ShrinkAfter.
+ *
+ * @param Pipe Pipeline instance
+ */
+void SdPipeShrinkIdle(sensor_data_pipe *Pipe);
+
+/**
+ * @brief Check whether the Reader has Released Every Replayed Buffer
+ *
+ * A writer that must not interleave new data with the data of a crashed run waits for this
+ * before it publishes. Always true for a pipe that is not persistent.
+ *
+ * @param Pipe Pipeline instance
+ * @return true if there is nothing left to replay
+ */
+bool SdPipeReplayed(sensor_data_pipe *Pipe);
+
 SDB_END_EXTERN_C
 
 #endif
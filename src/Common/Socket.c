@@ -22,6 +22,7 @@
 
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -43,7 +44,7 @@ SDB_LOG_REGISTER(Socket);
  * 1. Create TCP socket
  * 2. Configure server address
  * 3. Convert IP address
- * 4. Establish connection with brief delay
+ * 4. Establish connection
  *
  * @param IpAddress Destination IP address
  * @param Port Destination port number
@@ -72,8 +73,6 @@ SocketCreate(const char *IpAddress, int Port)
         return -1;
     }
 
-
-    sleep(1);
     if(connect(SockFd, (struct sockaddr *)&ServerAddr, sizeof(ServerAddr)) == -1) {
         SdbLogError("Failed to connect to server %s:%d, errno: %s", IpAddress,
                     ntohs(ServerAddr.sin_port), strerror(errno));
@@ -84,6 +83,90 @@ SocketCreate(const char *IpAddress, int Port)
     return SockFd;
 }
 
+/**
+ * @brief Start a Non-Blocking TCP Connect
+ *
+ * The socket is created non-blocking, so connect() returns at once. Unless the connection was
+ * established right away, it becomes writable once the handshake has ended, and
+ * SocketConnectResult tells whether it succeeded.
+ *
+ * @param IpAddress Destination IP address
+ * @param Port Destination port number
+ * @param SockFd Set to the socket file descriptor, or -1 on failure
+ * @return sdb_errno 0 if connected, -EINPROGRESS if the handshake is pending, -errno on failure
+ */
+sdb_errno
+SocketConnectNonBlocking(const char *IpAddress, int Port, int *SockFd)
+{
+    struct sockaddr_in ServerAddr;
+    SdbMemset(&ServerAddr, 0, sizeof(ServerAddr));
+    ServerAddr.sin_family = AF_INET;
+    ServerAddr.sin_port   = htons(Port);
+
+    *SockFd = -1;
+    if(inet_pton(AF_INET, IpAddress, &ServerAddr.sin_addr) <= 0) {
+        SdbLogError("Invalid IP address format: %s", IpAddress);
+        return -EINVAL;
+    }
+
+    int Fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(Fd == -1) {
+        SdbLogError("Error creating socket: %s", strerror(errno));
+        return -errno;
+    }
+
+    sdb_errno Ret = 0;
+    if(connect(Fd, (struct sockaddr *)&ServerAddr, sizeof(ServerAddr)) == -1) {
+        if(errno != EINPROGRESS) {
+            Ret = -errno;
+            SdbLogDebug("Failed to connect to server %s:%d, errno: %s", IpAddress, Port,
+                        strerror(errno));
+            close(Fd);
+            return Ret;
+        }
+        Ret = -EINPROGRESS;
+    }
+
+    *SockFd = Fd;
+    return Ret;
+}
+
+/**
+ * @brief Get the Outcome of a Non-Blocking Connect
+ *
+ * @param SockFd Socket that has become writable after SocketConnectNonBlocking
+ * @return sdb_errno 0 if connected, -errno of the failed connection attempt otherwise
+ */
+sdb_errno
+SocketConnectResult(int SockFd)
+{
+    int       Error = 0;
+    socklen_t Len   = sizeof(Error);
+    if(getsockopt(SockFd, SOL_SOCKET, SO_ERROR, &Error, &Len) == -1) {
+        return -errno;
+    }
+
+    return -Error;
+}
+
+/**
+ * @brief Put a Socket in Non-Blocking Mode
+ *
+ * @param SockFd Socket file descriptor
+ * @return sdb_errno 0 on success, -errno on failure
+ */
+sdb_errno
+SocketSetNonBlocking(int SockFd)
+{
+    int Flags = fcntl(SockFd, F_GETFL, 0);
+    if(Flags == -1 || fcntl(SockFd, F_SETFL, Flags | O_NONBLOCK) == -1) {
+        SdbLogError("Failed to set socket %d non-blocking: %s", SockFd, strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
 /**
  * @brief Receive Data with Configurable Timeout
  *
@@ -44,12 +44,50 @@ SDB_BEGIN_EXTERN_C
  * @return int
  * - Socket file descriptor on success
  * - -1 on connection failure
- *
- * @note Includes a 1-second connection delay for stability
  */
 int SocketCreate(const char *IpAddress, int Port);
 
 
+/**
+ * @brief Start a Non-Blocking TCP Connect
+ *
+ * Creates a non-blocking socket and starts connecting it, so the caller's event loop can wait
+ * for the handshake instead of blocking on it.
+ *
+ * @param IpAddress Destination IP address (IPv4 dot-decimal notation)
+ * @param Port Destination port number
+ * @param SockFd Set to the socket file descriptor, or -1 on failure
+ *
+ * @return sdb_errno
+ * - 0: Connected
+ * - -EINPROGRESS: Handshake pending; the socket becomes writable once it ends
+ * - Other negative values: Connection failure
+ */
+sdb_errno SocketConnectNonBlocking(const char *IpAddress, int Port, int *SockFd);
+
+
+/**
+ * @brief Get the Outcome of a Non-Blocking Connect
+ *
+ * @param SockFd Socket that has become writable after SocketConnectNonBlocking
+ *
+ * @return sdb_errno 0 if connected, -errno of the failed connection attempt otherwise
+ */
+sdb_errno SocketConnectResult(int SockFd);
+
+
+/**
+ * @brief Put a Socket in Non-Blocking Mode
+ *
+ * Sets O_NONBLOCK on the socket so it can be driven by an event loop.
+ *
+ * @param SockFd Socket file descriptor
+ *
+ * @return sdb_errno 0 on success, -errno on failure
+ */
+sdb_errno SocketSetNonBlocking(int SockFd);
+
+
 /**
  * @brief Receive Data with Timeout
  *
@@ -31,6 +31,18 @@ SDB_BEGIN_EXTERN_C
 
 #include <src/Common/Time.h>
 
+/** @brief Alignment that keeps data written by different threads off each other's cache lines */
+#define SDB_CACHE_LINE_SIZE 64
+
+/** @brief Tell the CPU the thread is spinning on a value another thread will change */
+#if defined(__x86_64__) || defined(__i386__)
+#define SdbCpuRelax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define SdbCpuRelax() __asm__ __volatile__("yield")
+#else
+#define SdbCpuRelax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
 typedef sem_t             sdb_sem;
 typedef pthread_mutex_t   sdb_mutex;
 typedef pthread_cond_t    sdb_cond;
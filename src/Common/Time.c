@@ -31,6 +31,12 @@ SdbTimeMonotonic(struct timespec *TimeStamp)
     return 0;
 }
 
+u64
+SdbTimespecNs(const struct timespec *Timespec)
+{
+    return (u64)Timespec->tv_sec * 1000000000ULL + Timespec->tv_nsec;
+}
+
 void
 SdbTimeAdd(struct timespec *Timespec, sdb_timediff Delta)
 {
@@ -80,6 +86,15 @@ SdbTimePrintSpecDiffWT(const struct timespec *StartTime, const struct timespec *
     return 0;
 }
 
+sdb_timediff
+SdbTimeDiff(const struct timespec *EndTime, const struct timespec *StartTime)
+{
+    i64 DiffNs = (EndTime->tv_sec - StartTime->tv_sec) * (i64)1e9
+               + (EndTime->tv_nsec - StartTime->tv_nsec);
+
+    return SDB_TIME_NS(DiffNs);
+}
+
 void
 SdbTimespec(struct timespec *Timespec, sdb_timediff Delta)
 {
@@ -116,3 +131,33 @@ SdbSleep(sdb_timediff Delta)
 
     return Ret;
 }
+
+sdb_timediff
+SdbTimeFromString(const char *TimeStr)
+{
+    if(!TimeStr || !*TimeStr) {
+        return 0;
+    }
+
+    char *EndPtr;
+    u64   Value = strtoull(TimeStr, &EndPtr, 10);
+    if(EndPtr == TimeStr) {
+        return 0;
+    }
+
+    while(isspace(*EndPtr)) {
+        EndPtr++;
+    }
+
+    if(!*EndPtr || strcmp(EndPtr, "ms") == 0) {
+        return SDB_TIME_MS(Value);
+    } else if(strcmp(EndPtr, "us") == 0) {
+        return SDB_TIME_US(Value);
+    } else if(strcmp(EndPtr, "ns") == 0) {
+        return SDB_TIME_NS(Value);
+    } else if(strcmp(EndPtr, "s") == 0) {
+        return SDB_TIME_S(Value);
+    }
+
+    return 0;
+}
@@ -78,6 +78,24 @@ sdb_errno SdbTimeMonotonic(struct timespec *TimeStamp);
 sdb_errno SdbTimePrintSpecDiffWT(const struct timespec *StartTime, const struct timespec *EndTime,
                                  struct timespec *Diff);
 
+/**
+ * @brief Get Time Difference Between Timestamps
+ *
+ * @param EndTime Ending timestamp
+ * @param StartTime Beginning timestamp, must not be later than EndTime
+ * @return sdb_timediff Time elapsed from StartTime to EndTime
+ */
+sdb_timediff SdbTimeDiff(const struct timespec *EndTime, const struct timespec *StartTime);
+
+
+/**
+ * @brief Convert Timestamp to Nanoseconds
+ *
+ * @param Timespec Timestamp, e.g. from CLOCK_REALTIME
+ * @return u64 Nanoseconds since the epoch of the timestamp's clock
+ */
+u64 SdbTimespecNs(const struct timespec *Timespec);
+
 
 /**
  * @brief Add Time Difference to Timestamp
@@ -141,6 +159,17 @@ bool SdbTimeoutExpired(struct timespec *Timeout, struct timespec *Now);
  */
 sdb_errno SdbSleep(sdb_timediff Delta);
 
+/**
+ * @brief Parse Time Difference From String
+ *
+ * Parses a number followed by one of the units "ns", "us", "ms" or "s", e.g. "200ms". A number
+ * without a unit is taken as milliseconds
+ *
+ * @param TimeStr String to parse
+ * @return sdb_timediff Parsed time difference, 0 if the string is invalid
+ */
+sdb_timediff SdbTimeFromString(const char *TimeStr);
+
 SDB_END_EXTERN_C
 
 #endif
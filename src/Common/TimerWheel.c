@@ -0,0 +1,146 @@
+/**
+ * @file TimerWheel.c
+ * @brief Implementation of the hashed timing wheel
+ *
+ * Resources:
+ * Hashed and Hierarchical Timing Wheels, Varghese & Lauck. Scheme 6 is what is implemented here.
+ * @link http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+ */
+
+#include <src/Sdb.h>
+SDB_LOG_REGISTER(TimerWheel);
+
+#include <src/Common/Time.h>
+#include <src/Common/TimerWheel.h>
+
+
+static inline u64
+TicksFromTime(sdb_timer_wheel *Wheel, sdb_timediff Time)
+{
+    return (Time + Wheel->Tick - 1) / Wheel->Tick;
+}
+
+static inline u64
+CurrentTick(sdb_timer_wheel *Wheel, struct timespec *Now)
+{
+    return SdbTimeDiff(Now, &Wheel->Start) / Wheel->Tick;
+}
+
+static inline void
+InsertTimer(sdb_timer_wheel *Wheel, u32 Timer)
+{
+    u32 Slot                    = Wheel->Timers[Timer].Due & Wheel->SlotMask;
+    Wheel->Timers[Timer].Next   = Wheel->Slots[Slot];
+    Wheel->Timers[Timer].Linked = true;
+    Wheel->Slots[Slot]          = Timer;
+}
+
+sdb_errno
+SdbTimerWheelInit(sdb_timer_wheel *Wheel, u32 SlotCount, u32 TimerCount, sdb_timediff Tick,
+                  sdb_arena *Arena)
+{
+    SdbAssert((SlotCount & (SlotCount - 1)) == 0, "Slot count %u is not a power of two",
+              SlotCount);
+
+    Wheel->Slots  = SdbPushArray(Arena, u32, SlotCount);
+    Wheel->Timers = SdbPushArrayZero(Arena, sdb_timer, TimerCount);
+    if(!Wheel->Slots || !Wheel->Timers) {
+        SdbLogError("Insufficient memory for timer wheel with %u timers", TimerCount);
+        return -ENOMEM;
+    }
+
+    for(u32 s = 0; s < SlotCount; ++s) {
+        Wheel->Slots[s] = SDB_TIMER_NONE;
+    }
+
+    Wheel->Tick       = SdbMax(Tick, 1);
+    Wheel->Now        = 0;
+    Wheel->SlotMask   = SlotCount - 1;
+    Wheel->TimerCount = TimerCount;
+    SdbTimeMonotonic(&Wheel->Start);
+
+    return 0;
+}
+
+void
+SdbTimerStart(sdb_timer_wheel *Wheel, u32 Timer, sdb_timediff Period, sdb_timediff FirstDelay)
+{
+    SdbAssert(Timer < Wheel->TimerCount, "Timer %u out of range", Timer);
+
+    sdb_timer *T = &Wheel->Timers[Timer];
+    T->Period    = SdbMax(TicksFromTime(Wheel, Period), 1);
+    T->Due       = Wheel->Now + SdbMax(TicksFromTime(Wheel, FirstDelay), 1);
+    if(!T->Linked) {
+        InsertTimer(Wheel, Timer);
+    }
+}
+
+void
+SdbTimerStop(sdb_timer_wheel *Wheel, u32 Timer)
+{
+    Wheel->Timers[Timer].Period = 0;
+}
+
+/**
+ * @brief Fires every timer due up to the current time and reschedules it
+ *
+ * Processes each tick since the last call. The timers of a slot are detached before they are
+ * visited, so a timer rescheduled into the same slot is not visited twice.
+ *
+ * @param Wheel Timer wheel
+ * @param Now Current monotonic time
+ * @param Fn Expiry callback
+ * @param Arg Passed to Fn
+ * @return Number of timers fired
+ */
+u64
+SdbTimerWheelAdvance(sdb_timer_wheel *Wheel, struct timespec *Now, sdb_timer_fn Fn, void *Arg)
+{
+    u64 Target = CurrentTick(Wheel, Now);
+    u64 Fired  = 0;
+
+    // NOTE(ingar): After a long stall, a single revolution visits every slot once
+    u64 From = Wheel->Now + 1;
+    if(Target > From + Wheel->SlotMask) {
+        From = Target - Wheel->SlotMask;
+    }
+
+    for(u64 Tick = From; Tick <= Target; ++Tick) {
+        u32 Slot          = Tick & Wheel->SlotMask;
+        u32 Timer         = Wheel->Slots[Slot];
+        Wheel->Slots[Slot] = SDB_TIMER_NONE;
+        Wheel->Now         = Tick;
+
+        while(Timer != SDB_TIMER_NONE) {
+            sdb_timer *T    = &Wheel->Timers[Timer];
+            u32        Next = T->Next;
+
+            if(T->Period == 0) {
+                T->Linked = false; // Stopped; dropped from the wheel
+            } else if(T->Due > Target) {
+                InsertTimer(Wheel, Timer);
+            } else {
+                T->Due += T->Period;
+                if(T->Due <= Target) {
+                    T->Due = Target + T->Period;
+                }
+                InsertTimer(Wheel, Timer);
+
+                Fn(Timer, Arg);
+                ++Fired;
+            }
+
+            Timer = Next;
+        }
+    }
+
+    Wheel->Now = SdbMax(Wheel->Now, Target);
+    return Fired;
+}
+
+sdb_timediff
+SdbTimerWheelUntilNextTick(sdb_timer_wheel *Wheel, struct timespec *Now)
+{
+    sdb_timediff Elapsed = SdbTimeDiff(Now, &Wheel->Start);
+    return Wheel->Tick - (Elapsed % Wheel->Tick);
+}
@@ -0,0 +1,119 @@
+/**
+ * @file TimerWheel.h
+ * @brief Hashed timing wheel for periodic timers
+ *
+ * Schedules a large number of periodic timers with O(1) start and expiry cost per timer.
+ * Time is divided into ticks; each timer lives in the slot of the tick it is due in. Timers
+ * due more than one revolution ahead stay in their slot and are skipped until their tick.
+ *
+ * Timers are identified by their index, and the wheel is only used by the thread that owns it.
+ */
+
+#ifndef SDB_TIMER_WHEEL_H
+#define SDB_TIMER_WHEEL_H
+
+#include <src/Sdb.h>
+
+SDB_BEGIN_EXTERN_C
+
+#include <src/Common/Time.h>
+
+#define SDB_TIMER_NONE (UINT32_MAX)
+
+/**
+ * @brief A periodic timer
+ */
+typedef struct
+{
+    u64  Due;    /**< Tick the timer fires in */
+    u64  Period; /**< Period in ticks, 0 if the timer is stopped */
+    u32  Next;   /**< Next timer in the same slot */
+    bool Linked; /**< In a slot, which a stopped timer stays in until the slot is processed */
+} sdb_timer;
+
+/**
+ * @brief Called for each timer that fires
+ *
+ * @param Timer Index of the timer
+ * @param Arg User argument given to SdbTimerWheelAdvance
+ */
+typedef void (*sdb_timer_fn)(u32 Timer, void *Arg);
+
+/**
+ * @brief Hashed timing wheel
+ */
+typedef struct
+{
+    sdb_timediff    Tick;     /**< Duration of one tick */
+    struct timespec Start;    /**< Monotonic time of tick 0 */
+    u64             Now;      /**< Last tick that has been processed */
+    u32             SlotMask; /**< Slot count - 1 */
+    u32            *Slots;    /**< First timer in each slot */
+    u32             TimerCount;
+    sdb_timer      *Timers;
+} sdb_timer_wheel;
+
+/**
+ * @brief Initializes a timer wheel with all timers stopped
+ *
+ * @param Wheel Wheel to initialize
+ * @param SlotCount Number of slots, must be a power of two
+ * @param TimerCount Number of timers
+ * @param Tick Duration of one tick, the resolution of the wheel
+ * @param Arena Arena the slots and timers are allocated from
+ * @return 0 on success, -ENOMEM if the arena is too small
+ */
+sdb_errno SdbTimerWheelInit(sdb_timer_wheel *Wheel, u32 SlotCount, u32 TimerCount,
+                            sdb_timediff Tick, sdb_arena *Arena);
+
+/**
+ * @brief Starts a periodic timer
+ *
+ * A timer that is restarted before its old slot has been processed fires no later than that
+ * slot's tick.
+ *
+ * @param Wheel Timer wheel
+ * @param Timer Index of the timer, must be stopped
+ * @param Period Time between expiries, rounded up to whole ticks
+ * @param FirstDelay Time until the first expiry
+ */
+void SdbTimerStart(sdb_timer_wheel *Wheel, u32 Timer, sdb_timediff Period,
+                   sdb_timediff FirstDelay);
+
+/**
+ * @brief Stops a timer
+ *
+ * The timer is removed lazily, the next time its slot is processed.
+ *
+ * @param Wheel Timer wheel
+ * @param Timer Index of the timer
+ */
+void SdbTimerStop(sdb_timer_wheel *Wheel, u32 Timer);
+
+/**
+ * @brief Fires every timer due up to the current time and reschedules it
+ *
+ * A timer that has fallen more than a period behind fires once and is rescheduled one period
+ * from now, instead of firing once for every missed period.
+ *
+ * @param Wheel Timer wheel
+ * @param Now Current monotonic time
+ * @param Fn Called for each timer that fires
+ * @param Arg Passed to Fn
+ * @return Number of timers fired
+ */
+u64 SdbTimerWheelAdvance(sdb_timer_wheel *Wheel, struct timespec *Now, sdb_timer_fn Fn,
+                         void *Arg);
+
+/**
+ * @brief Gets the time until the next tick starts
+ *
+ * @param Wheel Timer wheel
+ * @param Now Current monotonic time
+ * @return Time until the next tick
+ */
+sdb_timediff SdbTimerWheelUntilNextTick(sdb_timer_wheel *Wheel, struct timespec *Now);
+
+SDB_END_EXTERN_C
+
+#endif
@@ -12,6 +12,7 @@
 #include <src/Sdb.h>
 SDB_LOG_REGISTER(DataHandlers);
 
+#include <src/Common/Pages.h>
 #include <src/Common/ThreadGroup.h>
 #include <src/Libs/cJSON/cJSON.h>
 
@@ -82,6 +83,40 @@ DhsGetMemAndScratchSize(cJSON *Conf, u64 *MemSize, u64 *ScratchSize)
 }
 
 
+/**
+ * @brief Extracts page options from a "memory" configuration object
+ *
+ * Example:
+ * ~~~~~~~~
+ * "memory": { "hugepages": true, "mlock": true, "numa_node": 0 }
+ * ~~~~~~~~
+ *
+ * @param Conf JSON "memory" object, may be NULL
+ * @param Opts Pointer to store the page options
+ *
+ * @return sdb_errno 0 on success, -EINVAL if "numa_node" is not a valid node
+ */
+sdb_errno
+DhsGetPageOpts(cJSON *Conf, sdb_page_opts *Opts)
+{
+    cJSON *NumaNodeObj = cJSON_GetObjectItem(Conf, "numa_node");
+    *Opts              = SDB_PAGE_OPTS_DEFAULT;
+    Opts->Hugepages    = cJSON_IsTrue(cJSON_GetObjectItem(Conf, "hugepages"));
+    Opts->Lock         = cJSON_IsTrue(cJSON_GetObjectItem(Conf, "mlock"));
+    if(NumaNodeObj) {
+        double NumaNode = cJSON_GetNumberValue(NumaNodeObj);
+        if(!cJSON_IsNumber(NumaNodeObj) || NumaNode < 0 || NumaNode >= SDB_PAGES_MAX_NODES) {
+            SdbLogError("Memory \"numa_node\" must be a node number below %d",
+                        SDB_PAGES_MAX_NODES);
+            return -EINVAL;
+        }
+        Opts->NumaNode = NumaNode;
+    }
+
+    return 0;
+}
+
+
 /**
  * @brief Creates a thread group based on configuration
  *
@@ -91,6 +126,7 @@ DhsGetMemAndScratchSize(cJSON *Conf, u64 *MemSize, u64 *ScratchSize)
  *
  * @param Conf JSON configuration object
  * @param GroupId Unique identifier for the thread group
+ * @param Pool Buffer pool shared by the pipes of every handler, NULL if there is none
  * @param A Memory arena for allocation
  *
  * @return tg_group* Pointer to the created thread group, or NULL if creation fails
@@ -98,7 +134,7 @@ DhsGetMemAndScratchSize(cJSON *Conf, u64 *MemSize, u64 *ScratchSize)
  * @note Logs information or error messages during thread group creation
  */
 tg_group *
-DhsCreateTg(cJSON *Conf, u64 GroupId, sdb_arena *A)
+DhsCreateTg(cJSON *Conf, u64 GroupId, sdb_buf_pool *Pool, sdb_arena *A)
 {
     cJSON *Enabled = cJSON_GetObjectItem(Conf, "enabled");
     if(!(cJSON_IsBool(Enabled) && cJSON_IsTrue(Enabled))) {
@@ -113,7 +149,7 @@ DhsCreateTg(cJSON *Conf, u64 GroupId, sdb_arena *A)
     switch(HandlerId) {
         case Mb_With_Postgres:
             {
-                Group = MbPgCreateTg(Conf, GroupId, A);
+                Group = MbPgCreateTg(Conf, GroupId, Pool, A);
                 if(Group != NULL) {
                     SdbLogInfo("Created thread group for Modbus with Postgres");
                 } else {
@@ -14,6 +14,8 @@
 
 #include <src/Sdb.h>
 
+#include <src/Common/BufferPool.h>
+#include <src/Common/Pages.h>
 #include <src/Common/ThreadGroup.h>
 #include <src/Libs/cJSON/cJSON.h>
 
@@ -27,11 +29,12 @@
  *
  * @param Conf Pointer to the JSON configuration object
  * @param GroupId Unique identifier for the thread group
+ * @param Pool Buffer pool shared by the pipes of every handler, NULL if there is none
  * @param A Memory arena for allocation
  *
  * @return tg_group* Pointer to the created thread group, or NULL if creation fails
  */
-tg_group *DhsCreateTg(cJSON *Conf, u64 GroupId, sdb_arena *A);
+tg_group *DhsCreateTg(cJSON *Conf, u64 GroupId, sdb_buf_pool *Pool, sdb_arena *A);
 
 
 /**
@@ -46,4 +49,17 @@ tg_group *DhsCreateTg(cJSON *Conf, u64 GroupId, sdb_arena *A);
  */
 void DhsGetMemAndScratchSize(cJSON *Conf, u64 *MemSize, u64 *ScratchSize);
 
+
+/**
+ * @brief Extracts page options from a "memory" configuration object
+ *
+ * Reads "hugepages", "mlock" and "numa_node". Options that are left out are off.
+ *
+ * @param Conf Pointer to the JSON "memory" object, may be NULL
+ * @param Opts Pointer to store the page options
+ *
+ * @return sdb_errno 0 on success, -EINVAL if "numa_node" is not a valid node
+ */
+sdb_errno DhsGetPageOpts(cJSON *Conf, sdb_page_opts *Opts);
+
 #endif
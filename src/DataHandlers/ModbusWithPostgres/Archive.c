@@ -0,0 +1,169 @@
+/**
+ * @file Archive.c
+ * @brief Raw archive of the sensor data pipes, written through lossy pipe taps
+ */
+
+#define _GNU_SOURCE
+
+#include <src/Sdb.h>
+SDB_LOG_REGISTER(MbPgArchive);
+
+#include <src/Common/SensorDataPipe.h>
+#include <src/Common/Time.h>
+#include <src/DataHandlers/ModbusWithPostgres/Archive.h>
+#include <src/DataHandlers/ModbusWithPostgres/ModbusWithPostgres.h>
+#include <src/Signals.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/** @brief Pipe taps the archive thread reads from per wakeup */
+#define MBPG_ARCHIVE_EPOLL_BATCH 16
+
+/** @brief Longest time the archive thread waits before checking for shutdown */
+#define MBPG_ARCHIVE_EPOLL_WAIT SDB_TIME_MS(100)
+
+/** @brief Time between two logs of the archived and dropped buffers */
+#define MBPG_ARCHIVE_STATS_INTERVAL SDB_TIME_S(10)
+
+/**
+ * @brief Append one buffer to an archive file
+ *
+ * @return 0 on success, -EIO on a short write, or -errno
+ */
+static sdb_errno
+MbPgArchiveWrite(int Fd, sdp_buf_header *Header, sdb_arena *Buf)
+{
+    u64          Size  = SdbArenaGetPos(Buf);
+    struct iovec Iov[] = {
+        { .iov_base = Header, .iov_len = sizeof(*Header) },
+        { .iov_base = &Size, .iov_len = sizeof(Size) },
+        { .iov_base = Buf->Mem, .iov_len = Size },
+    };
+
+    ssize_t Written = writev(Fd, Iov, SdbArrayLen(Iov));
+    if(Written == -1) {
+        return -errno;
+    }
+    return ((u64)Written == sizeof(*Header) + sizeof(Size) + Size) ? 0 : -EIO;
+}
+
+/**
+ * @brief Opens the archive file of every pipe and watches its tap
+ */
+static sdb_errno
+MbPgArchiveOpen(mbpg_ctx *Ctx, int EpollFd, int *Fds)
+{
+    for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+        char Path[PATH_MAX];
+        snprintf(Path, sizeof(Path), "%s/%s-%lu.tap", Ctx->PipeTapDir,
+                 Ctx->ModbusRoutes[p % Ctx->SensorCount].Name, p / Ctx->SensorCount);
+        Fds[p] = open(Path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(Fds[p] == -1) {
+            SdbLogError("Failed to open archive file %s: %s", Path, strerror(errno));
+            return -errno;
+        }
+
+        struct epoll_event ReadEvent = { .events = EPOLLIN, .data.u64 = p };
+        if(epoll_ctl(EpollFd, EPOLL_CTL_ADD, Ctx->PipeTaps[p]->EventFd, &ReadEvent) == -1) {
+            SdbLogError("Failed to watch pipe tap: %s", strerror(errno));
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Main archive loop
+ *
+ * The taps are lossy, so a slow disk only costs archived buffers. If the thread cannot set up
+ * or write its files, it detaches the taps and the pipes go on without it.
+ *
+ * @param Arg Pointer to mbpg_ctx structure
+ * @return sdb_errno Success/error status
+ */
+sdb_errno
+MbPgArchiveRun(void *Arg)
+{
+    mbpg_ctx *Ctx     = Arg;
+    int       EpollFd = epoll_create1(0);
+    int      *Fds     = malloc(Ctx->SdPipeCount * sizeof(int));
+    sdb_errno Ret     = (EpollFd == -1 || Fds == NULL) ? -ENOMEM : 0;
+    for(u64 p = 0; Fds && p < Ctx->SdPipeCount; ++p) {
+        Fds[p] = -1;
+    }
+    if(Ret == 0) {
+        Ret = MbPgArchiveOpen(Ctx, EpollFd, Fds);
+    }
+
+    // NOTE(ingar): Waited on even if the setup failed, since the others wait for this thread
+    SdbLogInfo("Archive thread initialized. Waiting for other threads at barrier");
+    SdbBarrierWait(&Ctx->Barrier);
+
+    u64             ArchivedCount = 0;
+    struct timespec NextStats;
+    SdbTimeMonotonic(&NextStats);
+    SdbTimeAdd(&NextStats, MBPG_ARCHIVE_STATS_INTERVAL);
+    while(!SdbShouldShutdown() && Ret == 0) {
+        struct epoll_event Events[MBPG_ARCHIVE_EPOLL_BATCH];
+        int EventCount = epoll_wait(EpollFd, Events, MBPG_ARCHIVE_EPOLL_BATCH,
+                                    SDB_TIME_TO_MS(MBPG_ARCHIVE_EPOLL_WAIT));
+        if(EventCount == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            SdbLogError("Epoll wait failed: %s", strerror(errno));
+            Ret = -errno;
+            break;
+        }
+
+        // NOTE(ingar): One buffer per event, as in PgRun, so a busy pipe can not starve the others
+        for(int e = 0; e < EventCount && Ret == 0; ++e) {
+            u64               p    = Events[e].data.u64;
+            sensor_data_pipe *Pipe = Ctx->SdPipes[p];
+            sdb_arena        *Buf  = SdPipeTapTryGetReadBuffer(Pipe, Ctx->PipeTaps[p]);
+            if(Buf == NULL) {
+                continue;
+            }
+
+            Ret = MbPgArchiveWrite(Fds[p], SdPipeTapGetHeader(Pipe, Ctx->PipeTaps[p]), Buf);
+            SdPipeTapReleaseReadBuffer(Pipe, Ctx->PipeTaps[p]);
+            if(Ret != 0) {
+                SdbLogError("Failed to write to archive file of pipe %lu: %s", p, SdbStrErr(Ret));
+            } else {
+                ++ArchivedCount;
+            }
+        }
+
+        struct timespec Now;
+        SdbTimeMonotonic(&Now);
+        if(SdbTimeoutExpired(&NextStats, &Now)) {
+            u64 DroppedCount = 0;
+            for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+                DroppedCount += atomic_load_explicit(&Ctx->PipeTaps[p]->DroppedCount,
+                                                     memory_order_relaxed);
+            }
+            SdbLogInfo("Archived %lu buffers, %lu packets were not archived", ArchivedCount,
+                       DroppedCount);
+            NextStats = Now;
+            SdbTimeAdd(&NextStats, MBPG_ARCHIVE_STATS_INTERVAL);
+        }
+    }
+
+    for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+        SdpTapDetach(Ctx->SdPipes[p], Ctx->PipeTaps[p]);
+        if(Fds && Fds[p] != -1) {
+            close(Fds[p]);
+        }
+    }
+    if(EpollFd != -1) {
+        close(EpollFd);
+    }
+    free(Fds);
+
+    return Ret;
+}
@@ -0,0 +1,29 @@
+/**
+ * @file Archive.h
+ * @brief Raw archive of the sensor data pipes
+ * @details Copies every buffer the Modbus workers hand off to a file per pipe, through a lossy
+ * tap on the pipe, so the archive never holds up the workers or the database.
+ */
+
+
+#ifndef MBPG_ARCHIVE_H
+#define MBPG_ARCHIVE_H
+
+#include <src/Sdb.h>
+
+/**
+ * @brief Main archive thread function
+ *
+ * Appends each buffer read from the pipe taps in Ctx->PipeTaps to <tap_dir>/<sensor>-<worker>.tap
+ * as its sdp_buf_header, its size as a u64 and its data. A buffer the tap was moved past is not
+ * archived, and is counted in the tap's DroppedCount instead. The taps are detached when the
+ * thread stops, so the pipes go on without it.
+ *
+ * @param Arg Pointer to mbpg_ctx structure
+ * @return sdb_errno 0 on success, error code on failure:
+ *         - -EIO: Short write to an archive file
+ *         - -errno: System error codes
+ */
+sdb_errno MbPgArchiveRun(void *Arg);
+
+#endif
@@ -3,14 +3,21 @@
  * @brief Implementation of Modbus communication functionality
  */
 
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
 #include <src/Sdb.h>
 SDB_LOG_DECLARE(Modbus);
 SDB_THREAD_ARENAS_EXTERN(Modbus);
 
 #include <src/CommProtocols/Modbus.h>
+#include <src/Common/IoUring.h>
 #include <src/Common/SensorDataPipe.h>
 #include <src/Common/Socket.h>
 #include <src/Common/Thread.h>
+#include <src/Common/TimerWheel.h>
 #include <src/DataHandlers/ModbusWithPostgres/ModbusWithPostgres.h>
 #include <src/DevUtils/TestConstants.h>
 #include <src/Signals.h>
@@ -40,8 +47,13 @@ MbPipeThroughputTest(void *Arg)
 
     sdb_arena MbArena;
     u64       MbASize = Ctx->ModbusMemSize + MB_SCRATCH_COUNT * Ctx->ModbusScratchSize;
-    u8       *MbAMem  = malloc(MbASize);
-    SdbArenaInit(&MbArena, MbAMem, MbASize);
+    sdb_pages MbPages;
+    if(SdbPagesMap(&MbPages, MbASize, &Ctx->MemOpts) != 0) {
+        SdbLogError("Failed to map the Modbus arena");
+        SdbBarrierWait(&Ctx->Barrier);
+        return -ENOMEM;
+    }
+    SdbArenaInit(&MbArena, MbPages.Mem, MbASize);
 
     MbThreadArenasInit();
     SdbThreadArenasInitExtern(Modbus);
@@ -51,8 +63,8 @@ MbPipeThroughputTest(void *Arg)
     }
 
 
-    sensor_data_pipe *Pipe     = Ctx->SdPipe;
-    sdb_arena        *CurBuf   = Pipe->Buffers[atomic_load(&Pipe->WriteBufIdx)];
+    sensor_data_pipe *Pipe     = Ctx->SdPipes[0];
+    sdb_arena        *CurBuf   = SdPipeCurrentWriteBuffer(Pipe);
     sdb_file_data    *TestData = SdbLoadFileIntoMemory("./data/testdata/TestData.sdb", NULL);
 
     SdbLogInfo("Modbus thread successfully initialized. Waiting for other threads at barrier");
@@ -71,159 +83,1233 @@ MbPipeThroughputTest(void *Arg)
     SdPipeFlush(Pipe);
     SdbLogDebug("Modbus main loop stopped with %s", (Ret == 0) ? "success" : "error");
 
-    free(MbAMem);
+    SdbPagesUnmap(&MbPages);
     free(TestData);
     return Ret;
 }
 
 
 /**
- * @brief Implements main Modbus thread loop
+ * @brief Pushes one packet into the current write buffer of a route's pipe
  *
- * Manages the lifecycle of Modbus connections and data processing:
- * - Handles connection establishment and recovery
- * - Processes incoming Modbus frames
- * - Manages graceful shutdown
+ * Rotates to the next write buffer first if the current one is full. A SdpFraming_Prefixed pipe
+ * may be shared by several routes, so their packets are pushed as records through the pipe's
+ * own current buffer rather than the route's.
  *
- * Connection handling:
- * - Automatically reconnects on failure
- * - Implements backoff on repeated failures
- * - Validates frame integrity
+ * @param Route Route of the packet
+ * @param Data Packet data
+ * @param DataLength Packet length
+ * @param RecvNs Kernel receive time of the packet, 0 if unknown
+ */
+static inline void
+MbPushPacket(mb_route *Route, const u8 *Data, u16 DataLength, u64 RecvNs)
+{
+    sensor_data_pipe *Pipe = Route->Pipe;
+    if(Pipe->Framing == SdpFraming_Prefixed) {
+        SdPipePushRecord(Pipe, Route->SchemaId, Data, DataLength, RecvNs);
+        return;
+    }
+
+    SdbAssert((SdbArenaGetPos(Route->CurBuf) <= Pipe->BufferMaxFill),
+              "Pipe buffer overflow in buffer %p", (void *)Route->CurBuf);
+
+    if(SdbArenaGetPos(Route->CurBuf) == Pipe->BufferMaxFill) {
+        Route->CurBuf = SdPipeGetWriteBuffer(Pipe);
+    }
+
+    SdPipeStamp(Pipe, Route->CurBuf, RecvNs);
+    u8 *Ptr = SdbArenaPush(Route->CurBuf, DataLength);
+    SdbMemcpy(Ptr, Data, DataLength);
+}
+
+/**
+ * @brief Pushes the payload of one frame to the pipe of its route
  *
- * Data processing:
- * - Parses Modbus TCP frames
- * - Validates data length and format
- * - Manages buffer rotation
- * - Handles pipeline flushing
+ * Frames without a route, and frames whose payload does not fit the packet size of their
+ * route's pipe, are counted and dropped. Neither says anything about the health of the
+ * connection, so the connection is kept.
  *
- * @param Arg Pointer to mbpg_ctx structure
- * @return sdb_errno Success/error status
+ * @return 0 if the connection is still healthy, negative if it must be closed
  */
-sdb_errno
-MbRun(void *Arg)
+static inline sdb_errno
+MbRouteFrame(modbus_ctx *MbCtx, mb_conn *Conn, const u8 *Frame, i64 FrameLen, u64 *PacketCount)
 {
-    sdb_errno Ret      = 0;
-    mbpg_ctx *Ctx      = Arg;
-    bool      FirstRun = true;
+    u16       UnitId, DataLength;
+    const u8 *Data;
+    if(Conn->Poller) {
+        i64 Group = MbPollMatch(Conn, Frame, FrameLen, &Data, &DataLength);
+        if(Group == -2) {
+            return -1;
+        } else if(Group < 0) {
+            return 0;
+        }
+    } else {
+        Data = MbParseTcpFrame(Frame, &UnitId, &DataLength);
+        if(!Data) {
+            SdbLogError("Failed to parse frame on connection %lu", Conn->Idx);
+            return -1;
+        }
+    }
 
-    sdb_arena MbArena;
-    u64       MbASize = Ctx->ModbusMemSize + MB_SCRATCH_COUNT * Ctx->ModbusScratchSize;
-    u8       *MbAMem  = malloc(MbASize);
-    SdbArenaInit(&MbArena, MbAMem, MbASize);
+    mb_route *Route = MbRouteLookup(MbCtx, Conn, Frame[6], Frame[7]);
+    if(!Route) {
+        ++Conn->UnroutedCount;
+        return 0;
+    }
 
-    MbThreadArenasInit();
-    SdbThreadArenasInitExtern(Modbus);
-    for(u64 s = 0; s < MB_SCRATCH_COUNT; ++s) {
-        sdb_arena *Scratch = SdbArenaBootstrap(&MbArena, NULL, Ctx->ModbusScratchSize);
-        SdbThreadArenasAdd(Scratch);
+    if(DataLength != Route->OwnPipe->PacketSize) {
+        if(Route->MismatchCount++ == 0) {
+            SdbLogWarning("Size mismatch for sensor %s on connection %lu: got %u expected %zu. "
+                          "Dropping such frames",
+                          Route->Name, Conn->Idx, DataLength, Route->OwnPipe->PacketSize);
+        }
+        return 0;
     }
 
-    sensor_data_pipe *Pipe   = Ctx->SdPipe;
-    sdb_arena        *CurBuf = Pipe->Buffers[atomic_load(&Pipe->WriteBufIdx)];
+    MbPushPacket(Route, Data, DataLength, Conn->RecvStampNs);
+    ++Route->PacketCount;
+    Route->ByteCount += DataLength;
 
-    /**<  Only wait at barrier first time */
-    if(FirstRun) {
-        SdbLogInfo("Modbus thread successfully initialized. Waiting for other threads at barrier");
-        SdbBarrierWait(&Ctx->Barrier);
-        SdbLogInfo("Exited barrier. Starting main loop");
-        FirstRun = false;
+    if(++(*PacketCount) % 10000 == 0) {
+        SdbLogInfo("Received %lu packets", *PacketCount);
     }
 
-    while(!SdbShouldShutdown()) {
-        /**< Create new context and connection for each attempt */
-        modbus_ctx *MbCtx = MbPrepareCtx(&MbArena);
-        if(!MbCtx) {
-            SdbLogError("Failed to prepare Modbus context");
-            usleep(1000000); // Wait 1 second before retry
-            continue;
+    return 0;
+}
+
+/**
+ * @brief Drains the frames available on one ready connection
+ *
+ * Each recv pulls as many bytes as the socket has, and every complete frame is pushed to the
+ * pipe of its route before the next recv. A short read means the socket is drained, so no extra
+ * recv is made just to see EAGAIN; level-triggered epoll reports the connection again when more
+ * data arrives.
+ *
+ * @return 0 if the connection is still healthy, negative if it must be closed
+ */
+static sdb_errno
+MbHandleReadable(modbus_ctx *MbCtx, mb_conn *Conn, u64 *PacketCount)
+{
+    for(u64 r = 0; r < MB_MAX_RECVS_PER_EVENT; ++r) {
+        u32 Space     = MB_RECV_BUF_SIZE - (Conn->RecvTail - Conn->RecvHead);
+        i64 BytesRead = MbConnFill(Conn);
+        if(BytesRead <= 0) {
+            return BytesRead;
+        }
+
+        const u8 *Frame;
+        i64       FrameLen;
+        while((FrameLen = MbConnNextFrame(Conn, &Frame)) > 0) {
+            sdb_errno Ret = MbRouteFrame(MbCtx, Conn, Frame, FrameLen, PacketCount);
+            if(Ret != 0) {
+                return Ret;
+            }
+        }
+
+        if(FrameLen < 0) {
+            return FrameLen;
+        }
+
+        if((u64)BytesRead < Space) {
+            break;
         }
+    }
+
+    /**< Responses free window slots, so the polls waiting for one can go out right away */
+    if(Conn->Poller && Conn->Poller->BacklogCount > 0) {
+        struct timespec Now;
+        SdbTimeMonotonic(&Now);
+        i64 Sent = MbPollSend(Conn, &Now);
+        if(Sent < 0) {
+            return Sent;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drains one ready connection by receiving straight into the pipe write buffer
+ *
+ * The Modbus headers are then stripped by compacting the payloads in place, so each payload
+ * byte is copied once between the kernel and the database thread. The receive size is capped
+ * so that every complete frame it can hold fits in the buffer's remaining packet slots.
+ *
+ * Only used when every frame goes to the same route, since the frames are not looked at before
+ * they land in the pipe.
+ *
+ * @return 0 if the connection is still healthy, negative if it must be closed
+ */
+static sdb_errno
+MbHandleReadableZeroCopy(mb_conn *Conn, mb_route *Route, u64 *PacketCount)
+{
+    sensor_data_pipe *Pipe   = Route->Pipe;
+    sdb_arena       **CurBuf = &Route->CurBuf;
+    u64 FrameSize = MODBUS_TCP_LENGTH_OFFSET + 3 + Pipe->PacketSize; // Length = DataLength + 3
+
+    for(u64 r = 0; r < MB_MAX_RECVS_PER_EVENT; ++r) {
+        u64 Slots = (Pipe->BufferMaxFill - SdbArenaGetPos(*CurBuf)) / Pipe->PacketSize;
+        u64 Space = SdbMin(SdbArenaRemaining(*CurBuf), Slots * FrameSize);
+        if(Space < FrameSize) {
+            // NOTE(ingar): With SdpPolicy_Decimate, the buffer comes back partly filled
+            *CurBuf = SdPipeGetWriteBuffer(Pipe);
+            Slots   = (Pipe->BufferMaxFill - SdbArenaGetPos(*CurBuf)) / Pipe->PacketSize;
+            Space   = SdbMin(SdbArenaRemaining(*CurBuf), Slots * FrameSize);
+        }
+
+        u8 *Dst       = (*CurBuf)->Mem + SdbArenaGetPos(*CurBuf);
+        i64 BytesRead = MbConnRecvInto(Conn, Dst, Space);
+        if(BytesRead <= 0) {
+            return BytesRead;
+        }
+
+        i64 PayloadBytes = MbConnCompactFrames(Conn, Dst, BytesRead, Pipe->PacketSize);
+        if(PayloadBytes < 0) {
+            return PayloadBytes;
+        }
+        if(PayloadBytes > 0) {
+            SdPipeStamp(Pipe, *CurBuf, Conn->RecvStampNs);
+        }
+        SdbArenaReserve(*CurBuf, PayloadBytes);
+        Route->PacketCount += PayloadBytes / Pipe->PacketSize;
+        Route->ByteCount += PayloadBytes;
+
+        u64 Prev = *PacketCount;
+        *PacketCount += PayloadBytes / Pipe->PacketSize;
+        if(Prev / 10000 != *PacketCount / 10000) {
+            SdbLogInfo("Received %lu packets", *PacketCount);
+        }
+
+        if((u64)BytesRead < Space) {
+            break;
+        }
+    }
+
+    return 0;
+}
 
-        mb_conn Conn = MbCtx->Conns[0];
-        // int     LogCounter = 0;
+/**
+ * @brief Poll scheduler of the Modbus thread
+ *
+ * Timer i polls group i % GroupCount on connection i / GroupCount.
+ */
+typedef struct
+{
+    modbus_ctx     *MbCtx;
+    sdb_timer_wheel Wheel;
+    u64             ReadyCount;
+    mb_conn       **Ready; /**< Connections that got polls queued in the current tick */
+} mb_poll_sched;
+
+/**
+ * @brief Starts one timer per connection and group
+ *
+ * The first poll of each timer is spread over its period, so the requests of many connections
+ * are not all sent in the same tick.
+ *
+ * @return 0 on success, negative on failure
+ */
+static sdb_errno
+MbPollSchedInit(mb_poll_sched *Sched, modbus_ctx *MbCtx, const mb_poll_conf *Conf,
+                sdb_arena *Arena)
+{
+    u32 TimerCount = MbCtx->ConnCount * Conf->GroupCount;
+
+    Sched->MbCtx      = MbCtx;
+    Sched->ReadyCount = 0;
+    Sched->Ready      = SdbPushArray(Arena, mb_conn *, MbCtx->ConnCount);
+    if(!Sched->Ready) {
+        return -ENOMEM;
+    }
 
+    sdb_errno Ret = SdbTimerWheelInit(&Sched->Wheel, MB_POLL_WHEEL_SLOTS, TimerCount,
+                                      MB_POLL_TICK, Arena);
+    if(Ret != 0) {
+        return Ret;
+    }
 
-        while(!SdbShouldShutdown()) {
+    for(u32 t = 0; t < TimerCount; ++t) {
+        if(MbCtx->Conns[t / Conf->GroupCount].State != MbConn_Foreign) {
+            sdb_timediff Period = Conf->Groups[t % Conf->GroupCount].Period;
+            SdbTimerStart(&Sched->Wheel, t, Period, Period * t / TimerCount);
+        }
+    }
 
+    return 0;
+}
 
-            SdbAssert((SdbArenaGetPos(CurBuf) <= Pipe->BufferMaxFill),
-                      "Pipe buffer overflow in buffer %u", atomic_load(&Pipe->WriteBufIdx));
+/**
+ * @brief Starts or stops the timers of every group on one connection
+ *
+ * Used when a connection moves between workers, so a worker only runs the timers of the
+ * connections it owns.
+ */
+static void
+MbPollSchedSet(mb_poll_sched *Sched, mb_conn *Conn, bool Run)
+{
+    const mb_poll_conf *Conf = Conn->Poller->Conf;
+    for(u32 g = 0; g < Conf->GroupCount; ++g) {
+        u32 Timer = Conn->Idx * Conf->GroupCount + g;
+        if(Run) {
+            SdbTimerStart(&Sched->Wheel, Timer, Conf->Groups[g].Period, Conf->Groups[g].Period);
+        } else {
+            SdbTimerStop(&Sched->Wheel, Timer);
+        }
+    }
+}
 
-            if(SdbArenaGetPos(CurBuf) == Pipe->BufferMaxFill) {
-                CurBuf = SdPipeGetWriteBuffer(Pipe);
+/**
+ * @brief Hands off the data received so far on every route
+ *
+ * @param MbCtx Modbus context
+ */
+static void
+MbFlushRoutes(modbus_ctx *MbCtx)
+{
+    for(u64 r = 0; r < MbCtx->RouteCount; ++r) {
+        mb_route *Route = &MbCtx->Routes[r];
+        SdPipeFlush(Route->Pipe);
+        Route->CurBuf = SdPipeCurrentWriteBuffer(Route->Pipe);
+    }
+}
+
+/**
+ * @brief Hands off the partial buffer of one route if the pipe has a free buffer
+ *
+ * Never waits: with every buffer taken, the data stays in the current buffer until it fills up
+ * or the max latency flush timer finds it due. The pipe's current buffer is looked at rather
+ * than the route's, which is not kept for SdpFraming_Prefixed pipes.
+ */
+static void
+MbTryFlushRoute(mb_route *Route)
+{
+    if(SdbArenaGetPos(SdPipeCurrentWriteBuffer(Route->Pipe)) > 0
+       && SdPipeTryGetWriteBuffer(Route->Pipe) != NULL) {
+        Route->CurBuf = SdPipeCurrentWriteBuffer(Route->Pipe);
+    }
+}
+
+/**
+ * @brief Hands off the partial buffers of the routes a connection feeds, without waiting
+ *
+ * @param MbCtx Modbus context
+ * @param Conn Connection whose routes are flushed
+ */
+static void
+MbFlushConnRoutes(modbus_ctx *MbCtx, mb_conn *Conn)
+{
+    const mb_route_table *Table = Conn->Routes;
+    for(u32 u = 0; u < SdbArrayLen(Table->ByUnit); ++u) {
+        u16 Entry = Table->ByUnit[u];
+        if(Entry != MB_ROUTE_NONE && !(Entry & MB_ROUTE_BY_FUNCTION)) {
+            MbTryFlushRoute(&MbCtx->Routes[Entry]);
+        }
+    }
+
+    for(u32 t = 0; t < Table->FnTableCount; ++t) {
+        for(u32 f = 0; f < SdbArrayLen(Table->FnTables[t]); ++f) {
+            if(Table->FnTables[t][f] != MB_ROUTE_NONE) {
+                MbTryFlushRoute(&MbCtx->Routes[Table->FnTables[t][f]]);
             }
+        }
+    }
+}
+
+/**
+ * @brief Periodic check for partial buffers that have waited too long, and for elastic pipes
+ * that have buffers to retire
+ */
+typedef struct
+{
+    int          Fd;          /**< timerfd, -1 if no pipe has a max latency or can shrink */
+    sdb_timediff Interval;    /**< Time between checks */
+    u64          Expirations; /**< Read target of the timer */
+} mb_flush_timer;
+
+/**
+ * @brief Starts the flush timer at MB_FLUSH_CHECKS_PER_LATENCY checks per the lowest max latency
+ * of the worker's pipes, or per the lowest ShrinkAfter of its elastic pipes if that is lower
+ *
+ * @return 0 on success or if no pipe has a max latency or can shrink, negative on failure
+ */
+static sdb_errno
+MbFlushTimerInit(mb_flush_timer *Timer, modbus_ctx *MbCtx)
+{
+    Timer->Fd              = -1;
+    sdb_timediff MaxLatency = 0;
+    for(u64 r = 0; r < MbCtx->RouteCount; ++r) {
+        sensor_data_pipe *Pipe    = MbCtx->Routes[r].Pipe;
+        sdb_timediff      Latency = Pipe->MaxLatency;
+        if(Pipe->MinBufCount < Pipe->BufCount
+           && (Latency == 0 || Pipe->ShrinkAfter < Latency)) {
+            Latency = Pipe->ShrinkAfter;
+        }
+        if(Latency > 0 && (MaxLatency == 0 || Latency < MaxLatency)) {
+            MaxLatency = Latency;
+        }
+    }
+    if(MaxLatency == 0) {
+        return 0;
+    }
+
+    Timer->Interval = SdbMax(MaxLatency / MB_FLUSH_CHECKS_PER_LATENCY, 1);
+    Timer->Fd       = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(Timer->Fd == -1) {
+        SdbLogError("Failed to create flush timer: %s", strerror(errno));
+        return -errno;
+    }
+
+    struct itimerspec Spec = {
+        .it_interval = { .tv_sec  = SDB_TIME_TO_S(Timer->Interval),
+                        .tv_nsec = Timer->Interval % SDB_TIME_S(1) },
+    };
+    Spec.it_value = Spec.it_interval;
+    if(timerfd_settime(Timer->Fd, 0, &Spec, NULL) == -1) {
+        SdbLogError("Failed to start flush timer: %s", strerror(errno));
+        close(Timer->Fd);
+        Timer->Fd = -1;
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void
+MbFlushTimerDeinit(mb_flush_timer *Timer)
+{
+    if(Timer->Fd != -1) {
+        close(Timer->Fd);
+        Timer->Fd = -1;
+    }
+}
+
+/**
+ * @brief Hands off the partial buffers whose oldest data would be past its pipe's max latency
+ * by the next check, and lets elastic pipes that are not published to shrink. Called when the
+ * flush timer has expired
+ *
+ * @param MbCtx Modbus context
+ * @param Timer Flush timer
+ */
+static void
+MbFlushDueRoutes(modbus_ctx *MbCtx, mb_flush_timer *Timer)
+{
+    struct timespec Now;
+    SdbTimeNow(&Now);
+    u64 NowNs = SdbTimespecNs(&Now);
+    for(u64 r = 0; r < MbCtx->RouteCount; ++r) {
+        mb_route *Route = &MbCtx->Routes[r];
+        if(SdPipeFlushDue(Route->Pipe, NowNs, Timer->Interval)) {
+            Route->CurBuf = SdPipeCurrentWriteBuffer(Route->Pipe);
+        }
+        SdPipeShrinkIdle(Route->Pipe);
+    }
+}
+
+/**
+ * @brief Hands off the data received so far on the connection's routes and closes it
+ *
+ * The other connections keep filling their buffers, and a pipe without a free buffer is left
+ * to the flush timer, so a failing connection never stalls the worker. With several workers
+ * the connection is released, so the least loaded worker reopens it.
+ *
+ * @param MbCtx Modbus context
+ * @param Sched Poll scheduler, NULL if not polling
+ * @param Conn Connection to close
+ */
+static void
+MbDropConn(modbus_ctx *MbCtx, mb_poll_sched *Sched, mb_conn *Conn)
+{
+    MbFlushConnRoutes(MbCtx, Conn);
+    MbConnClose(MbCtx, Conn);
+    MbShardRelease(MbCtx, Conn);
+    if(Sched && Conn->State == MbConn_Foreign) {
+        MbPollSchedSet(Sched, Conn, false);
+    }
+}
+
+/**
+ * @brief Takes over released connections while this worker owns the fewest
+ *
+ * @param MbArena Arena of the worker
+ * @param MbCtx Modbus context
+ * @param Sched Poll scheduler, NULL if not polling
+ */
+static void
+MbClaimConns(sdb_arena *MbArena, modbus_ctx *MbCtx, mb_poll_sched *Sched)
+{
+    mb_conn *Conn;
+    while((Conn = MbShardClaim(MbArena, MbCtx)) != NULL) {
+        if(Sched) {
+            MbPollSchedSet(Sched, Conn, true);
+        }
+    }
+}
+
+/**
+ * @brief Logs the packet and byte counts of every route, and how its pipe coped with the load
+ *
+ * @param MbCtx Modbus context
+ */
+static void
+MbLogRoutes(modbus_ctx *MbCtx)
+{
+    u64 UnroutedCount = 0;
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        UnroutedCount += MbCtx->Conns[i].UnroutedCount;
+    }
+
+    for(u64 r = 0; r < MbCtx->RouteCount; ++r) {
+        mb_route *Route = &MbCtx->Routes[r];
+        SdbLogInfo("Worker %u, sensor %s: %lu packets, %lu bytes, %lu frames of the wrong size",
+                   MbCtx->Worker, Route->Name, Route->PacketCount, Route->ByteCount,
+                   Route->MismatchCount);
+
+        sensor_data_pipe *Pipe = Route->Pipe;
+        if(Pipe->FullCount > 0) {
+            SdbLogWarning("Worker %u, sensor %s: pipe found full %lu times, %lu packets dropped, "
+                          "%lu packets decimated, %lu packets spilled",
+                          MbCtx->Worker, Route->Name, Pipe->FullCount, Pipe->DroppedCount,
+                          Pipe->DecimatedCount, Pipe->SpilledCount);
+        }
+        if(Pipe->Region || Pipe->Pool) {
+            SdbLogInfo("Worker %u, sensor %s: %lu of %lu pipe buffers in use, %lu queued, grown by "
+                       "%lu buffers, shrunk %lu times",
+                       MbCtx->Worker, Route->Name, Pipe->ActiveCount, Pipe->BufCount,
+                       SdPipeQueuedCount(Pipe), Pipe->GrowCount, Pipe->ShrinkCount);
+        }
+        if(Pipe->PoolDryCount > 0) {
+            SdbLogWarning("Worker %u, sensor %s: buffer pool found empty %lu times",
+                          MbCtx->Worker, Route->Name, Pipe->PoolDryCount);
+        }
+    }
+    if(UnroutedCount > 0) {
+        SdbLogWarning("Worker %u: %lu frames matched no sensor", MbCtx->Worker, UnroutedCount);
+    }
+}
+
+/**
+ * @brief Logs how long the connections of the worker took to deliver data again after going
+ * down
+ */
+static void
+MbLogRecoveries(modbus_ctx *MbCtx)
+{
+    u64          RecoveryCount = 0;
+    sdb_timediff RecoveryTotal = 0;
+    sdb_timediff RecoveryMax   = 0;
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        mb_conn *Conn = &MbCtx->Conns[i];
+        RecoveryCount += Conn->RecoveryCount;
+        RecoveryTotal += Conn->RecoveryTotal;
+        RecoveryMax = SdbMax(RecoveryMax, Conn->RecoveryMax);
+    }
+
+    if(RecoveryCount > 0) {
+        sdb_timediff RecoveryAvg = RecoveryTotal / RecoveryCount;
+        SdbLogInfo("Worker %u: %lu reconnects, %lu us average and %lu us worst from going down "
+                   "to the first packet",
+                   MbCtx->Worker, RecoveryCount, SDB_TIME_TO_US(RecoveryAvg),
+                   SDB_TIME_TO_US(RecoveryMax));
+    }
+}
+
+/**
+ * @brief Timer wheel callback queueing the poll of one group on one connection
+ */
+static void
+MbPollDue(u32 Timer, void *Arg)
+{
+    mb_poll_sched *Sched      = Arg;
+    u32            GroupCount = Sched->MbCtx->Conns[0].Poller->Conf->GroupCount;
+    mb_conn       *Conn       = &Sched->MbCtx->Conns[Timer / GroupCount];
+
+    if(Conn->State != MbConn_Connected) {
+        return;
+    }
+
+    bool WasIdle = Conn->Poller->BacklogCount == 0;
+    if(MbPollQueue(Conn, Timer % GroupCount) && WasIdle) {
+        Sched->Ready[Sched->ReadyCount++] = Conn;
+    }
+}
+
+/**
+ * @brief Queues the polls that are due and sends them, one send call per connection
+ */
+static void
+MbPollTick(mb_poll_sched *Sched, struct timespec *Now)
+{
+    Sched->ReadyCount = 0;
+    SdbTimerWheelAdvance(&Sched->Wheel, Now, MbPollDue, Sched);
+
+    for(u64 r = 0; r < Sched->ReadyCount; ++r) {
+        mb_conn *Conn = Sched->Ready[r];
+        if(Conn->State == MbConn_Connected && MbPollSend(Conn, Now) < 0) {
+            MbDropConn(Sched->MbCtx, Sched, Conn);
+        }
+    }
+}
+
+/**
+ * @brief Gives up on unanswered polls and retries sends the socket did not accept
+ */
+static void
+MbPollSweep(modbus_ctx *MbCtx, mb_poll_sched *Sched, struct timespec *Now)
+{
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        mb_conn *Conn = &MbCtx->Conns[i];
+        if(Conn->State != MbConn_Connected) {
+            continue;
+        }
+
+        u64 Expired = MbPollExpire(Conn, Now);
+        if(Expired > 0) {
+            SdbLogWarning("%lu poll requests timed out on connection %lu", Expired, Conn->Idx);
+        }
+
+        if((Conn->Poller->BacklogCount > 0 || Conn->Poller->SendLen > 0)
+           && MbPollSend(Conn, Now) < 0) {
+            MbDropConn(MbCtx, Sched, Conn);
+        }
+    }
+}
+
+/**
+ * @brief Serves the connections with epoll
+ *
+ * Batches up to MB_EPOLL_BATCH readiness events per wakeup and drains each ready connection.
+ * When polling, the wait also ends at every scheduler tick so due polls go out on time.
+ * Connections are received straight into the pipe when configured to and every frame goes to
+ * the same route. The flush timer is registered with a NULL connection.
+ *
+ * @return 0 on shutdown, negative on failure
+ */
+static sdb_errno
+MbEpollLoop(mbpg_ctx *Ctx, modbus_ctx *MbCtx, sdb_arena *MbArena, mb_flush_timer *Flush,
+            u64 *PacketCount)
+{
+    bool      Poll     = Ctx->ModbusMode == MbMode_Poll;
+    mb_route *ZeroCopy = (Ctx->ModbusZeroCopy && !Poll) ? MbCtx->SoleRoute : NULL;
+    if(Ctx->ModbusZeroCopy && !ZeroCopy) {
+        SdbLogInfo("Frames are routed to several sensors, receiving through the connection "
+                   "buffers instead of straight into the pipe");
+    }
+
+    mb_poll_sched   Sched;
+    mb_poll_sched  *PollSched = Poll ? &Sched : NULL;
+    struct timespec NextSweep;
+    if(Poll) {
+        sdb_errno Ret = MbPollSchedInit(&Sched, MbCtx, &Ctx->ModbusPoll, MbArena);
+        if(Ret != 0) {
+            SdbLogError("Failed to initialize the poll scheduler");
+            return Ret;
+        }
+        SdbTimeMonotonic(&NextSweep);
+    }
 
+    if(Flush->Fd != -1) {
+        struct epoll_event Event = { .events = EPOLLIN, .data.ptr = NULL };
+        if(epoll_ctl(MbCtx->EpollFd, EPOLL_CTL_ADD, Flush->Fd, &Event) == -1) {
+            SdbLogError("Failed to add flush timer to epoll: %s", strerror(errno));
+            return -errno;
+        }
+    }
 
-            u8 Frame[MODBUS_TCP_FRAME_MAX_SIZE] = { 0 };
+    struct timespec NextStats;
+    SdbTimeMonotonic(&NextStats);
+    SdbTimeAdd(&NextStats, MB_ROUTE_STATS_INTERVAL);
 
-            /**< First receive just the header */
-            ssize_t HeaderResult = SocketRecvWithTimeout(Conn.SockFd, Frame, MODBUS_TCP_HEADER_LEN,
-                                                         SDB_TIME_MS(500));
+    u64 OpenedCount = 0;
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        if(MbCtx->Conns[i].State != MbConn_Foreign && MbConnOpen(MbCtx, &MbCtx->Conns[i]) == 0) {
+            ++OpenedCount;
+        }
+    }
+    SdbLogInfo("Worker %u: connecting %lu of %lu Modbus connections", MbCtx->Worker, OpenedCount,
+               MbCtx->OwnedCount);
 
-            if(HeaderResult == -2) {
+    struct epoll_event Events[MB_EPOLL_BATCH];
+    while(!SdbShouldShutdown()) {
+        int WaitMs = 100;
+        if(Poll) {
+            struct timespec Now;
+            SdbTimeMonotonic(&Now);
+            sdb_timediff UntilTick = SdbTimerWheelUntilNextTick(&Sched.Wheel, &Now);
+            UntilTick += SDB_TIME_MS(1) - 1; /**< Round up, so the wait never ends early */
+            WaitMs = SDB_TIME_TO_MS(UntilTick);
+        }
+
+        int EventCount = epoll_wait(MbCtx->EpollFd, Events, MB_EPOLL_BATCH, WaitMs);
+        if(EventCount == -1) {
+            if(errno == EINTR) {
                 continue;
             }
-            if(HeaderResult <= 0) {
-                goto reconnect;
+            SdbLogError("Epoll wait failed: %s", strerror(errno));
+            return -errno;
+        }
+
+        for(int e = 0; e < EventCount; ++e) {
+            mb_conn  *Conn     = Events[e].data.ptr;
+            sdb_errno ConnStat = 0;
+
+            if(Conn == NULL) {
+                if(read(Flush->Fd, &Flush->Expirations, sizeof(Flush->Expirations)) > 0) {
+                    MbFlushDueRoutes(MbCtx, Flush);
+                }
+                continue;
             }
-            if(HeaderResult != MODBUS_TCP_HEADER_LEN) {
-                SdbLogError("Incomplete header: %zd bytes", HeaderResult);
-                goto reconnect;
+
+            if(Conn->State == MbConn_Connecting) {
+                /**< Data that came with the handshake is read on the next wakeup */
+                MbConnFinishConnect(MbCtx, Conn);
+                continue;
             }
 
-            /**< Get the length from the header */
-            u16 Length = (Frame[4] << 8) | Frame[5];
-            if(Length > MODBUS_TCP_FRAME_MAX_SIZE - MODBUS_TCP_HEADER_LEN) {
-                SdbLogError("Invalid frame length: %u", Length);
-                goto reconnect;
+            if(Events[e].events & EPOLLIN) {
+                ConnStat = ZeroCopy ? MbHandleReadableZeroCopy(Conn, ZeroCopy, PacketCount)
+                                    : MbHandleReadable(MbCtx, Conn, PacketCount);
+            }
+            if(ConnStat == 0 && (Events[e].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+               && !(Events[e].events & EPOLLIN)) {
+                ConnStat = -SDBE_CONN_CLOSED_ERR;
             }
 
-            /**< Now receive the data portion */
-            ssize_t DataResult = SocketRecvWithTimeout(Conn.SockFd, Frame + MODBUS_TCP_HEADER_LEN,
-                                                       Length, SDB_TIME_MS(500));
+            if(ConnStat != 0) {
+                MbDropConn(MbCtx, PollSched, Conn);
+            }
+        }
 
-            if(DataResult != Length) {
-                SdbLogError("Incomplete data: %zd of %u bytes", DataResult, Length);
-                goto reconnect;
+        struct timespec Now;
+        SdbTimeMonotonic(&Now);
+        if(Poll) {
+            MbPollTick(&Sched, &Now);
+            if(SdbTimeoutExpired(&NextSweep, &Now)) {
+                MbPollSweep(MbCtx, &Sched, &Now);
+                NextSweep = Now;
+                SdbTimeAdd(&NextSweep, SDB_TIME_MS(100));
             }
+        }
+
+        MbClaimConns(MbArena, MbCtx, PollSched);
+        if(MbCtx->ConnectedCount < MbCtx->OwnedCount) {
+            MbReconnectDue(MbCtx, &Now);
+        }
+
+        if(SdbTimeoutExpired(&NextStats, &Now)) {
+            MbLogRoutes(MbCtx);
+            MbLogRecoveries(MbCtx);
+            NextStats = Now;
+            SdbTimeAdd(&NextStats, MB_ROUTE_STATS_INTERVAL);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Pushes the frames in one io_uring provided buffer to the pipes of their routes
+ *
+ * @return 0 if the connection is still healthy, negative if it must be closed
+ */
+static sdb_errno
+MbUringConsume(modbus_ctx *MbCtx, mb_conn *Conn, const u8 *Buf, u64 Len, u64 *PacketCount)
+{
+    MbConnGotData(Conn);
+
+    u64       Offset = 0;
+    const u8 *Frame;
+    i64       FrameLen;
+    while((FrameLen = MbConnNextFrameIn(Conn, Buf, Len, &Offset, &Frame)) > 0) {
+        sdb_errno Ret = MbRouteFrame(MbCtx, Conn, Frame, FrameLen, PacketCount);
+        if(Ret != 0) {
+            return Ret;
+        }
+    }
+
+    return FrameLen;
+}
+
+/**
+ * @brief Tag in the user data of the completion of a pending connect. Connections are at least
+ * 8 byte aligned, so the low bit of their address is free
+ */
+#define MB_URING_CONNECT_TAG 1
+
+/** @brief User data of the flush timer's read. No connection is at address 2 */
+#define MB_URING_FLUSH_TIMER 2
+
+/**
+ * @brief Message header of every multishot receive. It only sets how much room each completion
+ * leaves for control messages, which is enough for the SO_TIMESTAMPNS one
+ */
+static const struct msghdr MbUringRecvMsg = {
+    .msg_controllen = CMSG_SPACE(sizeof(struct timespec)),
+};
+
+/**
+ * @brief Gets the kernel receive time from a multishot receive's control messages
+ *
+ * @return Nanoseconds since the epoch, 0 if the completion has no SO_TIMESTAMPNS message
+ */
+static u64
+MbUringRecvStamp(struct io_uring_recvmsg_out *Out)
+{
+    struct msghdr   Control = SdbUringRecvmsgControl(Out, &MbUringRecvMsg);
+    struct cmsghdr *Cmsg    = CMSG_FIRSTHDR(&Control);
+    if(Cmsg && Cmsg->cmsg_level == SOL_SOCKET && Cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec Stamp;
+        SdbMemcpy(&Stamp, CMSG_DATA(Cmsg), sizeof(Stamp));
+        return SdbTimespecNs(&Stamp);
+    }
+    return 0;
+}
+
+/**
+ * @brief Gets a submission queue entry, submitting the queued ones if the queue is full
+ */
+static struct io_uring_sqe *
+MbUringGetSqe(sdb_uring *Ring)
+{
+    struct io_uring_sqe *Sqe = SdbUringGetSqe(Ring);
+    if(!Sqe) {
+        SdbUringSubmitAndWait(Ring, 0, SDB_TIMEOUT_NONE);
+        Sqe = SdbUringGetSqe(Ring);
+        if(!Sqe) {
+            SdbLogError("io_uring submission queue is full");
+        }
+    }
+
+    return Sqe;
+}
+
+/**
+ * @brief Queues a multishot receive on a connection
+ *
+ * A recvmsg rather than a recv, so every completion carries the kernel receive time of its data
+ * like the epoll backend's receives do.
+ *
+ * @return true if the request was queued
+ */
+static bool
+MbUringArmRecv(sdb_uring *Ring, mb_conn *Conn)
+{
+    struct io_uring_sqe *Sqe = MbUringGetSqe(Ring);
+    if(!Sqe) {
+        return false;
+    }
+
+    Sqe->opcode    = IORING_OP_RECVMSG;
+    Sqe->fd        = Conn->SockFd;
+    Sqe->addr      = (u64)(uintptr_t)&MbUringRecvMsg;
+    Sqe->len       = 1;
+    Sqe->ioprio    = IORING_RECV_MULTISHOT;
+    Sqe->flags     = IOSQE_BUFFER_SELECT;
+    Sqe->buf_group = MB_URING_BGID;
+    Sqe->user_data = (u64)(uintptr_t)Conn;
+    return true;
+}
 
-            u16       UnitId, DataLength;
-            const u8 *Data = MbParseTcpFrame(Frame, &UnitId, &DataLength);
+/**
+ * @brief Queues the first request of a newly opened connection: a receive if it is connected,
+ * or a one-shot wait for writability if its connect is pending
+ *
+ * @return true if the request was queued
+ */
+static bool
+MbUringArm(sdb_uring *Ring, mb_conn *Conn)
+{
+    if(Conn->State == MbConn_Connected) {
+        return MbUringArmRecv(Ring, Conn);
+    }
 
-            if(!Data) {
-                SdbLogError("Failed to parse frame");
-                goto reconnect;
+    struct io_uring_sqe *Sqe = MbUringGetSqe(Ring);
+    if(!Sqe) {
+        return false;
+    }
+
+    Sqe->opcode        = IORING_OP_POLL_ADD;
+    Sqe->fd            = Conn->SockFd;
+    Sqe->poll32_events = POLLOUT;
+    Sqe->user_data     = (u64)(uintptr_t)Conn | MB_URING_CONNECT_TAG;
+    return true;
+}
+
+/**
+ * @brief Queues a read of the flush timer's expiration count
+ *
+ * @return true if the request was queued
+ */
+static bool
+MbUringArmFlush(sdb_uring *Ring, mb_flush_timer *Flush)
+{
+    struct io_uring_sqe *Sqe = MbUringGetSqe(Ring);
+    if(!Sqe) {
+        return false;
+    }
+
+    Sqe->opcode    = IORING_OP_READ;
+    Sqe->fd        = Flush->Fd;
+    Sqe->addr      = (u64)(uintptr_t)&Flush->Expirations;
+    Sqe->len       = sizeof(Flush->Expirations);
+    Sqe->user_data = MB_URING_FLUSH_TIMER;
+    return true;
+}
+
+/**
+ * @brief Serves the connections with io_uring
+ *
+ * Each connection has one multishot receive outstanding, which keeps completing into buffers
+ * from the provided buffer ring without new submissions. All completions that are ready are
+ * handled per wakeup, so a single io_uring_enter call serves every connection. The payloads are
+ * copied from the provided buffers into the pipe, and the buffers go straight back to the ring.
+ *
+ * NOTE(ingar): The copy is deliberate. A receive holds frames for every route of its connection,
+ * each of which goes to another sensor's pipe, and the kernel picks the provided buffer before
+ * the frames are known, so a pipe buffer can not be handed to the kernel as a provided buffer.
+ * The copy is also where split frames are joined and frames of the wrong size are left out.
+ *
+ * A connection that fails is shut down, and closed when its receive has completed for the last
+ * time, so no completion can refer to a reused connection. The flush timer has a read of its own
+ * outstanding.
+ *
+ * @return 0 on shutdown, negative on failure
+ */
+static sdb_errno
+MbUringLoop(modbus_ctx *MbCtx, sdb_arena *MbArena, sdb_uring *Ring, sdb_uring_buf_ring *BufRing,
+            mb_flush_timer *Flush, u64 *PacketCount)
+{
+    struct timespec NextStats;
+    SdbTimeMonotonic(&NextStats);
+    SdbTimeAdd(&NextStats, MB_ROUTE_STATS_INTERVAL);
+
+    u64 OpenedCount = 0;
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        mb_conn *Conn = &MbCtx->Conns[i];
+        if(Conn->State != MbConn_Foreign && MbConnOpen(MbCtx, Conn) == 0) {
+            if(MbUringArm(Ring, Conn)) {
+                ++OpenedCount;
+            } else {
+                MbConnClose(MbCtx, Conn);
+            }
+        }
+    }
+    SdbLogInfo("Worker %u: connecting %lu of %lu Modbus connections", MbCtx->Worker, OpenedCount,
+               MbCtx->OwnedCount);
+
+    if(Flush->Fd != -1 && !MbUringArmFlush(Ring, Flush)) {
+        return -EBUSY;
+    }
+
+    while(!SdbShouldShutdown()) {
+        i64 Ret = SdbUringSubmitAndWait(Ring, 1, SDB_TIME_MS(100));
+        if(Ret < 0 && Ret != -ETIME && Ret != -EINTR && Ret != -EAGAIN && Ret != -EBUSY) {
+            SdbLogError("io_uring wait failed: %s", strerror(-Ret));
+            return Ret;
+        }
+
+        // NOTE(ingar): Only used for completions without a kernel receive time, e.g. if the socket
+        // could not enable SO_TIMESTAMPNS
+        struct timespec Reaped;
+        SdbTimeNow(&Reaped);
+        u64 ReapedNs = SdbTimespecNs(&Reaped);
+
+        u32                  Head;
+        u32                  Seen     = 0;
+        u32                  Recycled = 0;
+        struct io_uring_cqe *Cqe;
+        SdbUringForEachCqe(Ring, Head, Cqe)
+        {
+            ++Seen;
+            if(Cqe->user_data == MB_URING_FLUSH_TIMER) {
+                if(Cqe->res > 0) {
+                    MbFlushDueRoutes(MbCtx, Flush);
+                }
+                if(!MbUringArmFlush(Ring, Flush)) {
+                    SdbLogError("Failed to rearm the flush timer");
+                }
+                continue;
+            }
+
+            if(Cqe->user_data & MB_URING_CONNECT_TAG) {
+                mb_conn *Conn = (mb_conn *)(uintptr_t)(Cqe->user_data & ~MB_URING_CONNECT_TAG);
+                struct timespec Now;
+                SdbTimeMonotonic(&Now);
+                if(SdbTimeoutExpired(&Conn->ConnectDeadline, &Now)) {
+                    /**< Timed out, and the socket was shut down to end the wait */
+                    MbConnClose(MbCtx, Conn);
+                } else if(MbConnFinishConnect(MbCtx, Conn) == 0 && !MbUringArmRecv(Ring, Conn)) {
+                    MbConnClose(MbCtx, Conn);
+                }
+                continue;
             }
 
-            if(DataLength != Pipe->PacketSize) {
-                SdbLogError("Size mismatch: got %u expected %zu", DataLength, Pipe->PacketSize);
-                goto reconnect;
+            mb_conn *Conn = (mb_conn *)(uintptr_t)Cqe->user_data;
+
+            // NOTE(ingar): A receive's result counts the header, and it ends with an empty
+            // payload when the server closes the connection, so the payload length is used
+            i64 Res = Cqe->res;
+            if(Cqe->flags & IORING_CQE_F_BUFFER) {
+                u16                          Bid = Cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                u8                          *Buf = SdbUringBuf(BufRing, Bid);
+                struct io_uring_recvmsg_out *Out = SdbUringRecvmsgOut(Buf, Res, &MbUringRecvMsg);
+                Res = (Out != NULL) ? (i64)Out->payloadlen : -EMSGSIZE;
+                if(Res > 0 && Conn->State == MbConn_Connected) {
+                    u64 StampNs        = MbUringRecvStamp(Out);
+                    Conn->RecvStampNs  = (StampNs != 0) ? StampNs : ReapedNs;
+                    sdb_errno ConnStat = MbUringConsume(
+                        MbCtx, Conn, SdbUringRecvmsgPayload(Out, &MbUringRecvMsg), Res,
+                        PacketCount);
+                    if(ConnStat != 0) {
+                        /**< Ends the multishot receive; the connection is closed on its last CQE */
+                        shutdown(Conn->SockFd, SHUT_RDWR);
+                        Conn->State = MbConn_Closing;
+                    }
+                }
+                SdbUringBufRingAdd(BufRing, Bid);
+                ++Recycled;
             }
 
-            u8 *Ptr = SdbArenaPush(CurBuf, DataLength);
-            SdbMemcpy(Ptr, Data, DataLength);
+            if(!(Cqe->flags & IORING_CQE_F_MORE)) {
+                /**< The receive ended. It is rearmed unless the connection is gone */
+                bool Rearm = Conn->State == MbConn_Connected
+                          && (Res > 0 || Res == -ENOBUFS || Res == -EINTR);
+                if(Res == 0) {
+                    SdbLogWarning("Server closed connection %lu", Conn->Idx);
+                } else if(Res < 0 && !Rearm && Conn->State == MbConn_Connected) {
+                    SdbLogError("Recv failed on connection %lu: %s", Conn->Idx, strerror(-Res));
+                }
 
-            static int counter = 0;
-            if(++counter % 10000 == 0) {
-                SdbLogInfo("Received %d packets", counter);
+                if(!Rearm || !MbUringArmRecv(Ring, Conn)) {
+                    MbDropConn(MbCtx, NULL, Conn);
+                }
             }
         }
+        SdbUringCqAdvance(Ring, Seen);
+        if(Recycled > 0) {
+            SdbUringBufRingPublish(BufRing);
+        }
 
-reconnect:
-        SdPipeFlush(Pipe);
-        /**< Clean up current connection before retry */
-        for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
-            if(MbCtx->Conns[i].SockFd != -1) {
-                close(MbCtx->Conns[i].SockFd);
-                MbCtx->Conns[i].SockFd = -1;
+        struct timespec Now;
+        SdbTimeMonotonic(&Now);
+        MbClaimConns(MbArena, MbCtx, NULL);
+        if(MbCtx->ConnectedCount < MbCtx->OwnedCount) {
+            for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+                mb_conn *Conn = &MbCtx->Conns[i];
+                if(Conn->State == MbConn_Disconnected
+                   && SdbTimeoutExpired(&Conn->ReconnectAt, &Now) && MbConnOpen(MbCtx, Conn) == 0) {
+                    ++Conn->ReconnectCount;
+                    if(!MbUringArm(Ring, Conn)) {
+                        MbConnClose(MbCtx, Conn);
+                    }
+                } else if(Conn->State == MbConn_Connecting
+                          && SdbTimeoutExpired(&Conn->ConnectDeadline, &Now)) {
+                    /**< Ends the pending wait; the connection is closed on its completion */
+                    shutdown(Conn->SockFd, SHUT_RDWR);
+                }
             }
         }
 
-        if(!SdbShouldShutdown()) {
-            SdbLogInfo("Will attempt reconnection in 1 second");
-            usleep(1000000); /**< Wait 1 second before retry */
+        if(SdbTimeoutExpired(&NextStats, &Now)) {
+            MbLogRoutes(MbCtx);
+            MbLogRecoveries(MbCtx);
+            NextStats = Now;
+            SdbTimeAdd(&NextStats, MB_ROUTE_STATS_INTERVAL);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Waits until the Postgres writers have released the buffers replayed from the pipe
+ * files of a lane, so the data of a crashed run is stored before any new data
+ *
+ * Returns early on shutdown.
+ */
+static void
+MbAwaitReplay(sensor_data_pipe **Lane, u64 PipeCount, u32 Worker)
+{
+    u64 ReplayCount = 0;
+    for(u64 p = 0; p < PipeCount; ++p) {
+        ReplayCount += SdPipeReplayed(Lane[p]) ? 0 : Lane[p]->ReplayCount;
+    }
+    if(ReplayCount == 0) {
+        return;
+    }
+
+    SdbLogInfo("Modbus worker %u waiting for %lu replayed buffers to be stored", Worker,
+               ReplayCount);
+    for(u64 p = 0; p < PipeCount; ++p) {
+        while(!SdPipeReplayed(Lane[p])) {
+            if(SdbShouldShutdown()) {
+                return;
+            }
+            SdbSleep(SDB_TIME_MS(10));
         }
     }
+    SdbLogInfo("Modbus worker %u: replay done, starting ingest", Worker);
+}
+
+/**
+ * @brief Implements main Modbus thread loop
+ *
+ * Serves the worker's share of the configured Modbus connections from a single thread:
+ * - Opens all connections and serves them with the configured backend. The io_uring backend
+ *   falls back to epoll if the kernel does not support it
+ * - Closes a failing connection and reopens it on its own schedule, without affecting the
+ *   other connections. With several workers, the connection is reopened by the worker that owns
+ *   the fewest connections
+ * - In poll mode, sends read register requests on a timer wheel schedule, keeping several
+ *   requests outstanding on each connection
+ * - Manages graceful shutdown
+ *
+ * Data processing:
+ * - Parses Modbus TCP frames
+ * - Routes each frame by connection, unit id and function code to the pipe of its sensor in
+ *   the worker's lane
+ * - Validates data length and format
+ * - Manages buffer rotation
+ * - Handles pipeline flushing
+ *
+ * @param Arg Pointer to mbpg_ctx structure
+ * @return sdb_errno Success/error status
+ */
+sdb_errno
+MbRun(void *Arg, u32 Worker)
+{
+    sdb_errno Ret = 0;
+    mbpg_ctx *Ctx = Arg;
+
+    sdb_arena MbArena;
+    u64       MbASize = Ctx->ModbusMemSize + MB_SCRATCH_COUNT * Ctx->ModbusScratchSize;
+    sdb_pages MbPages;
+    if(SdbPagesMap(&MbPages, MbASize, &Ctx->MemOpts) != 0) {
+        SdbLogError("Failed to map the Modbus arena");
+        SdbBarrierWait(&Ctx->Barrier);
+        return -ENOMEM;
+    }
+    SdbArenaInit(&MbArena, MbPages.Mem, MbASize);
+
+    MbThreadArenasInit();
+    SdbThreadArenasInitExtern(Modbus);
+    for(u64 s = 0; s < MB_SCRATCH_COUNT; ++s) {
+        sdb_arena *Scratch = SdbArenaBootstrap(&MbArena, NULL, Ctx->ModbusScratchSize);
+        SdbThreadArenasAdd(Scratch);
+    }
+
+    mb_shard_table *Shards = (Ctx->ModbusWorkerCount > 1) ? &Ctx->ModbusShards : NULL;
+    modbus_ctx     *MbCtx  = MbPrepareCtx(&MbArena, Ctx->ModbusConnCount, Shards, Worker);
+    if(!MbCtx) {
+        SdbLogError("Failed to prepare Modbus context");
+        SdbBarrierWait(&Ctx->Barrier);
+        SdbPagesUnmap(&MbPages);
+        return -1;
+    }
+
+    // NOTE(ingar): The other workers only touch the shard table after the barrier
+    if(Shards && Worker == 0 && MbShardsInit(Shards, MbCtx->ConnCount) != 0) {
+        SdbLogWarning("Insufficient memory for the shard table. Connections will not be "
+                      "rebalanced between the Modbus workers");
+    }
+
+    if(Ctx->ModbusMode == MbMode_Poll && MbPollInit(&MbArena, MbCtx, &Ctx->ModbusPoll) != 0) {
+        SdbLogError("Failed to prepare Modbus polling");
+        MbDestroyCtx(MbCtx);
+        SdbBarrierWait(&Ctx->Barrier);
+        SdbPagesUnmap(&MbPages);
+        return -ENOMEM;
+    }
+
+    sensor_data_pipe **Lane = &Ctx->SdPipes[Worker * Ctx->SensorCount];
+    if(MbRoutesInit(&MbArena, MbCtx, Ctx->ModbusRoutes, Lane, Ctx->SensorCount) != 0) {
+        SdbLogError("Failed to prepare Modbus routes");
+        MbDestroyCtx(MbCtx);
+        SdbBarrierWait(&Ctx->Barrier);
+        SdbPagesUnmap(&MbPages);
+        return -ENOMEM;
+    }
+
+    sdb_uring          Ring;
+    sdb_uring_buf_ring BufRing;
+    bool               UseUring = false;
+    if(Ctx->ModbusBackend == MbBackend_IoUring && Ctx->ModbusMode == MbMode_Poll) {
+        SdbLogWarning("Polling is only supported by the epoll backend, falling back to epoll");
+    } else if(Ctx->ModbusBackend == MbBackend_IoUring) {
+        if(SdbUringInit(&Ring, MB_URING_ENTRIES) == 0) {
+            if(SdbUringBufRingInit(&Ring, &BufRing, MB_URING_BGID, MB_URING_BUF_COUNT,
+                                   MB_URING_BUF_SIZE)
+               == 0) {
+                UseUring = true;
+                close(MbCtx->EpollFd);
+                MbCtx->EpollFd = -1;
+            } else {
+                SdbUringDeinit(&Ring);
+            }
+        }
+
+        if(!UseUring) {
+            SdbLogWarning("io_uring backend is not supported by the kernel, falling back to epoll");
+        }
+    }
+
+    SdbLogInfo("Modbus worker %u successfully initialized. Waiting for other threads at barrier",
+               Worker);
+    SdbBarrierWait(&Ctx->Barrier);
+    SdbLogInfo("Exited barrier. Starting main loop using %s", UseUring ? "io_uring" : "epoll");
+    MbAwaitReplay(Lane, Ctx->SensorCount, Worker);
+
+    u64            PacketCount = 0;
+    mb_flush_timer Flush;
+    Ret = MbFlushTimerInit(&Flush, MbCtx);
+    if(Ret != 0) {
+        SdbLogWarning("Partial buffers are only handed off when full");
+        Ret = 0;
+    }
+
+    if(UseUring) {
+        Ret = MbUringLoop(MbCtx, &MbArena, &Ring, &BufRing, &Flush, &PacketCount);
+        SdbUringDeinit(&Ring);
+        SdbUringBufRingDeinit(&Ring, &BufRing);
+    } else {
+        Ret = MbEpollLoop(Ctx, MbCtx, &MbArena, &Flush, &PacketCount);
+    }
+    MbFlushTimerDeinit(&Flush);
+
+    MbFlushRoutes(MbCtx);
+    MbLogRoutes(MbCtx);
+    MbLogRecoveries(MbCtx);
+
+    u64       RecvCount = 0;
+    mb_poller Polled    = { 0 };
+    for(u64 i = 0; i < MbCtx->ConnCount; ++i) {
+        mb_conn *Conn = &MbCtx->Conns[i];
+        RecvCount += Conn->RecvCount;
+        if(Conn->Poller) {
+            Polled.RequestCount += Conn->Poller->RequestCount;
+            Polled.ResponseCount += Conn->Poller->ResponseCount;
+            Polled.ExceptionCount += Conn->Poller->ExceptionCount;
+            Polled.TimeoutCount += Conn->Poller->TimeoutCount;
+            Polled.OverrunCount += Conn->Poller->OverrunCount;
+            Polled.StaleCount += Conn->Poller->StaleCount;
+        }
+    }
+    if(Ctx->ModbusMode == MbMode_Poll) {
+        SdbLogInfo("Modbus worker %u polling: %lu requests, %lu responses, %lu exceptions, %lu timeouts, "
+                   "%lu late responses, %lu polls skipped while pending",
+                   Worker, Polled.RequestCount, Polled.ResponseCount, Polled.ExceptionCount,
+                   Polled.TimeoutCount, Polled.StaleCount, Polled.OverrunCount);
+    }
+    MbDestroyCtx(MbCtx);
+    if(UseUring) {
+        SdbLogInfo("Modbus worker %u received %lu packets in total", Worker, PacketCount);
+    } else {
+        SdbLogInfo("Modbus worker %u received %lu packets in total using %lu recv calls (%.3f per "
+                   "packet)",
+                   Worker, PacketCount, RecvCount,
+                   (PacketCount > 0) ? (double)RecvCount / PacketCount : 0.0);
+    }
 
-    free(MbAMem);
+    SdbPagesUnmap(&MbPages);
     return Ret;
 }
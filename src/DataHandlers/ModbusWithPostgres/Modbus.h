@@ -31,12 +31,13 @@ sdb_errno MbPipeThroughputTest(void *Arg);
  * - Manages connection lifecycle
  * - Handles data reception and parsing
  * - Implements reconnection logic
- * - pushes data to the sensor data pipe
+ * - pushes data to the sensor data pipes of its lane
  * - Manages graceful shutdown
  *
  * @param Arg Pointer to mbpg_ctx structure
+ * @param Worker Index of the ingest worker, which selects its connections and pipe lane
  * @return sdb_errno 0 on success, error code on failure
  */
-sdb_errno MbRun(void *Arg);
+sdb_errno MbRun(void *Arg, u32 Worker);
 
 #endif
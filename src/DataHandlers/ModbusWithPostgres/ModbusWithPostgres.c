@@ -11,14 +11,18 @@ SDB_LOG_REGISTER(MbWithPg);
 #include <src/Common/SensorDataPipe.h>
 #include <src/Common/ThreadGroup.h>
 #include <src/DataHandlers/DataHandlers.h>
+#include <src/DataHandlers/ModbusWithPostgres/Archive.h>
 #include <src/DataHandlers/ModbusWithPostgres/Modbus.h>
 #include <src/DataHandlers/ModbusWithPostgres/ModbusWithPostgres.h>
 #include <src/DataHandlers/ModbusWithPostgres/Postgres.h>
+#include <src/DatabaseSystems/DatabaseInitializer.h>
 #include <src/DevUtils/ModbusTestServer.h>
 
 #include <src/Libs/cJSON/cJSON.h>
 
+#include <limits.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include <src/Signals.h>
 
 
@@ -34,10 +38,14 @@ SDB_LOG_REGISTER(MbWithPg);
 void *
 PgThread(void *Arg)
 {
+    mbpg_ctx *Ctx    = Arg;
+    u32       Writer = atomic_fetch_add(&Ctx->NextPgWriter, 1);
 
-    pthread_setname_np(pthread_self(), "postgres-thread");
+    char ThreadName[16];
+    snprintf(ThreadName, sizeof(ThreadName), "pg-writer-%u", Writer);
+    pthread_setname_np(pthread_self(), ThreadName);
 
-    sdb_errno Ret = PgRun(Arg);
+    sdb_errno Ret = PgRun(Arg, Writer);
     if(Ret != 0) {
         SdbLogError("Postgres thread exited with error code %d (%s)", Ret, SdbStrErr(Ret));
     }
@@ -51,7 +59,8 @@ PgThread(void *Arg)
  * @brief Modbus thread implementation
  *
  * Sets thread name and runs Modbus operations. Handles errors
- * and performs graceful shutdown.
+ * and performs graceful shutdown. Every Modbus thread of a group runs this, and each takes the
+ * next worker index.
  *
  * @param Arg Pointer to mbpg_ctx structure
  * @return NULL
@@ -59,9 +68,14 @@ PgThread(void *Arg)
 void *
 MbThread(void *Arg)
 {
-    pthread_setname_np(pthread_self(), "modbus-thread");
+    mbpg_ctx *Ctx    = Arg;
+    u32       Worker = atomic_fetch_add(&Ctx->NextWorker, 1);
+
+    char ThreadName[16];
+    snprintf(ThreadName, sizeof(ThreadName), "modbus-thread-%u", Worker);
+    pthread_setname_np(pthread_self(), ThreadName);
 
-    sdb_errno Ret = MbRun(Arg);
+    sdb_errno Ret = MbRun(Arg, Worker);
     if(Ret != 0) {
         SdbLogError("Modbus thread exited with error code %d (%s)", Ret, SdbStrErr(Ret));
     }
@@ -71,6 +85,30 @@ MbThread(void *Arg)
 }
 
 
+/**
+ * @brief Archive thread implementation
+ *
+ * Sets thread name and runs the archive of the pipes. Handles errors
+ * and performs graceful shutdown.
+ *
+ * @param Arg Pointer to mbpg_ctx structure
+ * @return NULL
+ */
+void *
+MbPgArchiveThread(void *Arg)
+{
+    pthread_setname_np(pthread_self(), "pipe-archive");
+
+    sdb_errno Ret = MbPgArchiveRun(Arg);
+    if(Ret != 0) {
+        SdbLogError("Archive thread exited with error code %d (%s)", Ret, SdbStrErr(Ret));
+    }
+
+    SdbLogInfo("Archive thread shutting down");
+    return NULL;
+}
+
+
 /**
  * @brief Modbus test server thread
  *
@@ -86,7 +124,16 @@ MbPgTestServer(void *Arg)
     pthread_setname_np(pthread_self(), "modbus-test-server-thread");
     mbpg_ctx *Ctx = Arg;
 
-    RunModbusTestServer(&Ctx->Barrier);
+    if(Ctx->ModbusMode == MbMode_Poll) {
+        mb_test_server_conf Conf = {
+            .MaxClients    = SdbMax(Ctx->ModbusConnCount, 1),
+            .FramesPerSend = MB_POLL_MAX_IN_FLIGHT,
+            .Respond       = true,
+        };
+        MbTestServerRun(&Ctx->Barrier, &Conf);
+    } else {
+        RunModbusTestServer(&Ctx->Barrier, Ctx->ModbusConnCount);
+    }
 
     SdbLogInfo("Modbus test server thread shutting down");
     return NULL;
@@ -145,18 +192,386 @@ GetMemAndScratchSize(cJSON *Conf, u64 *MemSize, u64 *ScratchSize)
     *ScratchSize = SdbMemSizeFromString(cJSON_GetStringValue(ScratchSizeObj));
 }
 
+/**
+ * @brief Parses the polling configuration of the Modbus section
+ *
+ * Example:
+ * ~~~~~~~~
+ * "poll": {
+ *   "max_in_flight": 8,
+ *   "timeout": "1s",
+ *   "groups": [
+ *     { "unit_id": 1, "function": 3, "address": 0, "count": 24, "period": "10ms" }
+ *   ]
+ * }
+ * ~~~~~~~~
+ *
+ * @param[in] PollConf JSON poll object
+ * @param[out] Poll Parsed configuration
+ * @param[in] A Arena the groups are allocated from
+ * @return 0 on success, -EINVAL if the configuration is invalid
+ */
+static sdb_errno
+MbPgParsePollConf(cJSON *PollConf, mb_poll_conf *Poll, sdb_arena *A)
+{
+    cJSON *MaxInFlightObj = cJSON_GetObjectItem(PollConf, "max_in_flight");
+    cJSON *TimeoutObj     = cJSON_GetObjectItem(PollConf, "timeout");
+    cJSON *GroupsObj      = cJSON_GetObjectItem(PollConf, "groups");
+
+    Poll->MaxInFlight = cJSON_IsNumber(MaxInFlightObj) ? cJSON_GetNumberValue(MaxInFlightObj) : 4;
+    if(Poll->MaxInFlight < 1 || Poll->MaxInFlight > MB_POLL_MAX_IN_FLIGHT) {
+        SdbLogError("\"max_in_flight\" must be between 1 and %d", MB_POLL_MAX_IN_FLIGHT);
+        return -EINVAL;
+    }
+
+    Poll->Timeout = cJSON_IsString(TimeoutObj)
+                      ? SdbTimeFromString(cJSON_GetStringValue(TimeoutObj))
+                      : MB_POLL_TIMEOUT;
+    if(Poll->Timeout == 0) {
+        SdbLogError("Invalid poll \"timeout\"");
+        return -EINVAL;
+    }
+
+    Poll->GroupCount = cJSON_GetArraySize(GroupsObj);
+    if(!cJSON_IsArray(GroupsObj) || Poll->GroupCount == 0) {
+        SdbLogError("Polling requires at least one entry in \"groups\"");
+        return -EINVAL;
+    }
+
+    Poll->Groups = SdbPushArray(A, mb_poll_group, Poll->GroupCount);
+    if(!Poll->Groups) {
+        return -ENOMEM;
+    }
+
+    u32    g = 0;
+    cJSON *GroupObj;
+    cJSON_ArrayForEach(GroupObj, GroupsObj)
+    {
+        mb_poll_group *Group = &Poll->Groups[g];
+        cJSON         *UnitIdObj   = cJSON_GetObjectItem(GroupObj, "unit_id");
+        cJSON         *FunctionObj = cJSON_GetObjectItem(GroupObj, "function");
+        cJSON         *AddressObj  = cJSON_GetObjectItem(GroupObj, "address");
+        cJSON         *CountObj    = cJSON_GetObjectItem(GroupObj, "count");
+        cJSON         *PeriodObj   = cJSON_GetObjectItem(GroupObj, "period");
+
+        Group->UnitId   = cJSON_IsNumber(UnitIdObj) ? cJSON_GetNumberValue(UnitIdObj) : 1;
+        Group->Function = cJSON_IsNumber(FunctionObj) ? cJSON_GetNumberValue(FunctionObj)
+                                                      : MODBUS_READ_HOLDING_REGISTERS;
+        Group->Address  = cJSON_GetNumberValue(AddressObj);
+        Group->Quantity = cJSON_GetNumberValue(CountObj);
+        Group->Period   = SdbTimeFromString(cJSON_GetStringValue(PeriodObj));
+
+        if(Group->Function != MODBUS_READ_HOLDING_REGISTERS
+           && Group->Function != MODBUS_READ_INPUT_REGISTERS) {
+            SdbLogError("Poll group %u: \"function\" must be 3 or 4", g);
+            return -EINVAL;
+        }
+        if(Group->Quantity < 1 || Group->Quantity > MODBUS_READ_MAX_REGISTERS) {
+            SdbLogError("Poll group %u: \"count\" must be between 1 and %d", g,
+                        MODBUS_READ_MAX_REGISTERS);
+            return -EINVAL;
+        }
+        if(Group->Period == 0) {
+            SdbLogError("Poll group %u: invalid \"period\"", g);
+            return -EINVAL;
+        }
+
+        ++g;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reads an optional integer field of a route
+ *
+ * @return The value, -1 if the field is missing, or -2 if it is outside [Min, Max]
+ */
+static i64
+MbPgRouteField(cJSON *RouteConf, const char *Field, i64 Min, i64 Max)
+{
+    cJSON *Obj = cJSON_GetObjectItem(RouteConf, Field);
+    if(!Obj) {
+        return -1;
+    }
+
+    double Value = cJSON_GetNumberValue(Obj);
+    if(!cJSON_IsNumber(Obj) || Value < Min || Value > Max || Value != (i64)Value) {
+        return -2;
+    }
+    return Value;
+}
+
+/**
+ * @brief Reads a "backpressure" setting
+ *
+ * @param Obj The setting, or NULL to keep the current policy
+ * @param[out] Policy Policy set by the setting
+ * @return 0 on success, -EINVAL for an unknown policy
+ */
+static sdb_errno
+MbPgParsePolicy(cJSON *Obj, sdp_policy *Policy)
+{
+    if(!Obj) {
+        return 0;
+    }
+
+    char *Name = cJSON_GetStringValue(Obj);
+    if(Name == NULL) {
+        Name = "";
+    }
+    if(strcmp(Name, "block") == 0) {
+        *Policy = SdpPolicy_Block;
+    } else if(strcmp(Name, "drop_oldest") == 0) {
+        *Policy = SdpPolicy_DropOldest;
+    } else if(strcmp(Name, "drop_newest") == 0) {
+        *Policy = SdpPolicy_DropNewest;
+    } else if(strcmp(Name, "decimate") == 0) {
+        *Policy = SdpPolicy_Decimate;
+    } else if(strcmp(Name, "spill") == 0) {
+        *Policy = SdpPolicy_Spill;
+    } else {
+        SdbLogError("Unknown \"backpressure\" \"%s\". Valid policies are \"block\", "
+                    "\"drop_oldest\", \"drop_newest\", \"decimate\" and \"spill\"",
+                    Name);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Resolves the "into" of every sensor's "modbus" object, and makes the pipes that take
+ * other sensors' frames SdpFraming_Prefixed
+ *
+ * A sensor can only go into a sensor that goes into no other, so records are never passed on.
+ *
+ * @return 0 on success, -EINVAL if a sensor names itself, an unknown sensor or one that goes
+ * into another
+ */
+static sdb_errno
+MbPgResolveInto(mbpg_ctx *Ctx, cJSON *Sensors)
+{
+    u64    SensorIdx = 0;
+    cJSON *Sensor;
+    cJSON_ArrayForEach(Sensor, Sensors)
+    {
+        mb_route_conf *Route = &Ctx->ModbusRoutes[SensorIdx];
+        cJSON *Into = cJSON_GetObjectItem(cJSON_GetObjectItem(Sensor, "modbus"), "into");
+        char  *Name = cJSON_GetStringValue(Into);
+        if(Into && Name == NULL) {
+            SdbLogError("Sensor %s: \"into\" must be the name of a sensor", Route->Name);
+            return -EINVAL;
+        }
+        for(u64 s = 0; Name && s < Ctx->SensorCount; ++s) {
+            if(strcmp(Name, Ctx->ModbusRoutes[s].Name) == 0) {
+                Route->Into = s;
+                break;
+            }
+        }
+        if(Name && (Route->Into == -1 || Route->Into == (i64)SensorIdx)) {
+            SdbLogError("Sensor %s: \"into\" names %s, which is not another sensor", Route->Name,
+                        Name);
+            return -EINVAL;
+        }
+        ++SensorIdx;
+    }
+
+    for(u64 s = 0; s < Ctx->SensorCount; ++s) {
+        i64 Into = Ctx->ModbusRoutes[s].Into;
+        if(Into == -1) {
+            continue;
+        }
+        if(Ctx->ModbusRoutes[Into].Into != -1) {
+            SdbLogError("Sensor %s goes into %s, which goes into another sensor",
+                        Ctx->ModbusRoutes[s].Name, Ctx->ModbusRoutes[Into].Name);
+            return -EINVAL;
+        }
+        for(u32 w = 0; w < Ctx->ModbusWorkerCount; ++w) {
+            Ctx->SdPipes[w * Ctx->SensorCount + Into]->Framing = SdpFraming_Prefixed;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Creates one pipe per sensor in sensor_schemas.json and Modbus worker, and reads which
+ * Modbus frames go to each sensor
+ *
+ * Every worker has its own lane of pipes, one per sensor, so the workers never write to the same
+ * pipe.
+ *
+ * Each sensor can have a "modbus" object telling which connection, unit id and function code
+ * its frames come with. A missing field matches any value, and a sensor without the object
+ * gets every frame no other sensor matches more closely.
+ *
+ * Example:
+ * ~~~~~~~~
+ * { "name": "shaft_power", "modbus": { "unit_id": 1, "function": 3, "conn": 0 }, "data": {...} }
+ * ~~~~~~~~
+ *
+ * With "into" naming another sensor, the frames go into that sensor's pipes as length prefixed
+ * records of their own schema, so low rate sensors can share a pipe instead of each filling
+ * buffers of their own. Each record is still inserted into the table of its own sensor.
+ *
+ * A sensor's "backpressure" overrides the one of the "pipe" section for the sensor's pipes.
+ * Pipes that spill get the file <spill dir>/<sensor>-<worker>.spill. With a "tap_dir", every
+ * pipe gets a lossy tap for the archive thread.
+ *
+ * @param Ctx Context the pipes and routes are stored in
+ * @param BufCount Buffer count of each pipe
+ * @param BufSize Buffer size of each pipe
+ * @param A Arena the pipe and route arrays are allocated from
+ * @return 0 on success, negative on failure
+ */
+static sdb_errno
+MbPgCreateSensorPipes(mbpg_ctx *Ctx, u64 BufCount, u64 BufSize, sdb_arena *A)
+{
+    sdb_errno Ret        = 0;
+    cJSON    *SchemaConf = DbInitGetConfFromFile("./configs/sensor_schemas.json", NULL);
+    cJSON    *Sensors    = cJSON_GetObjectItem(SchemaConf, "sensors");
+    if(!cJSON_IsArray(Sensors) || cJSON_GetArraySize(Sensors) == 0) {
+        SdbLogError("The sensor schemas must have at least one entry in \"sensors\"");
+        cJSON_Delete(SchemaConf);
+        return -SDBE_JSON_ERR;
+    }
+
+    Ctx->SensorCount  = cJSON_GetArraySize(Sensors);
+    Ctx->SdPipeCount  = Ctx->SensorCount * Ctx->ModbusWorkerCount;
+    Ctx->SdPipes      = SdbPushArrayZero(A, sensor_data_pipe *, Ctx->SdPipeCount);
+    Ctx->PipeTaps     = SdbPushArrayZero(A, sdp_tap *, Ctx->SdPipeCount);
+    Ctx->ModbusRoutes = SdbPushArray(A, mb_route_conf, Ctx->SensorCount);
+    if(!Ctx->SdPipes || !Ctx->PipeTaps || !Ctx->ModbusRoutes) {
+        cJSON_Delete(SchemaConf);
+        return -ENOMEM;
+    }
+
+    u64    SensorIdx = 0;
+    cJSON *Sensor;
+    cJSON_ArrayForEach(Sensor, Sensors)
+    {
+        mb_route_conf *Route     = &Ctx->ModbusRoutes[SensorIdx];
+        cJSON         *RouteConf = cJSON_GetObjectItem(Sensor, "modbus");
+        char          *Name      = cJSON_GetStringValue(cJSON_GetObjectItem(Sensor, "name"));
+
+        Route->Name     = SdbStringMake(A, Name ? Name : "unnamed");
+        Route->Conn     = MbPgRouteField(RouteConf, "conn", 0, INT32_MAX);
+        Route->UnitId   = MbPgRouteField(RouteConf, "unit_id", 0, 255);
+        Route->Function = MbPgRouteField(RouteConf, "function", 1, 127);
+        Route->Into     = -1;
+        if(Route->Conn == -2 || Route->UnitId == -2 || Route->Function == -2) {
+            SdbLogError("Sensor %s: \"conn\" must be a connection index, \"unit_id\" between 0 "
+                        "and 255 and \"function\" between 1 and 127",
+                        Route->Name);
+            Ret = -EINVAL;
+            break;
+        }
+
+        sdp_policy Policy = Ctx->PipePolicy;
+        if(MbPgParsePolicy(cJSON_GetObjectItem(Sensor, "backpressure"), &Policy) != 0) {
+            SdbLogError("Sensor %s has an invalid \"backpressure\"", Route->Name);
+            Ret = -EINVAL;
+            break;
+        }
+        if(Ctx->PipePersistDir
+           && (Policy == SdpPolicy_DropOldest || Policy == SdpPolicy_Spill)) {
+            SdbLogError("Sensor %s: persistent pipes cannot use \"drop_oldest\" or \"spill\"",
+                        Route->Name);
+            Ret = -EINVAL;
+            break;
+        }
+        if(Ctx->PipeTapDir && Policy == SdpPolicy_DropOldest) {
+            SdbLogError("Sensor %s: archived pipes cannot use \"drop_oldest\"", Route->Name);
+            Ret = -EINVAL;
+            break;
+        }
+
+        for(u32 w = 0; w < Ctx->ModbusWorkerCount; ++w) {
+            u64 PipeIdx = w * Ctx->SensorCount + SensorIdx;
+            if(Ctx->PipePersistDir) {
+                char Path[PATH_MAX];
+                snprintf(Path, sizeof(Path), "%s/%s-%u.pipe", Ctx->PipePersistDir, Route->Name, w);
+                Ctx->SdPipes[PipeIdx]
+                    = SdpCreatePersistent(BufCount, BufSize, SdbStringMake(A, Path),
+                                          &Ctx->MemOpts, NULL);
+            } else if(Ctx->PipePool) {
+                Ctx->SdPipes[PipeIdx]
+                    = SdpCreatePooled(BufCount, Ctx->PipeMaxBufCount, Ctx->PipePool, NULL);
+            } else {
+                Ctx->SdPipes[PipeIdx]
+                    = SdpCreateElastic(BufCount, Ctx->PipeMaxBufCount, BufSize, &Ctx->MemOpts,
+                                       NULL);
+            }
+            if(!Ctx->SdPipes[PipeIdx]) {
+                Ret = -ENOMEM;
+                break;
+            }
+            Ctx->SdPipes[PipeIdx]->SchemaId     = SensorIdx;
+            Ctx->SdPipes[PipeIdx]->MaxLatency   = Ctx->PipeMaxLatency;
+            Ctx->SdPipes[PipeIdx]->Policy       = Policy;
+            Ctx->SdPipes[PipeIdx]->DecimateStep = Ctx->PipeDecimateStep;
+            Ctx->SdPipes[PipeIdx]->ShrinkAfter  = Ctx->PipeShrinkAfter;
+            Ctx->SdPipes[PipeIdx]->PersistSync  = Ctx->PipePersistSync;
+
+            if(Policy == SdpPolicy_Spill) {
+                if(mkdir(Ctx->PipeSpillDir, 0755) == -1 && errno != EEXIST) {
+                    SdbLogError("Failed to create spill directory %s: %s", Ctx->PipeSpillDir,
+                                strerror(errno));
+                    Ret = -errno;
+                    break;
+                }
+
+                char Path[PATH_MAX];
+                snprintf(Path, sizeof(Path), "%s/%s-%u.spill", Ctx->PipeSpillDir, Route->Name, w);
+                Ret = SdpSpillInit(Ctx->SdPipes[PipeIdx], SdbStringMake(A, Path),
+                                   Ctx->PipeSpillSize);
+                if(Ret != 0) {
+                    break;
+                }
+            }
+
+            if(Ctx->PipeTapDir) {
+                Ctx->PipeTaps[PipeIdx] = SdpTapAttach(Ctx->SdPipes[PipeIdx], true);
+                if(!Ctx->PipeTaps[PipeIdx]) {
+                    Ret = -ENOMEM;
+                    break;
+                }
+            }
+        }
+        if(Ret != 0) {
+            break;
+        }
+        ++SensorIdx;
+    }
+
+    if(Ret == 0) {
+        Ret = MbPgResolveInto(Ctx, Sensors);
+    }
+
+    cJSON_Delete(SchemaConf);
+    return Ret;
+}
+
 sdb_errno
 MbPgCleanup(void *Arg)
 {
     mbpg_ctx *Ctx = Arg;
     if(Ctx) {
-        if(Ctx->SdPipe) {
-            SdpDestroy(Ctx->SdPipe, false);
+        if(Ctx->SdPipes) {
+            for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+                if(Ctx->SdPipes[p]) {
+                    SdpDestroy(Ctx->SdPipes[p], false);
+                }
+            }
         } else {
             SdbLogWarning("The context passed to cleanup function's pipe was NULL");
             return -SDBE_PTR_WAS_NULL;
         }
+        free(Ctx->ModbusShards.Owners);
+        free(Ctx->ModbusShards.Loads);
         SdbBarrierDeinit(&Ctx->Barrier);
+        SdbMutexDeinit(&Ctx->PgSetupLock);
         free(Ctx);
     } else {
         SdbLogWarning("The context passed to cleanup function was NULL");
@@ -170,11 +585,9 @@ MbPgCleanup(void *Arg)
 static tg_task MbPgThroughputTestTasks[] = { PgThread, MbPgPipeThroughputTest };
 
 
-/**< Array of task functions. Starts postgres thread, modbus test server thread and modbus thread */
+/**< Task functions. Starts the modbus test server thread, then the postgres and modbus threads */
 static tg_task MbPgTestTasks[] = {
-    PgThread,
     MbPgTestServer,
-    MbThread,
 };
 
 
@@ -184,46 +597,254 @@ static tg_task MbPgTestTasks[] = {
  * Creates and initializes a thread group based on JSON configuration:
  * 1. Parses Modbus and PostgreSQL configurations
  * 2. Allocates and initializes context
- * 3. Sets up data pipe
+ * 3. Sets up one data pipe per sensor and Modbus worker, and the Modbus routes to them
  * 4. Configures thread tasks based on mode (test/normal)
  *
  * @param Conf JSON configuration
  * @param GroupId Thread group identifier
+ * @param Pool Buffer pool the pipes borrow their buffers from, NULL if they have their own
  * @param A Memory arena for allocations
  * @return Initialized thread group or NULL on failure
  */
 tg_group *
-MbPgCreateTg(cJSON *Conf, u64 GroupId, sdb_arena *A)
+MbPgCreateTg(cJSON *Conf, u64 GroupId, sdb_buf_pool *Pool, sdb_arena *A)
 {
     cJSON *ModbusConf   = cJSON_GetObjectItem(Conf, "modbus");
     cJSON *PostgresConf = cJSON_GetObjectItem(Conf, "postgres");
     cJSON *PipeConf     = cJSON_GetObjectItem(Conf, "pipe");
     cJSON *TestConf     = cJSON_GetObjectItem(Conf, "testing");
 
-    mbpg_ctx *Ctx = malloc(sizeof(mbpg_ctx));
+    mbpg_ctx *Ctx = calloc(1, sizeof(mbpg_ctx));
     if(Ctx == NULL) {
         return NULL;
     }
+    Ctx->PipePool = Pool;
+
+    cJSON *PipeBufCountObj   = cJSON_GetObjectItem(PipeConf, "buf_count");
+    cJSON *PipeBufSizeObj    = cJSON_GetObjectItem(PipeConf, "buf_size");
+    cJSON *PipeMaxLatencyObj = cJSON_GetObjectItem(PipeConf, "max_latency");
+    if(PipeMaxLatencyObj) {
+        Ctx->PipeMaxLatency = SdbTimeFromString(cJSON_GetStringValue(PipeMaxLatencyObj));
+        if(Ctx->PipeMaxLatency == 0) {
+            SdbLogError("Invalid pipe \"max_latency\"");
+            free(Ctx);
+            return NULL;
+        }
+    }
 
-    cJSON *PipeBufCountObj = cJSON_GetObjectItem(PipeConf, "buf_count");
-    cJSON *PipeBufSizeObj  = cJSON_GetObjectItem(PipeConf, "buf_size");
+    Ctx->PipePolicy = SdpPolicy_Block;
+    if(MbPgParsePolicy(cJSON_GetObjectItem(PipeConf, "backpressure"), &Ctx->PipePolicy) != 0) {
+        free(Ctx);
+        return NULL;
+    }
+
+    cJSON *DecimateStepObj = cJSON_GetObjectItem(PipeConf, "decimate_step");
+    Ctx->PipeDecimateStep  = 2;
+    if(DecimateStepObj) {
+        double Step = cJSON_GetNumberValue(DecimateStepObj);
+        if(!cJSON_IsNumber(DecimateStepObj) || Step < 2 || Step > UINT32_MAX || Step != (u32)Step) {
+            SdbLogError("Pipe \"decimate_step\" must be a whole number of at least 2");
+            free(Ctx);
+            return NULL;
+        }
+        Ctx->PipeDecimateStep = Step;
+    }
 
     DhsGetMemAndScratchSize(ModbusConf, &Ctx->ModbusMemSize, &Ctx->ModbusScratchSize);
     DhsGetMemAndScratchSize(PostgresConf, &Ctx->PgMemSize, &Ctx->PgScratchSize);
 
+    cJSON *CopyConf = cJSON_GetObjectItem(PostgresConf, "copy");
+    Ctx->PgStream   = cJSON_IsObject(CopyConf);
+    if(Ctx->PgStream) {
+        cJSON *MaxRowsObj  = cJSON_GetObjectItem(CopyConf, "max_rows");
+        char  *MaxBytes    = cJSON_GetStringValue(cJSON_GetObjectItem(CopyConf, "max_bytes"));
+        char  *MaxAge      = cJSON_GetStringValue(cJSON_GetObjectItem(CopyConf, "max_age"));
+        Ctx->PgCommitRows  = cJSON_IsNumber(MaxRowsObj) ? cJSON_GetNumberValue(MaxRowsObj) : 0;
+        Ctx->PgCommitBytes = MaxBytes ? SdbMemSizeFromString(MaxBytes) : SdbMebiByte(8);
+        Ctx->PgCommitAge   = MaxAge ? SdbTimeFromString(MaxAge) : SDB_TIME_S(1);
+        if(Ctx->PgCommitRows == 0 && Ctx->PgCommitBytes == 0 && Ctx->PgCommitAge == 0) {
+            SdbLogError("Postgres \"copy\" needs at least one of \"max_rows\", \"max_bytes\" "
+                        "and \"max_age\"");
+            free(Ctx);
+            return NULL;
+        }
+    }
+
+    cJSON *WritersObj  = cJSON_GetObjectItem(PostgresConf, "writers");
+    Ctx->PgWriterCount = cJSON_IsNumber(WritersObj) ? cJSON_GetNumberValue(WritersObj) : 1;
+    if(Ctx->PgWriterCount == 0 || Ctx->PgWriterCount > MBPG_MAX_PG_WRITERS) {
+        SdbLogError("Postgres \"writers\" must be between 1 and %d", MBPG_MAX_PG_WRITERS);
+        free(Ctx);
+        return NULL;
+    }
+    atomic_init(&Ctx->NextPgWriter, 0);
+    atomic_init(&Ctx->PgInsertedRows, 0);
+    SdbMutexInit(&Ctx->PgSetupLock);
+
+    cJSON *ConnCountObj  = cJSON_GetObjectItem(ModbusConf, "conn_count");
+    Ctx->ModbusConnCount = cJSON_IsNumber(ConnCountObj) ? cJSON_GetNumberValue(ConnCountObj) : 0;
+
+    cJSON *WorkersObj      = cJSON_GetObjectItem(ModbusConf, "workers");
+    Ctx->ModbusWorkerCount = cJSON_IsNumber(WorkersObj) ? cJSON_GetNumberValue(WorkersObj) : 1;
+    if(Ctx->ModbusWorkerCount == 0) {
+        Ctx->ModbusWorkerCount = SdbMax(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+    if(Ctx->ModbusWorkerCount > MBPG_MAX_MODBUS_WORKERS) {
+        SdbLogError("\"workers\" must be at most %d", MBPG_MAX_MODBUS_WORKERS);
+        free(Ctx);
+        return NULL;
+    }
+    atomic_init(&Ctx->NextWorker, 0);
+
+    Ctx->ModbusShards.WorkerCount = Ctx->ModbusWorkerCount;
+    Ctx->ModbusShards.Loads       = aligned_alloc(
+        SDB_CACHE_LINE_SIZE, Ctx->ModbusWorkerCount * sizeof(*Ctx->ModbusShards.Loads));
+    if(!Ctx->ModbusShards.Loads) {
+        free(Ctx);
+        return NULL;
+    }
+
+    cJSON *ZeroCopyObj  = cJSON_GetObjectItem(ModbusConf, "zero_copy");
+    Ctx->ModbusZeroCopy = !cJSON_IsFalse(ZeroCopyObj);
+
+    cJSON *BackendObj  = cJSON_GetObjectItem(ModbusConf, "backend");
+    char  *BackendName = cJSON_GetStringValue(BackendObj);
+    if(BackendName == NULL || strcmp(BackendName, "epoll") == 0) {
+        Ctx->ModbusBackend = MbBackend_Epoll;
+    } else if(strcmp(BackendName, "io_uring") == 0) {
+        Ctx->ModbusBackend = MbBackend_IoUring;
+    } else {
+        SdbLogError("Unknown Modbus backend \"%s\". Valid backends are \"epoll\" and \"io_uring\"",
+                    BackendName);
+        free(Ctx->ModbusShards.Loads);
+        free(Ctx);
+        return NULL;
+    }
+
+    cJSON *ModeObj  = cJSON_GetObjectItem(ModbusConf, "mode");
+    char  *ModeName = cJSON_GetStringValue(ModeObj);
+    if(ModeName == NULL || strcmp(ModeName, "push") == 0) {
+        Ctx->ModbusMode = MbMode_Push;
+    } else if(strcmp(ModeName, "poll") == 0) {
+        Ctx->ModbusMode = MbMode_Poll;
+        if(MbPgParsePollConf(cJSON_GetObjectItem(ModbusConf, "poll"), &Ctx->ModbusPoll, A) != 0) {
+            free(Ctx->ModbusShards.Loads);
+            free(Ctx);
+            return NULL;
+        }
+    } else {
+        SdbLogError("Unknown Modbus mode \"%s\". Valid modes are \"push\" and \"poll\"",
+                    ModeName);
+        free(Ctx->ModbusShards.Loads);
+        free(Ctx);
+        return NULL;
+    }
+
     u64 PipeBufCount = cJSON_GetNumberValue(PipeBufCountObj);
     u64 PipeBufSize  = SdbMemSizeFromString(cJSON_GetStringValue(PipeBufSizeObj));
-    Ctx->SdPipe      = SdpCreate(PipeBufCount, PipeBufSize, NULL);
-    if(Ctx->SdPipe == NULL) {
+
+    cJSON *PipeMaxBufCountObj = cJSON_GetObjectItem(PipeConf, "max_buf_count");
+    Ctx->PipeMaxBufCount      = cJSON_IsNumber(PipeMaxBufCountObj)
+                                  ? cJSON_GetNumberValue(PipeMaxBufCountObj)
+                                  : PipeBufCount;
+    if(Ctx->PipeMaxBufCount < PipeBufCount) {
+        SdbLogError("Pipe \"max_buf_count\" must be at least \"buf_count\"");
+        free(Ctx->ModbusShards.Loads);
         free(Ctx);
         return NULL;
     }
 
+    char *PipeSpillDir = cJSON_GetStringValue(cJSON_GetObjectItem(PipeConf, "spill_dir"));
+    char *PipeSpillSize = cJSON_GetStringValue(cJSON_GetObjectItem(PipeConf, "spill_size"));
+    Ctx->PipeSpillDir   = SdbStringMake(A, PipeSpillDir ? PipeSpillDir : "spill");
+    Ctx->PipeSpillSize  = PipeSpillSize ? SdbMemSizeFromString(PipeSpillSize) : SdbMebiByte(256);
+
+    cJSON *PipeShrinkAfterObj = cJSON_GetObjectItem(PipeConf, "shrink_after");
+    Ctx->PipeShrinkAfter      = SDP_SHRINK_AFTER;
+    if(PipeShrinkAfterObj) {
+        Ctx->PipeShrinkAfter = SdbTimeFromString(cJSON_GetStringValue(PipeShrinkAfterObj));
+        if(Ctx->PipeShrinkAfter == 0) {
+            SdbLogError("Invalid pipe \"shrink_after\"");
+            free(Ctx->ModbusShards.Loads);
+            free(Ctx);
+            return NULL;
+        }
+    }
+
+    char *PipePersistDir = cJSON_GetStringValue(cJSON_GetObjectItem(PipeConf, "persist_dir"));
+    Ctx->PipePersistDir  = PipePersistDir ? SdbStringMake(A, PipePersistDir) : NULL;
+    Ctx->PipePersistSync = cJSON_IsTrue(cJSON_GetObjectItem(PipeConf, "persist_sync"));
+    if(Ctx->PipePersistDir) {
+        if(Ctx->PipeMaxBufCount != PipeBufCount) {
+            SdbLogError("Persistent pipes cannot be elastic, leave out \"max_buf_count\"");
+            free(Ctx->ModbusShards.Loads);
+            free(Ctx);
+            return NULL;
+        }
+        if(mkdir(Ctx->PipePersistDir, 0755) == -1 && errno != EEXIST) {
+            SdbLogError("Failed to create pipe directory %s: %s", Ctx->PipePersistDir,
+                        strerror(errno));
+            free(Ctx->ModbusShards.Loads);
+            free(Ctx);
+            return NULL;
+        }
+    }
+
+    char *PipeTapDir = cJSON_GetStringValue(cJSON_GetObjectItem(PipeConf, "tap_dir"));
+    Ctx->PipeTapDir  = PipeTapDir ? SdbStringMake(A, PipeTapDir) : NULL;
+    if(Ctx->PipeTapDir && mkdir(Ctx->PipeTapDir, 0755) == -1 && errno != EEXIST) {
+        SdbLogError("Failed to create archive directory %s: %s", Ctx->PipeTapDir,
+                    strerror(errno));
+        free(Ctx->ModbusShards.Loads);
+        free(Ctx);
+        return NULL;
+    }
+
+    if(DhsGetPageOpts(cJSON_GetObjectItem(Conf, "memory"), &Ctx->MemOpts) != 0) {
+        free(Ctx->ModbusShards.Loads);
+        free(Ctx);
+        return NULL;
+    }
+
+    if(MbPgCreateSensorPipes(Ctx, PipeBufCount, PipeBufSize, A) != 0) {
+        for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+            if(Ctx->SdPipes && Ctx->SdPipes[p]) {
+                SdpDestroy(Ctx->SdPipes[p], false);
+            }
+        }
+        free(Ctx->ModbusShards.Loads);
+        free(Ctx);
+        return NULL;
+    }
+
+    // NOTE(ingar): Every table is written by one writer, so writers beyond the tables would idle
+    if(Ctx->PgWriterCount > Ctx->SensorCount) {
+        SdbLogWarning("%u Postgres writers for %lu tables, using %lu", Ctx->PgWriterCount,
+                      Ctx->SensorCount, Ctx->SensorCount);
+        Ctx->PgWriterCount = Ctx->SensorCount;
+    }
+
     tg_group *Group;
     cJSON    *TestingEnabled = cJSON_GetObjectItem(TestConf, "enabled");
     if(cJSON_IsTrue(TestingEnabled)) {
-        SdbBarrierInit(&Ctx->Barrier, 3);
-        Group = TgCreateGroup(GroupId, 3, Ctx, NULL, MbPgTestTasks, MbPgCleanup, A);
+        u64 TaskCount = SdbArrayLen(MbPgTestTasks) + Ctx->PgWriterCount + Ctx->ModbusWorkerCount
+                      + (Ctx->PipeTapDir != NULL);
+        tg_task
+            Tasks[SdbArrayLen(MbPgTestTasks) + MBPG_MAX_PG_WRITERS + MBPG_MAX_MODBUS_WORKERS + 1];
+        SdbMemcpy(Tasks, MbPgTestTasks, sizeof(MbPgTestTasks));
+        u64 t = SdbArrayLen(MbPgTestTasks);
+        if(Ctx->PipeTapDir) {
+            Tasks[t++] = MbPgArchiveThread;
+        }
+        for(u32 w = 0; w < Ctx->PgWriterCount; ++w) {
+            Tasks[t++] = PgThread;
+        }
+        for(u32 w = 0; w < Ctx->ModbusWorkerCount; ++w) {
+            Tasks[t++] = MbThread;
+        }
+
+        SdbBarrierInit(&Ctx->Barrier, TaskCount);
+        Group = TgCreateGroup(GroupId, TaskCount, Ctx, NULL, Tasks, MbPgCleanup, A);
     } else {
 #if 1
         SdbLogError("Throughput test is currently not functional. Please set \"enabled\" in "
@@ -235,7 +856,8 @@ MbPgCreateTg(cJSON *Conf, u64 GroupId, sdb_arena *A)
 #endif
     }
 
-    GSignalContext.Pipe = Ctx->SdPipe;
+    GSignalContext.Pipes     = Ctx->SdPipes;
+    GSignalContext.PipeCount = Ctx->SdPipeCount;
 
     return Group;
 }
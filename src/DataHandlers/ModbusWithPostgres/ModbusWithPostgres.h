@@ -10,11 +10,18 @@
 
 #include <src/Sdb.h>
 
+#include <src/CommProtocols/Modbus.h>
 #include <src/Common/SensorDataPipe.h>
 #include <src/Common/ThreadGroup.h>
 
 #include <src/Libs/cJSON/cJSON.h>
 
+/** @brief Upper limit of the "workers" setting */
+#define MBPG_MAX_MODBUS_WORKERS 256
+
+/** @brief Upper limit of the "writers" setting */
+#define MBPG_MAX_PG_WRITERS 64
+
 /**
  * @struct mbpg_ctx
  * @brief Context for Modbus-PostgreSQL integration
@@ -23,11 +30,43 @@ typedef struct
 {
     u64 ModbusMemSize;
     u64 ModbusScratchSize;
+    u64 ModbusConnCount; // NOTE(ingar): 0 means one connection per endpoint in modbus-conf
+    u32 ModbusWorkerCount; // Modbus threads the connections are sharded over
+    bool ModbusZeroCopy; // Receive straight into the pipe buffers
+    mb_backend ModbusBackend;
+    mb_mode ModbusMode;
+    mb_poll_conf ModbusPoll; // NOTE(ingar): Only used when ModbusMode is MbMode_Poll
     u64 PgMemSize;
     u64 PgScratchSize;
+    bool PgStream; // Keep one COPY open across pipe buffers and commit it in batches
+    u64 PgCommitRows; // NOTE(ingar): 0 means no limit, as for the byte and age limits
+    u64 PgCommitBytes;
+    sdb_timediff PgCommitAge;
+    u32 PgWriterCount; // Postgres threads the tables are sharded over, each with a connection
+    sdb_timediff PipeMaxLatency; // NOTE(ingar): 0 means buffers are only handed off when full
+    sdp_policy PipePolicy; // What the Modbus threads do when a pipe is full, unless the sensor says
+    u32 PipeDecimateStep; // Packets per packet kept by SdpPolicy_Decimate
+    u64 PipeMaxBufCount; // NOTE(ingar): Above buf_count, the pipes are elastic
+    sdb_timediff PipeShrinkAfter; // How long elastic pipes keep buffers they did not need
+    sdb_string PipeSpillDir; // Where pipes with SdpPolicy_Spill keep their spill files
+    u64 PipeSpillSize; // Size of each spill file
+    sdb_string PipePersistDir; // NOTE(ingar): NULL unless the pipes are persistent
+    bool PipePersistSync; // Whether persistent pipes msync every buffer they publish
+    sdb_string PipeTapDir; // NOTE(ingar): NULL unless the pipes are archived through taps
+    sdb_page_opts MemOpts; // Backing of the pipe buffers and the thread arenas
+    sdb_buf_pool *PipePool; // NOTE(ingar): NULL unless the pipes borrow from a shared pool
 
-    sensor_data_pipe *SdPipe;
-    sdb_barrier       Barrier;
+    u64                SensorCount;  // Sensors in sensor_schemas.json
+    u64                SdPipeCount;  // SensorCount pipes per Modbus worker
+    sensor_data_pipe **SdPipes;      // Lane of worker w starts at w * SensorCount
+    sdp_tap          **PipeTaps;     // Archive tap of each pipe, NULL without "tap_dir"
+    mb_route_conf     *ModbusRoutes; // Which frames go to each sensor
+    mb_shard_table     ModbusShards;
+    atomic_uint        NextWorker;
+    atomic_uint        NextPgWriter;
+    atomic_ulong       PgInsertedRows; // Rows committed by every Postgres writer
+    sdb_mutex          PgSetupLock;    // Lets one writer at a time create the tables
+    sdb_barrier        Barrier;
 
 } mbpg_ctx;
 
@@ -48,6 +87,14 @@ void *PgThread(void *Arg);
 
 void *MbThread(void *Arg);
 
+/**
+ * @brief Archive thread function
+ *
+ * @param Arg Pointer to mbpg_ctx structure
+ * @return Thread return value (always NULL)
+ */
+void *MbPgArchiveThread(void *Arg);
+
 /**
  * @brief Data pipe throughput test thread
  *
@@ -77,9 +124,10 @@ sdb_errno MbPgCleanup(void *Arg);
  *
  * @param Conf JSON configuration
  * @param GroupId Thread group identifier
+ * @param Pool Buffer pool the pipes borrow their buffers from, NULL if they have their own
  * @param A Memory arena for allocations
  * @return Initialized thread group or NULL on failure
  */
-tg_group *MbPgCreateTg(cJSON *Conf, u64 GroupId, sdb_arena *A);
+tg_group *MbPgCreateTg(cJSON *Conf, u64 GroupId, sdb_buf_pool *Pool, sdb_arena *A);
 
 #endif
@@ -5,6 +5,7 @@
  * including connection management, event handling, and performance monitoring.
  */
 
+#include <poll.h>
 #include <signal.h>
 #include <sys/epoll.h>
 
@@ -12,6 +13,8 @@
 SDB_LOG_DECLARE(Postgres);
 SDB_THREAD_ARENAS_EXTERN(Postgres);
 
+#include <src/Common/LatencyHistogram.h>
+#include <src/Common/SensorDataPipe.h>
 #include <src/Common/Time.h>
 #include <src/DataHandlers/ModbusWithPostgres/ModbusWithPostgres.h>
 #include <src/DatabaseSystems/DatabaseInitializer.h>
@@ -20,18 +23,394 @@ SDB_THREAD_ARENAS_EXTERN(Postgres);
 
 extern volatile sig_atomic_t GlobalShutdown;
 
+/** @brief Event data of the database connection's socket, pipes use their index */
+#define PG_EPOLL_CONN UINT64_MAX
+
+/** @brief Longest wait for the server to commit what is left on shutdown */
+#define PG_FINISH_TIMEOUT SDB_TIME_S(5)
+
+/**
+ * @brief Logs the receive to commit latency percentiles of the packets committed since the
+ * last log, and starts over
+ */
+static void
+PgLogLatency(sdb_latency_hist *Hist, u32 Writer)
+{
+    if(Hist->Count == 0) {
+        return;
+    }
+
+    SdbLogInfo("Writer %u receive to commit latency of %lu packets: p50 %lu us, p99 %lu us, "
+               "p99.9 %lu us, max %lu us",
+               Writer, Hist->Count, SDB_TIME_TO_US(SdbLatencyHistPercentile(Hist, 50.0)),
+               SDB_TIME_TO_US(SdbLatencyHistPercentile(Hist, 99.0)),
+               SDB_TIME_TO_US(SdbLatencyHistPercentile(Hist, 99.9)), SDB_TIME_TO_US(Hist->Max));
+    SdbLatencyHistReset(Hist);
+}
+
+/**
+ * @brief Sort key of an event, the connection first and then the pipes by table
+ */
+static inline u64
+PgEventKey(const struct epoll_event *Event, u64 SensorCount)
+{
+    return (Event->data.u64 == PG_EPOLL_CONN) ? 0 : 1 + Event->data.u64 % SensorCount;
+}
+
+/**
+ * @brief Orders events by the table of their pipe, so a COPY stream switches tables as rarely as
+ * possible. The connection goes first, so the stream is pumped before it is given more rows
+ *
+ * NOTE(ingar): Insertion sort, there are at most PG_EPOLL_BATCH events. It is stable, so pipes
+ * of the same table keep their order
+ */
+static void
+PgSortEventsByTable(struct epoll_event *Events, int EventCount, u64 SensorCount)
+{
+    for(int e = 1; e < EventCount; ++e) {
+        struct epoll_event Event = Events[e];
+        u64                Key   = PgEventKey(&Event, SensorCount);
+        int                i     = e;
+        for(; i > 0 && PgEventKey(&Events[i - 1], SensorCount) > Key; --i) {
+            Events[i] = Events[i - 1];
+        }
+        Events[i] = Event;
+    }
+}
+
+/**
+ * @brief Keeps the connection's socket in the epoll set, waiting for the events the stream needs
+ *
+ * NOTE(ingar): A reset connection has a new socket, which may reuse the old one's number, so a
+ * reset is told by the stream's ResetCount rather than by the socket. libpq may open another
+ * socket on every step of the reconnect, or none after a failed one, so until the reconnect is
+ * done the socket is added again each time, and a socket already in the set is modified
+ */
+static sdb_errno
+PgWatchConn(int EpollFd, pg_copy_stream *Stream, u64 *WatchedResets, u32 *WatchedEvents)
+{
+    u32 Events = PgStreamEvents(Stream);
+    if(*WatchedResets == Stream->ResetCount && *WatchedEvents == Events) {
+        return 0;
+    }
+
+    int Fd = PQsocket(Stream->Conn);
+    if(Fd == -1) {
+        return 0;
+    }
+
+    int Op = (*WatchedResets == Stream->ResetCount) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    struct epoll_event Event = { .events = Events, .data.u64 = PG_EPOLL_CONN };
+    if(epoll_ctl(EpollFd, Op, Fd, &Event) == -1
+       && (Op != EPOLL_CTL_ADD || errno != EEXIST
+           || epoll_ctl(EpollFd, EPOLL_CTL_MOD, Fd, &Event) == -1)) {
+        SdbLogError("Failed to watch the database connection: %s", strerror(errno));
+        return -errno;
+    }
+    if(Stream->Phase != PgStream_Resetting) {
+        *WatchedResets = Stream->ResetCount;
+    }
+    *WatchedEvents = Events;
+
+    return 0;
+}
+
+/**
+ * @brief Commits the open batch of a COPY stream if it is due
+ */
+static sdb_errno
+PgStreamCommitIfDue(pg_copy_stream *Stream)
+{
+    struct timespec Now;
+    SdbTimeMonotonic(&Now);
+    if(PgStreamUntilDue(Stream, SdbTimespecNs(&Now)) != 0) {
+        return 0;
+    }
+
+    return PgStreamCommit(Stream);
+}
+
+/**
+ * @brief Counts the records of each table in a SdpFraming_Prefixed buffer
+ *
+ * @param[out] Counts Records of each sensor's table, SensorCount of them
+ * @return u64 Records that are no table's rows, which are dropped
+ */
+static u64
+PgCountRecords(sdb_arena *Buf, postgres_ctx *PgCtx, u64 SensorCount, u32 *Counts)
+{
+    SdbMemset(Counts, 0, SensorCount * sizeof(*Counts));
+
+    u64         Dropped = 0, Offset = 0;
+    sdp_record *Record;
+    while((Record = SdPipeNextRecord(Buf, &Offset)) != NULL) {
+        if(Record->SchemaId < SensorCount
+           && Record->Size == PgCtx->TablesInfo[Record->SchemaId]->RowSize) {
+            ++Counts[Record->SchemaId];
+        } else {
+            ++Dropped;
+        }
+    }
+
+    return Dropped;
+}
+
+/**
+ * @brief Copies the records of one table out of a SdpFraming_Prefixed buffer into rows, and
+ * stamps the rows with the receive times of their records
+ *
+ * @param Stamps Stamps of Buf, NULL if the rows need none
+ * @param Rows Room for the rows, the size of Buf's data is enough
+ * @param[out] RowStamps Stamps of Rows, NULL if Stamps is
+ * @return u64 Rows copied
+ */
+static u64
+PgGatherRecords(sdb_arena *Buf, const sdp_stamps *Stamps, u32 SchemaId, u64 RowSize, u8 *Rows,
+                sdp_stamps *RowStamps)
+{
+    static const sdp_stamps NoStamps = { 0 };
+    if(Stamps == NULL) {
+        Stamps = &NoStamps;
+    } else {
+        RowStamps->Count = 0;
+    }
+
+    u64         Count = 0, Offset = 0, Start = 0;
+    u32         s     = 0;
+    sdp_record *Record;
+    while((Record = SdPipeNextRecord(Buf, &Offset)) != NULL) {
+        while(s + 1 < Stamps->Count && Stamps->Stamps[s + 1].Offset <= Start) {
+            ++s;
+        }
+        if(Record->SchemaId == SchemaId && Record->Size == RowSize) {
+            // NOTE(ingar): Rows of the same stamp share one, as in the buffer
+            const sdp_stamp *Stamp = &Stamps->Stamps[s];
+            if(Stamps->Count > 0 && Stamp->Offset <= Start
+               && (RowStamps->Count == 0
+                   || RowStamps->Stamps[RowStamps->Count - 1].RecvNs != Stamp->RecvNs)) {
+                RowStamps->Stamps[RowStamps->Count++]
+                    = (sdp_stamp){ .RecvNs = Stamp->RecvNs, .Offset = Count * RowSize };
+            }
+            SdbMemcpy(Rows + Count * RowSize, Record->Data, RowSize);
+            ++Count;
+        }
+        Start = Offset;
+    }
+
+    return Count;
+}
+
+/**
+ * @brief Inserts the records of a SdpFraming_Prefixed buffer into their tables, in a transaction
+ * per table
+ *
+ * @param Counts Records of each table, from PgCountRecords
+ * @param[out] InsertedRows Rows inserted
+ * @return sdb_errno 0 if every table's rows were inserted
+ */
+static sdb_errno
+PgInsertRecords(PGconn *Conn, postgres_ctx *PgCtx, sdb_arena *Buf, const u32 *Counts,
+                u64 SensorCount, u64 *InsertedRows)
+{
+    sdb_errno Ret = 0;
+    for(u64 t = 0; t < SensorCount; ++t) {
+        if(Counts[t] == 0) {
+            continue;
+        }
+
+        sdb_scratch_arena Scratch   = SdbScratchGet(NULL, 0);
+        pg_table_info    *TableInfo = PgCtx->TablesInfo[t];
+        u8               *Rows      = SdbPushArray(Scratch.Arena, u8, Buf->Cur);
+        if(Rows == NULL) {
+            SdbScratchRelease(Scratch);
+            return -ENOMEM;
+        }
+
+        u64       Count     = PgGatherRecords(Buf, NULL, t, TableInfo->RowSize, Rows, NULL);
+        sdb_errno InsertRet = PgInsertData(Conn, TableInfo, (const char *)Rows, Count);
+        SdbScratchRelease(Scratch);
+        if(InsertRet != 0) {
+            Ret = InsertRet;
+        } else {
+            *InsertedRows += Count;
+        }
+    }
+
+    return Ret;
+}
+
+/**
+ * @brief Pipe buffer taken by a writer with a COPY stream and kept in its pipe
+ *
+ * A SdpFraming_Prefixed buffer has an entry for the rows of each table in it, and is released
+ * with the last one.
+ */
+typedef struct
+{
+    u64  PipeIdx;   /**< Pipe of the buffer */
+    u64  Seq;       /**< Sequence number of the buffer among the pipe's kept ones */
+    u64  SensorIdx; /**< Table of the rows */
+    bool Dropped;   /**< Not appended, released as soon as the buffers before it are */
+    bool Last;      /**< Last entry of the buffer */
+} pg_kept_entry;
+
+/**
+ * @brief Buffers appended to a COPY stream and not committed yet, in the order they were read
+ *
+ * The buffers stay kept in their pipes until their rows commit, so the rows of a batch that is
+ * rolled back are appended again from them instead of being lost, and a persistent pipe only
+ * forgets rows once they are in the database. Every buffer taken is an entry, so the pipes get
+ * their buffers back in the order they were taken.
+ */
+typedef struct
+{
+    pg_kept_entry *Entries;
+    u64            Cap;
+    u64            Tail;      /**< Oldest entry not released */
+    u64            Next;      /**< Next entry to append again after a rollback, Head if none */
+    u64            Head;      /**< Entries added */
+    u64            Committed; /**< CommittedAppends of the stream when last settled */
+    u64            Rollbacks; /**< RollbackCount of the stream when last settled */
+} pg_kept_log;
+
+/**
+ * @brief Keeps the buffer the writer holds and adds an entry for the rows of each table in it
+ * to the log. The entries are appended from Next, which is left where it was
+ *
+ * @param Counts Rows of each table in the buffer. A buffer with none gets a dropped entry, so
+ * it is still released in order
+ */
+static void
+PgKeptAdd(pg_kept_log *Log, sensor_data_pipe *Pipe, u64 PipeIdx, const u32 *Counts,
+          u64 SensorCount)
+{
+    u64 Seq  = SdPipeKeepReadBuffer(Pipe);
+    u64 Head = Log->Head;
+    for(u64 t = 0; t <= SensorCount; ++t) {
+        bool Dropped = t == SensorCount;
+        if((Dropped && Log->Head != Head) || (!Dropped && Counts[t] == 0)) {
+            continue;
+        }
+
+        SdbAssert(Log->Head - Log->Tail < Log->Cap, "COPY stream keeps too many buffers");
+        pg_kept_entry *Entry = &Log->Entries[Log->Head++ % Log->Cap];
+        Entry->PipeIdx       = PipeIdx;
+        Entry->Seq           = Seq;
+        Entry->SensorIdx     = Dropped ? PipeIdx % SensorCount : t;
+        Entry->Dropped       = Dropped;
+        Entry->Last          = false;
+    }
+    Log->Entries[(Log->Head - 1) % Log->Cap].Last = true;
+}
+
+/**
+ * @brief Releases the buffers whose rows the stream has committed, and rewinds to the oldest
+ * buffer not committed if the stream has rolled back since the last call
+ *
+ * Called after every call on the stream, so no buffer is read between a rollback and the
+ * rewind.
+ *
+ * @return u64 Buffers released
+ */
+static u64
+PgKeptSettle(pg_kept_log *Log, pg_copy_stream *Stream, sensor_data_pipe **Pipes)
+{
+    u64 Released = 0;
+    while(Log->Tail < Log->Next) {
+        pg_kept_entry *Entry = &Log->Entries[Log->Tail % Log->Cap];
+        if(!Entry->Dropped) {
+            if(Log->Committed == Stream->CommittedAppends) {
+                break;
+            }
+            ++Log->Committed;
+        }
+        if(Entry->Last) {
+            SdPipeReleaseKept(Pipes[Entry->PipeIdx]);
+            ++Released;
+        }
+        ++Log->Tail;
+    }
+
+    if(Log->Rollbacks != Stream->RollbackCount) {
+        Log->Rollbacks = Stream->RollbackCount;
+        Log->Next      = Log->Tail;
+    }
+
+    return Released;
+}
+
+/**
+ * @brief Appends the rows of the next entry to the stream, for a buffer just read or for one
+ * of a batch that was rolled back
+ *
+ * The rows of a SdpFraming_Prefixed buffer are gathered into a scratch arena first. An entry
+ * whose rows do not fit the stream's stage is dropped.
+ */
+static sdb_errno
+PgKeptAppendNext(pg_kept_log *Log, pg_copy_stream *Stream, mbpg_ctx *Ctx, postgres_ctx *PgCtx)
+{
+    pg_kept_entry *Entry = &Log->Entries[Log->Next++ % Log->Cap];
+    if(Entry->Dropped) {
+        return 0;
+    }
+
+    sdb_errno      Ret;
+    sdp_kept      *Kept      = SdPipeGetKept(Ctx->SdPipes[Entry->PipeIdx], Entry->Seq);
+    pg_table_info *TableInfo = PgCtx->TablesInfo[Entry->SensorIdx];
+    if(Kept->Header->Framing == SdpFraming_Fixed) {
+        Ret = PgStreamAppend(Stream, TableInfo, (const char *)Kept->Buf->Mem,
+                             Kept->Header->RecordCount, Kept->Stamps);
+    } else {
+        sdb_scratch_arena Scratch = SdbScratchGet(NULL, 0);
+        u8               *Rows    = SdbPushArray(Scratch.Arena, u8, Kept->Buf->Cur);
+        sdp_stamps       *Stamps  = SdbPushStruct(Scratch.Arena, sdp_stamps);
+        if(Rows == NULL || Stamps == NULL) {
+            Ret = -ENOMEM;
+        } else {
+            u64 Count = PgGatherRecords(Kept->Buf, Kept->Stamps, Entry->SensorIdx,
+                                        TableInfo->RowSize, Rows, Stamps);
+            Ret       = PgStreamAppend(Stream, TableInfo, (const char *)Rows, Count, Stamps);
+        }
+        SdbScratchRelease(Scratch);
+    }
+
+    Entry->Dropped = Ret == -ENOMEM;
+    return Ret;
+}
+
+/**
+ * @brief Counts a failed insertion, and stops the loop once there have been too many
+ */
+static sdb_errno
+PgCountFailure(u64 *PgFailCounter)
+{
+    SdbLogError("Failed to insert data for the %lusthnd", ++*PgFailCounter);
+    if(*PgFailCounter >= 5) {
+        SdbLogError("Postgres operations have failed more than threshod. Stopping main loop");
+        return -1;
+    }
+
+    return 0;
+}
 
 /**
  * @brief Main PostgreSQL operation loop
  *
  * Implementation details:
  * 1. Initializes thread-local resources and arenas
- * 2. Sets up database connection and event handling
+ * 2. Sets up its own database connection and event handling
  * 3. Processes data in a loop until shutdown:
- *    - Waits for data using epoll
- *    - Reads data from pipe
- *    - Inserts data into database
- *    - Tracks performance metrics
+ *    - Waits for data on the pipes of its tables using epoll. Table t is written by writer
+ *      t % PgWriterCount only, so the rows of a table are committed in the order they are read
+ *      from its pipes, however many writers there are
+ *    - Reads one buffer from each ready pipe
+ *    - Inserts the data into the sensor's table, either in a transaction of its own or, if
+ *      "copy" is configured, as part of a COPY stream committed in batches. The stream's
+ *      connection is non-blocking and its socket is in the same epoll set, so the next buffer
+ *      is converted while the server takes the one before it
+ *    - Tracks performance metrics, including the latency from the kernel receiving each packet
+ *      to its commit
  * 4. Handles cleanup on shutdown
  *
  * Performance monitoring:
@@ -41,26 +420,29 @@ extern volatile sig_atomic_t GlobalShutdown;
  *
  * Error handling:
  * - Connection failures
- * - Timeouts
  * - I/O errors
  * - Data insertion failures
  *
  * @param Arg Pointer to mbpg_ctx structure
  * @return sdb_errno Success/error status
  *
- * @note Currently supports single table operations
- * @warning May timeout after 5 consecutive failures
+ * @warning Stops after 5 failed insertions, or 5 batches rolled back if streaming
  */
 sdb_errno
-PgRun(void *Arg)
+PgRun(void *Arg, u32 Writer)
 {
-    sdb_errno Ret = 0;
-    mbpg_ctx *Ctx = Arg;
+    sdb_errno     Ret     = 0;
+    mbpg_ctx     *Ctx     = Arg;
+    postgres_ctx *PgCtx   = NULL;
+    int           EpollFd = -1;
 
     sdb_arena PgArena;
     u64       PgASize = Ctx->PgMemSize + PG_SCRATCH_COUNT * Ctx->PgScratchSize;
-    u8       *PgAMem  = malloc(PgASize);
-    SdbArenaInit(&PgArena, PgAMem, PgASize);
+    sdb_pages PgPages;
+    if(SdbPagesMap(&PgPages, PgASize, &Ctx->MemOpts) != 0) {
+        return -ENOMEM;
+    }
+    SdbArenaInit(&PgArena, PgPages.Mem, PgASize);
 
     PgInitThreadArenas();
     SdbThreadArenasInitExtern(Postgres);
@@ -69,32 +451,37 @@ PgRun(void *Arg)
         SdbThreadArenasAdd(Scratch);
     }
 
-    // Initialize postgres context
-    postgres_ctx *PgCtx = PgPrepareCtx(&PgArena, Ctx->SdPipe);
+    // NOTE(ingar): Every writer has its own connection and table information. Concurrent CREATE
+    // TABLE IF NOT EXISTS of the same table can fail, so the writers prepare one at a time
+    SdbMutexLock(&Ctx->PgSetupLock, SDB_TIMEOUT_MAX);
+    PgCtx = PgPrepareCtx(&PgArena, Ctx->SdPipes, Ctx->SdPipeCount, Ctx->ModbusWorkerCount);
+    SdbMutexUnlock(&Ctx->PgSetupLock);
     if(PgCtx == NULL) {
-        return -1;
+        Ret = -1;
+        goto cleanup;
     }
 
     PGconn *Conn = PgCtx->DbConn;
-    // NOTE(ingar): We unfortunately don't have time to extend the implementation to support more
-    // than one table at the moment, but it should be relatively straightforward. Create more pipes
-    // (one per sensor) in the Mb-Pg thread group creation function and extend the epoll waiting
-    // system to have one per pipe and then write to the correct table.
-    pg_table_info    *TableInfo   = PgCtx->TablesInfo[0];
-    sensor_data_pipe *Pipe        = Ctx->SdPipe;
-    int               ReadEventFd = Pipe->ReadEventFd;
-
-    int EpollFd = epoll_create1(0);
+
+    EpollFd = epoll_create1(0);
     if(EpollFd == -1) {
-        SdbLogError("Failed to create epoll: %s", strerror(errno));
-        return -errno;
+        Ret = -errno;
+        SdbLogError("Failed to create epoll: %s", strerror(-Ret));
+        goto cleanup;
     }
 
-    struct epoll_event ReadEvent
-        = { .events = EPOLLIN | EPOLLERR | EPOLLHUP, .data.fd = ReadEventFd };
-    if(epoll_ctl(EpollFd, EPOLL_CTL_ADD, ReadEventFd, &ReadEvent) == -1) {
-        SdbLogError("Failed to start read event: %s", strerror(errno));
-        return -errno;
+    // NOTE(ingar): Each sensor has its own table and one pipe per Modbus worker. The event data is
+    // the index of the pipe
+    for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+        if((p % Ctx->SensorCount) % Ctx->PgWriterCount != Writer) {
+            continue;
+        }
+        struct epoll_event ReadEvent = { .events = EPOLLIN | EPOLLERR | EPOLLHUP, .data.u64 = p };
+        if(epoll_ctl(EpollFd, EPOLL_CTL_ADD, Ctx->SdPipes[p]->ReadEventFd, &ReadEvent) == -1) {
+            Ret = -errno;
+            SdbLogError("Failed to start read event: %s", strerror(-Ret));
+            goto cleanup;
+        }
     }
 
     // NOTE(ingar): Wait for modbus (and test server if running tests) to complete its setup
@@ -102,17 +489,83 @@ PgRun(void *Arg)
     SdbBarrierWait(&Ctx->Barrier);
     SdbLogInfo("Exited barrier. Starting main loop");
 
-    u64             PgFailCounter  = 0;
-    u64             TimeoutCounter = 0;
-    struct timespec LoopStart, CopyStart, CopyEnd, TimeDiff;
-    static u64      TotalInsertedItems = 0;
-    SdbLogDebug("Item count/buf: %lu\n", Pipe->ItemMaxCount);
+    u64             PgFailCounter      = 0;
+    u64             TotalInsertedItems = 0;
+    u64             CommittedRows      = 0; /**< Rows committed by the per-buffer inserts */
+    u64             PublishedRows      = 0; /**< Rows added to Ctx->PgInsertedRows */
+    struct timespec LoopStart, CopyStart, CopyEnd, TimeDiff, NextLatencyLog;
+
+    sdb_latency_hist *Latency = SdbPushArrayZero(&PgArena, sdb_latency_hist, 1);
+    u32              *Counts  = SdbPushArray(&PgArena, u32, Ctx->SensorCount);
+    if(Latency == NULL || Counts == NULL) {
+        Ret = -ENOMEM;
+        goto cleanup;
+    }
+
+    // NOTE(ingar): The stage holds one converted buffer, which the scratch arenas must fit anyway
+    pg_copy_stream *Stream        = NULL;
+    u64             WatchedResets = 0;
+    u32             WatchedEvents = 0;
+    pg_kept_log     Kept          = { 0 };
+    bool            KeptWait      = false; /**< A pipe has no buffer to spare until a commit */
+    if(Ctx->PgStream) {
+        for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+            sensor_data_pipe *Pipe = Ctx->SdPipes[p];
+            if((p % Ctx->SensorCount) % Ctx->PgWriterCount == Writer) {
+                u64 Tables = (Pipe->Framing == SdpFraming_Prefixed) ? Ctx->SensorCount : 1;
+                Kept.Cap += 2 * Pipe->BufCount * Tables;
+            }
+        }
+        Kept.Entries = SdbPushArray(&PgArena, pg_kept_entry, Kept.Cap);
+        Stream       = SdbPushStruct(&PgArena, pg_copy_stream);
+        if(Stream == NULL || Kept.Entries == NULL
+           || PgStreamInit(Stream, Conn, Ctx->PgCommitRows, Ctx->PgCommitBytes, Ctx->PgCommitAge,
+                           Ctx->PgScratchSize, Latency, &PgArena)
+                  != 0) {
+            SdbLogError("Failed to set up the COPY stream");
+            Ret = -ENOMEM;
+            goto cleanup;
+        }
+
+        WatchedEvents                = PgStreamEvents(Stream);
+        struct epoll_event ConnEvent = { .events = WatchedEvents, .data.u64 = PG_EPOLL_CONN };
+        if(epoll_ctl(EpollFd, EPOLL_CTL_ADD, PQsocket(Conn), &ConnEvent) == -1) {
+            Ret = -errno;
+            SdbLogError("Failed to watch the database connection: %s", strerror(-Ret));
+            goto cleanup;
+        }
+    }
 
     SdbTimeMonotonic(&LoopStart);
-    while(!SdbShouldShutdown()) {
-        struct epoll_event Events[1];
-        int                EpollRet = epoll_wait(EpollFd, Events, 1, SDB_TIME_MS(100));
-        if(EpollRet == -1) {
+    NextLatencyLog = LoopStart;
+    SdbTimeAdd(&NextLatencyLog, PG_LATENCY_STATS_INTERVAL);
+    while(!SdbShouldShutdown() && Ret == 0) {
+        // NOTE(ingar): A batch past its age is committed even if no data comes. The wait is
+        // rounded up, so a batch due within the millisecond does not make the loop spin
+        sdb_timediff Wait = PG_EPOLL_WAIT;
+        if(Stream != NULL) {
+            struct timespec Now;
+            SdbTimeMonotonic(&Now);
+            sdb_timediff UntilDue = PgStreamUntilDue(Stream, SdbTimespecNs(&Now));
+            Wait                  = SdbMin(Wait, UntilDue);
+        }
+
+        // NOTE(ingar): While the stream is busy, is appending a rolled back batch again or waits
+        // for a commit to free a pipe's buffers, ready pipes would wake epoll right away without
+        // being read, so only the connection is waited on
+        struct epoll_event Events[PG_EPOLL_BATCH];
+        int                EventCount;
+        bool               Busy
+            = Stream != NULL && (!PgStreamReady(Stream) || Kept.Next != Kept.Head || KeptWait);
+        if(Busy) {
+            struct pollfd ConnPoll = { .fd = PQsocket(Conn), .events = PgStreamEvents(Stream) };
+            EventCount = poll(&ConnPoll, 1, SDB_TIME_TO_MS(Wait + SDB_TIME_MS(1) - 1));
+            Events[0]  = (struct epoll_event){ .data.u64 = PG_EPOLL_CONN };
+        } else {
+            EventCount = epoll_wait(EpollFd, Events, PG_EPOLL_BATCH,
+                                    SDB_TIME_TO_MS(Wait + SDB_TIME_MS(1) - 1));
+        }
+        if(EventCount == -1) {
             if(errno == EINTR) {
                 SdbLogWarning("Epoll wait received interrupt");
                 continue;
@@ -121,69 +574,202 @@ PgRun(void *Arg)
                 Ret = -errno;
                 break;
             }
-        } else if(EpollRet == 0) {
-            SdbLogInfo("Epoll wait timed out for the %lusthnd time", ++TimeoutCounter);
-            if(TimeoutCounter >= 5) {
-                SdbLogError("Epoll has timed out more than threshold. Stopping main loop");
-                Ret = -ETIMEDOUT;
-            } else {
-                continue;
-            }
         }
 
-        if(Events[0].events & (EPOLLERR | EPOLLHUP)) {
-            SdbLogError("Epoll error on read event fd");
-            Ret = -EIO; // Use appropriate error code
-            break;
+        if(Stream != NULL) {
+            PgSortEventsByTable(Events, EventCount, Ctx->SensorCount);
         }
 
-        if(Events[0].events & EPOLLIN) {
-            sdb_arena *Buf = NULL;
-            while((Buf = SdPipeGetReadBuffer(Pipe)) != NULL) {
-                SdbAssert(Buf->Cur % Pipe->PacketSize == 0,
-                          "Pipe does not contain a multiple of the packet size");
+        for(int e = 0; e < EventCount && Ret == 0; ++e) {
+            // NOTE(ingar): Errors on the socket are found by libpq when the stream is pumped
+            if(Events[e].data.u64 == PG_EPOLL_CONN) {
+                if(PgStreamPump(Stream) != 0) {
+                    Ret = PgCountFailure(&PgFailCounter);
+                }
+                KeptWait &= PgKeptSettle(&Kept, Stream, Ctx->SdPipes) == 0;
+                continue;
+            }
 
-                u64 ItemCount = Buf->Cur / Pipe->PacketSize;
-                SdbLogDebug("Inserting %lu items into db. Total is %lu", ItemCount,
-                            TotalInsertedItems);
-                TotalInsertedItems += ItemCount;
+            if(Events[e].events & (EPOLLERR | EPOLLHUP)) {
+                SdbLogError("Epoll error on read event fd");
+                Ret = -EIO; // Use appropriate error code
+                break;
+            }
+
+            // NOTE(ingar): One buffer per event, so a busy sensor can not starve the others. The
+            // event stays ready until the pipe is found empty, and the pipe is never waited on
+            // here, so the epoll timeout holds
+            if(Stream != NULL && (!PgStreamReady(Stream) || Kept.Next != Kept.Head)) {
+                continue;
+            }
 
-                SdbTimeMonotonic(&CopyStart);
-                sdb_errno InsertRet
-                    = PgInsertData(Conn, TableInfo, (const char *)Buf->Mem, ItemCount);
-                SdbTimeMonotonic(&CopyEnd);
+            // NOTE(ingar): A pipe whose buffers are all kept has its writer waiting for them, so
+            // the batch holding them is committed now
+            u64               PipeIdx = Events[e].data.u64;
+            sensor_data_pipe *Pipe    = Ctx->SdPipes[PipeIdx];
+            if(Stream != NULL && SdPipeKeptFull(Pipe)) {
+                KeptWait = true;
+                if(PgStreamCommit(Stream) != 0) {
+                    Ret = PgCountFailure(&PgFailCounter);
+                }
+                KeptWait &= PgKeptSettle(&Kept, Stream, Ctx->SdPipes) == 0;
+                continue;
+            }
 
-                SdbTimePrintSpecDiffWT(&CopyStart, &CopyEnd, &TimeDiff);
-                SdbLogDebug("Copy transaction time: %ld.%09ld ", TimeDiff.tv_sec, TimeDiff.tv_nsec);
+            sdb_arena *Buf = SdPipeTryGetReadBuffer(Pipe);
+            if(Buf == NULL) {
+                continue;
+            }
 
-                SdbTimePrintSpecDiffWT(&LoopStart, &CopyEnd, &TimeDiff);
-                SdbLogDebug("Time since loop start: %ld.%09ld\n", TimeDiff.tv_sec,
-                            TimeDiff.tv_nsec);
+            // NOTE(ingar): A persistent pipe may replay buffers written before the sensors were
+            // changed, which are not rows of the pipe's table any more. The records of a
+            // prefixed buffer each tell their own table
+            u64             SensorIdx = PipeIdx % Ctx->SensorCount;
+            pg_table_info  *TableInfo = PgCtx->TablesInfo[SensorIdx];
+            sdp_buf_header *Header    = SdPipeGetHeader(Pipe, Buf);
+            bool            Prefixed  = Header->Framing == SdpFraming_Prefixed;
+            SdbMemset(Counts, 0, Ctx->SensorCount * sizeof(*Counts));
+            if((!Prefixed && Header->SchemaId != SensorIdx) || Header->Endian != SDP_ENDIAN_HOST
+               || Header->Framing > SdpFraming_Prefixed) {
+                SdbLogError("Dropping buffer of %u records with schema %u, byte order %u and "
+                            "framing %u from pipe %lu",
+                            Header->RecordCount, Header->SchemaId, Header->Endian,
+                            Header->Framing, PipeIdx);
+                if(Stream != NULL) {
+                    PgKeptAdd(&Kept, Pipe, PipeIdx, Counts, Ctx->SensorCount);
+                    PgKeptSettle(&Kept, Stream, Ctx->SdPipes);
+                } else {
+                    SdPipeReleaseReadBuffer(Pipe);
+                }
+                continue;
+            }
 
-                if(TotalInsertedItems >= 1e6) {
-                    break;
+            u64 ItemCount = Header->RecordCount;
+            if(Prefixed) {
+                u64 Dropped = PgCountRecords(Buf, PgCtx, Ctx->SensorCount, Counts);
+                if(Dropped > 0) {
+                    SdbLogWarning("Dropping %lu records of pipe %lu that are no table's rows",
+                                  Dropped, PipeIdx);
                 }
+                ItemCount -= Dropped;
+            } else {
+                SdbAssert(Buf->Cur == Header->RecordCount * Pipe->PacketSize,
+                          "Pipe does not contain a multiple of the packet size");
+                Counts[SensorIdx] = ItemCount;
+            }
 
-                if(InsertRet != 0) {
-                    SdbLogError("Failed to insert data for the %lusthnd", ++PgFailCounter);
-                    if(PgFailCounter >= 5) {
-                        SdbLogError("Postgres operations have failed more than threshod. Stopping "
-                                    "main loop");
-                        Ret = -1;
-                        break;
+            SdbLogDebug("Inserting %lu items into %s. Total is %lu", ItemCount,
+                        Prefixed ? "several tables" : TableInfo->TableName, TotalInsertedItems);
+            TotalInsertedItems += ItemCount;
+
+            // NOTE(ingar): The rows are converted into the stream's stage one table at a time,
+            // and the buffer is kept until they commit. Their latency is recorded then
+            if(Stream != NULL) {
+                PgKeptAdd(&Kept, Pipe, PipeIdx, Counts, Ctx->SensorCount);
+                while(Ret == 0 && PgStreamReady(Stream) && Kept.Next != Kept.Head) {
+                    if(PgKeptAppendNext(&Kept, Stream, Ctx, PgCtx) != 0) {
+                        Ret = PgCountFailure(&PgFailCounter);
                     }
-                } else {
-                    SdbLogDebug("Pipe data inserted successfully");
+                    KeptWait &= PgKeptSettle(&Kept, Stream, Ctx->SdPipes) == 0;
+                }
+                if(Ret == 0 && PgStreamCommitIfDue(Stream) != 0) {
+                    Ret = PgCountFailure(&PgFailCounter);
                 }
+                KeptWait &= PgKeptSettle(&Kept, Stream, Ctx->SdPipes) == 0;
+                continue;
+            }
+
+            u64       InsertedRows = 0;
+            sdb_errno InsertRet;
+            SdbTimeMonotonic(&CopyStart);
+            if(Prefixed) {
+                InsertRet = PgInsertRecords(Conn, PgCtx, Buf, Counts, Ctx->SensorCount,
+                                            &InsertedRows);
+            } else {
+                InsertRet = PgInsertData(Conn, TableInfo, (const char *)Buf->Mem, ItemCount);
+                InsertedRows = (InsertRet == 0) ? ItemCount : 0;
             }
+            SdbTimeMonotonic(&CopyEnd);
+
+            SdbTimePrintSpecDiffWT(&CopyStart, &CopyEnd, &TimeDiff);
+            SdbLogDebug("Copy transaction time: %ld.%09ld ", TimeDiff.tv_sec, TimeDiff.tv_nsec);
+
+            SdbTimePrintSpecDiffWT(&LoopStart, &CopyEnd, &TimeDiff);
+            SdbLogDebug("Time since loop start: %ld.%09ld\n", TimeDiff.tv_sec, TimeDiff.tv_nsec);
+
+            CommittedRows += InsertedRows;
+            if(InsertRet != 0) {
+                Ret = PgCountFailure(&PgFailCounter);
+            } else {
+                SdbLogDebug("Pipe data inserted successfully");
+                struct timespec Committed;
+                SdbTimeNow(&Committed);
+                SdPipeRecordLatency(Pipe, Buf, SdbTimespecNs(&Committed), Latency);
+            }
+            SdPipeReleaseReadBuffer(Pipe);
         }
+
+        if(Stream != NULL && Ret == 0) {
+            // NOTE(ingar): A reconnect that failed has no socket to wake the loop, so it is
+            // retried from here
+            if(Stream->Phase == PgStream_Resetting) {
+                PgStreamPump(Stream);
+            }
+            if(PgStreamCommitIfDue(Stream) != 0) {
+                Ret = PgCountFailure(&PgFailCounter);
+            }
+            KeptWait &= PgKeptSettle(&Kept, Stream, Ctx->SdPipes) == 0;
+            while(Ret == 0 && PgStreamReady(Stream) && Kept.Next != Kept.Head) {
+                if(PgKeptAppendNext(&Kept, Stream, Ctx, PgCtx) != 0) {
+                    Ret = PgCountFailure(&PgFailCounter);
+                }
+                KeptWait &= PgKeptSettle(&Kept, Stream, Ctx->SdPipes) == 0;
+            }
+            if(PgWatchConn(EpollFd, Stream, &WatchedResets, &WatchedEvents) != 0) {
+                Ret = -EIO;
+            }
+        }
+
+        u64 Committed = (Stream != NULL) ? Stream->CommittedRows : CommittedRows;
+        if(Committed != PublishedRows) {
+            atomic_fetch_add_explicit(&Ctx->PgInsertedRows, Committed - PublishedRows,
+                                      memory_order_relaxed);
+            PublishedRows = Committed;
+        }
+
+        struct timespec Now;
+        SdbTimeMonotonic(&Now);
+        if(SdbTimeoutExpired(&NextLatencyLog, &Now)) {
+            PgLogLatency(Latency, Writer);
+            if(Stream != NULL) {
+                SdbLogInfo("Writer %u COPY stream: %lu batches committed, %lu rolled back with "
+                           "%lu rows, %lu reconnects",
+                           Writer, Stream->CommitCount, Stream->RollbackCount, Stream->LostRows,
+                           Stream->ResetCount);
+            }
+            NextLatencyLog = Now;
+            SdbTimeAdd(&NextLatencyLog, PG_LATENCY_STATS_INTERVAL);
+        }
+    }
+
+    // NOTE(ingar): Buffers whose rows are not committed stay kept, so a persistent pipe replays
+    // them on the next start
+    if(Stream != NULL) {
+        PgStreamFinish(Stream, PG_FINISH_TIMEOUT);
+        PgKeptSettle(&Kept, Stream, Ctx->SdPipes);
     }
+    PgLogLatency(Latency, Writer);
 
     SdbLogDebug("Total time in loop: %ld.%09ld\n", TimeDiff.tv_sec, TimeDiff.tv_nsec);
 
-    PQfinish(PgCtx->DbConn);
-    close(EpollFd);
-    free(PgAMem);
+cleanup:
+    if(PgCtx != NULL) {
+        PQfinish(PgCtx->DbConn);
+    }
+    if(EpollFd != -1) {
+        close(EpollFd);
+    }
+    SdbPagesUnmap(&PgPages);
 
     SdbLogDebug("Postgres loop finished. Exiting");
 
@@ -16,16 +16,16 @@
  *
  * Manages the PostgreSQL database operations:
  * - Initializes database connection
- * - Processes sensor data from pipe
+ * - Processes sensor data from the pipes of its tables into them
  * - Handles data insertion with timing metrics
  * - Manages graceful shutdown
  * 
  * @param Arg Pointer to mbpg_ctx structure
+ * @param Writer Index of the writer, which selects its tables
  * @return sdb_errno 0 on success, error code on failure:
- *         - -ETIMEDOUT: Connection timeout
  *         - -EIO: I/O error
  *         - -errno: System error codes
  */
-sdb_errno PgRun(void *Arg);
+sdb_errno PgRun(void *Arg, u32 Writer);
 
 #endif
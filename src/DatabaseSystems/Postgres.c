@@ -5,6 +5,7 @@
 
 #include <arpa/inet.h>
 #include <libpq-fe.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
@@ -201,7 +202,7 @@ GetTableMetadata(PGconn *DbConn, sdb_string TableName, i16 *ColCount, i16 *ColCo
 
 
 postgres_ctx *
-PgPrepareCtx(sdb_arena *PgArena, sensor_data_pipe *Pipe)
+PgPrepareCtx(sdb_arena *PgArena, sensor_data_pipe **Pipes, u64 PipeCount, u64 LaneCount)
 {
     sdb_errno         Errno   = 0;
     sdb_scratch_arena Scratch = SdbScratchGet(NULL, 0);
@@ -226,9 +227,19 @@ PgPrepareCtx(sdb_arena *PgArena, sensor_data_pipe *Pipe)
         goto cleanup;
     }
 
-    u64           SensorCount = cJSON_GetArraySize(SensorSchemaArray);
-    postgres_ctx *PgCtx       = SdbPushStruct(PgArena, postgres_ctx);
-    PgCtx->TablesInfo         = SdbPushArray(PgArena, pg_table_info *, SensorCount);
+    u64 SensorCount = cJSON_GetArraySize(SensorSchemaArray);
+    if(SensorCount * LaneCount != PipeCount) {
+        SdbLogError("The sensor schemas have %lu sensors, but %lu pipes were created for %lu "
+                    "lanes",
+                    SensorCount, PipeCount, LaneCount);
+        cJSON_Delete(SchemaConf);
+        SdbScratchRelease(Scratch);
+        return NULL;
+    }
+
+    postgres_ctx *PgCtx = SdbPushStruct(PgArena, postgres_ctx);
+    PgCtx->TableCount   = SensorCount;
+    PgCtx->TablesInfo   = SdbPushArray(PgArena, pg_table_info *, SensorCount);
 
     const char *ConnInfo = (const char *)ConfFile->Data;
     PgCtx->DbConn        = PQconnectdb(ConnInfo);
@@ -323,14 +334,17 @@ PgPrepareCtx(sdb_arena *PgArena, sensor_data_pipe *Pipe)
         SdbStringBackspace(Ti->CopyCommand, 2);
         SdbStringAppendC(Ti->CopyCommand, ") FROM STDIN WITH (FORMAT binary)");
 
-        // NOTE(ingar): An assumption made is that each sensor will have its own pipe since we don't
-        // have a method of differentiating packets at the moment, but unfortunately we probably
-        // don't have time to complete this part. This means that the max number of sensors
-        // supported in this current implementation is 1, BUT extending it to support more should be
-        // relatively simple.
-        Pipe->PacketSize    = Ti->RowSize;
-        Pipe->ItemMaxCount  = Pipe->Buffers[0]->Cap / Pipe->PacketSize;
-        Pipe->BufferMaxFill = Pipe->PacketSize * Pipe->ItemMaxCount;
+        if(PgCompileConvPlan(Ti, PgArena) != 0) {
+            Errno = -SDBE_PG_ERR;
+            goto cleanup;
+        }
+
+        for(u64 l = 0; l < LaneCount; ++l) {
+            sensor_data_pipe *Pipe = Pipes[l * SensorCount + SensorIdx];
+            Pipe->PacketSize       = Ti->RowSize;
+            Pipe->ItemMaxCount     = Pipe->Buffers[0]->Cap / Pipe->PacketSize;
+            Pipe->BufferMaxFill    = Pipe->PacketSize * Pipe->ItemMaxCount;
+        }
 
         ++SensorIdx;
     }
@@ -352,52 +366,212 @@ cleanup:
 }
 
 
+// NOTE(ingar): The columns are moved with __builtin_memcpy rather than SdbMemcpy, which is
+// defined in another translation unit, so each one compiles to a load and a store
+
 /**
  * @brief Writes a 2-byte value in network byte order
  *
  * @param To Destination buffer
  * @param From Source buffer
- * @return Number of bytes written
  */
-static inline size_t
+static inline void
 Write2(char *To, const char *From)
 {
     u16 Val;
-    SdbMemcpy(&Val, From, sizeof(Val));
+    __builtin_memcpy(&Val, From, sizeof(Val));
     Val = htobe16(Val);
-    SdbMemcpy(To, &Val, sizeof(Val));
-    return sizeof(Val);
+    __builtin_memcpy(To, &Val, sizeof(Val));
 }
 
-static inline size_t
+static inline void
 Write4(char *To, const char *From)
 {
     u32 Val;
-    SdbMemcpy(&Val, From, sizeof(Val));
+    __builtin_memcpy(&Val, From, sizeof(Val));
     Val = htobe32(Val);
-    SdbMemcpy(To, &Val, sizeof(Val));
-    return sizeof(Val);
+    __builtin_memcpy(To, &Val, sizeof(Val));
 }
 
-static inline size_t
+static inline void
 Write8(char *To, const char *From)
 {
     u64 Val;
-    SdbMemcpy(&Val, From, sizeof(Val));
+    __builtin_memcpy(&Val, From, sizeof(Val));
     Val = htobe64(Val);
-    SdbMemcpy(To, &Val, sizeof(Val));
-    return sizeof(Val);
+    __builtin_memcpy(To, &Val, sizeof(Val));
 }
 
-static inline size_t
+static inline void
 WriteTimestamp(char *To, const char *From)
 {
     time_t UTime;
-    SdbMemcpy(&UTime, From, sizeof(UTime));
+    __builtin_memcpy(&UTime, From, sizeof(UTime));
     pg_timestamp Val = UnixToPgTimestamp(UTime);
     Val              = htobe64(Val);
-    SdbMemcpy(To, &Val, sizeof(Val));
-    return sizeof(Val);
+    __builtin_memcpy(To, &Val, sizeof(Val));
+}
+
+/**
+ * @brief Finds the op that converts a column
+ *
+ * NOTE(ingar): Support for incoming timestamps of different types (timeval, timespec, time_t,
+ * other) is probably outside the scope of this project, since I think it will be quite tricky.
+ * I think it's best if we just set it to be time_t, since it's a single value (unlike timeval
+ * and timespec)
+ */
+static sdb_errno
+PgConvOpOf(const pg_col_metadata *ColMd, pg_conv_op *Op)
+{
+    static const i32 OpSize[PgConv_Count] = {
+        [PgConv_Swap8] = 8, [PgConv_Swap4] = 4, [PgConv_Swap2] = 2, [PgConv_Timestamp] = 8
+    };
+
+    switch(ColMd->TypeOid) {
+        case PG_INT8:
+        case PG_FLOAT8:
+            *Op = PgConv_Swap8;
+            break;
+        case PG_INT4:
+        case PG_FLOAT4:
+            *Op = PgConv_Swap4;
+            break;
+        case PG_INT2:
+            *Op = PgConv_Swap2;
+            break;
+        case PG_TIMESTAMP:
+            *Op = PgConv_Timestamp;
+            break;
+        default:
+            SdbLogError("Column %s has the unhandled or invalid PG oid %d", ColMd->ColumnName,
+                        ColMd->TypeOid);
+            return -SDBE_PG_ERR;
+    }
+
+    if(ColMd->TypeLength != OpSize[*Op]) {
+        SdbLogError("Column %s with PG oid %d is %d bytes, expected %d", ColMd->ColumnName,
+                    ColMd->TypeOid, ColMd->TypeLength, OpSize[*Op]);
+        return -SDBE_PG_ERR;
+    }
+
+    return 0;
+}
+
+sdb_errno
+PgCompileConvPlan(pg_table_info *Ti, sdb_arena *A)
+{
+    pg_conv_plan *Plan = &Ti->ConvPlan;
+    Plan->RowSize      = sizeof(i16) + Ti->ColCountNoAutoIncrements * sizeof(i32) + Ti->RowSize;
+    Plan->Template     = SdbPushArrayZero(A, char, Plan->RowSize);
+    Plan->Steps        = SdbPushArray(A, pg_conv_step, Ti->ColCountNoAutoIncrements);
+    if(Plan->Template == NULL || Plan->Steps == NULL) {
+        SdbLogError("Insufficient space for the conversion plan of table %s", Ti->TableName);
+        return -ENOMEM;
+    }
+
+    u32 OpCount[PgConv_Count] = { 0 };
+    for(i16 c = 0; c < Ti->ColCount; ++c) {
+        pg_conv_op Op = PgConv_Swap8;
+        if(Ti->ColMetadata[c].IsAutoIncrement) {
+            continue;
+        }
+        if(PgConvOpOf(&Ti->ColMetadata[c], &Op) != 0) {
+            return -SDBE_PG_ERR;
+        }
+        ++OpCount[Op];
+    }
+
+    // NOTE(ingar): OpCount is reused as the next step of each op
+    Plan->OpStart[0] = 0;
+    for(u32 o = 0; o < PgConv_Count; ++o) {
+        Plan->OpStart[o + 1] = Plan->OpStart[o] + OpCount[o];
+        OpCount[o]           = Plan->OpStart[o];
+    }
+
+    i16 NtwrkFieldCount = htons(Ti->ColCountNoAutoIncrements);
+    SdbMemcpy(Plan->Template, &NtwrkFieldCount, sizeof(NtwrkFieldCount));
+    u64 DstOffset = sizeof(NtwrkFieldCount);
+    for(i16 c = 0; c < Ti->ColCount; ++c) {
+        const pg_col_metadata *ColMd = &Ti->ColMetadata[c];
+        pg_conv_op             Op    = PgConv_Swap8;
+        if(ColMd->IsAutoIncrement) {
+            continue;
+        }
+        PgConvOpOf(ColMd, &Op);
+
+        i32 NtwrkTypeLen = htobe32(ColMd->TypeLength);
+        SdbMemcpy(Plan->Template + DstOffset, &NtwrkTypeLen, sizeof(NtwrkTypeLen));
+        DstOffset += sizeof(NtwrkTypeLen);
+
+        pg_conv_step *Step = &Plan->Steps[OpCount[Op]++];
+        Step->SrcOffset    = ColMd->Offset;
+        Step->DstOffset    = DstOffset;
+        DstOffset += ColMd->TypeLength;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Bytes ItemCount rows of the table take up in the binary COPY format
+ */
+static inline size_t
+PgCopyRowsSize(const pg_table_info *Ti, u64 ItemCount)
+{
+    return ItemCount * Ti->ConvPlan.RowSize;
+}
+
+size_t
+PgConvertRows(const pg_table_info *Ti, const char *Data, u64 ItemCount, char *To)
+{
+    const pg_conv_plan *Plan  = &Ti->ConvPlan;
+    const pg_conv_step *Steps = Plan->Steps;
+    const u32          *Start = Plan->OpStart;
+
+    for(u64 r = 0; r < ItemCount; ++r) {
+        const char *Row = Data + r * Ti->RowSize;
+        char       *Dst = To + r * Plan->RowSize;
+
+        __builtin_memcpy(Dst, Plan->Template, Plan->RowSize);
+        for(u32 s = Start[PgConv_Swap8]; s < Start[PgConv_Swap8 + 1]; ++s) {
+            Write8(Dst + Steps[s].DstOffset, Row + Steps[s].SrcOffset);
+        }
+        for(u32 s = Start[PgConv_Swap4]; s < Start[PgConv_Swap4 + 1]; ++s) {
+            Write4(Dst + Steps[s].DstOffset, Row + Steps[s].SrcOffset);
+        }
+        for(u32 s = Start[PgConv_Swap2]; s < Start[PgConv_Swap2 + 1]; ++s) {
+            Write2(Dst + Steps[s].DstOffset, Row + Steps[s].SrcOffset);
+        }
+        for(u32 s = Start[PgConv_Timestamp]; s < Start[PgConv_Timestamp + 1]; ++s) {
+            WriteTimestamp(Dst + Steps[s].DstOffset, Row + Steps[s].SrcOffset);
+        }
+    }
+
+    return ItemCount * Plan->RowSize;
+}
+
+
+/**
+ * @brief Sends the header that starts the data of a binary COPY
+ */
+static sdb_errno
+PgPutCopyHeader(PGconn *Conn, pg_table_info *Ti)
+{
+    char CopyHeader[19]       = "PGCOPY\n\377\r\n\0";
+    u32  CopyFlags            = htonl(0);
+    u32  CopyExtenstionLength = htonl(0);
+
+    SdbMemcpy(CopyHeader + 11, &CopyFlags, sizeof(CopyFlags));
+    SdbMemcpy(CopyHeader + 15, &CopyExtenstionLength, sizeof(CopyExtenstionLength));
+
+    if(PQputCopyData(Conn, CopyHeader, 19) != 1) {
+        SdbLogError("Failed to send COPY binary header for table %s. Pg error: %s", Ti->TableName,
+                    PQerrorMessage(Conn));
+        return -SDBE_PG_ERR;
+    }
+
+    return 0;
 }
 
 
@@ -444,23 +618,12 @@ PgInsertData(PGconn *Conn, pg_table_info *Ti, const char *Data, u64 ItemCount)
     PQclear(PgRes);
 
 
-    char CopyHeader[19]       = "PGCOPY\n\377\r\n\0";
-    u32  CopyFlags            = htonl(0);
-    u32  CopyExtenstionLength = htonl(0);
-
-    SdbMemcpy(CopyHeader + 11, &CopyFlags, sizeof(CopyFlags));
-    SdbMemcpy(CopyHeader + 15, &CopyExtenstionLength, sizeof(CopyExtenstionLength));
-
-    if(PQputCopyData(Conn, CopyHeader, 19) != 1) {
-        SdbLogError("Failed to send COPY binary header for table %s. Pg error: %s", Ti->TableName,
-                    PQerrorMessage(Conn));
+    if(PgPutCopyHeader(Conn, Ti) != 0) {
         Ret = -SDBE_PG_ERR;
         goto cleanup;
     }
 
-    size_t PgHeaderSize
-        = sizeof(Ti->ColCount) + (ItemCount * sizeof(Ti->ColMetadata[0].TypeLength));
-    size_t NtwrkConvBufSize = PgHeaderSize + (ItemCount * Ti->RowSize);
+    size_t NtwrkConvBufSize = PgCopyRowsSize(Ti, ItemCount);
 
     sdb_scratch_arena NtwrkBufArena = SdbScratchGet(NULL, 0);
     char             *NtwrkConvBuf  = SdbPushArrayZero(NtwrkBufArena.Arena, char, NtwrkConvBufSize);
@@ -472,54 +635,7 @@ PgInsertData(PGconn *Conn, pg_table_info *Ti, const char *Data, u64 ItemCount)
         goto cleanup;
     }
 
-    size_t ConvOffset = 0;
-    for(u64 RowsProcessed = 0; RowsProcessed < ItemCount; ++RowsProcessed) {
-        const char *CurrRow = (const char *)Data + (RowsProcessed * Ti->RowSize);
-
-        i16 NtwrkFieldCount = htons(Ti->ColCountNoAutoIncrements);
-        SdbMemcpy(NtwrkConvBuf + ConvOffset, &NtwrkFieldCount, sizeof(NtwrkFieldCount));
-        ConvOffset += sizeof(NtwrkFieldCount);
-
-        for(u64 c = 0; c < Ti->ColCount; ++c) {
-            pg_col_metadata ColMd = Ti->ColMetadata[c];
-
-            if(ColMd.IsAutoIncrement) {
-                continue;
-            }
-
-            i32 NtwrkTypeLen = htobe32(ColMd.TypeLength);
-            SdbMemcpy(NtwrkConvBuf + ConvOffset, &NtwrkTypeLen, sizeof(NtwrkTypeLen));
-            ConvOffset += sizeof(NtwrkTypeLen);
-
-            // WARN: The type length might not necessarily be the same as the type written to the
-            // network conversion buffer, so we might need to add handling of that
-            const char *ColData = CurrRow + ColMd.Offset;
-            switch(ColMd.TypeOid) {
-                case PG_INT8:
-                case PG_FLOAT8:
-                    ConvOffset += Write8(NtwrkConvBuf + ConvOffset, ColData);
-                    break;
-                case PG_INT4:
-                case PG_FLOAT4:
-                    ConvOffset += Write4(NtwrkConvBuf + ConvOffset, ColData);
-                    break;
-                case PG_INT2:
-                    ConvOffset += Write2(NtwrkConvBuf + ConvOffset, ColData);
-                    break;
-                case PG_TIMESTAMP:
-                    // NOTE(ingar): Support for incoming timestamps of different types
-                    // (timeval, timespec, time_t, other) is probably outside the scope of
-                    // this project, since I think it will be quite tricky.
-                    // I think it's best if we just set it to be time_t, since it's a single
-                    // value (unlike timeval and timespec)
-                    ConvOffset += WriteTimestamp(NtwrkConvBuf + ConvOffset, ColData);
-                    break;
-                default:
-                    SdbLogWarning("Encountered unhandled or invalid PG oid %d", ColMd.TypeOid);
-                    break;
-            }
-        }
-    }
+    size_t ConvOffset = PgConvertRows(Ti, Data, ItemCount, NtwrkConvBuf);
 
     if(PQputCopyData(Conn, NtwrkConvBuf, ConvOffset) != 1) {
         SdbLogError("Unable to copy converted data for table %s. Pg error: %s", Ti->TableName,
@@ -569,3 +685,467 @@ cleanup:
 
     return Ret;
 }
+
+
+sdb_errno
+PgStreamInit(pg_copy_stream *Stream, PGconn *Conn, u64 MaxRows, u64 MaxBytes,
+             sdb_timediff MaxAge, u64 StageCap, sdb_latency_hist *Hist, sdb_arena *A)
+{
+    SdbMemZero(Stream, sizeof(*Stream));
+    Stream->Conn        = Conn;
+    Stream->Hist        = Hist;
+    Stream->MaxRows     = MaxRows;
+    Stream->MaxBytes    = MaxBytes;
+    Stream->MaxAge      = MaxAge;
+    Stream->Phase       = PgStream_Idle;
+    Stream->StageCap    = StageCap;
+    Stream->Stamps      = SdbPushArray(A, pg_stream_stamp, PG_STREAM_STAMP_MAX);
+    Stream->Stage       = SdbPushArray(A, char, StageCap);
+    Stream->StageStamps = SdbPushArray(A, pg_stream_stamp, SDP_STAMP_MAX);
+    if(Stream->Stamps == NULL || Stream->Stage == NULL || Stream->StageStamps == NULL) {
+        return -ENOMEM;
+    }
+
+    if(PQsetnonblocking(Conn, 1) != 0) {
+        SdbLogError("Failed to make the connection non-blocking. Pg error: %s",
+                    PQerrorMessage(Conn));
+        return -SDBE_PG_ERR;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Adds receive times to a list of them, counting rows with the last entry once it is
+ * full
+ */
+static void
+PgStreamAddStamps(pg_stream_stamp *To, u64 *ToCount, u64 ToCap, const pg_stream_stamp *From,
+                  u64 FromCount)
+{
+    for(u64 s = 0; s < FromCount; ++s) {
+        if(*ToCount == ToCap) {
+            To[*ToCount - 1].Count += From[s].Count;
+        } else {
+            To[(*ToCount)++] = From[s];
+        }
+    }
+}
+
+/**
+ * @brief Forgets the open batch once it has been committed or rolled back
+ */
+static void
+PgStreamReset(pg_copy_stream *Stream)
+{
+    Stream->Phase        = PgStream_Idle;
+    Stream->CommitWanted = false;
+    Stream->Ti           = NULL;
+    Stream->Rows         = 0;
+    Stream->Bytes        = 0;
+    Stream->StampCount   = 0;
+    Stream->BatchAppends = 0;
+}
+
+/**
+ * @brief Starts reopening the lost connection, to be moved on by PgStreamResetStep
+ */
+static void
+PgStreamResetStart(pg_copy_stream *Stream)
+{
+    struct timespec Now;
+    SdbTimeMonotonic(&Now);
+    Stream->Phase     = PgStream_Resetting;
+    Stream->ResetNs   = SdbTimespecNs(&Now);
+    Stream->ResetPoll = PGRES_POLLING_WRITING;
+    if(!PQresetStart(Stream->Conn)) {
+        SdbLogWarning("Failed to start reconnecting. Pg error: %s", PQerrorMessage(Stream->Conn));
+        Stream->ResetPoll = PGRES_POLLING_FAILED;
+    }
+}
+
+/**
+ * @brief Moves the reconnect on without waiting for the server. An attempt that failed is
+ * retried PG_RESET_RETRY after it began, and one that takes PG_RESET_TIMEOUT is started over
+ *
+ * @return int 1 once the connection is open again, 0 while the reconnect waits
+ */
+static int
+PgStreamResetStep(pg_copy_stream *Stream)
+{
+    PGconn         *Conn = Stream->Conn;
+    struct timespec Now;
+    SdbTimeMonotonic(&Now);
+    u64 Age = SdbTimespecNs(&Now) - Stream->ResetNs;
+    if(Stream->ResetPoll == PGRES_POLLING_FAILED) {
+        if(Age >= PG_RESET_RETRY) {
+            PgStreamResetStart(Stream);
+        }
+        return 0;
+    }
+    if(Age >= PG_RESET_TIMEOUT) {
+        SdbLogWarning("Timed out reconnecting to the database, starting over");
+        PgStreamResetStart(Stream);
+        return 0;
+    }
+
+    PostgresPollingStatusType Poll = PQresetPoll(Conn);
+    if(Poll == PGRES_POLLING_OK) {
+        if(PQsetnonblocking(Conn, 1) != 0) {
+            SdbLogWarning("Failed to make the connection non-blocking. Pg error: %s",
+                          PQerrorMessage(Conn));
+        }
+        SdbLogInfo("Reconnected to the database");
+        PgStreamReset(Stream);
+        return 1;
+    }
+    if(Poll == PGRES_POLLING_FAILED) {
+        SdbLogWarning("Failed to reconnect to the database. Pg error: %s", PQerrorMessage(Conn));
+    }
+    Stream->ResetPoll = Poll;
+
+    return 0;
+}
+
+/**
+ * @brief Rolls back the open batch, along with the staged rows
+ *
+ * NOTE(ingar): Failures are rare, so this waits for the server in blocking mode rather than
+ * adding failure phases to the stream. A lost connection has no server to wait for, and is
+ * reopened without blocking, by PgStreamResetStep
+ */
+static void
+PgStreamRollback(pg_copy_stream *Stream)
+{
+    PGconn *Conn      = Stream->Conn;
+    bool    Resetting = (Stream->Phase == PgStream_Resetting);
+    if(!Resetting && PQstatus(Conn) != CONNECTION_BAD) {
+        PQsetnonblocking(Conn, 0);
+        if(Stream->Phase == PgStream_Copying) {
+            PQputCopyEnd(Conn, "Batch rolled back");
+        }
+        PGresult *PgRes;
+        while((PgRes = PQgetResult(Conn)) != NULL) {
+            if(PQresultStatus(PgRes) == PGRES_COPY_IN) {
+                PQputCopyEnd(Conn, "Batch rolled back");
+            }
+            PQclear(PgRes);
+        }
+        if(Stream->Phase != PgStream_Idle) {
+            PQclear(PQexec(Conn, "ROLLBACK"));
+        }
+        PQsetnonblocking(Conn, 1);
+    }
+
+    u64 Lost = Stream->Rows + Stream->StageRows;
+    Stream->LostRows += Lost;
+    ++Stream->RollbackCount;
+    SdbLogWarning("Rolled back COPY batch of %lu rows", Lost);
+
+    PgStreamReset(Stream);
+    Stream->Flushing        = false;
+    Stream->StageRows       = 0;
+    Stream->StageSize       = 0;
+    Stream->StageStampCount = 0;
+
+    // NOTE(ingar): The next batch would fail as well, so a lost connection is reopened first
+    if(Resetting) {
+        Stream->Phase = PgStream_Resetting;
+    } else if(PQstatus(Conn) == CONNECTION_BAD) {
+        SdbLogWarning("Lost the database connection, reconnecting");
+        ++Stream->ResetCount;
+        PgStreamResetStart(Stream);
+    }
+}
+
+/**
+ * @brief Sends a command without waiting for its results
+ *
+ * @return int 1 once sent, -1 on failure
+ */
+static int
+PgStreamSend(pg_copy_stream *Stream, const char *Command, pg_stream_phase Phase)
+{
+    if(!PQsendQuery(Stream->Conn, Command)) {
+        SdbLogError("Failed to send \"%s\". Pg error: %s", Command, PQerrorMessage(Stream->Conn));
+        return -1;
+    }
+    Stream->Phase        = Phase;
+    Stream->ResultFailed = false;
+
+    return 1;
+}
+
+/**
+ * @brief Takes the results of the command sent last that have arrived
+ *
+ * @param Stream COPY stream
+ * @param Want Status of a successful result
+ * @return int 1 if the command is done, or the COPY it started is open, 0 if more results are
+ * to come, -1 if it failed
+ */
+static int
+PgStreamResult(pg_copy_stream *Stream, ExecStatusType Want)
+{
+    PGconn *Conn = Stream->Conn;
+    if(!PQconsumeInput(Conn)) {
+        SdbLogError("Failed to read from the database. Pg error: %s", PQerrorMessage(Conn));
+        return -1;
+    }
+
+    while(!PQisBusy(Conn)) {
+        PGresult *PgRes = PQgetResult(Conn);
+        if(PgRes == NULL) {
+            return Stream->ResultFailed ? -1 : 1;
+        }
+
+        // NOTE(ingar): COMMIT of a transaction that failed succeeds, but rolls it back
+        ExecStatusType Status = PQresultStatus(PgRes);
+        if(Status != Want
+           || (Stream->Phase == PgStream_Committing && strcmp(PQcmdStatus(PgRes), "COMMIT") != 0)) {
+            SdbLogError("Database command failed in phase %d. Pg error: %s", Stream->Phase,
+                        PQresultErrorMessage(PgRes));
+            Stream->ResultFailed = true;
+        }
+        PQclear(PgRes);
+
+        // NOTE(ingar): A COPY that started has no more results until it is ended
+        if(Status == PGRES_COPY_IN) {
+            return Stream->ResultFailed ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Records the latency of the batch just committed and starts over
+ */
+static void
+PgStreamCommitted(pg_copy_stream *Stream)
+{
+    struct timespec Committed;
+    SdbTimeNow(&Committed);
+    u64 CommittedNs = SdbTimespecNs(&Committed);
+    for(u64 s = 0; s < Stream->StampCount; ++s) {
+        pg_stream_stamp *Stamp = &Stream->Stamps[s];
+        // NOTE(ingar): The realtime clock can be stepped back between receive and now
+        SdbLatencyHistAdd(Stream->Hist,
+                          (CommittedNs > Stamp->RecvNs) ? CommittedNs - Stamp->RecvNs : 0,
+                          Stamp->Count);
+    }
+
+    SdbLogDebug("Committed COPY batch of %lu rows, %lu bytes", Stream->Rows, Stream->Bytes);
+    ++Stream->CommitCount;
+    Stream->CommittedRows += Stream->Rows;
+    Stream->CommittedAppends += Stream->BatchAppends;
+    PgStreamReset(Stream);
+}
+
+/**
+ * @brief Moves the stream on by one phase, or puts the staged rows into the open COPY
+ *
+ * @return int 1 if it made progress, 0 if it waits for the socket, -1 on failure
+ */
+static int
+PgStreamStep(pg_copy_stream *Stream)
+{
+    PGconn *Conn = Stream->Conn;
+    int     Ret;
+    switch(Stream->Phase) {
+        case PgStream_Idle:
+            if(Stream->StageRows == 0) {
+                return 0;
+            }
+            struct timespec Now;
+            SdbTimeMonotonic(&Now);
+            Stream->StartNs = SdbTimespecNs(&Now);
+            return PgStreamSend(Stream, "BEGIN", PgStream_Beginning);
+
+        case PgStream_Beginning:
+            if((Ret = PgStreamResult(Stream, PGRES_COMMAND_OK)) != 1) {
+                return Ret;
+            }
+            Stream->Ti = Stream->StageTi;
+            return PgStreamSend(Stream, Stream->Ti->CopyCommand, PgStream_Starting);
+
+        case PgStream_Starting:
+            if((Ret = PgStreamResult(Stream, PGRES_COPY_IN)) != 1) {
+                return Ret;
+            }
+            Stream->Phase = PgStream_Copying;
+            return (PgPutCopyHeader(Conn, Stream->Ti) == 0) ? 1 : -1;
+
+        case PgStream_Copying:
+            // NOTE(ingar): The stage waits while libpq still has rows to send, so libpq never
+            // holds more than one buffer of them
+            if(Stream->StageRows > 0 && Stream->StageTi == Stream->Ti) {
+                if(Stream->Flushing) {
+                    return 0;
+                }
+                if(PQputCopyData(Conn, Stream->Stage, Stream->StageSize) != 1) {
+                    SdbLogError("Unable to copy converted data for table %s. Pg error: %s",
+                                Stream->Ti->TableName, PQerrorMessage(Conn));
+                    return -1;
+                }
+                Stream->Rows += Stream->StageRows;
+                Stream->Bytes += Stream->StageSize;
+                ++Stream->BatchAppends;
+                PgStreamAddStamps(Stream->Stamps, &Stream->StampCount, PG_STREAM_STAMP_MAX,
+                                  Stream->StageStamps, Stream->StageStampCount);
+                Stream->StageRows       = 0;
+                Stream->StageSize       = 0;
+                Stream->StageStampCount = 0;
+                return 1;
+            }
+            if(!Stream->CommitWanted && Stream->StageRows == 0) {
+                return 0;
+            }
+            if(PQputCopyEnd(Conn, NULL) != 1) {
+                SdbLogError("Failed to end COPY for table %s. Pg error: %s",
+                            Stream->Ti->TableName, PQerrorMessage(Conn));
+                return -1;
+            }
+            Stream->Phase        = PgStream_Ending;
+            Stream->ResultFailed = false;
+            return 1;
+
+        case PgStream_Ending:
+            if((Ret = PgStreamResult(Stream, PGRES_COMMAND_OK)) != 1) {
+                return Ret;
+            }
+            if(Stream->CommitWanted) {
+                Stream->Ti = NULL;
+                return PgStreamSend(Stream, "COMMIT", PgStream_Committing);
+            }
+            Stream->Ti = Stream->StageTi;
+            return PgStreamSend(Stream, Stream->Ti->CopyCommand, PgStream_Starting);
+
+        case PgStream_Committing:
+            if((Ret = PgStreamResult(Stream, PGRES_COMMAND_OK)) != 1) {
+                return Ret;
+            }
+            PgStreamCommitted(Stream);
+            return 1;
+
+        case PgStream_Resetting:
+            return PgStreamResetStep(Stream);
+    }
+
+    return 0;
+}
+
+sdb_errno
+PgStreamPump(pg_copy_stream *Stream)
+{
+    int Step;
+    do {
+        // NOTE(ingar): A connection being reopened has nothing to send
+        int Flush        = (Stream->Phase == PgStream_Resetting) ? 0 : PQflush(Stream->Conn);
+        Stream->Flushing = (Flush == 1);
+        if(Flush == -1) {
+            SdbLogError("Failed to send to the database. Pg error: %s",
+                        PQerrorMessage(Stream->Conn));
+            Step = -1;
+        } else {
+            Step = PgStreamStep(Stream);
+        }
+    } while(Step == 1);
+
+    if(Step == -1) {
+        PgStreamRollback(Stream);
+        return -SDBE_PG_ERR;
+    }
+
+    return 0;
+}
+
+sdb_errno
+PgStreamAppend(pg_copy_stream *Stream, pg_table_info *Ti, const char *Data, u64 ItemCount,
+               const sdp_stamps *Stamps)
+{
+    SdbAssert(PgStreamReady(Stream), "Rows appended to a COPY stream that is not ready");
+
+    size_t Size = PgCopyRowsSize(Ti, ItemCount);
+    if(Size > Stream->StageCap) {
+        SdbLogError("COPY stream stage has insufficient space for %lu rows of table %s (need %zd "
+                    "bytes). Re-evaluate scratch size",
+                    ItemCount, Ti->TableName, Size);
+        Stream->LostRows += ItemCount;
+        return -ENOMEM;
+    }
+
+    Stream->StageTi         = Ti;
+    Stream->StageSize       = PgConvertRows(Ti, Data, ItemCount, Stream->Stage);
+    Stream->StageRows       = ItemCount;
+    Stream->StageStampCount = 0;
+    for(u32 s = 0; Stamps != NULL && s < Stamps->Count; ++s) {
+        const sdp_stamp *Stamp = &Stamps->Stamps[s];
+        u64              End   = (s + 1 < Stamps->Count) ? Stamps->Stamps[s + 1].Offset
+                                                         : ItemCount * Ti->RowSize;
+        u64              Count = (End - Stamp->Offset) / Ti->RowSize;
+        if(Count > 0) {
+            Stream->StageStamps[Stream->StageStampCount++]
+                = (pg_stream_stamp){ Stamp->RecvNs, Count };
+        }
+    }
+
+    return PgStreamPump(Stream);
+}
+
+sdb_timediff
+PgStreamUntilDue(pg_copy_stream *Stream, u64 NowNs)
+{
+    if(Stream->Phase == PgStream_Idle || Stream->Phase == PgStream_Resetting
+       || Stream->CommitWanted) {
+        return SDB_TIME_MAX;
+    }
+    if((Stream->MaxRows > 0 && Stream->Rows >= Stream->MaxRows)
+       || (Stream->MaxBytes > 0 && Stream->Bytes >= Stream->MaxBytes)
+       || Stream->StampCount + SDP_STAMP_MAX > PG_STREAM_STAMP_MAX) {
+        return 0;
+    }
+    if(Stream->MaxAge == 0) {
+        return SDB_TIME_MAX;
+    }
+
+    u64 Age = NowNs - Stream->StartNs;
+    return (Age >= Stream->MaxAge) ? 0 : Stream->MaxAge - Age;
+}
+
+sdb_errno
+PgStreamCommit(pg_copy_stream *Stream)
+{
+    if(Stream->Phase != PgStream_Idle || Stream->StageRows > 0) {
+        Stream->CommitWanted = true;
+    }
+
+    return PgStreamPump(Stream);
+}
+
+sdb_errno
+PgStreamFinish(pg_copy_stream *Stream, sdb_timediff Timeout)
+{
+    struct timespec Deadline;
+    SdbTimeMonotonic(&Deadline);
+    SdbTimeAdd(&Deadline, Timeout);
+
+    // NOTE(ingar): Staged rows for another table begin a batch of their own once the open one is
+    // committed, so commits are asked for until nothing is left
+    sdb_errno Ret = PgStreamCommit(Stream);
+    while(Ret == 0 && (Stream->Phase != PgStream_Idle || Stream->StageRows > 0)) {
+        struct timespec Now;
+        SdbTimeMonotonic(&Now);
+        if(SdbTimeoutExpired(&Deadline, &Now)) {
+            SdbLogError("Timed out committing the COPY stream");
+            PgStreamRollback(Stream);
+            return -ETIMEDOUT;
+        }
+
+        struct pollfd ConnPoll = { .fd = PQsocket(Stream->Conn), .events = PgStreamEvents(Stream) };
+        poll(&ConnPoll, 1, SDB_TIME_TO_MS(PG_EPOLL_WAIT));
+        Ret = PgStreamCommit(Stream);
+    }
+
+    return Ret;
+}
@@ -8,6 +8,7 @@
 #define POSTGRES_H_
 
 #include <libpq-fe.h>
+#include <sys/epoll.h>
 
 #include <src/Sdb.h>
 
@@ -230,6 +231,45 @@ typedef struct
     bool       IsAutoIncrement;
 } pg_col_metadata;
 
+/**
+ * @brief How a column is converted to the binary COPY format
+ */
+typedef enum
+{
+    PgConv_Swap8,     /**< 8 byte integer or float, to network byte order */
+    PgConv_Swap4,     /**< 4 byte integer or float, to network byte order */
+    PgConv_Swap2,     /**< 2 byte integer, to network byte order */
+    PgConv_Timestamp, /**< time_t, to a PostgreSQL timestamp in network byte order */
+    PgConv_Count,
+} pg_conv_op;
+
+/**
+ * @brief Where a column is read from in a pipe row and written to in a converted row
+ */
+typedef struct
+{
+    u32 SrcOffset;
+    u32 DstOffset;
+} pg_conv_step;
+
+/**
+ * @struct pg_conv_plan
+ * @brief Conversion of the rows of a table to the binary COPY format, compiled once per table
+ *
+ * Every column has a fixed length, so every converted row has the same size, field count and
+ * field lengths. Those are baked into Template, which is copied to every converted row before
+ * the columns are written into it. The steps are grouped by op, so a row is converted by one
+ * loop per op instead of a switch per column.
+ */
+typedef struct
+{
+    u64           RowSize;  /**< Bytes of a converted row */
+    char         *Template; /**< Converted row with the field count and lengths filled in */
+    pg_conv_step *Steps;    /**< Steps of every column, grouped by op */
+
+    u32 OpStart[PgConv_Count + 1]; /**< The steps of op o are OpStart[o] to OpStart[o + 1] */
+} pg_conv_plan;
+
 /**
  * @struct pg_table_info
  * @brief Table information for PostgreSQL operations
@@ -242,6 +282,7 @@ typedef struct
     sdb_string       TableName;
     sdb_string       CopyCommand;
     pg_col_metadata *ColMetadata;
+    pg_conv_plan     ConvPlan;
 
 } pg_table_info;
 
@@ -251,15 +292,124 @@ typedef struct
  */
 typedef struct
 {
-    PGconn         *DbConn; // TODO(ingar): One connection per table?
-    pg_table_info **TablesInfo;
+    PGconn         *DbConn; /**< Connection of the writer, which serves the tables of one shard */
+    u64             TableCount;
+    pg_table_info **TablesInfo; /**< One per sensor, in sensor_schemas.json order */
 
 } postgres_ctx;
 
+/** @brief Receive times kept for the rows of a batch of a COPY stream */
+#ifndef PG_STREAM_STAMP_MAX
+#define PG_STREAM_STAMP_MAX 4096
+#endif
+
+/**
+ * @brief Rows of a batch of a COPY stream received at the same time
+ */
+typedef struct
+{
+    u64 RecvNs; /**< CLOCK_REALTIME nanoseconds the rows were received by the kernel */
+    u64 Count;  /**< Rows received then */
+} pg_stream_stamp;
+
+/**
+ * @brief What a COPY stream is waiting for
+ */
+typedef enum
+{
+    PgStream_Idle,       /**< No transaction is open */
+    PgStream_Beginning,  /**< BEGIN was sent */
+    PgStream_Starting,   /**< The COPY command was sent */
+    PgStream_Copying,    /**< The COPY is open and takes rows */
+    PgStream_Ending,     /**< The COPY was ended, and the server has not accepted its rows yet */
+    PgStream_Committing, /**< COMMIT was sent */
+    PgStream_Resetting,  /**< The lost connection is being reopened */
+} pg_stream_phase;
+
+/**
+ * @struct pg_copy_stream
+ * @brief Binary COPY kept open across pipe buffers and committed in batches
+ *
+ * A batch is one transaction. Rows are streamed to the table of the open COPY as they come, and
+ * rows for another table end that COPY and start one for their table in the same transaction.
+ * The batch is committed once it holds MaxRows rows or MaxBytes bytes of COPY data, or began
+ * MaxAge ago, so it costs the same few round trips however many buffers it holds. A failure
+ * rolls back the open batch only, and the next rows begin a new one.
+ *
+ * The connection is non-blocking, and nothing but a rollback waits on the server. Rows are
+ * converted into the stage, and go from there into the open COPY once it is for their table and
+ * libpq has sent the rows before them. Until then the stream is busy, and the caller waits for
+ * the connection's socket, as PgStreamEvents says, and pumps the stream when it is ready. So
+ * one buffer is converted while the one before it is sent and committed. A lost connection is
+ * reopened the same way, with PQresetPoll, and rows staged meanwhile begin a batch once it is.
+ *
+ * Appends go into batches in the order they were made, so the appends committed are always the
+ * oldest ones. A caller that must not lose rows keeps the data of each append until
+ * CommittedAppends counts it, and appends what it kept again once RollbackCount moves, since a
+ * rollback drops every append not committed, the staged one included.
+ */
+typedef struct
+{
+    PGconn           *Conn;
+    sdb_latency_hist *Hist;     /**< Where the receive to commit latency of rows is recorded */
+    u64               MaxRows;  /**< Rows a batch is committed at, 0 for no limit */
+    u64               MaxBytes; /**< Bytes of COPY data a batch is committed at, 0 for no limit */
+    sdb_timediff      MaxAge;   /**< Age a batch is committed at, 0 for no limit */
+
+    pg_stream_phase Phase;
+    bool            CommitWanted; /**< Commit once the staged rows of the table are in */
+    bool            Flushing;     /**< libpq holds data the socket did not take yet */
+    bool            ResultFailed; /**< The command sent last returned an error */
+
+    PostgresPollingStatusType ResetPoll; /**< What the reconnect waits for, failed until retried */
+    u64                       ResetNs;   /**< CLOCK_MONOTONIC nanoseconds the reconnect began */
+
+    pg_table_info   *Ti;         /**< Table of the open COPY, NULL if none is open */
+    u64              Rows;       /**< Rows in the batch */
+    u64              Bytes;      /**< Bytes of COPY data in the batch */
+    u64              StartNs;    /**< CLOCK_MONOTONIC nanoseconds the batch began */
+    pg_stream_stamp *Stamps;     /**< Receive times of the rows in the batch */
+    u64              StampCount; /**< Entries of Stamps in use */
+
+    pg_table_info   *StageTi;         /**< Table of the staged rows */
+    char            *Stage;           /**< Staged rows, converted to the binary COPY format */
+    u64              StageCap;        /**< Bytes Stage can hold */
+    u64              StageSize;       /**< Bytes of staged rows */
+    u64              StageRows;       /**< Staged rows, 0 if the stream is ready for more */
+    pg_stream_stamp *StageStamps;     /**< Receive times of the staged rows */
+    u64              StageStampCount; /**< Entries of StageStamps in use */
+
+    u64 BatchAppends;     /**< Appends whose rows are in the batch */
+    u64 CommittedAppends; /**< Appends whose rows were committed */
+
+    u64 CommitCount;   /**< Batches committed */
+    u64 CommittedRows; /**< Rows of the batches committed */
+    u64 RollbackCount; /**< Batches rolled back */
+    u64 LostRows;      /**< Rows of the batches rolled back, staged rows included */
+    u64 ResetCount;    /**< Times the connection was lost and reopened */
+} pg_copy_stream;
+
 #ifndef PG_SCRATCH_COUNT
 #define PG_SCRATCH_COUNT 2
 #endif
 
+/** @brief Maximum number of ready pipes handled per wakeup of the Postgres thread */
+#ifndef PG_EPOLL_BATCH
+#define PG_EPOLL_BATCH 16
+#endif
+
+/** @brief Longest wait for pipe data, which bounds how late shutdown is noticed */
+#define PG_EPOLL_WAIT SDB_TIME_MS(100)
+
+/** @brief Shortest time between the starts of two attempts to reopen a lost connection */
+#define PG_RESET_RETRY SDB_TIME_S(1)
+
+/** @brief Longest an attempt to reopen a lost connection may take */
+#define PG_RESET_TIMEOUT SDB_TIME_S(10)
+
+/** @brief Time between logs of the receive to commit latency percentiles */
+#define PG_LATENCY_STATS_INTERVAL SDB_TIME_S(10)
+
 void             DiagnoseConnectionAndTable(PGconn *DbConn, const char *TableName);
 void             PrintPGresult(const PGresult *Result);
 pg_col_metadata *GetTableMetadata(PGconn *DbConn, sdb_string TableName, i16 *ColCount,
@@ -273,17 +423,136 @@ void PgInitThreadArenas(void);
 /**
  * @brief Prepares PostgreSQL context from configuration
  *
+ * Creates one table per sensor and sets the packet size of the sensor's pipes to the row size
+ * of its table. Each lane has one pipe per sensor, e.g. one lane per Modbus worker.
+ *
  * @param PgArena Memory arena for allocations
- * @param Pipe Sensor data pipe
+ * @param Pipes Sensor data pipes, lane after lane, each lane in sensor_schemas.json order
+ * @param PipeCount Number of pipes, must equal the number of sensors times LaneCount
+ * @param LaneCount Number of lanes
  * @return Initialized context or NULL on failure
  */
-postgres_ctx *PgPrepareCtx(sdb_arena *PgArena, sensor_data_pipe *Pipe);
+postgres_ctx *PgPrepareCtx(sdb_arena *PgArena, sensor_data_pipe **Pipes, u64 PipeCount,
+                           u64 LaneCount);
 
 pg_timestamp UnixToPgTimestamp(time_t UnixTime);
 pg_timestamp TimevalToPgTimestamp(struct timeval Tv);
 pg_timestamp TimespecToPgTimestamp(struct timespec Ts);
 sdb_errno    PgInsertData(PGconn *Conn, pg_table_info *Ti, const char *Data, u64 ItemCount);
 
+/**
+ * @brief Compiles the conversion plan of a table from its column metadata
+ *
+ * @param Ti Table information, with ColMetadata, ColCountNoAutoIncrements and RowSize set
+ * @param A Arena the plan is allocated from
+ * @return sdb_errno 0 on success, -ENOMEM if A is too small, -SDBE_PG_ERR if a column has a
+ * type that can not be converted
+ */
+sdb_errno PgCompileConvPlan(pg_table_info *Ti, sdb_arena *A);
+
+/**
+ * @brief Converts rows to the binary COPY format with the conversion plan of their table
+ *
+ * @param Ti Table information, with a compiled conversion plan
+ * @param Data Rows to convert
+ * @param ItemCount Number of rows
+ * @param To Buffer of at least ItemCount * Ti->ConvPlan.RowSize bytes
+ * @return size_t Bytes written to To
+ */
+size_t PgConvertRows(const pg_table_info *Ti, const char *Data, u64 ItemCount, char *To);
+
+/**
+ * @brief Prepares a COPY stream with no batch open, and makes its connection non-blocking
+ *
+ * @param Stream Stream to prepare
+ * @param Conn Database connection, used by nothing else from now on
+ * @param MaxRows Rows a batch is committed at, 0 for no limit
+ * @param MaxBytes Bytes of COPY data a batch is committed at, 0 for no limit
+ * @param MaxAge Age a batch is committed at, 0 for no limit
+ * @param StageCap Bytes of COPY data one append can convert to at most
+ * @param Hist Histogram the receive to commit latency of rows is recorded in
+ * @param A Arena the stage and the receive times of a batch are allocated from
+ * @return sdb_errno 0 on success, -ENOMEM if A is too small, -SDBE_PG_ERR if the connection
+ * cannot be made non-blocking
+ */
+sdb_errno PgStreamInit(pg_copy_stream *Stream, PGconn *Conn, u64 MaxRows, u64 MaxBytes,
+                       sdb_timediff MaxAge, u64 StageCap, sdb_latency_hist *Hist, sdb_arena *A);
+
+/**
+ * @brief Checks whether the stream can take rows
+ */
+static inline bool
+PgStreamReady(const pg_copy_stream *Stream)
+{
+    return Stream->StageRows == 0;
+}
+
+/**
+ * @brief Socket events the stream waits for, EPOLLIN and, while libpq has data to send,
+ * EPOLLOUT. While reconnecting, the one PQresetPoll asked for
+ */
+static inline u32
+PgStreamEvents(const pg_copy_stream *Stream)
+{
+    if(Stream->Phase == PgStream_Resetting) {
+        return (Stream->ResetPoll == PGRES_POLLING_WRITING) ? EPOLLOUT : EPOLLIN;
+    }
+
+    return EPOLLIN | (Stream->Flushing ? EPOLLOUT : 0);
+}
+
+/**
+ * @brief Stages rows for a table, to be streamed as part of the open batch or a new one
+ *
+ * The stream must be ready. The rows are converted right away, so Data can be reused once this
+ * returns. They are not committed until the batch is.
+ *
+ * @param Stream COPY stream
+ * @param Ti Table the rows belong to
+ * @param Data Rows to insert
+ * @param ItemCount Number of rows
+ * @param Stamps Receive times of the rows, NULL if they have none
+ * @return sdb_errno 0 on success, -ENOMEM if the rows do not fit in the stage, -SDBE_PG_ERR if
+ * the batch was rolled back
+ */
+sdb_errno PgStreamAppend(pg_copy_stream *Stream, pg_table_info *Ti, const char *Data,
+                         u64 ItemCount, const sdp_stamps *Stamps);
+
+/**
+ * @brief Sends what the stream has to send and takes the results the server has sent, without
+ * waiting for either
+ *
+ * @return sdb_errno 0 on success, -SDBE_PG_ERR if the batch was rolled back
+ */
+sdb_errno PgStreamPump(pg_copy_stream *Stream);
+
+/**
+ * @brief Time until the open batch must be committed
+ *
+ * @param Stream COPY stream
+ * @param NowNs CLOCK_MONOTONIC nanoseconds
+ * @return sdb_timediff 0 if the batch is due, SDB_TIME_MAX if no batch is open, it is being
+ * committed or it has no age limit
+ */
+sdb_timediff PgStreamUntilDue(pg_copy_stream *Stream, u64 NowNs);
+
+/**
+ * @brief Starts committing the open batch, if any, once the staged rows for its table are in it
+ *
+ * @return sdb_errno 0 on success, -SDBE_PG_ERR if the batch was rolled back
+ */
+sdb_errno PgStreamCommit(pg_copy_stream *Stream);
+
+/**
+ * @brief Commits everything appended to the stream, waiting for the server
+ *
+ * @param Stream COPY stream
+ * @param Timeout Longest wait for the server, after which the batch is rolled back
+ * @return sdb_errno 0 on success, -SDBE_PG_ERR if a batch was rolled back, -ETIMEDOUT if the
+ * server did not answer in time
+ */
+sdb_errno PgStreamFinish(pg_copy_stream *Stream, sdb_timediff Timeout);
+
 SDB_END_EXTERN_C
 
 #endif
@@ -0,0 +1,294 @@
+/**
+ * @file MbIngestBench.c
+ * @brief Benchmark of Modbus ingest throughput versus connection count
+ *
+ * Runs the Modbus thread against the unthrottled test server for an increasing number of
+ * connections and reports the number of packets per second delivered into the sensor data
+ * pipes, and the latency from the kernel receiving each packet to the consumer reading it. Each connection count runs in a forked child, since the shutdown flag used to stop
+ * the threads can not be reset.
+ *
+ * With several workers, the connections are sharded over that many Modbus threads, each with
+ * its own pipe, and served by as many test server threads.
+ *
+ * Usage: MbIngestBench [seconds per run] [max connections] [mode] [workers]
+ *
+ * Modes:
+ * - zero-copy: epoll backend receiving straight into the pipe
+ * - copy: epoll backend receiving through the per-connection buffers
+ * - io_uring: io_uring backend
+ * - poll: epoll backend polling BENCH_POLL_GROUPS register groups per connection every
+ *   millisecond, with every group's request outstanding at once
+ * - all (default): every mode after each other, for comparison
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(MbIngestBench);
+
+#include <src/Common/LatencyHistogram.h>
+#include <src/Common/SensorDataPipe.h>
+#include <src/Common/Thread.h>
+#include <src/Common/Time.h>
+#include <src/DataHandlers/ModbusWithPostgres/ModbusWithPostgres.h>
+#include <src/DevUtils/ModbusTestServer.h>
+#include <src/DevUtils/TestConstants.h>
+#include <src/Signals.h>
+
+#define BENCH_POLL_GROUPS 16
+
+typedef struct
+{
+    mbpg_ctx        *Ctx;
+    atomic_bool      Stop;
+    atomic_bool      Measure;
+    atomic_ulong     PacketCount;
+    sdb_latency_hist Latency; /**< Receive to read latency while Measure is set */
+} bench_consumer;
+
+static void *
+BenchServer(void *Arg)
+{
+    mbpg_ctx           *Ctx  = Arg;
+    mb_test_server_conf Conf = {
+        .MaxClients    = Ctx->ModbusConnCount,
+        .SendInterval  = 0,
+        .FramesPerSend = 64,
+        .Respond       = Ctx->ModbusMode == MbMode_Poll,
+    };
+
+    MbTestServerRun(&Ctx->Barrier, &Conf);
+    return NULL;
+}
+
+static void *
+BenchConsumer(void *Arg)
+{
+    bench_consumer *Consumer = Arg;
+    mbpg_ctx       *Ctx      = Consumer->Ctx;
+
+    int EpollFd = epoll_create1(0);
+    for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+        struct epoll_event Event = { .events = EPOLLIN, .data.u64 = p };
+        epoll_ctl(EpollFd, EPOLL_CTL_ADD, Ctx->SdPipes[p]->ReadEventFd, &Event);
+    }
+
+    SdbBarrierWait(&Ctx->Barrier);
+
+    struct epoll_event Events[MBPG_MAX_MODBUS_WORKERS];
+    while(!atomic_load(&Consumer->Stop)) {
+        int EventCount = epoll_wait(EpollFd, Events, SdbArrayLen(Events), 10);
+        for(int e = 0; e < EventCount; ++e) {
+            sensor_data_pipe *Pipe = Ctx->SdPipes[Events[e].data.u64];
+            sdb_arena        *Buf  = SdPipeTryGetReadBuffer(Pipe);
+            if(Buf) {
+                atomic_fetch_add(&Consumer->PacketCount, SdbArenaGetPos(Buf) / Pipe->PacketSize);
+                if(atomic_load(&Consumer->Measure)) {
+                    struct timespec Now;
+                    SdbTimeNow(&Now);
+                    SdPipeRecordLatency(Pipe, Buf, SdbTimespecNs(&Now), &Consumer->Latency);
+                }
+                SdPipeReleaseReadBuffer(Pipe);
+            }
+        }
+    }
+
+    close(EpollFd);
+    return NULL;
+}
+
+typedef struct
+{
+    const char *Name;
+    mb_backend  Backend;
+    bool        ZeroCopy;
+    mb_mode     Mode;
+} bench_mode;
+
+static const bench_mode BenchModes[] = {
+    { "zero-copy", MbBackend_Epoll, true, MbMode_Push },
+    { "copy", MbBackend_Epoll, false, MbMode_Push },
+    { "io_uring", MbBackend_IoUring, false, MbMode_Push },
+    { "poll", MbBackend_Epoll, false, MbMode_Poll },
+};
+
+static int
+RunBench(u64 ConnCount, u64 Seconds, const bench_mode *Mode, u32 Workers)
+{
+    mbpg_ctx Ctx          = { 0 };
+    Ctx.ModbusMemSize     = SdbMebiByte(16);
+    Ctx.ModbusScratchSize = SdbKibiByte(128);
+    Ctx.ModbusConnCount   = ConnCount;
+    Ctx.ModbusZeroCopy    = Mode->ZeroCopy;
+    Ctx.ModbusBackend     = Mode->Backend;
+    Ctx.ModbusMode        = Mode->Mode;
+
+    mb_poll_group Groups[BENCH_POLL_GROUPS];
+    for(u32 g = 0; g < BENCH_POLL_GROUPS; ++g) {
+        Groups[g] = (mb_poll_group){
+            .UnitId   = 1,
+            .Function = MODBUS_READ_HOLDING_REGISTERS,
+            .Address  = g * sizeof(shaft_power_data) / 2,
+            .Quantity = sizeof(shaft_power_data) / 2,
+            .Period   = SDB_TIME_MS(1),
+        };
+    }
+    Ctx.ModbusPoll = (mb_poll_conf){
+        .MaxInFlight = MB_POLL_MAX_IN_FLIGHT,
+        .Timeout     = MB_POLL_TIMEOUT,
+        .GroupCount  = BENCH_POLL_GROUPS,
+        .Groups      = Groups,
+    };
+
+    sensor_data_pipe *Pipes[MBPG_MAX_MODBUS_WORKERS];
+    for(u32 w = 0; w < Workers; ++w) {
+        Pipes[w] = SdpCreate(4, SdbKibiByte(32), NULL);
+        if(!Pipes[w]) {
+            return EXIT_FAILURE;
+        }
+        Pipes[w]->PacketSize    = sizeof(shaft_power_data);
+        Pipes[w]->ItemMaxCount  = SdbKibiByte(32) / sizeof(shaft_power_data);
+        Pipes[w]->BufferMaxFill = Pipes[w]->ItemMaxCount * sizeof(shaft_power_data);
+    }
+
+    /**< One sensor, so each worker's lane is a single pipe */
+    mb_route_conf Route
+        = { .Name = "shaft_power", .Conn = -1, .UnitId = -1, .Function = -1, .Into = -1 };
+    Ctx.ModbusWorkerCount = Workers;
+    Ctx.SensorCount       = 1;
+    Ctx.SdPipeCount       = Workers;
+    Ctx.SdPipes           = Pipes;
+    Ctx.ModbusRoutes      = &Route;
+
+    Ctx.ModbusShards.WorkerCount = Workers;
+    Ctx.ModbusShards.Loads
+        = aligned_alloc(SDB_CACHE_LINE_SIZE, Workers * sizeof(*Ctx.ModbusShards.Loads));
+    if(!Ctx.ModbusShards.Loads) {
+        return EXIT_FAILURE;
+    }
+
+    bench_consumer *Consumer = calloc(1, sizeof(*Consumer));
+    if(!Consumer) {
+        return EXIT_FAILURE;
+    }
+    Consumer->Ctx = &Ctx;
+    atomic_init(&Consumer->Stop, false);
+    atomic_init(&Consumer->Measure, false);
+    atomic_init(&Consumer->PacketCount, 0);
+
+    SdbBarrierInit(&Ctx.Barrier, 2 * Workers + 2);
+
+    pthread_t ServerThreads[MBPG_MAX_MODBUS_WORKERS], MbThreadIds[MBPG_MAX_MODBUS_WORKERS];
+    pthread_t ConsumerThread;
+    for(u32 w = 0; w < Workers; ++w) {
+        pthread_create(&ServerThreads[w], NULL, BenchServer, &Ctx);
+        pthread_create(&MbThreadIds[w], NULL, MbThread, &Ctx);
+    }
+    pthread_create(&ConsumerThread, NULL, BenchConsumer, Consumer);
+
+    SdbBarrierWait(&Ctx.Barrier);
+
+    /**< Give every connection time to come up before measuring */
+    SdbSleep(SDB_TIME_MS(500));
+
+    struct timespec Start, End;
+    SdbTimeMonotonic(&Start);
+    u64 StartCount = atomic_load(&Consumer->PacketCount);
+    atomic_store(&Consumer->Measure, true);
+
+    SdbSleep(SDB_TIME_S(Seconds));
+
+    atomic_store(&Consumer->Measure, false);
+    SdbTimeMonotonic(&End);
+    u64 EndCount = atomic_load(&Consumer->PacketCount);
+
+    SdbRequestShutdown();
+    for(u32 w = 0; w < Workers; ++w) {
+        pthread_join(MbThreadIds[w], NULL);
+        pthread_join(ServerThreads[w], NULL);
+    }
+    atomic_store(&Consumer->Stop, true);
+    pthread_join(ConsumerThread, NULL);
+
+    double Elapsed = (double)SdbTimeDiff(&End, &Start) / 1e9;
+    double Pps     = (double)(EndCount - StartCount) / Elapsed;
+    printf("%8lu %16.0f %12.2f %10lu %10lu\n", ConnCount, Pps,
+           Pps * sizeof(shaft_power_data) / (1024.0 * 1024.0),
+           SDB_TIME_TO_US(SdbLatencyHistPercentile(&Consumer->Latency, 50.0)),
+           SDB_TIME_TO_US(SdbLatencyHistPercentile(&Consumer->Latency, 99.0)));
+    fflush(stdout);
+    free(Consumer);
+
+    SdbBarrierDeinit(&Ctx.Barrier);
+    for(u32 w = 0; w < Workers; ++w) {
+        SdpDestroy(Pipes[w], false);
+    }
+    free(Ctx.ModbusShards.Owners);
+    free(Ctx.ModbusShards.Loads);
+    return EXIT_SUCCESS;
+}
+
+int
+main(int ArgCount, char **ArgV)
+{
+    u64         Seconds  = (ArgCount > 1) ? strtoull(ArgV[1], NULL, 10) : 2;
+    u64         MaxConns = (ArgCount > 2) ? strtoull(ArgV[2], NULL, 10) : 512;
+    const char *ModeName = (ArgCount > 3) ? ArgV[3] : "all";
+    u32         Workers  = (ArgCount > 4) ? strtoul(ArgV[4], NULL, 10) : 1;
+    if(Workers == 0 || Workers > MBPG_MAX_MODBUS_WORKERS) {
+        SdbLogError("Workers must be between 1 and %d", MBPG_MAX_MODBUS_WORKERS);
+        return EXIT_FAILURE;
+    }
+
+    /**< Both ends of every connection live in this process */
+    struct rlimit Limit;
+    getrlimit(RLIMIT_NOFILE, &Limit);
+    Limit.rlim_cur = Limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &Limit);
+
+    bool RanAny = false;
+    for(u64 m = 0; m < SdbArrayLen(BenchModes); ++m) {
+        const bench_mode *Mode = &BenchModes[m];
+        if(strcmp(ModeName, "all") != 0 && strcmp(ModeName, Mode->Name) != 0) {
+            continue;
+        }
+        RanAny = true;
+
+        printf("\nMode: %s, %u workers\n", Mode->Name, Workers);
+        printf("%8s %16s %12s %10s %10s\n", "conns", "packets/s", "MiB/s", "p50 us", "p99 us");
+        fflush(stdout);
+        for(u64 ConnCount = 1; ConnCount <= MaxConns; ConnCount *= 2) {
+            pid_t Pid = fork();
+            if(Pid == 0) {
+                exit(RunBench(ConnCount, Seconds, Mode, Workers));
+            } else if(Pid == -1) {
+                SdbLogError("Failed to fork: %s", strerror(errno));
+                return EXIT_FAILURE;
+            }
+
+            int Status;
+            waitpid(Pid, &Status, 0);
+            if(!WIFEXITED(Status) || WEXITSTATUS(Status) != EXIT_SUCCESS) {
+                SdbLogError("Benchmark with %lu connections failed", ConnCount);
+            }
+        }
+    }
+
+    if(!RanAny) {
+        SdbLogError("Unknown mode \"%s\"", ModeName);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+/**
+ * @file PgConvBench.c
+ * @brief Benchmark of the conversion of pipe rows to the binary COPY format
+ *
+ * Compares the compiled conversion plan with the conversion it replaced, which switched on the
+ * type of every column of every row, for shaft_power and for a 40 column table like slowkpis.
+ * Both tables have the id SERIAL column every table gets. Needs no database, and checks that
+ * both conversions give the same bytes before timing them.
+ *
+ * Usage: PgConvBench [rows] [rounds]
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(PgConvBench);
+
+#include <src/Common/Time.h>
+#include <src/DatabaseSystems/Postgres.h>
+
+#define BENCH_MAX_COLS 64
+
+typedef struct
+{
+    const char *Name;
+    u32         ColCount; /**< Columns, not counting id */
+    pg_oid      Types[BENCH_MAX_COLS];
+} bench_table;
+
+/**
+ * @brief The conversion before the plan, kept for comparison
+ */
+static size_t
+LegacyConvertRows(pg_table_info *Ti, const char *Data, u64 ItemCount, char *To)
+{
+    size_t ConvOffset = 0;
+    for(u64 RowsProcessed = 0; RowsProcessed < ItemCount; ++RowsProcessed) {
+        const char *CurrRow = Data + (RowsProcessed * Ti->RowSize);
+
+        i16 NtwrkFieldCount = htons(Ti->ColCountNoAutoIncrements);
+        SdbMemcpy(To + ConvOffset, &NtwrkFieldCount, sizeof(NtwrkFieldCount));
+        ConvOffset += sizeof(NtwrkFieldCount);
+
+        for(i16 c = 0; c < Ti->ColCount; ++c) {
+            pg_col_metadata ColMd = Ti->ColMetadata[c];
+
+            if(ColMd.IsAutoIncrement) {
+                continue;
+            }
+
+            i32 NtwrkTypeLen = htobe32(ColMd.TypeLength);
+            SdbMemcpy(To + ConvOffset, &NtwrkTypeLen, sizeof(NtwrkTypeLen));
+            ConvOffset += sizeof(NtwrkTypeLen);
+
+            const char *ColData = CurrRow + ColMd.Offset;
+            switch(ColMd.TypeOid) {
+                case PG_INT8:
+                case PG_FLOAT8: {
+                    u64 Val;
+                    SdbMemcpy(&Val, ColData, sizeof(Val));
+                    Val = htobe64(Val);
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                case PG_INT4:
+                case PG_FLOAT4: {
+                    u32 Val;
+                    SdbMemcpy(&Val, ColData, sizeof(Val));
+                    Val = htobe32(Val);
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                case PG_INT2: {
+                    u16 Val;
+                    SdbMemcpy(&Val, ColData, sizeof(Val));
+                    Val = htobe16(Val);
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                case PG_TIMESTAMP: {
+                    time_t UTime;
+                    SdbMemcpy(&UTime, ColData, sizeof(UTime));
+                    pg_timestamp Val = htobe64(UnixToPgTimestamp(UTime));
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                default:
+                    SdbLogWarning("Encountered unhandled or invalid PG oid %d", ColMd.TypeOid);
+                    break;
+            }
+        }
+    }
+
+    return ConvOffset;
+}
+
+static i32
+BenchTypeLength(pg_oid Type)
+{
+    switch(Type) {
+        case PG_INT2:
+            return 2;
+        case PG_INT4:
+        case PG_FLOAT4:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+/**
+ * @brief Makes the table information PgPrepareCtx would get from the database
+ */
+static pg_table_info *
+BenchMakeTable(const bench_table *Table, sdb_arena *A)
+{
+    pg_table_info *Ti            = SdbPushStructZero(A, pg_table_info);
+    Ti->TableName                = SdbStringMake(A, Table->Name);
+    Ti->ColCount                 = Table->ColCount + 1;
+    Ti->ColCountNoAutoIncrements = Table->ColCount;
+    Ti->ColMetadata              = SdbPushArrayZero(A, pg_col_metadata, Ti->ColCount);
+
+    Ti->ColMetadata[0].TypeOid         = PG_INT4;
+    Ti->ColMetadata[0].TypeLength      = 4;
+    Ti->ColMetadata[0].Offset          = -1;
+    Ti->ColMetadata[0].ColumnName      = SdbStringMake(A, "id");
+    Ti->ColMetadata[0].IsAutoIncrement = true;
+    for(u32 c = 0; c < Table->ColCount; ++c) {
+        pg_col_metadata *ColMd = &Ti->ColMetadata[c + 1];
+        ColMd->TypeOid         = Table->Types[c];
+        ColMd->TypeLength      = BenchTypeLength(Table->Types[c]);
+        ColMd->Offset          = Ti->RowSize;
+        ColMd->ColumnName      = SdbStringMake(A, "col");
+        Ti->RowSize += ColMd->TypeLength;
+    }
+
+    if(PgCompileConvPlan(Ti, A) != 0) {
+        return NULL;
+    }
+
+    return Ti;
+}
+
+/**
+ * @brief Fills rows with random bytes, and timestamps around now
+ */
+static void
+BenchFillRows(const pg_table_info *Ti, char *Rows, u64 RowCount)
+{
+    for(u64 b = 0; b < RowCount * Ti->RowSize; ++b) {
+        Rows[b] = (char)rand();
+    }
+    for(u64 r = 0; r < RowCount; ++r) {
+        for(i16 c = 0; c < Ti->ColCount; ++c) {
+            if(Ti->ColMetadata[c].TypeOid == PG_TIMESTAMP) {
+                time_t Now = time(NULL) + r;
+                SdbMemcpy(Rows + r * Ti->RowSize + Ti->ColMetadata[c].Offset, &Now, sizeof(Now));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Best ns per row of Rounds conversions of RowCount rows
+ */
+static double
+BenchTime(pg_table_info *Ti, const char *Rows, u64 RowCount, char *To, u64 Rounds, bool Plan)
+{
+    sdb_timediff Best = SDB_TIME_MAX;
+    for(u64 r = 0; r < Rounds; ++r) {
+        struct timespec Start, End;
+        SdbTimeMonotonic(&Start);
+        if(Plan) {
+            PgConvertRows(Ti, Rows, RowCount, To);
+        } else {
+            LegacyConvertRows(Ti, Rows, RowCount, To);
+        }
+        SdbTimeMonotonic(&End);
+        __asm__ volatile("" : : "r"(To) : "memory");
+
+        sdb_timediff Elapsed = SdbTimeDiff(&End, &Start);
+        Best                 = (Elapsed < Best) ? Elapsed : Best;
+    }
+
+    return (double)Best / RowCount;
+}
+
+static int
+RunBench(const bench_table *Table, u64 RowCount, u64 Rounds)
+{
+    sdb_arena      Arena;
+    u64            ArenaSize = SdbMebiByte(1);
+    pg_table_info *Ti        = NULL;
+    SdbArenaInit(&Arena, malloc(ArenaSize), ArenaSize);
+    if(Arena.Mem == NULL || (Ti = BenchMakeTable(Table, &Arena)) == NULL) {
+        free(Arena.Mem);
+        return EXIT_FAILURE;
+    }
+
+    u64   ConvSize = RowCount * Ti->ConvPlan.RowSize;
+    char *Rows     = malloc(RowCount * Ti->RowSize);
+    char *Legacy   = calloc(1, ConvSize);
+    char *Planned  = calloc(1, ConvSize);
+    int   Ret      = EXIT_FAILURE;
+    if(Rows == NULL || Legacy == NULL || Planned == NULL) {
+        SdbLogError("Failed to allocate %lu rows of table %s", RowCount, Table->Name);
+        goto cleanup;
+    }
+    BenchFillRows(Ti, Rows, RowCount);
+
+    if(LegacyConvertRows(Ti, Rows, RowCount, Legacy) != ConvSize
+       || PgConvertRows(Ti, Rows, RowCount, Planned) != ConvSize
+       || !SdbMemcmp(Legacy, Planned, ConvSize)) {
+        SdbLogError("The conversions of table %s differ", Table->Name);
+        goto cleanup;
+    }
+
+    double Before = BenchTime(Ti, Rows, RowCount, Legacy, Rounds, false);
+    double After  = BenchTime(Ti, Rows, RowCount, Planned, Rounds, true);
+    printf("%-12s %8u %10.2f %10.2f %8.2fx\n", Table->Name, Table->ColCount, Before, After,
+           Before / After);
+    fflush(stdout);
+    Ret = EXIT_SUCCESS;
+
+cleanup:
+    free(Rows);
+    free(Legacy);
+    free(Planned);
+    free(Arena.Mem);
+    return Ret;
+}
+
+int
+main(int ArgCount, char **ArgV)
+{
+    u64 RowCount = (ArgCount > 1) ? strtoull(ArgV[1], NULL, 10) : 4096;
+    u64 Rounds   = (ArgCount > 2) ? strtoull(ArgV[2], NULL, 10) : 200;
+    if(RowCount == 0 || Rounds == 0) {
+        SdbLogError("Rows and rounds must be above 0");
+        return EXIT_FAILURE;
+    }
+
+    bench_table ShaftPower = {
+        .Name     = "shaft_power",
+        .ColCount = 6,
+        .Types    = { PG_INT8, PG_TIMESTAMP, PG_FLOAT8, PG_FLOAT8, PG_FLOAT8, PG_FLOAT8 },
+    };
+
+    // NOTE(ingar): Mostly doubles, with some of every other type, as KPI tables tend to be
+    bench_table SlowKpis = { .Name = "slowkpis", .ColCount = 40 };
+    pg_oid      KpiTypes[] = { PG_FLOAT8, PG_FLOAT8, PG_FLOAT4, PG_FLOAT8, PG_INT4, PG_INT2 };
+    SlowKpis.Types[0]      = PG_INT8;
+    SlowKpis.Types[1]      = PG_TIMESTAMP;
+    for(u32 c = 2; c < SlowKpis.ColCount; ++c) {
+        SlowKpis.Types[c] = KpiTypes[c % SdbArrayLen(KpiTypes)];
+    }
+
+    printf("\n%lu rows, best of %lu rounds\n", RowCount, Rounds);
+    printf("%-12s %8s %10s %10s %9s\n", "table", "columns", "before", "after", "speedup");
+    printf("%-12s %8s %10s %10s %9s\n", "", "", "ns/row", "ns/row", "");
+    fflush(stdout);
+
+    int Ret = RunBench(&ShaftPower, RowCount, Rounds);
+    if(Ret == EXIT_SUCCESS) {
+        Ret = RunBench(&SlowKpis, RowCount, Rounds);
+    }
+
+    return Ret;
+}
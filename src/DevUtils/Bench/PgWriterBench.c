@@ -0,0 +1,293 @@
+/**
+ * @file PgWriterBench.c
+ * @brief Benchmark of Postgres insert throughput versus writer count
+ *
+ * Runs the Postgres writers against the database in configs/postgres-conf and reports the rows
+ * committed per second, for 1, 2, 4 and so on up to the max writers. Every table has a single
+ * writer, so the benchmark makes max writers tables, copies of the first sensor in
+ * configs/sensor_schemas.json named <sensor>_bench<i>, and runs in a temporary directory with
+ * a schema file of those. A producer thread keeps the pipe of every table full. The writers log
+ * their receive to commit latency as usual. Each writer count runs in a forked child, since the
+ * shutdown flag used to stop the threads can not be reset.
+ *
+ * Usage: PgWriterBench [seconds per run] [max writers] [mode]
+ *
+ * Modes:
+ * - copy (default): COPY stream committed every BENCH_COMMIT_BYTES or BENCH_COMMIT_AGE
+ * - buffer: one BEGIN/COPY/COMMIT per pipe buffer
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(PgWriterBench);
+
+#include <src/Common/LatencyHistogram.h>
+#include <src/Common/SensorDataPipe.h>
+#include <src/Common/Thread.h>
+#include <src/Common/Time.h>
+#include <src/DataHandlers/ModbusWithPostgres/ModbusWithPostgres.h>
+#include <src/DatabaseSystems/DatabaseInitializer.h>
+#include <src/DatabaseSystems/Postgres.h>
+#include <src/Signals.h>
+
+#define BENCH_BUF_COUNT    4
+#define BENCH_BUF_SIZE     SdbKibiByte(32)
+#define BENCH_COMMIT_BYTES SdbMebiByte(8)
+#define BENCH_COMMIT_AGE   SDB_TIME_MS(250)
+
+typedef struct
+{
+    mbpg_ctx   *Ctx;
+    atomic_bool Stop;
+} bench_producer;
+
+/**
+ * @brief Keeps every pipe full of zeroed rows, which are valid for every column type
+ */
+static void *
+BenchProducer(void *Arg)
+{
+    bench_producer *Producer = Arg;
+    mbpg_ctx       *Ctx      = Producer->Ctx;
+
+    SdbBarrierWait(&Ctx->Barrier);
+
+    while(!atomic_load(&Producer->Stop)) {
+        bool Published = false;
+        for(u64 p = 0; p < Ctx->SdPipeCount; ++p) {
+            sensor_data_pipe *Pipe = Ctx->SdPipes[p];
+            sdb_arena        *Buf  = SdPipeCurrentWriteBuffer(Pipe);
+            if(Buf->Cur == 0) {
+                struct timespec Now;
+                SdbTimeNow(&Now);
+                SdPipeStamp(Pipe, Buf, SdbTimespecNs(&Now));
+                SdbMemZero(SdbArenaPush(Buf, Pipe->BufferMaxFill), Pipe->BufferMaxFill);
+            }
+            Published |= (SdPipeTryGetWriteBuffer(Pipe) != NULL);
+        }
+        if(!Published) {
+            SdbSleep(SDB_TIME_US(50));
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Writes Data to Path
+ */
+static sdb_errno
+BenchWriteFile(const char *Path, const void *Data, u64 Size)
+{
+    FILE *File = fopen(Path, "w");
+    if(File == NULL) {
+        SdbLogError("Failed to open %s: %s", Path, strerror(errno));
+        return -errno;
+    }
+    sdb_errno Ret = (fwrite(Data, 1, Size, File) == Size) ? 0 : -EIO;
+    fclose(File);
+    return Ret;
+}
+
+/**
+ * @brief Makes a temporary directory with TableCount copies of the first sensor and the
+ * connection string, and moves into it
+ */
+static sdb_errno
+BenchSetUpDir(char *Dir, u64 TableCount)
+{
+    cJSON         *SchemaConf = DbInitGetConfFromFile("./configs/sensor_schemas.json", NULL);
+    sdb_file_data *ConnInfo   = SdbLoadFileIntoMemory(POSTGRES_CONF_FS_PATH, NULL);
+    cJSON         *Sensors    = cJSON_GetObjectItem(SchemaConf, "sensors");
+    cJSON         *Sensor     = cJSON_GetArrayItem(Sensors, 0);
+    if(!cJSON_IsObject(Sensor) || ConnInfo == NULL) {
+        SdbLogError("Run from the repository root, with a sensor in configs/sensor_schemas.json "
+                    "and the connection string in %s",
+                    POSTGRES_CONF_FS_PATH);
+        cJSON_Delete(SchemaConf);
+        free(ConnInfo);
+        return -ENOENT;
+    }
+
+    const char *Name    = cJSON_GetStringValue(cJSON_GetObjectItem(Sensor, "name"));
+    cJSON      *Tables  = cJSON_CreateArray();
+    cJSON      *Schemas = cJSON_CreateObject();
+    cJSON_AddItemToObject(Schemas, "sensors", Tables);
+    for(u64 t = 0; t < TableCount; ++t) {
+        char TableName[256];
+        snprintf(TableName, sizeof(TableName), "%s_bench%lu", Name, t);
+        cJSON *Table = cJSON_Duplicate(Sensor, true);
+        cJSON_ReplaceItemInObject(Table, "name", cJSON_CreateString(TableName));
+        cJSON_AddItemToArray(Tables, Table);
+    }
+    char *SchemaText = cJSON_Print(Schemas);
+    cJSON_Delete(Schemas);
+    cJSON_Delete(SchemaConf);
+
+    char Path[PATH_MAX];
+    if(mkdtemp(Dir) == NULL || snprintf(Path, sizeof(Path), "%s/configs", Dir) < 0
+       || mkdir(Path, 0755) == -1 || chdir(Dir) == -1) {
+        sdb_errno Ret = -errno;
+        SdbLogError("Failed to make the benchmark directory: %s", strerror(-Ret));
+        free(SchemaText);
+        free(ConnInfo);
+        return Ret;
+    }
+    sdb_errno Ret
+        = BenchWriteFile("./configs/sensor_schemas.json", SchemaText, strlen(SchemaText));
+    if(Ret == 0) {
+        Ret = BenchWriteFile(POSTGRES_CONF_FS_PATH, ConnInfo->Data, ConnInfo->Size);
+    }
+    free(SchemaText);
+    free(ConnInfo);
+    return Ret;
+}
+
+/**
+ * @brief Removes the files BenchSetUpDir made
+ */
+static void
+BenchTearDownDir(const char *Dir)
+{
+    unlink("./configs/sensor_schemas.json");
+    unlink(POSTGRES_CONF_FS_PATH);
+    rmdir("./configs");
+    chdir("/");
+    rmdir(Dir);
+}
+
+static int
+RunBench(u32 Writers, u64 Seconds, bool Stream, u64 SensorCount)
+{
+    mbpg_ctx Ctx          = { 0 };
+    Ctx.PgMemSize         = SdbMebiByte(8);
+    Ctx.PgScratchSize     = SdbKibiByte(256);
+    Ctx.PgStream          = Stream;
+    Ctx.PgCommitBytes     = BENCH_COMMIT_BYTES;
+    Ctx.PgCommitAge       = BENCH_COMMIT_AGE;
+    Ctx.PgWriterCount     = Writers;
+    Ctx.ModbusWorkerCount = 1;
+    Ctx.MemOpts           = SDB_PAGE_OPTS_DEFAULT;
+    atomic_init(&Ctx.NextPgWriter, 0);
+    atomic_init(&Ctx.PgInsertedRows, 0);
+    SdbMutexInit(&Ctx.PgSetupLock);
+
+    /**< One lane, so each sensor has a single pipe */
+    sensor_data_pipe **Pipes = calloc(SensorCount, sizeof(*Pipes));
+    if(!Pipes) {
+        return EXIT_FAILURE;
+    }
+    for(u64 s = 0; s < SensorCount; ++s) {
+        Pipes[s] = SdpCreate(BENCH_BUF_COUNT, BENCH_BUF_SIZE, NULL);
+        if(!Pipes[s]) {
+            return EXIT_FAILURE;
+        }
+        Pipes[s]->SchemaId = s;
+    }
+    Ctx.SensorCount = SensorCount;
+    Ctx.SdPipeCount = SensorCount;
+    Ctx.SdPipes     = Pipes;
+
+    bench_producer Producer = { .Ctx = &Ctx };
+    atomic_init(&Producer.Stop, false);
+
+    SdbBarrierInit(&Ctx.Barrier, Writers + 2);
+
+    pthread_t WriterThreads[MBPG_MAX_PG_WRITERS];
+    pthread_t ProducerThread;
+    for(u32 w = 0; w < Writers; ++w) {
+        pthread_create(&WriterThreads[w], NULL, PgThread, &Ctx);
+    }
+    pthread_create(&ProducerThread, NULL, BenchProducer, &Producer);
+
+    SdbBarrierWait(&Ctx.Barrier);
+
+    /**< Let the writers reach a steady state before measuring */
+    SdbSleep(SDB_TIME_S(1));
+
+    struct timespec Start, End;
+    SdbTimeMonotonic(&Start);
+    u64 StartRows = atomic_load(&Ctx.PgInsertedRows);
+
+    SdbSleep(SDB_TIME_S(Seconds));
+
+    SdbTimeMonotonic(&End);
+    u64 EndRows = atomic_load(&Ctx.PgInsertedRows);
+
+    SdbRequestShutdown();
+    for(u32 w = 0; w < Writers; ++w) {
+        pthread_join(WriterThreads[w], NULL);
+    }
+    atomic_store(&Producer.Stop, true);
+    pthread_join(ProducerThread, NULL);
+
+    double Elapsed = (double)SdbTimeDiff(&End, &Start) / 1e9;
+    double Rps     = (double)(EndRows - StartRows) / Elapsed;
+    printf("%8u %16.0f %12.2f\n", Writers, Rps,
+           Rps * Pipes[0]->PacketSize / (1024.0 * 1024.0));
+    fflush(stdout);
+
+    SdbBarrierDeinit(&Ctx.Barrier);
+    SdbMutexDeinit(&Ctx.PgSetupLock);
+    for(u64 s = 0; s < SensorCount; ++s) {
+        SdpDestroy(Pipes[s], false);
+    }
+    free(Pipes);
+    return EXIT_SUCCESS;
+}
+
+int
+main(int ArgCount, char **ArgV)
+{
+    u64         Seconds    = (ArgCount > 1) ? strtoull(ArgV[1], NULL, 10) : 5;
+    u32         MaxWriters = (ArgCount > 2) ? strtoul(ArgV[2], NULL, 10) : 8;
+    const char *ModeName   = (ArgCount > 3) ? ArgV[3] : "copy";
+    if(MaxWriters == 0 || MaxWriters > MBPG_MAX_PG_WRITERS) {
+        SdbLogError("Writers must be between 1 and %d", MBPG_MAX_PG_WRITERS);
+        return EXIT_FAILURE;
+    }
+    if(strcmp(ModeName, "copy") != 0 && strcmp(ModeName, "buffer") != 0) {
+        SdbLogError("Unknown mode \"%s\". Valid modes are \"copy\" and \"buffer\"", ModeName);
+        return EXIT_FAILURE;
+    }
+
+    char Dir[] = "/tmp/PgWriterBench-XXXXXX";
+    if(BenchSetUpDir(Dir, MaxWriters) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    /**< Rows are a few dozen bytes, so the row rate is what matters, MiB/s is of the raw rows */
+    printf("\nMode: %s, %u tables\n", ModeName, MaxWriters);
+    printf("%8s %16s %12s\n", "writers", "rows/s", "MiB/s");
+    fflush(stdout);
+    for(u32 Writers = 1; Writers <= MaxWriters; Writers *= 2) {
+        pid_t Pid = fork();
+        if(Pid == 0) {
+            exit(RunBench(Writers, Seconds, strcmp(ModeName, "copy") == 0, MaxWriters));
+        } else if(Pid == -1) {
+            SdbLogError("Failed to fork: %s", strerror(errno));
+            BenchTearDownDir(Dir);
+            return EXIT_FAILURE;
+        }
+
+        int Status;
+        waitpid(Pid, &Status, 0);
+        if(!WIFEXITED(Status) || WEXITSTATUS(Status) != EXIT_SUCCESS) {
+            SdbLogError("Benchmark with %u writers failed", Writers);
+        }
+    }
+
+    BenchTearDownDir(Dir);
+    return EXIT_SUCCESS;
+}
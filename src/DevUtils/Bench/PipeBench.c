@@ -0,0 +1,497 @@
+/**
+ * @file PipeBench.c
+ * @brief Benchmark of sensor data pipe handoffs
+ *
+ * Compares the sensor data pipe with the implementation it replaced, which read and wrote an
+ * eventfd on both sides of every buffer handoff. Each pipe is measured in two ways:
+ * - handoffs/s: the writer publishes buffers as fast as the reader takes them, along with the
+ *   context switches per handoff, since every wait that is not spun out costs two
+ * - wakeup latency: the writer publishes one buffer every interval, so the reader has parked
+ *   each time, and the time from publishing to the reader holding the buffer is recorded
+ *
+ * The ring is then run again with taps attached: lossless taps, which must see every buffer in
+ * order, and one lossy tap that is slowed down, which must see the buffers in order and have
+ * every one it missed counted as dropped.
+ *
+ * Usage: PipeBench [handoffs] [buffers] [interval us] [lossless taps]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(PipeBench);
+
+#include <src/Common/LatencyHistogram.h>
+#include <src/Common/SensorDataPipe.h>
+#include <src/Common/Thread.h>
+#include <src/Common/Time.h>
+
+#define BENCH_BUF_SIZE         SdbKibiByte(4)
+#define BENCH_LATENCY_HANDOFFS 20000
+#define BENCH_LOSSY_DELAY      SDB_TIME_US(10)
+
+/**
+ * @brief The pipe before it became a ring, kept for comparison
+ */
+typedef struct
+{
+    atomic_uint WriteBufIdx;
+    atomic_uint ReadBufIdx;
+    atomic_uint FullBuffersCount;
+
+    int ReadEventFd;
+    int WriteEventFd;
+
+    u64         BufCount;
+    sdb_arena **Buffers;
+} legacy_pipe;
+
+static legacy_pipe *
+LegacyCreate(u64 BufCount, u64 BufSize)
+{
+    u64 PipeSize = sizeof(legacy_pipe) + BufCount * sizeof(sdb_arena *)
+                 + BufCount * sizeof(sdb_arena) + BufCount * BufSize;
+    sdb_arena Arena;
+    SdbArenaInit(&Arena, calloc(1, PipeSize), PipeSize);
+
+    legacy_pipe *Pipe = SdbPushStruct(&Arena, legacy_pipe);
+    Pipe->Buffers     = SdbPushArray(&Arena, sdb_arena *, BufCount);
+    for(u64 b = 0; b < BufCount; ++b) {
+        Pipe->Buffers[b] = SdbArenaBootstrap(&Arena, NULL, BufSize);
+    }
+
+    Pipe->ReadEventFd  = eventfd(0, EFD_SEMAPHORE);
+    Pipe->WriteEventFd = eventfd(0, EFD_SEMAPHORE);
+    atomic_init(&Pipe->WriteBufIdx, 0);
+    atomic_init(&Pipe->ReadBufIdx, 0);
+    atomic_init(&Pipe->FullBuffersCount, 0);
+
+    Pipe->BufCount = BufCount;
+    u64 InitVal    = BufCount - 1;
+    write(Pipe->WriteEventFd, &InitVal, sizeof(InitVal));
+
+    return Pipe;
+}
+
+static sdb_arena *
+LegacyGetWriteBuffer(legacy_pipe *Pipe)
+{
+    u32 NextWriteBuf = (atomic_load(&Pipe->WriteBufIdx) + 1) % Pipe->BufCount;
+
+    u64 Val;
+    if(read(Pipe->WriteEventFd, &Val, sizeof(Val)) == -1) {
+        return NULL;
+    }
+
+    atomic_store(&Pipe->WriteBufIdx, NextWriteBuf);
+    atomic_fetch_add(&Pipe->FullBuffersCount, 1);
+
+    Val = 1;
+    write(Pipe->ReadEventFd, &Val, sizeof(Val));
+
+    sdb_arena *Buf = Pipe->Buffers[NextWriteBuf];
+    SdbArenaClear(Buf);
+    return Buf;
+}
+
+static sdb_arena *
+LegacyGetReadBuffer(legacy_pipe *Pipe)
+{
+    u64 Val;
+    if(read(Pipe->ReadEventFd, &Val, sizeof(Val)) == -1) {
+        return NULL;
+    }
+
+    u32        CurReadBuffer = atomic_load(&Pipe->ReadBufIdx);
+    sdb_arena *Buf           = Pipe->Buffers[CurReadBuffer];
+    atomic_store(&Pipe->ReadBufIdx, (CurReadBuffer + 1) % Pipe->BufCount);
+    atomic_fetch_sub(&Pipe->FullBuffersCount, 1);
+
+    Val = 1;
+    write(Pipe->WriteEventFd, &Val, sizeof(Val));
+
+    return Buf;
+}
+
+static void
+LegacyDestroy(legacy_pipe *Pipe)
+{
+    close(Pipe->ReadEventFd);
+    close(Pipe->WriteEventFd);
+    free(Pipe);
+}
+
+/**
+ * @brief One of the pipes under test
+ */
+typedef struct
+{
+    const char *Name;
+    void *(*Create)(u64 BufCount);
+    sdb_arena *(*CurrentWriteBuffer)(void *Pipe);
+    sdb_arena *(*GetWriteBuffer)(void *Pipe);
+    sdb_arena *(*GetReadBuffer)(void *Pipe);
+    void (*ReleaseReadBuffer)(void *Pipe);
+    void (*Destroy)(void *Pipe);
+} bench_pipe;
+
+static void *
+RingCreate(u64 BufCount)
+{
+    return SdpCreate(BufCount, BENCH_BUF_SIZE, NULL);
+}
+
+static sdb_arena *
+RingCurrentWriteBuffer(void *Pipe)
+{
+    return SdPipeCurrentWriteBuffer(Pipe);
+}
+
+static sdb_arena *
+RingGetWriteBuffer(void *Pipe)
+{
+    return SdPipeGetWriteBuffer(Pipe);
+}
+
+static sdb_arena *
+RingGetReadBuffer(void *Pipe)
+{
+    return SdPipeGetReadBuffer(Pipe);
+}
+
+static void
+RingReleaseReadBuffer(void *Pipe)
+{
+    SdPipeReleaseReadBuffer(Pipe);
+}
+
+static void
+RingDestroy(void *Pipe)
+{
+    SdpDestroy(Pipe, false);
+}
+
+static void *
+EventFdCreate(u64 BufCount)
+{
+    return LegacyCreate(BufCount, BENCH_BUF_SIZE);
+}
+
+static sdb_arena *
+EventFdCurrentWriteBuffer(void *Pipe)
+{
+    legacy_pipe *Legacy = Pipe;
+    return Legacy->Buffers[atomic_load(&Legacy->WriteBufIdx)];
+}
+
+static sdb_arena *
+EventFdGetWriteBuffer(void *Pipe)
+{
+    return LegacyGetWriteBuffer(Pipe);
+}
+
+static sdb_arena *
+EventFdGetReadBuffer(void *Pipe)
+{
+    return LegacyGetReadBuffer(Pipe);
+}
+
+static void
+EventFdReleaseReadBuffer(void *Pipe)
+{
+    (void)Pipe; // Released as soon as it is read
+}
+
+static void
+EventFdDestroy(void *Pipe)
+{
+    LegacyDestroy(Pipe);
+}
+
+static const bench_pipe BenchPipes[] = {
+    { "eventfd", EventFdCreate, EventFdCurrentWriteBuffer, EventFdGetWriteBuffer,
+      EventFdGetReadBuffer, EventFdReleaseReadBuffer, EventFdDestroy },
+    { "spsc ring", RingCreate, RingCurrentWriteBuffer, RingGetWriteBuffer, RingGetReadBuffer,
+      RingReleaseReadBuffer, RingDestroy },
+};
+
+typedef struct
+{
+    const bench_pipe *Ops;
+    void             *Pipe;
+    u64               Handoffs;
+    sdb_timediff      Interval; /**< Time between handoffs, 0 to hand off as fast as possible */
+    sdb_latency_hist  Latency;  /**< Publish to read latency, filled by the reader */
+    u64               Errors;   /**< Buffers read out of order */
+    u64               Switches; /**< Context switches of the process while running */
+} bench_run;
+
+static u64
+MonotonicNs(void)
+{
+    struct timespec Now;
+    SdbTimeMonotonic(&Now);
+    return SdbTimespecNs(&Now);
+}
+
+static void *
+BenchWriter(void *Arg)
+{
+    bench_run *Run = Arg;
+    sdb_arena *Buf = Run->Ops->CurrentWriteBuffer(Run->Pipe);
+
+    for(u64 h = 0; h < Run->Handoffs; ++h) {
+        if(Run->Interval > 0) {
+            SdbSleep(Run->Interval);
+        }
+
+        u64 *Payload = SdbPushArray(Buf, u64, 2);
+        Payload[0]   = h;
+        Payload[1]   = MonotonicNs();
+        Buf          = Run->Ops->GetWriteBuffer(Run->Pipe);
+        if(Buf == NULL) {
+            SdbLogError("Writer failed to get a buffer");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void *
+BenchReader(void *Arg)
+{
+    bench_run *Run = Arg;
+
+    for(u64 h = 0; h < Run->Handoffs; ++h) {
+        sdb_arena *Buf = Run->Ops->GetReadBuffer(Run->Pipe);
+        if(Buf == NULL) {
+            SdbLogError("Reader failed to get a buffer");
+            break;
+        }
+
+        u64 *Payload = (u64 *)Buf->Mem;
+        u64  Now     = MonotonicNs();
+        if(Payload[0] != h) {
+            ++Run->Errors;
+        }
+        SdbLatencyHistAdd(&Run->Latency, (Now > Payload[1]) ? Now - Payload[1] : 0, 1);
+        Run->Ops->ReleaseReadBuffer(Run->Pipe);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Run one writer and one reader over a fresh pipe
+ *
+ * @return Seconds the handoffs took
+ */
+static double
+RunBench(bench_run *Run, u64 BufCount)
+{
+    Run->Pipe = Run->Ops->Create(BufCount);
+    if(Run->Pipe == NULL) {
+        SdbLogError("Failed to create %s pipe", Run->Ops->Name);
+        exit(EXIT_FAILURE);
+    }
+
+    struct rusage UsageStart, UsageEnd;
+    getrusage(RUSAGE_SELF, &UsageStart);
+
+    pthread_t Writer, Reader;
+    u64       Start = MonotonicNs();
+    pthread_create(&Reader, NULL, BenchReader, Run);
+    pthread_create(&Writer, NULL, BenchWriter, Run);
+    pthread_join(Writer, NULL);
+    pthread_join(Reader, NULL);
+    u64 End = MonotonicNs();
+
+    getrusage(RUSAGE_SELF, &UsageEnd);
+    Run->Switches = (UsageEnd.ru_nvcsw + UsageEnd.ru_nivcsw)
+                  - (UsageStart.ru_nvcsw + UsageStart.ru_nivcsw);
+
+    Run->Ops->Destroy(Run->Pipe);
+    if(Run->Errors > 0) {
+        SdbLogError("%s pipe delivered %lu buffers out of order", Run->Ops->Name, Run->Errors);
+    }
+
+    return (double)(End - Start) / 1e9;
+}
+
+typedef struct
+{
+    sensor_data_pipe *Pipe;
+    sdp_tap          *Tap;
+    u64               Handoffs;
+    sdb_timediff      Delay;  /**< Time spent after releasing each buffer */
+    u64               Seen;   /**< Buffers the tap read */
+    u64               Errors; /**< Buffers read out of order, or missed by a lossless tap */
+} bench_tap;
+
+static void *
+BenchTap(void *Arg)
+{
+    bench_tap *Run  = Arg;
+    u64        Next = 0;
+
+    while(Next < Run->Handoffs) {
+        sdb_arena *Buf = SdPipeTapGetReadBuffer(Run->Pipe, Run->Tap);
+        if(Buf == NULL) {
+            SdbLogError("Tap failed to get a buffer");
+            break;
+        }
+
+        u64 *Payload = (u64 *)Buf->Mem;
+        if(Payload[0] < Next || (!Run->Tap->Lossy && Payload[0] != Next)) {
+            ++Run->Errors;
+        }
+        Next = Payload[0] + 1;
+        ++Run->Seen;
+        if(Run->Delay > 0) {
+            SdPipeTapReleaseReadBuffer(Run->Pipe, Run->Tap);
+            SdbSleep(Run->Delay);
+        }
+    }
+    SdpTapDetach(Run->Pipe, Run->Tap);
+
+    return NULL;
+}
+
+/**
+ * @brief Run one writer, one reader, TapCount lossless taps and one lossy tap over a fresh ring
+ *
+ * @return Seconds the writer, the reader and the lossless taps took, or a negative value if a tap
+ *         saw the wrong buffers
+ */
+static double
+RunTapBench(u64 Handoffs, u64 BufCount, u64 TapCount)
+{
+    bench_run *Run  = calloc(1, sizeof(*Run));
+    bench_tap *Taps = calloc(TapCount + 1, sizeof(*Taps));
+    if(!Run || !Taps) {
+        exit(EXIT_FAILURE);
+    }
+
+    sensor_data_pipe *Pipe = RingCreate(BufCount);
+    if(Pipe == NULL) {
+        SdbLogError("Failed to create spsc ring pipe");
+        exit(EXIT_FAILURE);
+    }
+    // NOTE(ingar): One packet per buffer, so the lossy tap's dropped packets are buffers
+    Pipe->PacketSize = 2 * sizeof(u64);
+    Run->Ops         = &BenchPipes[1];
+    Run->Pipe        = Pipe;
+    Run->Handoffs    = Handoffs;
+    for(u64 t = 0; t <= TapCount; ++t) {
+        Taps[t].Pipe     = Pipe;
+        Taps[t].Tap      = SdpTapAttach(Pipe, t == TapCount);
+        Taps[t].Handoffs = Handoffs;
+        Taps[t].Delay    = (t == TapCount) ? BENCH_LOSSY_DELAY : 0;
+        if(Taps[t].Tap == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_t Writer, Reader, TapThreads[SDP_MAX_TAPS];
+    u64       Start = MonotonicNs();
+    for(u64 t = 0; t <= TapCount; ++t) {
+        pthread_create(&TapThreads[t], NULL, BenchTap, &Taps[t]);
+    }
+    pthread_create(&Reader, NULL, BenchReader, Run);
+    pthread_create(&Writer, NULL, BenchWriter, Run);
+    pthread_join(Writer, NULL);
+    pthread_join(Reader, NULL);
+    for(u64 t = 0; t < TapCount; ++t) {
+        pthread_join(TapThreads[t], NULL);
+    }
+    u64 End = MonotonicNs();
+    pthread_join(TapThreads[TapCount], NULL);
+
+    bench_tap *Lossy   = &Taps[TapCount];
+    u64        Dropped = atomic_load(&Lossy->Tap->DroppedCount);
+    u64        Errors  = Run->Errors;
+    for(u64 t = 0; t <= TapCount; ++t) {
+        Errors += Taps[t].Errors;
+    }
+    if(Lossy->Seen + Dropped != Handoffs) {
+        SdbLogError("Lossy tap saw %lu buffers and dropped %lu of %lu", Lossy->Seen, Dropped,
+                    Handoffs);
+        ++Errors;
+    }
+
+    double Elapsed = (double)(End - Start) / 1e9;
+    printf("%-10s %14.0f %12.1f   lossy tap saw %lu, dropped %lu, %lu errors\n", "taps",
+           Handoffs / Elapsed, Elapsed * 1e9 / Handoffs, Lossy->Seen, Dropped, Errors);
+
+    SdpDestroy(Pipe, false);
+    free(Run);
+    free(Taps);
+
+    return (Errors > 0) ? -1.0 : Elapsed;
+}
+
+int
+main(int ArgCount, char **ArgV)
+{
+    u64 Handoffs = (ArgCount > 1) ? strtoull(ArgV[1], NULL, 10) : 1000000;
+    u64 BufCount = (ArgCount > 2) ? strtoull(ArgV[2], NULL, 10) : 4;
+    u64 Interval = (ArgCount > 3) ? strtoull(ArgV[3], NULL, 10) : 100;
+    u64 TapCount = (ArgCount > 4) ? strtoull(ArgV[4], NULL, 10) : 2;
+    if(BufCount < 2) {
+        SdbLogError("The pipes need at least 2 buffers");
+        return EXIT_FAILURE;
+    }
+    if(TapCount >= SDP_MAX_TAPS) {
+        SdbLogError("A pipe has room for %d lossless taps besides the lossy one",
+                    SDP_MAX_TAPS - 1);
+        return EXIT_FAILURE;
+    }
+
+    printf("%lu handoffs, %lu buffers, latency measured every %lu us\n", Handoffs, BufCount,
+           Interval);
+    printf("%-10s %14s %12s %12s %10s %10s %10s\n", "pipe", "handoffs/s", "ns/handoff",
+           "switches/ho", "p50 ns", "p99 ns", "max ns");
+    for(u64 p = 0; p < SdbArrayLen(BenchPipes); ++p) {
+        bench_run *Throughput = calloc(1, sizeof(*Throughput));
+        bench_run *Wakeup     = calloc(1, sizeof(*Wakeup));
+        if(!Throughput || !Wakeup) {
+            return EXIT_FAILURE;
+        }
+
+        Throughput->Ops      = &BenchPipes[p];
+        Throughput->Handoffs = Handoffs;
+        double Elapsed       = RunBench(Throughput, BufCount);
+
+        Wakeup->Ops      = &BenchPipes[p];
+        Wakeup->Handoffs = SdbMin(Handoffs, BENCH_LATENCY_HANDOFFS);
+        Wakeup->Interval = SDB_TIME_US(Interval);
+        RunBench(Wakeup, BufCount);
+
+        printf("%-10s %14.0f %12.1f %12.3f %10lu %10lu %10lu\n", BenchPipes[p].Name,
+               Handoffs / Elapsed, Elapsed * 1e9 / Handoffs, (double)Throughput->Switches / Handoffs,
+               SdbLatencyHistPercentile(&Wakeup->Latency, 50.0),
+               SdbLatencyHistPercentile(&Wakeup->Latency, 99.0), Wakeup->Latency.Max);
+        fflush(stdout);
+
+        free(Throughput);
+        free(Wakeup);
+    }
+
+    printf("%lu lossless taps and 1 lossy tap on the spsc ring\n", TapCount);
+    if(RunTapBench(Handoffs, BufCount, TapCount) < 0.0) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
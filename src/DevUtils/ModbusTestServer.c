@@ -21,6 +21,7 @@
  */
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <time.h>
@@ -36,6 +37,7 @@ SDB_LOG_REGISTER(ModbusTestServer);
 #include <src/Common/Thread.h>
 #include <src/Common/Time.h>
 #include <src/DatabaseSystems/Postgres.h>
+#include <src/DevUtils/ModbusTestServer.h>
 #include <src/DevUtils/TestConstants.h>
 #include <src/Signals.h>
 
@@ -132,35 +134,22 @@ GenerateModbusTcpFrame(u8 *Buffer, u16 TransactionId, u16 ProtocolId, u16 Length
 
 
 /**
- * @brief Sends Modbus data over a socket
+ * @brief Writes one Modbus frame carrying a random shaft power packet
  *
- * Generates a random shaft power data packet, constructs a
- * Modbus TCP frame, and sends it over the provided socket.
- *
- * Features:
- * - Random data generation
- * - Modbus TCP frame construction
- * - Periodic logging of sent packets
- *
- * @param NewFd Socket file descriptor to send data
- * @return sdb_errno Status of send operation
+ * @param ModbusFrame Destination, must hold at least MODBUS_TCP_FRAME_MAX_SIZE bytes
+ * @return Size of the frame in bytes
  */
-static inline sdb_errno
-SendModbusData(int NewFd)
+static inline size_t
+WriteModbusDataFrame(u8 *ModbusFrame)
 {
-    static u8        ModbusFrame[MODBUS_TCP_FRAME_MAX_SIZE] = { 0 };
-    static const u16 DataLength                             = sizeof(shaft_power_data);
-    static const u16 Length                                 = DataLength + 3;
+    static const u16 DataLength = sizeof(shaft_power_data);
+    static const u16 Length     = DataLength + 3;
     shaft_power_data SpData;
-    static u64       SendCount = 0;
 
-    // Sanity check the sizes
-    if(Length > MODBUS_TCP_FRAME_MAX_SIZE - MODBUS_TCP_HEADER_LEN) {
-        SdbLogError("Frame too large: %u", Length);
-        return -1;
-    }
+    static_assert(sizeof(shaft_power_data) + 3
+                      <= MODBUS_TCP_FRAME_MAX_SIZE - MODBUS_TCP_LENGTH_OFFSET,
+                  "Frame too large");
 
-    memset(ModbusFrame, 0, MODBUS_TCP_FRAME_MAX_SIZE);
     GenerateShaftPowerDataRandom(&SpData);
 
     u16 Pos = 0;
@@ -175,44 +164,260 @@ SendModbusData(int NewFd)
     ModbusFrame[Pos++] = 0x10;                 // Function code
     ModbusFrame[Pos++] = DataLength;           // Byte count
 
-    // Copy data with bounds checking
-    if(Pos + DataLength > MODBUS_TCP_FRAME_MAX_SIZE) {
-        SdbLogError("Buffer overflow prevented");
-        return -1;
+    SdbMemcpy(&ModbusFrame[Pos], &SpData, DataLength);
+    return MODBUS_TCP_LENGTH_OFFSET + Length;
+}
+
+
+/**
+ * @brief Writes the response to a read holding/input registers request
+ *
+ * The registers hold a random shaft power packet, zero padded or truncated to the requested
+ * register count. Other function codes get an illegal function exception.
+ *
+ * @param ModbusFrame Destination, must hold at least MODBUS_TCP_FRAME_MAX_SIZE bytes
+ * @param Request Complete request frame
+ * @return Size of the response in bytes
+ */
+static size_t
+WriteModbusReadResponse(u8 *ModbusFrame, const u8 *Request)
+{
+    u8  Function = Request[7];
+    u16 Quantity = (Request[10] << 8) | Request[11];
+
+    SdbMemcpy(ModbusFrame, Request, 4); // Transaction and protocol ID
+    ModbusFrame[6] = Request[6];        // Unit ID
+
+    if(Function != MODBUS_READ_HOLDING_REGISTERS && Function != MODBUS_READ_INPUT_REGISTERS) {
+        ModbusFrame[4] = 0x00;
+        ModbusFrame[5] = 0x03;
+        ModbusFrame[7] = Function | MODBUS_EXCEPTION_FLAG;
+        ModbusFrame[8] = 0x01; // Illegal function
+        return MODBUS_TCP_LENGTH_OFFSET + 3;
     }
 
-    SdbMemcpy(&ModbusFrame[Pos], &SpData, DataLength);
-    size_t TotalSize = MODBUS_TCP_HEADER_LEN + Length;
+    Quantity          = SdbMin(Quantity, MODBUS_READ_MAX_REGISTERS);
+    u16 ByteCount     = 2 * Quantity;
+    u16 Length        = ByteCount + 3;
+    ModbusFrame[4]    = (Length >> 8) & 0xFF;
+    ModbusFrame[5]    = Length & 0xFF;
+    ModbusFrame[7]    = Function;
+    ModbusFrame[8]    = ByteCount;
 
-    SdbLogDebug("Sending frame - Length: %u, DataLength: %u, TotalSize: %zu", Length, DataLength,
-                TotalSize);
+    shaft_power_data SpData;
+    GenerateShaftPowerDataRandom(&SpData);
+    u16 Copied = SdbMin(ByteCount, sizeof(SpData));
+    SdbMemcpy(&ModbusFrame[9], &SpData, Copied);
+    SdbMemset(&ModbusFrame[9 + Copied], 0, ByteCount - Copied);
+
+    return MODBUS_TCP_LENGTH_OFFSET + Length;
+}
+
+
+/**
+ * @brief State of one client served by the test server
+ */
+typedef struct
+{
+    int             Fd;
+    char            Ip[INET6_ADDRSTRLEN];
+    int             Port;
+    struct timespec Start;  /**< When the client was accepted */
+    u64             Queued; /**< Frames written to the out buffer so far */
+    u64             Sent;   /**< Frames fully sent */
+    u64             OutFrames;
+    size_t          OutLen;
+    size_t          OutOff;
+    u8             *Out;
+    size_t          InLen; /**< Bytes of partial requests in In, responder mode only */
+    u8             *In;
+} mb_test_client;
+
+
+/**
+ * @brief Accepts pending connections until the client limit is reached
+ */
+static void
+AcceptClients(int SockFd, mb_test_client *Clients, u64 *ClientCount, const mb_test_server_conf *Conf)
+{
+    while(*ClientCount < Conf->MaxClients) {
+        struct sockaddr_in ClientAddr;
+        socklen_t          SinSize = sizeof(ClientAddr);
 
-    ssize_t SendResult = send(NewFd, ModbusFrame, TotalSize, 0);
-    if(SendResult > 0) {
-        SendCount++;
-        if(SendCount % 10000 == 0) {
-            SdbLogInfo("Sent %lu packets", SendCount);
+        int NewFd = accept(SockFd, (struct sockaddr *)&ClientAddr, &SinSize);
+        if(NewFd == -1) {
+            if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                SdbLogError("Accept error: %s (errno: %d)", strerror(errno), errno);
+            }
+            return;
+        }
+
+        // Set client socket to non-blocking too
+        SocketSetNonBlocking(NewFd);
+
+        // Enable TCP_NODELAY for client socket
+        int OptVal = 1;
+        setsockopt(NewFd, IPPROTO_TCP, TCP_NODELAY, &OptVal, sizeof(OptVal));
+
+        mb_test_client *Client = &Clients[(*ClientCount)++];
+        Client->Fd             = NewFd;
+        Client->Port           = ntohs(ClientAddr.sin_port);
+        Client->Queued         = 0;
+        Client->Sent           = 0;
+        Client->OutFrames      = 0;
+        Client->OutLen         = 0;
+        Client->OutOff         = 0;
+        Client->InLen          = 0;
+        clock_gettime(CLOCK_MONOTONIC, &Client->Start);
+        inet_ntop(ClientAddr.sin_family, &(ClientAddr.sin_addr), Client->Ip, sizeof(Client->Ip));
+        SdbLogInfo("Server: accepted connection from %s:%d", Client->Ip, Client->Port);
+    }
+}
+
+
+/**
+ * @brief Sends as much of a client's out buffer as the socket accepts
+ *
+ * @return Number of bytes sent, 0 if the socket is full, -1 if the client must be dropped
+ */
+static ssize_t
+SendQueued(mb_test_client *Client)
+{
+    ssize_t SendResult
+        = send(Client->Fd, Client->Out + Client->OutOff, Client->OutLen - Client->OutOff,
+               MSG_NOSIGNAL);
+    if(SendResult == -1) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
         }
+        if(errno == ECONNRESET || errno == EPIPE) {
+            SdbLogInfo("Client %s:%d disconnected", Client->Ip, Client->Port);
+        } else {
+            SdbLogError("Failed to send to %s:%d: %s", Client->Ip, Client->Port, strerror(errno));
+        }
+        return -1;
+    }
+
+    Client->OutOff += SendResult;
+    if(Client->OutOff == Client->OutLen) {
+        Client->Sent += Client->OutFrames;
     }
 
     return SendResult;
 }
 
 
+/**
+ * @brief Sends the frames that are due to one client
+ *
+ * @return Number of bytes sent, 0 if nothing was sent, -1 if the client must be dropped
+ */
+static ssize_t
+ServeClient(mb_test_client *Client, const mb_test_server_conf *Conf, struct timespec *Now)
+{
+    if(Client->OutOff == Client->OutLen) {
+        u64 Due = Conf->FramesPerSend;
+        if(Conf->SendInterval > 0) {
+            u64 Target = SdbTimeDiff(Now, &Client->Start) / Conf->SendInterval;
+            Due        = (Target > Client->Queued) ? Target - Client->Queued : 0;
+            Due        = SdbMin(Due, Conf->FramesPerSend);
+        }
+        if(Due == 0) {
+            return 0;
+        }
+
+        Client->OutLen = 0;
+        for(u64 f = 0; f < Due; ++f) {
+            Client->OutLen += WriteModbusDataFrame(Client->Out + Client->OutLen);
+        }
+        Client->OutOff    = 0;
+        Client->OutFrames = Due;
+        Client->Queued += Due;
+    }
+
+    return SendQueued(Client);
+}
+
+
+/**
+ * @brief Answers the requests received from one client
+ *
+ * New requests are only read once the previous responses are sent, so a client that does not
+ * read its responses is throttled by its own socket buffers.
+ *
+ * @return Number of bytes sent, 0 if nothing was sent, -1 if the client must be dropped
+ */
+static ssize_t
+AnswerClient(mb_test_client *Client, const mb_test_server_conf *Conf)
+{
+    if(Client->OutOff == Client->OutLen) {
+        size_t  InSize = Conf->FramesPerSend * MODBUS_READ_REQUEST_LEN;
+        ssize_t Got    = recv(Client->Fd, Client->In + Client->InLen, InSize - Client->InLen, 0);
+        if(Got == 0) {
+            SdbLogInfo("Client %s:%d disconnected", Client->Ip, Client->Port);
+            return -1;
+        } else if(Got == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                SdbLogInfo("Failed to receive from %s:%d: %s", Client->Ip, Client->Port,
+                           strerror(errno));
+                return -1;
+            }
+            Got = 0;
+        }
+        Client->InLen += Got;
+
+        size_t Off     = 0;
+        Client->OutLen = 0;
+        Client->OutOff = 0;
+        Client->OutFrames = 0;
+        while(Client->InLen - Off >= MODBUS_TCP_HEADER_LEN) {
+            const u8 *Request = Client->In + Off;
+            u16       Length  = (Request[4] << 8) | Request[5];
+            if(Length != MODBUS_READ_REQUEST_LEN - MODBUS_TCP_LENGTH_OFFSET) {
+                SdbLogError("Unsupported request of length %u from %s:%d", Length, Client->Ip,
+                            Client->Port);
+                return -1;
+            }
+            if(Client->InLen - Off < MODBUS_READ_REQUEST_LEN) {
+                break;
+            }
+
+            Client->OutLen += WriteModbusReadResponse(Client->Out + Client->OutLen, Request);
+            Off += MODBUS_READ_REQUEST_LEN;
+            ++Client->OutFrames;
+        }
+
+        Client->InLen -= Off;
+        if(Client->InLen > 0) {
+            memmove(Client->In, Client->In + Off, Client->InLen);
+        }
+        Client->Queued += Client->OutFrames;
+
+        if(Client->OutLen == 0) {
+            return 0;
+        }
+    }
+
+    return SendQueued(Client);
+}
+
+
 /**
  * @brief Main Modbus Test Server routine
  *
  * Implements the complete Modbus test server workflow:
  * - Create and configure server socket
- * - Handle incoming client connections
- * - Send simulated shaft power data
+ * - Accept up to Conf->MaxClients clients
+ * - Send simulated shaft power data to every client at the configured rate, batching several
+ *   frames into each send() when the client is behind schedule
  * - Support non-blocking operations
  * - Graceful shutdown handling
  *
  * @param Barrier Synchronization barrier to coordinate server startup
+ * @param Conf Server configuration
  */
 void
-RunModbusTestServer(sdb_barrier *Barrier)
+MbTestServerRun(sdb_barrier *Barrier, const mb_test_server_conf *Conf)
 {
     SdbLogInfo("Running Modbus Test Server");
 
@@ -221,6 +426,7 @@ RunModbusTestServer(sdb_barrier *Barrier)
     int SockFd = socket(AF_INET, SOCK_STREAM, 0);
     if(SockFd == -1) {
         SdbLogError("Failed to create socket: %s (errno: %d)", strerror(errno), errno);
+        SdbBarrierWait(Barrier);
         return;
     }
 
@@ -229,6 +435,16 @@ RunModbusTestServer(sdb_barrier *Barrier)
     if(setsockopt(SockFd, SOL_SOCKET, SO_REUSEADDR, &OptVal, sizeof(OptVal)) == -1) {
         SdbLogError("Failed to set SO_REUSEADDR: %s", strerror(errno));
         close(SockFd);
+        SdbBarrierWait(Barrier);
+        return;
+    }
+
+    // NOTE(ingar): Lets several server threads share the port, with the kernel spreading the
+    // connections between them
+    if(setsockopt(SockFd, SOL_SOCKET, SO_REUSEPORT, &OptVal, sizeof(OptVal)) == -1) {
+        SdbLogError("Failed to set SO_REUSEPORT: %s", strerror(errno));
+        close(SockFd);
+        SdbBarrierWait(Barrier);
         return;
     }
 
@@ -236,6 +452,7 @@ RunModbusTestServer(sdb_barrier *Barrier)
     if(setsockopt(SockFd, IPPROTO_TCP, TCP_NODELAY, &OptVal, sizeof(OptVal)) == -1) {
         SdbLogError("Failed to set TCP_NODELAY: %s", strerror(errno));
         close(SockFd);
+        SdbBarrierWait(Barrier);
         return;
     }
 
@@ -248,84 +465,98 @@ RunModbusTestServer(sdb_barrier *Barrier)
     if(bind(SockFd, (struct sockaddr *)&ServerAddr, sizeof(ServerAddr)) == -1) {
         SdbLogError("Failed to bind: %s (errno: %d)", strerror(errno), errno);
         close(SockFd);
+        SdbBarrierWait(Barrier);
         return;
     }
 
-    if(listen(SockFd, BACKLOG) == -1) {
+    if(listen(SockFd, SdbMax(BACKLOG, (int)Conf->MaxClients)) == -1) {
         SdbLogError("Failed to listen: %s (errno: %d)", strerror(errno), errno);
         close(SockFd);
+        SdbBarrierWait(Barrier);
         return;
     }
 
     // Make socket non-blocking
-    int Flags = fcntl(SockFd, F_GETFL, 0);
-    fcntl(SockFd, F_SETFL, Flags | O_NONBLOCK);
+    SocketSetNonBlocking(SockFd);
+
+    mb_test_client *Clients  = malloc(Conf->MaxClients * sizeof(mb_test_client));
+    size_t          OutSize  = Conf->FramesPerSend * MODBUS_TCP_FRAME_MAX_SIZE;
+    u8             *OutMem   = malloc(Conf->MaxClients * OutSize);
+    size_t          InSize   = Conf->Respond ? Conf->FramesPerSend * MODBUS_READ_REQUEST_LEN : 0;
+    u8             *InMem    = malloc(SdbMax(Conf->MaxClients * InSize, 1));
+    u64             ClientCount = 0;
+    for(u64 c = 0; c < Conf->MaxClients; ++c) {
+        Clients[c].Out = OutMem + c * OutSize;
+        Clients[c].In  = InMem + c * InSize;
+    }
 
-    SdbLogInfo("Server: waiting for connections on port %d...", MODBUS_PORT);
+    SdbLogInfo("Server: waiting for up to %lu connections on port %d...", Conf->MaxClients,
+               MODBUS_PORT);
     SdbBarrierWait(Barrier);
 
     while(!SdbShouldShutdown()) {
-        struct sockaddr_in ClientAddr;
-        socklen_t          SinSize = sizeof(ClientAddr);
-        char               ClientIp[INET6_ADDRSTRLEN];
-
-        int NewFd = accept(SockFd, (struct sockaddr *)&ClientAddr, &SinSize);
-        if(NewFd == -1) {
-            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(10000); // 10ms delay if no connection
-                continue;
-            }
-            SdbLogError("Accept error: %s (errno: %d)", strerror(errno), errno);
-            continue;
-        }
-
-        // Set client socket to non-blocking too
-        Flags = fcntl(NewFd, F_GETFL, 0);
-        fcntl(NewFd, F_SETFL, Flags | O_NONBLOCK);
-
-        // Enable TCP_NODELAY for client socket
-        OptVal = 1;
-        setsockopt(NewFd, IPPROTO_TCP, TCP_NODELAY, &OptVal, sizeof(OptVal));
-
-        inet_ntop(ClientAddr.sin_family, &(ClientAddr.sin_addr), ClientIp, sizeof(ClientIp));
-        SdbLogInfo("Server: accepted connection from %s:%d", ClientIp, ntohs(ClientAddr.sin_port));
-
-        u64             PacketsSent = 0;
-        struct timespec LastSend, Now;
-        clock_gettime(CLOCK_MONOTONIC, &LastSend);
-
-        while(!SdbShouldShutdown()) {
-            clock_gettime(CLOCK_MONOTONIC, &Now);
-
-            // Control send rate
-            if((Now.tv_sec - LastSend.tv_sec) * 1000000 + (Now.tv_nsec - LastSend.tv_nsec) / 1000
-               < 100) { // 100 microseconds = 10kHz
+        AcceptClients(SockFd, Clients, &ClientCount, Conf);
+
+        struct timespec Now;
+        clock_gettime(CLOCK_MONOTONIC, &Now);
+
+        bool Progress = false;
+        for(u64 c = 0; c < ClientCount;) {
+            ssize_t Result = Conf->Respond ? AnswerClient(&Clients[c], Conf)
+                                           : ServeClient(&Clients[c], Conf, &Now);
+            if(Result == -1) {
+                SdbLogInfo("Connection closed after sending %lu packets", Clients[c].Sent);
+                close(Clients[c].Fd);
+
+                /**< Swap the last client into the hole, keeping its buffers */
+                u8 *Out    = Clients[c].Out;
+                u8 *In     = Clients[c].In;
+                Clients[c] = Clients[--ClientCount];
+                Clients[ClientCount].Out = Out;
+                Clients[ClientCount].In  = In;
                 continue;
             }
 
-            sdb_errno SendResult = SendModbusData(NewFd);
-            if(SendResult == -1) {
-                if(errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(1000); // Wait if buffer is full
-                    continue;
-                }
-                SdbLogError("Failed to send to %s:%d: %s", ClientIp, ntohs(ClientAddr.sin_port),
-                            strerror(errno));
-                break;
-            }
-
-
-            LastSend = Now;
+            Progress |= (Result > 0);
+            ++c;
         }
 
-        SdbLogInfo("Connection closed after sending %lu packets", PacketsSent);
-        close(NewFd);
-
-        if(SdbShouldShutdown()) {
-            break;
+        if(!Progress) {
+            usleep(ClientCount > 0 ? 20 : 10000); // 10ms delay if no connection
         }
     }
 
-    SdbLogInfo("Server shutting down");
+    u64 TotalSent = 0;
+    for(u64 c = 0; c < ClientCount; ++c) {
+        TotalSent += Clients[c].Sent;
+        close(Clients[c].Fd);
+    }
+    SdbLogInfo("Server shutting down after sending %lu packets to %lu clients", TotalSent,
+               ClientCount);
+
+    free(InMem);
+    free(OutMem);
+    free(Clients);
     close(SockFd);
 }
+
+
+/**
+ * @brief Runs the test server with the default configuration
+ *
+ * Sends a frame every 100 microseconds (10 kHz) to each client.
+ *
+ * @param Barrier Synchronization barrier to coordinate server startup
+ * @param MaxClients Maximum number of simultaneously served clients
+ */
+void
+RunModbusTestServer(sdb_barrier *Barrier, u64 MaxClients)
+{
+    mb_test_server_conf Conf = {
+        .MaxClients    = SdbMax(MaxClients, 1),
+        .SendInterval  = SDB_TIME_US(100),
+        .FramesPerSend = 16,
+    };
+
+    MbTestServerRun(Barrier, &Conf);
+}
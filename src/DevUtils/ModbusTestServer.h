@@ -17,6 +17,7 @@
 #define MODBUS_TEST_SERVER_H
 
 #include <src/Common/Thread.h>
+#include <src/Common/Time.h>
 #include <src/Sdb.h>
 
 /**
@@ -27,6 +28,17 @@
  */
 #define MODBUS_PORT (1312) // (502)
 
+/**
+ * @brief Test server configuration
+ */
+typedef struct
+{
+    u64          MaxClients;    /**< Maximum number of simultaneously served clients */
+    sdb_timediff SendInterval;  /**< Time between frames per client, 0 for unthrottled */
+    u64          FramesPerSend; /**< Maximum number of frames batched into one send() */
+    bool         Respond;       /**< Answer read register requests instead of sending on a timer */
+} mb_test_server_conf;
+
 
 /**
  * @brief Runs the Modbus Test Server
@@ -35,11 +47,25 @@
  * shaft power data. The server:
  * - Listens for incoming connections
  * - Creates non-blocking sockets
- * - Sends data at a controlled frequency
+ * - Sends data to every client at 10 kHz
  * - Handles connection and shutdown gracefully
  *
  * @param Barrier Synchronization barrier to coordinate server startup
+ * @param MaxClients Maximum number of simultaneously served clients
+ */
+void RunModbusTestServer(sdb_barrier *Barrier, u64 MaxClients);
+
+/**
+ * @brief Runs the Modbus Test Server with an explicit configuration
+ *
+ * Serves every accepted client from a single thread, sending frames to each client at
+ * the configured rate. In responder mode, clients instead get one response per read holding or
+ * input registers request, carrying the request's transaction id.
+ * Several servers may run at once, each accepting a share of the connections to the port.
+ *
+ * @param Barrier Synchronization barrier to coordinate server startup
+ * @param Conf Server configuration
  */
-void RunModbusTestServer(sdb_barrier *Barrier);
+void MbTestServerRun(sdb_barrier *Barrier, const mb_test_server_conf *Conf);
 
 #endif
@@ -26,6 +26,7 @@
 
 SDB_LOG_REGISTER(Main);
 
+#include <src/Common/BufferPool.h>
 #include <src/Common/Thread.h>
 #include <src/Common/ThreadGroup.h>
 #include <src/DataHandlers/DataHandlers.h>
@@ -41,8 +42,14 @@ SDB_LOG_REGISTER(Main);
  *
  *
  *
+ * A top level "buffer_pool" object creates a pool of pipe buffers shared by every data handler:
+ * ~~~~~~~~
+ * "buffer_pool": { "buf_count": 256, "buf_size": "32kB", "memory": { "hugepages": true } }
+ * ~~~~~~~~
+ *
  * @param[in] ConfFilename Path to the JSON configuration file
  * @param[out] Manager Pointer to the thread group manager pointer that will be initialized
+ * @param[out] Pool Pointer to the shared buffer pool, NULL if the configuration has none
  *
  * @return sdb_errno Returns 0 on success, or one of the following error codes:
  *         - -ENOMEM: Memory allocation failed
@@ -51,10 +58,10 @@ SDB_LOG_REGISTER(Main);
  *         - -1: General failure in thread group creation or manager initialization
  *
  * @note The caller is responsible for destroying the manager using TgDestroyManager()
- *       when it's no longer needed
+ *       when it's no longer needed, and the pool using SdbBufPoolDestroy() after that
  */
 sdb_errno
-SetUpFromConf(sdb_string ConfFilename, tg_manager **Manager)
+SetUpFromConf(sdb_string ConfFilename, tg_manager **Manager, sdb_buf_pool **Pool)
 {
     sdb_errno      Ret               = 0;
     sdb_file_data *ConfFile          = NULL;
@@ -82,6 +89,30 @@ SetUpFromConf(sdb_string ConfFilename, tg_manager **Manager)
         goto cleanup;
     }
 
+    cJSON *PoolConf = cJSON_GetObjectItem(Conf, "buffer_pool");
+    if(PoolConf) {
+        cJSON        *PoolBufCountObj = cJSON_GetObjectItem(PoolConf, "buf_count");
+        cJSON        *PoolBufSizeObj  = cJSON_GetObjectItem(PoolConf, "buf_size");
+        sdb_page_opts PoolOpts;
+        if(!cJSON_IsNumber(PoolBufCountObj) || !cJSON_IsString(PoolBufSizeObj)) {
+            SdbLogError("The buffer pool needs \"buf_count\" and \"buf_size\"");
+            Ret = -EINVAL;
+            goto cleanup;
+        }
+        if(DhsGetPageOpts(cJSON_GetObjectItem(PoolConf, "memory"), &PoolOpts) != 0) {
+            Ret = -EINVAL;
+            goto cleanup;
+        }
+
+        *Pool = SdbBufPoolCreate(cJSON_GetNumberValue(PoolBufCountObj),
+                                 SdbMemSizeFromString(cJSON_GetStringValue(PoolBufSizeObj)),
+                                 &PoolOpts);
+        if(*Pool == NULL) {
+            Ret = -ENOMEM;
+            goto cleanup;
+        }
+    }
+
     HandlerCount = cJSON_GetArraySize(DataHandlersConfs);
     if(HandlerCount <= 0) {
         SdbLogError("No data handlers were found in the configuration file");
@@ -97,7 +128,7 @@ SetUpFromConf(sdb_string ConfFilename, tg_manager **Manager)
 
     cJSON_ArrayForEach(HandlerConf, DataHandlersConfs)
     {
-        Tgs[tg] = DhsCreateTg(HandlerConf, tg, NULL);
+        Tgs[tg] = DhsCreateTg(HandlerConf, tg, *Pool, NULL);
         if(Tgs[tg] == NULL) {
             cJSON *CouplingName = cJSON_GetObjectItem(HandlerConf, "name");
             SdbLogError("Unable to create thread group for data handler %s",
@@ -147,8 +178,9 @@ cleanup:
 int
 main(int ArgCount, char **ArgV)
 {
-    tg_manager *Manager = NULL;
-    SetUpFromConf("./configs/sdb_conf.json", &Manager);
+    tg_manager   *Manager = NULL;
+    sdb_buf_pool *Pool    = NULL;
+    SetUpFromConf("./configs/sdb_conf.json", &Manager, &Pool);
     if(Manager == NULL) {
         SdbLogError("Failed to set up from config file");
         exit(EXIT_FAILURE);
@@ -176,6 +208,9 @@ main(int ArgCount, char **ArgV)
 
     TgManagerWaitForAll(Manager);
     TgDestroyManager(Manager);
+    if(Pool) {
+        SdbBufPoolDestroy(Pool);
+    }
 
     return EXIT_SUCCESS;
 }
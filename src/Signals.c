@@ -164,7 +164,8 @@ InitiateGracefulShutdown(void)
 /**
  * @brief Handles internal pipe dump operations
  *
- * Creates timestamped dump files of pipe contents during signal handling.
+ * Creates timestamped dump files of the contents of every pipe that is not persistent during
+ * signal handling.
  * Used by the signal handler to preserve data during crashes.
  *
  * @return true if dump successful, false on error
@@ -172,7 +173,7 @@ InitiateGracefulShutdown(void)
 static bool
 HandlePipeDump(void)
 {
-    if(!GSignalContext.Pipe) {
+    if(!GSignalContext.Pipes) {
         SdbLogError("Pipe is NULL during signal handling");
         return false;
     }
@@ -181,16 +182,24 @@ HandlePipeDump(void)
     time_t     Now    = time(NULL);
     struct tm *TmInfo = localtime(&Now);
 
-    snprintf(DumpFilename, sizeof(DumpFilename), "dumps/pipe_dump_%04d%02d%02d_%02d%02d%02d.bin",
-             TmInfo->tm_year + 1900, TmInfo->tm_mon + 1, TmInfo->tm_mday, TmInfo->tm_hour,
-             TmInfo->tm_min, TmInfo->tm_sec);
-
-    if(!SdbDumpSensorDataPipe(GSignalContext.Pipe, DumpFilename)) {
-        SdbLogError("Failed to dump pipe contents");
-        return false;
+    bool Success = true;
+    for(u64 p = 0; p < GSignalContext.PipeCount; ++p) {
+        // NOTE(ingar): A persistent pipe's buffers are in its file already
+        if(GSignalContext.Pipes[p]->Persist) {
+            continue;
+        }
+        snprintf(DumpFilename, sizeof(DumpFilename),
+                 "dumps/pipe_dump_%04d%02d%02d_%02d%02d%02d_%lu.bin", TmInfo->tm_year + 1900,
+                 TmInfo->tm_mon + 1, TmInfo->tm_mday, TmInfo->tm_hour, TmInfo->tm_min,
+                 TmInfo->tm_sec, p);
+
+        if(!SdbDumpSensorDataPipe(GSignalContext.Pipes[p], DumpFilename)) {
+            SdbLogError("Failed to dump contents of pipe %lu", p);
+            Success = false;
+        }
     }
 
-    return true;
+    return Success;
 }
 
 
@@ -310,6 +319,12 @@ SdbShouldShutdown(void)
     return __atomic_load_n(&GShutdownRequested, __ATOMIC_SEQ_CST) != 0;
 }
 
+void
+SdbRequestShutdown(void)
+{
+    InitiateGracefulShutdown();
+}
+
 /**
  * @brief Dumps sensor data pipe contents to a file
  *
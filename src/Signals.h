@@ -27,7 +27,8 @@ typedef struct signal_handler_context
     tg_manager           *Manager;        /**< Thread group manager instance */
     char                 *MemoryDumpPath; /**< Path for memory dump files */
     volatile sig_atomic_t ShutdownFlag;   /**< Atomic flag indicating shutdown status */
-    sensor_data_pipe     *Pipe;           /**< Current sensor data pipe being monitored */
+    sensor_data_pipe    **Pipes;          /**< Sensor data pipes being monitored */
+    u64                   PipeCount;
 
 } signal_handler_context;
 
@@ -54,6 +55,14 @@ int SdbSetupSignalHandlers(tg_manager *Manager);
  */
 bool SdbShouldShutdown(void);
 
+/**
+ * @brief Requests a graceful shutdown without a signal
+ *
+ * Has the same effect as receiving SIGINT/SIGTERM. Used by development utilities that drive
+ * the system programmatically.
+ */
+void SdbRequestShutdown(void);
+
 /**
  * @brief Dumps sensor data pipe contents to a file
  *
@@ -0,0 +1,203 @@
+/**
+ * @file BufferPoolTest.c
+ * @brief Tests of the shared buffer pool
+ *
+ * Every buffer handed out is marked as in use in a table of its own, so a buffer handed to two
+ * takers at once, or given back twice, is caught where it happens.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(BufferPoolTest);
+
+#include <src/Common/BufferPool.h>
+#include <tests/Test.h>
+
+#define TEST_BUF_SIZE       200
+#define TEST_THREAD_COUNT   8
+#define TEST_THREAD_HOLD    6
+#define TEST_THREAD_ROUNDS  100000
+#define TEST_EXCHANGE_SLOTS 16
+
+typedef struct
+{
+    sdb_buf_pool *Pool;
+    atomic_bool  *InUse; /**< Whether each buffer is handed out */
+    atomic_ulong  Errors;
+
+    // NOTE(ingar): Buffers left by one thread for another to give back
+    _Atomic(u8 *) Exchange[TEST_EXCHANGE_SLOTS];
+} test_pool;
+
+static u64
+TestBufIdx(test_pool *Test, u8 *Buf)
+{
+    return (Buf - Test->Pool->Pages.Mem) / Test->Pool->Stride;
+}
+
+/**
+ * @brief Takes a buffer, and checks that nobody else has it
+ */
+static u8 *
+TestGet(test_pool *Test)
+{
+    u8 *Buf = SdbBufPoolGet(Test->Pool);
+    if(Buf != NULL && atomic_exchange(&Test->InUse[TestBufIdx(Test, Buf)], true)) {
+        atomic_fetch_add(&Test->Errors, 1);
+    }
+    return Buf;
+}
+
+/**
+ * @brief Gives a buffer back, and checks that it was handed out
+ */
+static void
+TestPut(test_pool *Test, u8 *Buf)
+{
+    if(!atomic_exchange(&Test->InUse[TestBufIdx(Test, Buf)], false)) {
+        atomic_fetch_add(&Test->Errors, 1);
+    }
+    SdbBufPoolPut(Test->Pool, Buf);
+}
+
+static sdb_errno
+TestExhaust(void)
+{
+    u64           BufCount = 3 * SDB_BUF_POOL_CACHE_SIZE + 1;
+    sdb_buf_pool *Pool     = SdbBufPoolCreate(BufCount, TEST_BUF_SIZE, NULL);
+    SdbTestCheck(Pool != NULL, "Failed to create pool");
+    SdbTestCheck(Pool->Stride >= TEST_BUF_SIZE && Pool->Stride % SDB_CACHE_LINE_SIZE == 0,
+                 "Buffers are %lu bytes apart", Pool->Stride);
+
+    test_pool Test = { .Pool = Pool, .InUse = calloc(BufCount, sizeof(atomic_bool)) };
+    u8      **Bufs = calloc(BufCount, sizeof(u8 *));
+    SdbTestCheck(Test.InUse != NULL && Bufs != NULL, "Failed to allocate test state");
+
+    for(int Round = 0; Round < 2; ++Round) {
+        for(u64 b = 0; b < BufCount; ++b) {
+            Bufs[b] = TestGet(&Test);
+            SdbTestCheck(Bufs[b] != NULL, "Pool ran dry after %lu of %lu buffers", b, BufCount);
+            SdbTestCheck((uintptr_t)Bufs[b] % SDB_CACHE_LINE_SIZE == 0, "Buffer %p is unaligned",
+                         (void *)Bufs[b]);
+            SdbMemset(Bufs[b], 0xaa, TEST_BUF_SIZE);
+        }
+        SdbTestCheck(atomic_load(&Test.Errors) == 0, "A buffer was handed out twice");
+
+        u64 DryCount = atomic_load(&Pool->DryCount);
+        SdbTestCheck(SdbBufPoolGet(Pool) == NULL, "Empty pool handed out a buffer");
+        SdbTestCheck(atomic_load(&Pool->DryCount) == DryCount + 1, "Dry pool was not counted");
+
+        for(u64 b = 0; b < BufCount; ++b) {
+            TestPut(&Test, Bufs[b]);
+        }
+        SdbTestCheck(atomic_load(&Test.Errors) == 0, "A buffer was given back twice");
+    }
+
+    free(Bufs);
+    free(Test.InUse);
+    SdbBufPoolDestroy(Pool);
+    return 0;
+}
+
+static void *
+TestPoolThread(void *Arg)
+{
+    test_pool *Test = Arg;
+    u8        *Held[TEST_THREAD_HOLD];
+    u32        HeldCount = 0;
+    u64        Rand      = (uintptr_t)&Held;
+
+    for(u64 r = 0; r < TEST_THREAD_ROUNDS; ++r) {
+        Rand = Rand * 6364136223846793005ull + 1442695040888963407ull;
+        u32 Op = (Rand >> 33) % 4;
+        if(Op < 2 && HeldCount < TEST_THREAD_HOLD) {
+            u8 *Buf = TestGet(Test);
+            if(Buf != NULL) {
+                Held[HeldCount++] = Buf;
+            }
+        } else if(Op == 2 && HeldCount > 0) {
+            TestPut(Test, Held[--HeldCount]);
+        } else if(HeldCount > 0) {
+            // NOTE(ingar): Swapped with a buffer another thread left, which this one gives back,
+            // so buffers move between the caches of the threads
+            u8 *Other = atomic_exchange(&Test->Exchange[(Rand >> 40) % TEST_EXCHANGE_SLOTS],
+                                        Held[--HeldCount]);
+            if(Other != NULL) {
+                TestPut(Test, Other);
+            }
+        }
+    }
+
+    while(HeldCount > 0) {
+        TestPut(Test, Held[--HeldCount]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Threads that take and give back buffers at once never share one, and lose none
+ *
+ * The pool holds fewer buffers than the threads want, so the stack runs empty and the tag has
+ * to tell apart tops that were popped and pushed again.
+ */
+static sdb_errno
+TestContention(void)
+{
+    u64           BufCount = TEST_THREAD_COUNT * SDB_BUF_POOL_CACHE_SIZE;
+    sdb_buf_pool *Pool     = SdbBufPoolCreate(BufCount, TEST_BUF_SIZE, NULL);
+    SdbTestCheck(Pool != NULL, "Failed to create pool");
+
+    test_pool Test = { .Pool = Pool, .InUse = calloc(BufCount, sizeof(atomic_bool)) };
+    SdbTestCheck(Test.InUse != NULL, "Failed to allocate test state");
+
+    pthread_t Threads[TEST_THREAD_COUNT];
+    for(u32 t = 0; t < TEST_THREAD_COUNT; ++t) {
+        pthread_create(&Threads[t], NULL, TestPoolThread, &Test);
+    }
+    for(u32 t = 0; t < TEST_THREAD_COUNT; ++t) {
+        pthread_join(Threads[t], NULL);
+    }
+    for(u32 s = 0; s < TEST_EXCHANGE_SLOTS; ++s) {
+        if(Test.Exchange[s] != NULL) {
+            TestPut(&Test, Test.Exchange[s]);
+        }
+    }
+    SdbTestCheck(atomic_load(&Test.Errors) == 0, "%lu buffers were shared or given back twice",
+                 atomic_load(&Test.Errors));
+
+    // NOTE(ingar): The threads' caches went back to the pool when they exited, so every buffer
+    // can be taken again
+    for(u64 b = 0; b < BufCount; ++b) {
+        SdbTestCheck(TestGet(&Test) != NULL, "Pool lost %lu buffers", BufCount - b);
+    }
+    SdbTestCheck(atomic_load(&Test.Errors) == 0, "A buffer was handed out twice");
+    SdbTestCheck(SdbBufPoolGet(Pool) == NULL, "Pool handed out more buffers than it has");
+
+    // NOTE(ingar): Every buffer is handed out, and destroying the pool only needs them back in it
+    for(u64 b = 0; b < BufCount; ++b) {
+        TestPut(&Test, Pool->Pages.Mem + b * Pool->Stride);
+    }
+
+    free(Test.InUse);
+    SdbBufPoolDestroy(Pool);
+    return 0;
+}
+
+int
+main(void)
+{
+    sdb_test Tests[] = {
+        { "every buffer is handed out once until the pool is dry", TestExhaust },
+        { "threads never share a buffer under contention", TestContention },
+    };
+
+    return SdbTestRun(Tests, SdbArrayLen(Tests));
+}
@@ -0,0 +1,541 @@
+/**
+ * @file SensorDataPipeTest.c
+ * @brief Tests of the sensor data pipe
+ *
+ * The packets written are u64 sequence numbers, so a reader can tell exactly which packets it
+ * got, in which order, and which were lost. The files of spilling and persistent pipes are made
+ * in a directory of their own under /tmp, which is removed when the tests are done.
+ */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(SensorDataPipeTest);
+
+#include <src/Common/SensorDataPipe.h>
+#include <src/Common/Time.h>
+#include <tests/Test.h>
+
+#define TEST_BUF_SIZE       SdbKibiByte(1)
+#define TEST_BUF_PACKETS    (TEST_BUF_SIZE / sizeof(u64))
+#define TEST_STREAM_PACKETS 200000
+
+static char TestDir[] = "/tmp/SensorDataPipeTestXXXXXX";
+
+/**
+ * @brief Path of a file in the test directory
+ */
+static char *
+TestPath(char *Path, const char *Name)
+{
+    snprintf(Path, PATH_MAX, "%s/%s", TestDir, Name);
+    return Path;
+}
+
+/**
+ * @brief Sets a pipe up for u64 packets, as PgPrepareCtx would for rows
+ */
+static sensor_data_pipe *
+TestPipeSetup(sensor_data_pipe *Pipe, sdp_policy Policy)
+{
+    if(Pipe != NULL) {
+        Pipe->Policy        = Policy;
+        Pipe->PacketSize    = sizeof(u64);
+        Pipe->ItemMaxCount  = TEST_BUF_PACKETS;
+        Pipe->BufferMaxFill = TEST_BUF_SIZE;
+    }
+    return Pipe;
+}
+
+static sensor_data_pipe *
+TestPipeCreate(u64 BufCount, sdp_policy Policy)
+{
+    return TestPipeSetup(SdpCreate(BufCount, TEST_BUF_SIZE, NULL), Policy);
+}
+
+/**
+ * @brief Appends the packets First to First + Count - 1 to a write buffer
+ */
+static void
+TestWrite(sdb_arena *Buf, u64 First, u64 Count)
+{
+    u64 *Packets = SdbPushArray(Buf, u64, Count);
+    for(u64 p = 0; p < Count; ++p) {
+        Packets[p] = First + p;
+    }
+}
+
+/**
+ * @brief Checks that a buffer holds the packets First, First + Step, ..., Count of them
+ */
+static bool
+TestHolds(sdb_arena *Buf, u64 First, u64 Count, u64 Step)
+{
+    if(Buf == NULL || SdbArenaGetPos(Buf) != Count * sizeof(u64)) {
+        return false;
+    }
+    u64 *Packets = (u64 *)Buf->Mem;
+    for(u64 p = 0; p < Count; ++p) {
+        if(Packets[p] != First + p * Step) {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct
+{
+    sensor_data_pipe *Pipe;
+    sdb_arena        *Buf;
+    atomic_bool       Done;
+} test_writer;
+
+static void *
+TestBlockedWriter(void *Arg)
+{
+    test_writer *Writer = Arg;
+    Writer->Buf         = SdPipeGetWriteBuffer(Writer->Pipe);
+    atomic_store(&Writer->Done, true);
+    return NULL;
+}
+
+static sdb_errno
+TestBlockWaitsForReader(void)
+{
+    sensor_data_pipe *Pipe = TestPipeCreate(4, SdpPolicy_Block);
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+
+    for(u64 b = 0; b < 3; ++b) {
+        TestWrite(SdPipeCurrentWriteBuffer(Pipe), b, 1);
+        SdbTestCheck(SdPipeTryGetWriteBuffer(Pipe) != NULL, "Buffer %lu was not published", b);
+    }
+    TestWrite(SdPipeCurrentWriteBuffer(Pipe), 3, 1);
+    SdbTestCheck(SdPipeTryGetWriteBuffer(Pipe) == NULL, "Full pipe took another buffer");
+    SdbTestCheck(SdPipeQueuedCount(Pipe) == 3, "%lu buffers queued", SdPipeQueuedCount(Pipe));
+
+    test_writer Writer = { .Pipe = Pipe };
+    pthread_t   WriterThread;
+    pthread_create(&WriterThread, NULL, TestBlockedWriter, &Writer);
+    SdbSleep(SDB_TIME_MS(20));
+    bool DoneBeforeTake = atomic_load(&Writer.Done);
+
+    // NOTE(ingar): A taken buffer is not free until it is released
+    bool FirstRead = TestHolds(SdPipeGetReadBuffer(Pipe), 0, 1, 1);
+    SdbSleep(SDB_TIME_MS(20));
+    bool DoneBeforeRelease = atomic_load(&Writer.Done);
+    SdPipeReleaseReadBuffer(Pipe);
+    pthread_join(WriterThread, NULL);
+
+    SdbTestCheck(!DoneBeforeTake && !DoneBeforeRelease, "Writer did not wait for the release");
+    SdbTestCheck(FirstRead, "First buffer has the wrong data");
+    SdbTestCheck(Writer.Buf != NULL && SdbArenaGetPos(Writer.Buf) == 0,
+                 "Writer did not get an empty buffer");
+    SdbTestCheck(Pipe->FullCount == 1, "Pipe was found full %lu times", Pipe->FullCount);
+    for(u64 b = 1; b < 4; ++b) {
+        SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), b, 1, 1), "Buffer %lu is wrong", b);
+    }
+    SdbTestCheck(SdPipeTryGetReadBuffer(Pipe) == NULL, "Reader got more buffers than published");
+    SdbTestCheck(Pipe->DroppedCount == 0, "Blocking pipe dropped %lu packets",
+                 Pipe->DroppedCount);
+
+    SdpDestroy(Pipe, false);
+    return 0;
+}
+
+static sdb_errno
+TestDropNewest(void)
+{
+    sensor_data_pipe *Pipe = TestPipeCreate(4, SdpPolicy_DropNewest);
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+
+    for(u64 b = 0; b < 3; ++b) {
+        TestWrite(SdPipeCurrentWriteBuffer(Pipe), b * 10, 10);
+        SdbTestCheck(SdPipeGetWriteBuffer(Pipe) != NULL, "Buffer %lu was not published", b);
+    }
+    TestWrite(SdPipeCurrentWriteBuffer(Pipe), 30, 7);
+    sdb_arena *Buf = SdPipeGetWriteBuffer(Pipe);
+
+    SdbTestCheck(Buf == SdPipeCurrentWriteBuffer(Pipe) && SdbArenaGetPos(Buf) == 0,
+                 "Writer did not get its buffer back emptied");
+    SdbTestCheck(Pipe->DroppedCount == 7, "Dropped %lu packets", Pipe->DroppedCount);
+    SdbTestCheck(Pipe->FullCount == 1, "Pipe was found full %lu times", Pipe->FullCount);
+    for(u64 b = 0; b < 3; ++b) {
+        SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), b * 10, 10, 1),
+                     "Buffer %lu is wrong", b);
+    }
+    SdbTestCheck(SdPipeTryGetReadBuffer(Pipe) == NULL, "Dropped buffer reached the reader");
+
+    SdpDestroy(Pipe, false);
+    return 0;
+}
+
+static sdb_errno
+TestDropOldest(void)
+{
+    sensor_data_pipe *Pipe = TestPipeCreate(4, SdpPolicy_DropOldest);
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+
+    for(u64 b = 0; b < 5; ++b) {
+        TestWrite(SdPipeCurrentWriteBuffer(Pipe), b * 10, b + 1);
+        SdbTestCheck(SdPipeGetWriteBuffer(Pipe) != NULL, "Buffer %lu was not published", b);
+    }
+
+    // NOTE(ingar): Buffers 0 and 1 made room for buffers 3 and 4
+    SdbTestCheck(Pipe->DroppedCount == 1 + 2, "Dropped %lu packets", Pipe->DroppedCount);
+    for(u64 b = 2; b < 5; ++b) {
+        SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), b * 10, b + 1, 1),
+                     "Buffer %lu is wrong", b);
+    }
+    SdbTestCheck(SdPipeTryGetReadBuffer(Pipe) == NULL, "Dropped buffer reached the reader");
+
+    // NOTE(ingar): With the only other buffer held, there is nothing old to drop
+    sensor_data_pipe *Small = TestPipeCreate(2, SdpPolicy_DropOldest);
+    SdbTestCheck(Small != NULL, "Failed to create pipe");
+    TestWrite(SdPipeCurrentWriteBuffer(Small), 0, 2);
+    SdPipeGetWriteBuffer(Small);
+    sdb_arena *Held = SdPipeTryGetReadBuffer(Small);
+    TestWrite(SdPipeCurrentWriteBuffer(Small), 2, 3);
+    SdPipeGetWriteBuffer(Small);
+    SdbTestCheck(TestHolds(Held, 0, 2, 1), "Held buffer was overwritten");
+    SdbTestCheck(Small->DroppedCount == 3, "Dropped %lu packets", Small->DroppedCount);
+
+    SdpDestroy(Small, false);
+    SdpDestroy(Pipe, false);
+    return 0;
+}
+
+static sdb_errno
+TestDecimate(void)
+{
+    sensor_data_pipe *Pipe = TestPipeCreate(2, SdpPolicy_Decimate);
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+
+    TestWrite(SdPipeCurrentWriteBuffer(Pipe), 1000, 1);
+    SdbTestCheck(SdPipeGetWriteBuffer(Pipe) != NULL, "First buffer was not published");
+
+    // NOTE(ingar): Packets 0-4 received at 100 and 5-9 at 200
+    sdb_arena *Buf = SdPipeCurrentWriteBuffer(Pipe);
+    SdPipeStamp(Pipe, Buf, 100);
+    TestWrite(Buf, 0, 5);
+    SdPipeStamp(Pipe, Buf, 200);
+    TestWrite(Buf, 5, 5);
+    SdbTestCheck(SdPipeGetWriteBuffer(Pipe) == Buf, "Decimated buffer was not kept");
+    SdbTestCheck(TestHolds(Buf, 0, 5, 2), "Decimated buffer does not hold every other packet");
+    SdbTestCheck(Pipe->DecimatedCount == 5, "Decimated %lu packets", Pipe->DecimatedCount);
+
+    // NOTE(ingar): Thinned again while the reader still stalls, so the oldest data gets sparser
+    TestWrite(Buf, 10, 3);
+    SdPipeGetWriteBuffer(Pipe);
+    SdbTestCheck(SdbArenaGetPos(Buf) == 4 * sizeof(u64), "Buffer holds %lu bytes",
+                 SdbArenaGetPos(Buf));
+    u64 *Packets = (u64 *)Buf->Mem;
+    SdbTestCheck(Packets[0] == 0 && Packets[1] == 4 && Packets[2] == 8 && Packets[3] == 11,
+                 "Second decimation kept %lu %lu %lu %lu", Packets[0], Packets[1], Packets[2],
+                 Packets[3]);
+    SdbTestCheck(Pipe->DecimatedCount == 5 + 4, "Decimated %lu packets", Pipe->DecimatedCount);
+    SdbTestCheck(Pipe->DroppedCount == 0, "Decimating pipe dropped %lu packets",
+                 Pipe->DroppedCount);
+
+    SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), 1000, 1, 1), "First buffer is wrong");
+    SdPipeReleaseReadBuffer(Pipe);
+    SdbTestCheck(SdPipeGetWriteBuffer(Pipe) != NULL, "Decimated buffer was not published");
+    sdb_arena *Read = SdPipeTryGetReadBuffer(Pipe);
+    SdbTestCheck(Read != NULL && SdbArenaGetPos(Read) == 4 * sizeof(u64),
+                 "Reader did not get the decimated buffer");
+
+    // NOTE(ingar): Every kept packet keeps its receive time, and the stamp of packets 5-9 moves
+    // to packet 8, the first of them that is still kept
+    sdp_stamps *Stamps = SdPipeGetStamps(Pipe, Read);
+    SdbTestCheck(Stamps->Count == 2, "Decimated buffer has %u stamps", Stamps->Count);
+    SdbTestCheck(Stamps->Stamps[0].RecvNs == 100 && Stamps->Stamps[0].Offset == 0,
+                 "First stamp is %lu at %lu", Stamps->Stamps[0].RecvNs, Stamps->Stamps[0].Offset);
+    SdbTestCheck(Stamps->Stamps[1].RecvNs == 200 && Stamps->Stamps[1].Offset == 2 * sizeof(u64),
+                 "Second stamp is %lu at %lu", Stamps->Stamps[1].RecvNs,
+                 Stamps->Stamps[1].Offset);
+    SdbTestCheck(SdPipeGetHeader(Pipe, Read)->RecordCount == 4, "Header counts %u records",
+                 SdPipeGetHeader(Pipe, Read)->RecordCount);
+
+    SdpDestroy(Pipe, false);
+    return 0;
+}
+
+static void *
+TestStreamWriter(void *Arg)
+{
+    sensor_data_pipe *Pipe = Arg;
+    sdb_arena        *Buf  = SdPipeCurrentWriteBuffer(Pipe);
+    for(u64 Seq = 0; Seq < TEST_STREAM_PACKETS && Buf != NULL;) {
+        u64 Count = SdbMin(1 + Seq % 7, TEST_STREAM_PACKETS - Seq);
+        TestWrite(Buf, Seq, Count);
+        Seq += Count;
+        Buf = SdPipeGetWriteBuffer(Pipe);
+    }
+    return NULL;
+}
+
+/**
+ * @brief A writer that outruns a reader on another thread loses nothing and reorders nothing
+ */
+static sdb_errno
+TestBlockStream(void)
+{
+    sensor_data_pipe *Pipe = TestPipeCreate(4, SdpPolicy_Block);
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+
+    pthread_t WriterThread;
+    pthread_create(&WriterThread, NULL, TestStreamWriter, Pipe);
+
+    // NOTE(ingar): Reads every packet even after one is out of order, so the writer never stays
+    // blocked
+    u64  Received = 0, BufCount = 0;
+    bool InOrder  = true;
+    while(Received < TEST_STREAM_PACKETS) {
+        sdb_arena *Buf = SdPipeGetReadBuffer(Pipe);
+        if(Buf == NULL) {
+            break;
+        }
+        u64 Count = SdbArenaGetPos(Buf) / sizeof(u64);
+        InOrder   = InOrder && Count > 0 && TestHolds(Buf, Received, Count, 1);
+        Received += Count;
+        if(++BufCount % 64 == 0) {
+            SdbSleep(SDB_TIME_US(200));
+        }
+    }
+    SdPipeReleaseReadBuffer(Pipe);
+    pthread_join(WriterThread, NULL);
+
+    SdbTestCheck(Received == TEST_STREAM_PACKETS && InOrder, "Reader got %lu packets, %s",
+                 Received, InOrder ? "in order" : "out of order");
+    SdbTestCheck(Pipe->FullCount > 0, "Writer never found the pipe full");
+    SdbTestCheck(Pipe->DroppedCount == 0, "Blocking pipe dropped %lu packets",
+                 Pipe->DroppedCount);
+
+    SdpDestroy(Pipe, false);
+    return 0;
+}
+
+/**
+ * @brief Size of a spill file of SlotCount slots
+ */
+static u64
+TestSpillSize(u64 SlotCount)
+{
+    u64 PageSize = sysconf(_SC_PAGESIZE);
+    u64 SlotSize = sizeof(sdp_spill_slot) + TEST_BUF_SIZE;
+    return SlotCount * ((SlotSize + PageSize - 1) & ~(PageSize - 1));
+}
+
+static sdb_errno
+TestSpill(void)
+{
+    char              Path[PATH_MAX];
+    sensor_data_pipe *Pipe = TestPipeCreate(2, SdpPolicy_Spill);
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+    SdbTestCheck(SdpSpillInit(Pipe, TestPath(Path, "spill"), TestSpillSize(8)) == 0,
+                 "Failed to create spill file");
+    SdbTestCheck(Pipe->SpillSlotCount == 8, "Spill file has %lu slots", Pipe->SpillSlotCount);
+
+    // NOTE(ingar): Buffer 0 fills the pipe, so buffers 1 and 2 go to the spill file
+    for(u64 b = 0; b < 3; ++b) {
+        sdb_arena *Buf = SdPipeCurrentWriteBuffer(Pipe);
+        SdPipeStamp(Pipe, Buf, 100 + b);
+        TestWrite(Buf, b * 10, b + 1);
+        SdbTestCheck(SdPipeGetWriteBuffer(Pipe) != NULL, "Writer got no buffer after %lu", b);
+    }
+    SdbTestCheck(SdPipeQueuedCount(Pipe) == 1, "%lu buffers queued", SdPipeQueuedCount(Pipe));
+    SdbTestCheck(Pipe->SpilledCount == 2 + 3, "Spilled %lu packets", Pipe->SpilledCount);
+    SdbTestCheck(Pipe->FullCount == 1, "Pipe was found full %lu times", Pipe->FullCount);
+
+    // NOTE(ingar): The writer keeps spilling once there is room, until the reader has caught up,
+    // so buffer 3 can not overtake the spilled ones
+    SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), 0, 1, 1), "Buffer 0 is wrong");
+    SdPipeReleaseReadBuffer(Pipe);
+    TestWrite(SdPipeCurrentWriteBuffer(Pipe), 30, 4);
+    SdPipeGetWriteBuffer(Pipe);
+    SdbTestCheck(SdPipeQueuedCount(Pipe) == 0, "Writer published while spilling");
+    SdbTestCheck(Pipe->SpilledCount == 2 + 3 + 4, "Spilled %lu packets", Pipe->SpilledCount);
+
+    for(u64 b = 1; b < 4; ++b) {
+        sdb_arena *Buf = SdPipeTryGetReadBuffer(Pipe);
+        SdbTestCheck(TestHolds(Buf, b * 10, b + 1, 1), "Spilled buffer %lu is wrong", b);
+        SdbTestCheck(SdPipeGetHeader(Pipe, Buf)->RecordCount == b + 1,
+                     "Spilled buffer %lu has %u records", b,
+                     SdPipeGetHeader(Pipe, Buf)->RecordCount);
+        sdp_stamps *Stamps = SdPipeGetStamps(Pipe, Buf);
+        SdbTestCheck(b == 3 || (Stamps->Count == 1 && Stamps->Stamps[0].RecvNs == 100 + b),
+                     "Spilled buffer %lu lost its stamp", b);
+    }
+    SdPipeReleaseReadBuffer(Pipe);
+
+    // NOTE(ingar): Caught up, so the writer publishes again
+    TestWrite(SdPipeCurrentWriteBuffer(Pipe), 40, 5);
+    SdPipeGetWriteBuffer(Pipe);
+    SdbTestCheck(SdPipeQueuedCount(Pipe) == 1, "Writer did not publish after the spill");
+    SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), 40, 5, 1), "Buffer 4 is wrong");
+    SdbTestCheck(Pipe->SpilledCount == 2 + 3 + 4 && Pipe->DroppedCount == 0,
+                 "Spilled %lu and dropped %lu packets", Pipe->SpilledCount, Pipe->DroppedCount);
+
+    SdpDestroy(Pipe, false);
+    unlink(Path);
+    return 0;
+}
+
+static sdb_errno
+TestSpillFull(void)
+{
+    char              Path[PATH_MAX];
+    sensor_data_pipe *Pipe = TestPipeCreate(2, SdpPolicy_Spill);
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+    SdbTestCheck(SdpSpillInit(Pipe, TestPath(Path, "spill-full"), TestSpillSize(2)) == 0,
+                 "Failed to create spill file");
+
+    // NOTE(ingar): Buffer 0 is published, 1 and 2 fill the spill file and 3 is dropped
+    for(u64 b = 0; b < 4; ++b) {
+        TestWrite(SdPipeCurrentWriteBuffer(Pipe), b * 10, 2);
+        SdPipeGetWriteBuffer(Pipe);
+    }
+    SdbTestCheck(Pipe->SpilledCount == 4, "Spilled %lu packets", Pipe->SpilledCount);
+    SdbTestCheck(Pipe->DroppedCount == 2, "Dropped %lu packets", Pipe->DroppedCount);
+
+    for(u64 b = 0; b < 3; ++b) {
+        SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), b * 10, 2, 1), "Buffer %lu is wrong",
+                     b);
+    }
+    SdbTestCheck(SdPipeTryGetReadBuffer(Pipe) == NULL, "Dropped buffer reached the reader");
+
+    SdpDestroy(Pipe, false);
+    unlink(Path);
+    return 0;
+}
+
+static sensor_data_pipe *
+TestPersistentCreate(u64 BufCount, sdb_string Path)
+{
+    return TestPipeSetup(SdpCreatePersistent(BufCount, TEST_BUF_SIZE, Path, NULL, NULL),
+                         SdpPolicy_Block);
+}
+
+/**
+ * @brief A pipe destroyed without its reader catching up, as if the process had died, gives the
+ * reader what it had not released when it is opened again, and nothing else
+ */
+static sdb_errno
+TestPersistReplay(void)
+{
+    char              Path[PATH_MAX];
+    sensor_data_pipe *Pipe = TestPersistentCreate(4, TestPath(Path, "persist"));
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+    SdbTestCheck(Pipe->ReplayCount == 0 && SdPipeReplayed(Pipe), "New pipe file has %lu buffers",
+                 Pipe->ReplayCount);
+
+    for(u64 b = 0; b < 3; ++b) {
+        sdb_arena *Buf = SdPipeCurrentWriteBuffer(Pipe);
+        SdPipeStamp(Pipe, Buf, 100 + b);
+        TestWrite(Buf, b * 10, b + 2);
+        SdbTestCheck(SdPipeTryGetWriteBuffer(Pipe) != NULL, "Buffer %lu was not published", b);
+    }
+    TestWrite(SdPipeCurrentWriteBuffer(Pipe), 30, 1);
+
+    // NOTE(ingar): Buffer 0 is released, buffer 1 is held and buffer 3 was never published
+    SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), 0, 2, 1), "Buffer 0 is wrong");
+    SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), 10, 3, 1), "Buffer 1 is wrong");
+    SdpDestroy(Pipe, false);
+
+    Pipe = TestPersistentCreate(4, Path);
+    SdbTestCheck(Pipe != NULL, "Failed to reopen pipe");
+    SdbTestCheck(Pipe->ReplayCount == 2, "Replaying %lu buffers", Pipe->ReplayCount);
+    SdbTestCheck(SdbArenaGetPos(SdPipeCurrentWriteBuffer(Pipe)) == 0,
+                 "Unpublished data survived");
+    for(u64 b = 1; b < 3; ++b) {
+        SdbTestCheck(!SdPipeReplayed(Pipe), "Replay ended before buffer %lu", b);
+        sdb_arena *Buf = SdPipeTryGetReadBuffer(Pipe);
+        SdbTestCheck(TestHolds(Buf, b * 10, b + 2, 1), "Replayed buffer %lu is wrong", b);
+        SdbTestCheck(SdPipeGetHeader(Pipe, Buf)->RecordCount == b + 2,
+                     "Replayed buffer %lu has %u records", b,
+                     SdPipeGetHeader(Pipe, Buf)->RecordCount);
+        SdbTestCheck(SdPipeGetHeader(Pipe, Buf)->FirstNs == 100 + b,
+                     "Replayed buffer %lu lost its receive time", b);
+    }
+    SdbTestCheck(!SdPipeReplayed(Pipe), "Replay ended before the last buffer was released");
+    SdPipeReleaseReadBuffer(Pipe);
+    SdbTestCheck(SdPipeReplayed(Pipe), "Replay did not end");
+    SdbTestCheck(SdPipeTryGetReadBuffer(Pipe) == NULL, "Replayed more than was queued");
+
+    // NOTE(ingar): New data follows the replay, and every buffer is in circulation again
+    for(u64 b = 4; b < 7; ++b) {
+        TestWrite(SdPipeCurrentWriteBuffer(Pipe), b * 10, 1);
+        SdbTestCheck(SdPipeTryGetWriteBuffer(Pipe) != NULL, "Buffer %lu was not published", b);
+    }
+    for(u64 b = 4; b < 7; ++b) {
+        SdbTestCheck(TestHolds(SdPipeTryGetReadBuffer(Pipe), b * 10, 1, 1), "Buffer %lu is wrong",
+                     b);
+    }
+    SdPipeReleaseReadBuffer(Pipe);
+    SdpDestroy(Pipe, false);
+
+    Pipe = TestPersistentCreate(4, Path);
+    SdbTestCheck(Pipe != NULL, "Failed to reopen pipe");
+    SdbTestCheck(Pipe->ReplayCount == 0, "Replaying %lu released buffers", Pipe->ReplayCount);
+    SdpDestroy(Pipe, false);
+
+    unlink(Path);
+    return 0;
+}
+
+/**
+ * @brief A pipe file made for another pipe is started over instead of replayed
+ */
+static sdb_errno
+TestPersistShapeChange(void)
+{
+    char              Path[PATH_MAX];
+    sensor_data_pipe *Pipe = TestPersistentCreate(4, TestPath(Path, "persist-shape"));
+    SdbTestCheck(Pipe != NULL, "Failed to create pipe");
+    TestWrite(SdPipeCurrentWriteBuffer(Pipe), 0, 1);
+    SdPipeTryGetWriteBuffer(Pipe);
+    SdpDestroy(Pipe, false);
+
+    Pipe = TestPersistentCreate(3, Path);
+    SdbTestCheck(Pipe != NULL, "Failed to reopen pipe");
+    SdbTestCheck(Pipe->ReplayCount == 0, "Replaying %lu buffers of another pipe",
+                 Pipe->ReplayCount);
+    SdbTestCheck(SdPipeTryGetReadBuffer(Pipe) == NULL, "Reader got a buffer of another pipe");
+    SdpDestroy(Pipe, false);
+
+    unlink(Path);
+    return 0;
+}
+
+int
+main(void)
+{
+    sdb_test Tests[] = {
+        { "block waits for the reader", TestBlockWaitsForReader },
+        { "drop newest", TestDropNewest },
+        { "drop oldest", TestDropOldest },
+        { "decimate", TestDecimate },
+        { "block stream keeps every packet in order", TestBlockStream },
+        { "spill", TestSpill },
+        { "spill falls back to drop newest when full", TestSpillFull },
+        { "persistent pipe replays what was not released", TestPersistReplay },
+        { "persistent pipe starts over for another shape", TestPersistShapeChange },
+    };
+
+    if(mkdtemp(TestDir) == NULL) {
+        SdbLogError("Failed to create test directory: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int Ret = SdbTestRun(Tests, SdbArrayLen(Tests));
+    rmdir(TestDir);
+
+    return Ret;
+}
@@ -0,0 +1,237 @@
+/**
+ * @file TimerWheelTest.c
+ * @brief Tests of the hashed timing wheel
+ *
+ * The wheel is advanced with times made from its own start time, so the tests know exactly
+ * which tick each call processes and never sleep.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(TimerWheelTest);
+
+#include <src/Common/Time.h>
+#include <src/Common/TimerWheel.h>
+#include <tests/Test.h>
+
+#define TEST_TICK        SDB_TIME_MS(1)
+#define TEST_SLOT_COUNT  8
+#define TEST_TIMER_COUNT 4
+#define TEST_MAX_FIRES   64
+
+typedef struct
+{
+    sdb_timer_wheel *Wheel;
+    u64              Count[TEST_TIMER_COUNT];
+    u64              Ticks[TEST_TIMER_COUNT][TEST_MAX_FIRES]; /**< Tick each expiry was in */
+} test_fires;
+
+static void
+TestRecordFire(u32 Timer, void *Arg)
+{
+    test_fires *Fires = Arg;
+    if(Fires->Count[Timer] < TEST_MAX_FIRES) {
+        Fires->Ticks[Timer][Fires->Count[Timer]] = Fires->Wheel->Now;
+    }
+    ++Fires->Count[Timer];
+}
+
+/**
+ * @brief Time Tick whole ticks after the wheel started
+ */
+static struct timespec
+TestAt(sdb_timer_wheel *Wheel, u64 Tick)
+{
+    struct timespec Now = Wheel->Start;
+    SdbTimeAdd(&Now, Tick * TEST_TICK);
+    return Now;
+}
+
+static sdb_errno
+TestWheelInit(sdb_timer_wheel *Wheel, test_fires *Fires, sdb_arena *Arena)
+{
+    SdbMemZero(Fires, sizeof(*Fires));
+    Fires->Wheel = Wheel;
+    return SdbTimerWheelInit(Wheel, TEST_SLOT_COUNT, TEST_TIMER_COUNT, TEST_TICK, Arena);
+}
+
+/**
+ * @brief Checks that a timer fired in First, First + Period, ... up to Last, and in no other tick
+ */
+static bool
+TestFiredEvery(test_fires *Fires, u32 Timer, u64 First, u64 Period, u64 Last)
+{
+    u64 Expected = (Last >= First) ? (Last - First) / Period + 1 : 0;
+    if(Fires->Count[Timer] != Expected) {
+        SdbLogError("Timer %u fired %lu times, not %lu", Timer, Fires->Count[Timer], Expected);
+        return false;
+    }
+    for(u64 f = 0; f < Expected && f < TEST_MAX_FIRES; ++f) {
+        if(Fires->Ticks[Timer][f] != First + f * Period) {
+            SdbLogError("Timer %u fired in tick %lu, not %lu", Timer, Fires->Ticks[Timer][f],
+                        First + f * Period);
+            return false;
+        }
+    }
+    return true;
+}
+
+static sdb_errno
+TestPeriodicExpiry(void)
+{
+    u8              ArenaMem[SdbKibiByte(4)];
+    sdb_arena       Arena;
+    sdb_timer_wheel Wheel;
+    test_fires      Fires;
+    SdbArenaInit(&Arena, ArenaMem, sizeof(ArenaMem));
+    SdbTestCheck(TestWheelInit(&Wheel, &Fires, &Arena) == 0, "Failed to init wheel");
+
+    // NOTE(ingar): Timer 2 is due more than a revolution ahead, and timer 3 has a period that is
+    // rounded up to whole ticks
+    SdbTimerStart(&Wheel, 0, SDB_TIME_MS(3), SDB_TIME_MS(1));
+    SdbTimerStart(&Wheel, 1, SDB_TIME_MS(5), SDB_TIME_MS(5));
+    SdbTimerStart(&Wheel, 2, SDB_TIME_MS(20), SDB_TIME_MS(20));
+    SdbTimerStart(&Wheel, 3, SDB_TIME_US(2500), SDB_TIME_US(1500));
+
+    u64 Fired = 0;
+    for(u64 Tick = 1; Tick <= 40; ++Tick) {
+        struct timespec Now = TestAt(&Wheel, Tick);
+        Fired += SdbTimerWheelAdvance(&Wheel, &Now, TestRecordFire, &Fires);
+    }
+
+    SdbTestCheck(TestFiredEvery(&Fires, 0, 1, 3, 40), "Timer 0 fired off its period");
+    SdbTestCheck(TestFiredEvery(&Fires, 1, 5, 5, 40), "Timer 1 fired off its period");
+    SdbTestCheck(TestFiredEvery(&Fires, 2, 20, 20, 40), "Timer 2 fired off its period");
+    SdbTestCheck(TestFiredEvery(&Fires, 3, 2, 3, 40), "Timer 3 fired off its period");
+    SdbTestCheck(Fired == Fires.Count[0] + Fires.Count[1] + Fires.Count[2] + Fires.Count[3],
+                 "Advance counted %lu expiries", Fired);
+
+    // NOTE(ingar): Advancing to a tick that was processed already fires nothing
+    struct timespec Now = TestAt(&Wheel, 40);
+    SdbTestCheck(SdbTimerWheelAdvance(&Wheel, &Now, TestRecordFire, &Fires) == 0,
+                 "Timers fired twice in tick 40");
+
+    return 0;
+}
+
+static sdb_errno
+TestStopAndRestart(void)
+{
+    u8              ArenaMem[SdbKibiByte(4)];
+    sdb_arena       Arena;
+    sdb_timer_wheel Wheel;
+    test_fires      Fires;
+    SdbArenaInit(&Arena, ArenaMem, sizeof(ArenaMem));
+    SdbTestCheck(TestWheelInit(&Wheel, &Fires, &Arena) == 0, "Failed to init wheel");
+
+    SdbTimerStart(&Wheel, 0, SDB_TIME_MS(2), SDB_TIME_MS(2));
+    SdbTimerStart(&Wheel, 1, SDB_TIME_MS(2), SDB_TIME_MS(2));
+    for(u64 Tick = 1; Tick <= 4; ++Tick) {
+        struct timespec Now = TestAt(&Wheel, Tick);
+        SdbTimerWheelAdvance(&Wheel, &Now, TestRecordFire, &Fires);
+    }
+    SdbTimerStop(&Wheel, 0);
+    for(u64 Tick = 5; Tick <= 12; ++Tick) {
+        struct timespec Now = TestAt(&Wheel, Tick);
+        SdbTimerWheelAdvance(&Wheel, &Now, TestRecordFire, &Fires);
+    }
+    SdbTestCheck(TestFiredEvery(&Fires, 0, 2, 2, 4), "Stopped timer kept firing");
+    SdbTestCheck(TestFiredEvery(&Fires, 1, 2, 2, 12), "Timer fired off its period");
+    SdbTestCheck(!Wheel.Timers[0].Linked, "Stopped timer stayed in the wheel");
+
+    // NOTE(ingar): Stopped and started again before its slot is processed, timer 1 is still in
+    // the slot of tick 14, and is moved on from there to the tick it is due in now
+    SdbTimerStop(&Wheel, 1);
+    SdbTimerStart(&Wheel, 1, SDB_TIME_MS(3), SDB_TIME_MS(5));
+    SdbTimerStart(&Wheel, 0, SDB_TIME_MS(4), SDB_TIME_MS(4));
+    SdbMemZero(Fires.Count, sizeof(Fires.Count));
+    for(u64 Tick = 13; Tick <= 30; ++Tick) {
+        struct timespec Now = TestAt(&Wheel, Tick);
+        SdbTimerWheelAdvance(&Wheel, &Now, TestRecordFire, &Fires);
+    }
+    SdbTestCheck(TestFiredEvery(&Fires, 0, 16, 4, 30), "Restarted timer fired off its period");
+    SdbTestCheck(TestFiredEvery(&Fires, 1, 17, 3, 30), "Restarted timer fired off its period");
+
+    return 0;
+}
+
+/**
+ * @brief A wheel that is not advanced for many periods fires each timer once, and goes on one
+ * period from then
+ */
+static sdb_errno
+TestStall(void)
+{
+    u8              ArenaMem[SdbKibiByte(4)];
+    sdb_arena       Arena;
+    sdb_timer_wheel Wheel;
+    test_fires      Fires;
+    SdbArenaInit(&Arena, ArenaMem, sizeof(ArenaMem));
+    SdbTestCheck(TestWheelInit(&Wheel, &Fires, &Arena) == 0, "Failed to init wheel");
+
+    SdbTimerStart(&Wheel, 0, SDB_TIME_MS(3), SDB_TIME_MS(3));
+    SdbTimerStart(&Wheel, 1, SDB_TIME_MS(20), SDB_TIME_MS(20));
+    SdbTimerStart(&Wheel, 2, SDB_TIME_MS(200), SDB_TIME_MS(200));
+
+    struct timespec Now = TestAt(&Wheel, 100);
+    SdbTestCheck(SdbTimerWheelAdvance(&Wheel, &Now, TestRecordFire, &Fires) == 2,
+                 "Stalled wheel fired %lu and %lu times", Fires.Count[0], Fires.Count[1]);
+    SdbTestCheck(Fires.Count[0] == 1 && Fires.Count[1] == 1 && Fires.Count[2] == 0,
+                 "Stalled wheel fired %lu, %lu and %lu times", Fires.Count[0], Fires.Count[1],
+                 Fires.Count[2]);
+    SdbTestCheck(Wheel.Now == 100, "Wheel is at tick %lu", Wheel.Now);
+    SdbTestCheck(Wheel.Timers[0].Due == 103 && Wheel.Timers[1].Due == 120,
+                 "Timers are due in ticks %lu and %lu", Wheel.Timers[0].Due,
+                 Wheel.Timers[1].Due);
+
+    SdbMemZero(Fires.Count, sizeof(Fires.Count));
+    for(u64 Tick = 101; Tick <= 200; ++Tick) {
+        Now = TestAt(&Wheel, Tick);
+        SdbTimerWheelAdvance(&Wheel, &Now, TestRecordFire, &Fires);
+    }
+    SdbTestCheck(TestFiredEvery(&Fires, 0, 103, 3, 200), "Timer 0 did not catch up");
+    SdbTestCheck(TestFiredEvery(&Fires, 1, 120, 20, 200), "Timer 1 did not catch up");
+    SdbTestCheck(TestFiredEvery(&Fires, 2, 200, 200, 200), "Timer 2 fired off its period");
+
+    return 0;
+}
+
+static sdb_errno
+TestUntilNextTick(void)
+{
+    u8              ArenaMem[SdbKibiByte(4)];
+    sdb_arena       Arena;
+    sdb_timer_wheel Wheel;
+    test_fires      Fires;
+    SdbArenaInit(&Arena, ArenaMem, sizeof(ArenaMem));
+    SdbTestCheck(TestWheelInit(&Wheel, &Fires, &Arena) == 0, "Failed to init wheel");
+
+    struct timespec Now = TestAt(&Wheel, 7);
+    SdbTestCheck(SdbTimerWheelUntilNextTick(&Wheel, &Now) == TEST_TICK,
+                 "A tick start is %lu ns from the next", SdbTimerWheelUntilNextTick(&Wheel, &Now));
+    SdbTimeAdd(&Now, SDB_TIME_US(300));
+    SdbTestCheck(SdbTimerWheelUntilNextTick(&Wheel, &Now) == SDB_TIME_US(700),
+                 "%lu ns left of the tick", SdbTimerWheelUntilNextTick(&Wheel, &Now));
+
+    return 0;
+}
+
+int
+main(void)
+{
+    sdb_test Tests[] = {
+        { "timers fire every period", TestPeriodicExpiry },
+        { "stopped timers do not fire and can be restarted", TestStopAndRestart },
+        { "stalled wheel fires once and catches up", TestStall },
+        { "time until the next tick", TestUntilNextTick },
+    };
+
+    return SdbTestRun(Tests, SdbArrayLen(Tests));
+}
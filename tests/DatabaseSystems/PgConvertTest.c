@@ -0,0 +1,337 @@
+/**
+ * @file PgConvertTest.c
+ * @brief Tests of the conversion of pipe rows to the binary COPY format
+ *
+ * The compiled conversion plan has to give the same bytes as the conversion it replaced, which
+ * switched on the type of every column of every row, and which is kept here to compare with.
+ * Every table has the id SERIAL column every table gets. Needs no database.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(PgConvertTest);
+
+#include <src/DatabaseSystems/Postgres.h>
+#include <tests/Test.h>
+
+#define TEST_MAX_COLS 64
+
+typedef struct
+{
+    const char *Name;
+    u32         ColCount; /**< Columns, not counting id */
+    pg_oid      Types[TEST_MAX_COLS];
+} test_table;
+
+/**
+ * @brief The conversion before the plan
+ */
+static size_t
+LegacyConvertRows(pg_table_info *Ti, const char *Data, u64 ItemCount, char *To)
+{
+    size_t ConvOffset = 0;
+    for(u64 RowsProcessed = 0; RowsProcessed < ItemCount; ++RowsProcessed) {
+        const char *CurrRow = Data + (RowsProcessed * Ti->RowSize);
+
+        i16 NtwrkFieldCount = htons(Ti->ColCountNoAutoIncrements);
+        SdbMemcpy(To + ConvOffset, &NtwrkFieldCount, sizeof(NtwrkFieldCount));
+        ConvOffset += sizeof(NtwrkFieldCount);
+
+        for(i16 c = 0; c < Ti->ColCount; ++c) {
+            pg_col_metadata ColMd = Ti->ColMetadata[c];
+
+            if(ColMd.IsAutoIncrement) {
+                continue;
+            }
+
+            i32 NtwrkTypeLen = htobe32(ColMd.TypeLength);
+            SdbMemcpy(To + ConvOffset, &NtwrkTypeLen, sizeof(NtwrkTypeLen));
+            ConvOffset += sizeof(NtwrkTypeLen);
+
+            const char *ColData = CurrRow + ColMd.Offset;
+            switch(ColMd.TypeOid) {
+                case PG_INT8:
+                case PG_FLOAT8: {
+                    u64 Val;
+                    SdbMemcpy(&Val, ColData, sizeof(Val));
+                    Val = htobe64(Val);
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                case PG_INT4:
+                case PG_FLOAT4: {
+                    u32 Val;
+                    SdbMemcpy(&Val, ColData, sizeof(Val));
+                    Val = htobe32(Val);
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                case PG_INT2: {
+                    u16 Val;
+                    SdbMemcpy(&Val, ColData, sizeof(Val));
+                    Val = htobe16(Val);
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                case PG_TIMESTAMP: {
+                    time_t UTime;
+                    SdbMemcpy(&UTime, ColData, sizeof(UTime));
+                    pg_timestamp Val = htobe64(UnixToPgTimestamp(UTime));
+                    SdbMemcpy(To + ConvOffset, &Val, sizeof(Val));
+                    ConvOffset += sizeof(Val);
+                } break;
+                default:
+                    SdbLogWarning("Encountered unhandled or invalid PG oid %d", ColMd.TypeOid);
+                    break;
+            }
+        }
+    }
+
+    return ConvOffset;
+}
+
+static i32
+TestTypeLength(pg_oid Type)
+{
+    switch(Type) {
+        case PG_INT2:
+            return 2;
+        case PG_INT4:
+        case PG_FLOAT4:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+/**
+ * @brief Makes the table information PgPrepareCtx would get from the database, without the plan
+ */
+static pg_table_info *
+TestMakeTable(const test_table *Table, sdb_arena *A)
+{
+    pg_table_info *Ti            = SdbPushStructZero(A, pg_table_info);
+    Ti->TableName                = SdbStringMake(A, Table->Name);
+    Ti->ColCount                 = Table->ColCount + 1;
+    Ti->ColCountNoAutoIncrements = Table->ColCount;
+    Ti->ColMetadata              = SdbPushArrayZero(A, pg_col_metadata, Ti->ColCount);
+
+    Ti->ColMetadata[0].TypeOid         = PG_INT4;
+    Ti->ColMetadata[0].TypeLength      = 4;
+    Ti->ColMetadata[0].Offset          = -1;
+    Ti->ColMetadata[0].ColumnName      = SdbStringMake(A, "id");
+    Ti->ColMetadata[0].IsAutoIncrement = true;
+    for(u32 c = 0; c < Table->ColCount; ++c) {
+        pg_col_metadata *ColMd = &Ti->ColMetadata[c + 1];
+        ColMd->TypeOid         = Table->Types[c];
+        ColMd->TypeLength      = TestTypeLength(Table->Types[c]);
+        ColMd->Offset          = Ti->RowSize;
+        ColMd->ColumnName      = SdbStringMake(A, "col");
+        Ti->RowSize += ColMd->TypeLength;
+    }
+
+    return Ti;
+}
+
+/**
+ * @brief Fills rows with random bytes, and timestamps around now
+ */
+static void
+TestFillRows(const pg_table_info *Ti, char *Rows, u64 RowCount)
+{
+    for(u64 b = 0; b < RowCount * Ti->RowSize; ++b) {
+        Rows[b] = (char)rand();
+    }
+    for(u64 r = 0; r < RowCount; ++r) {
+        for(i16 c = 0; c < Ti->ColCount; ++c) {
+            if(Ti->ColMetadata[c].TypeOid == PG_TIMESTAMP) {
+                time_t Now = time(NULL) + r;
+                SdbMemcpy(Rows + r * Ti->RowSize + Ti->ColMetadata[c].Offset, &Now, sizeof(Now));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Checks that the plan and the old conversion give the same bytes for every row count
+ */
+static sdb_errno
+TestMatchesLegacy(const test_table *Table)
+{
+    static const u64 RowCounts[] = { 0, 1, 2, 7, 1000 };
+
+    sdb_arena      Arena;
+    u64            ArenaSize = SdbMebiByte(1);
+    pg_table_info *Ti        = NULL;
+    SdbArenaInit(&Arena, malloc(ArenaSize), ArenaSize);
+    SdbTestCheck(Arena.Mem != NULL, "Failed to allocate arena");
+    Ti = TestMakeTable(Table, &Arena);
+    SdbTestCheck(PgCompileConvPlan(Ti, &Arena) == 0, "Failed to compile plan of %s", Table->Name);
+    SdbTestCheck(Ti->ConvPlan.RowSize
+                     == sizeof(i16) + Table->ColCount * sizeof(i32) + Ti->RowSize,
+                 "Converted rows of %s are %lu bytes", Table->Name, Ti->ConvPlan.RowSize);
+
+    u64   MaxRows  = RowCounts[SdbArrayLen(RowCounts) - 1];
+    u64   ConvSize = MaxRows * Ti->ConvPlan.RowSize;
+    char *Rows     = malloc(MaxRows * Ti->RowSize);
+    char *Legacy   = malloc(ConvSize + 1);
+    char *Planned  = malloc(ConvSize + 1);
+    SdbTestCheck(Rows != NULL && Legacy != NULL && Planned != NULL, "Failed to allocate rows");
+    TestFillRows(Ti, Rows, MaxRows);
+
+    sdb_errno Ret = 0;
+    for(u64 i = 0; i < SdbArrayLen(RowCounts) && Ret == 0; ++i) {
+        u64 RowCount = RowCounts[i];
+        u64 Expected = RowCount * Ti->ConvPlan.RowSize;
+
+        // NOTE(ingar): The byte after the rows is set apart in each buffer, so writing past the
+        // rows is caught too
+        SdbMemset(Legacy, 0x11, ConvSize + 1);
+        SdbMemset(Planned, 0x22, ConvSize + 1);
+        size_t LegacySize  = LegacyConvertRows(Ti, Rows, RowCount, Legacy);
+        size_t PlannedSize = PgConvertRows(Ti, Rows, RowCount, Planned);
+        if(LegacySize != Expected || PlannedSize != Expected) {
+            SdbLogError("%lu rows of %s converted to %lu and %lu bytes, not %lu", RowCount,
+                        Table->Name, LegacySize, PlannedSize, Expected);
+            Ret = -1;
+        } else if(!SdbMemcmp(Legacy, Planned, Expected)) {
+            SdbLogError("The conversions of %lu rows of %s differ", RowCount, Table->Name);
+            Ret = -1;
+        } else if(Planned[Expected] != 0x22) {
+            SdbLogError("The conversion of %lu rows of %s wrote past them", RowCount,
+                        Table->Name);
+            Ret = -1;
+        }
+    }
+
+    free(Rows);
+    free(Legacy);
+    free(Planned);
+    free(Arena.Mem);
+    return Ret;
+}
+
+static sdb_errno
+TestShaftPower(void)
+{
+    test_table ShaftPower = {
+        .Name     = "shaft_power",
+        .ColCount = 6,
+        .Types    = { PG_INT8, PG_TIMESTAMP, PG_FLOAT8, PG_FLOAT8, PG_FLOAT8, PG_FLOAT8 },
+    };
+    return TestMatchesLegacy(&ShaftPower);
+}
+
+/**
+ * @brief A 40 column table like slowkpis, with the types mixed so the plan reorders the columns
+ */
+static sdb_errno
+TestSlowKpis(void)
+{
+    test_table SlowKpis   = { .Name = "slowkpis", .ColCount = 40 };
+    pg_oid     KpiTypes[] = { PG_FLOAT8, PG_FLOAT8, PG_FLOAT4, PG_FLOAT8, PG_INT4, PG_INT2 };
+    SlowKpis.Types[0]     = PG_INT8;
+    SlowKpis.Types[1]     = PG_TIMESTAMP;
+    for(u32 c = 2; c < SlowKpis.ColCount; ++c) {
+        SlowKpis.Types[c] = KpiTypes[c % SdbArrayLen(KpiTypes)];
+    }
+    return TestMatchesLegacy(&SlowKpis);
+}
+
+static sdb_errno
+TestEveryType(void)
+{
+    pg_oid Types[] = { PG_INT2, PG_INT4, PG_INT8, PG_FLOAT4, PG_FLOAT8, PG_TIMESTAMP };
+    for(u32 t = 0; t < SdbArrayLen(Types); ++t) {
+        test_table Table = { .Name = "single", .ColCount = 1, .Types = { Types[t] } };
+        SdbTestCheck(TestMatchesLegacy(&Table) == 0, "Columns of type %d differ", Types[t]);
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks one converted row byte for byte
+ */
+static sdb_errno
+TestKnownRow(void)
+{
+    u8        ArenaMem[SdbKibiByte(4)];
+    sdb_arena Arena;
+    SdbArenaInit(&Arena, ArenaMem, sizeof(ArenaMem));
+
+    test_table Table = {
+        .Name     = "known",
+        .ColCount = 4,
+        .Types    = { PG_INT2, PG_INT4, PG_INT8, PG_TIMESTAMP },
+    };
+    pg_table_info *Ti = TestMakeTable(&Table, &Arena);
+    SdbTestCheck(PgCompileConvPlan(Ti, &Arena) == 0, "Failed to compile plan");
+
+    // NOTE(ingar): 2000-01-01 00:00:00 UTC is 0 as a PostgreSQL timestamp
+    char   Row[2 + 4 + 8 + 8];
+    u16    Int2 = 0x0102;
+    u32    Int4 = 0x03040506;
+    u64    Int8 = 0x0708090a0b0c0d0eull;
+    time_t Time = 946684800 + 1;
+    SdbMemcpy(Row, &Int2, sizeof(Int2));
+    SdbMemcpy(Row + 2, &Int4, sizeof(Int4));
+    SdbMemcpy(Row + 6, &Int8, sizeof(Int8));
+    SdbMemcpy(Row + 14, &Time, sizeof(Time));
+
+    static const u8 Expected[] = {
+        0x00, 0x04,                                                 // Field count
+        0x00, 0x00, 0x00, 0x02, 0x01, 0x02,                         // int2
+        0x00, 0x00, 0x00, 0x04, 0x03, 0x04, 0x05, 0x06,             // int4
+        0x00, 0x00, 0x00, 0x08, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, // int8
+        0x0d, 0x0e,
+        0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0f, // timestamp, 1 s in us
+        0x42, 0x40,
+    };
+    char To[sizeof(Expected)];
+    SdbTestCheck(Ti->ConvPlan.RowSize == sizeof(Expected), "Converted row is %lu bytes",
+                 Ti->ConvPlan.RowSize);
+    SdbTestCheck(PgConvertRows(Ti, Row, 1, To) == sizeof(Expected), "Wrong converted size");
+    SdbTestCheck(SdbMemcmp(To, Expected, sizeof(Expected)), "Converted row differs");
+
+    return 0;
+}
+
+static sdb_errno
+TestUnconvertibleType(void)
+{
+    u8        ArenaMem[SdbKibiByte(4)];
+    sdb_arena Arena;
+    SdbArenaInit(&Arena, ArenaMem, sizeof(ArenaMem));
+
+    test_table     Table = { .Name = "text", .ColCount = 2, .Types = { PG_INT4, PG_TEXT } };
+    pg_table_info *Ti    = TestMakeTable(&Table, &Arena);
+    SdbTestCheck(PgCompileConvPlan(Ti, &Arena) == -SDBE_PG_ERR, "Compiled a plan for text");
+
+    return 0;
+}
+
+int
+main(void)
+{
+    srand(time(NULL));
+
+    sdb_test Tests[] = {
+        { "known row converts byte for byte", TestKnownRow },
+        { "shaft_power converts as before", TestShaftPower },
+        { "slowkpis converts as before", TestSlowKpis },
+        { "every type converts as before", TestEveryType },
+        { "columns that can not be converted are refused", TestUnconvertibleType },
+    };
+
+    return SdbTestRun(Tests, SdbArrayLen(Tests));
+}
@@ -0,0 +1,577 @@
+/**
+ * @file PgStreamTest.c
+ * @brief Tests of the COPY stream's batches, commits and rollbacks
+ *
+ * The stream talks to a stand-in server on a thread of its own, which speaks just enough of the
+ * PostgreSQL frontend/backend protocol for BEGIN, COPY FROM STDIN, COMMIT and ROLLBACK. It keeps
+ * the COPY data of the open transaction apart, and adds it to what it has committed only when
+ * the transaction commits, so the tests can compare what the stream counts as committed with
+ * what the server has. It is told to fail the next COPY or COMMIT, the way a real server fails
+ * on bad rows or a deferred constraint.
+ *
+ * Resources:
+ * Frontend/Backend Protocol, Message Formats.
+ * @link https://www.postgresql.org/docs/current/protocol-message-formats.html
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SDB_H_IMPLEMENTATION
+#include <src/Sdb.h>
+#undef SDB_H_IMPLEMENTATION
+
+SDB_LOG_REGISTER(PgStreamTest);
+
+#include <src/Common/LatencyHistogram.h>
+#include <src/Common/Time.h>
+#include <src/DatabaseSystems/Postgres.h>
+#include <tests/Test.h>
+
+#define TEST_STAGE_CAP   SdbKibiByte(64)
+#define TEST_COPY_HEADER 19
+#define TEST_WAIT        SDB_TIME_S(5)
+
+/**
+ * @brief Stand-in server, and what it has been told and seen
+ */
+typedef struct
+{
+    int       ListenFd;
+    u16       Port;
+    pthread_t Thread;
+
+    atomic_bool FailCopy;   /**< Fail the next COPY once its data ends */
+    atomic_bool FailCommit; /**< Roll back the next transaction that commits */
+
+    atomic_ulong Begins;         /**< Transactions begun */
+    atomic_ulong Copies;         /**< COPY commands that started */
+    atomic_ulong Commits;        /**< Transactions committed */
+    atomic_ulong Rollbacks;      /**< Transactions rolled back */
+    atomic_ulong CommittedBytes; /**< COPY data of the committed transactions, headers excluded */
+} test_server;
+
+static bool
+TestSrvRecv(int Fd, void *Buf, u64 Len)
+{
+    for(u64 Got = 0; Got < Len;) {
+        ssize_t Ret = recv(Fd, (char *)Buf + Got, Len - Got, 0);
+        if(Ret <= 0) {
+            return false;
+        }
+        Got += Ret;
+    }
+    return true;
+}
+
+static void
+TestSrvSend(int Fd, char Type, const void *Body, u32 Len)
+{
+    char Msg[256];
+    u32  NtwrkLen = htonl(Len + sizeof(NtwrkLen));
+    SdbAssert(Len + 5 <= sizeof(Msg), "Message of %u bytes is too long", Len);
+    Msg[0] = Type;
+    SdbMemcpy(Msg + 1, &NtwrkLen, sizeof(NtwrkLen));
+    SdbMemcpy(Msg + 5, Body, Len);
+    send(Fd, Msg, Len + 5, MSG_NOSIGNAL);
+}
+
+static void
+TestSrvSendStr(int Fd, char Type, const char *Str)
+{
+    TestSrvSend(Fd, Type, Str, strlen(Str) + 1);
+}
+
+static void
+TestSrvParam(int Fd, const char *Name, const char *Value)
+{
+    char Body[128];
+    int  Len = snprintf(Body, sizeof(Body), "%s%c%s", Name, '\0', Value);
+    TestSrvSend(Fd, 'S', Body, Len + 1);
+}
+
+static void
+TestSrvError(int Fd, const char *Message)
+{
+    char Body[200];
+    int  Len = snprintf(Body, sizeof(Body) - 1, "SERROR%cVERROR%cCXX000%cM%s", '\0', '\0', '\0',
+                        Message);
+    Len      = SdbMin(Len, (int)sizeof(Body) - 2);
+
+    // NOTE(ingar): The message field and the fields end with a null each
+    Body[Len + 1] = '\0';
+    TestSrvSend(Fd, 'E', Body, Len + 2);
+}
+
+static void
+TestSrvReady(int Fd, char TxState)
+{
+    TestSrvSend(Fd, 'Z', &TxState, 1);
+}
+
+/**
+ * @brief Reads the body of a message into Body, grown to hold it, and ends it with a null
+ */
+static bool
+TestSrvBody(int Fd, u32 NtwrkLen, char **Body, u64 *BodyCap, u64 *BodyLen)
+{
+    *BodyLen = ntohl(NtwrkLen) - sizeof(NtwrkLen);
+    if(*BodyLen + 1 > *BodyCap) {
+        *BodyCap = *BodyLen + 1;
+        *Body    = realloc(*Body, *BodyCap);
+    }
+    if(*Body == NULL || !TestSrvRecv(Fd, *Body, *BodyLen)) {
+        return false;
+    }
+    (*Body)[*BodyLen] = '\0';
+    return true;
+}
+
+/**
+ * @brief Reads a message
+ *
+ * @return char Type of the message, 0 once the connection is closed
+ */
+static char
+TestSrvMessage(int Fd, char **Body, u64 *BodyCap, u64 *BodyLen)
+{
+    char Header[5];
+    u32  NtwrkLen;
+    if(!TestSrvRecv(Fd, Header, sizeof(Header))) {
+        return 0;
+    }
+    SdbMemcpy(&NtwrkLen, Header + 1, sizeof(NtwrkLen));
+    return TestSrvBody(Fd, NtwrkLen, Body, BodyCap, BodyLen) ? Header[0] : 0;
+}
+
+/**
+ * @brief Takes the COPY data that follows CopyInResponse, and answers how it ended
+ *
+ * @return bool Whether the COPY succeeded
+ */
+static bool
+TestSrvCopy(test_server *Server, int Fd, char **Body, u64 *BodyCap, u64 *TxBytes)
+{
+    u64 CopyBytes = 0;
+    for(;;) {
+        u64  BodyLen;
+        char Type = TestSrvMessage(Fd, Body, BodyCap, &BodyLen);
+        if(Type == 'd') {
+            CopyBytes += BodyLen;
+        } else if(Type == 'c') {
+            if(atomic_exchange(&Server->FailCopy, false)) {
+                TestSrvError(Fd, "Failed by the test");
+                return false;
+            }
+            *TxBytes += CopyBytes - TEST_COPY_HEADER;
+            TestSrvSendStr(Fd, 'C', "COPY 0");
+            return true;
+        } else if(Type == 'f') {
+            TestSrvError(Fd, *Body);
+            return false;
+        } else if(Type == 0) {
+            return false;
+        }
+    }
+}
+
+/**
+ * @brief Serves one connection after the other, each from startup to Terminate
+ */
+static void *
+TestSrvThread(void *Arg)
+{
+    test_server *Server  = Arg;
+    char        *Body    = NULL;
+    u64          BodyCap = 0;
+    u64          BodyLen;
+    int          Fd;
+
+    while((Fd = accept(Server->ListenFd, NULL, NULL)) >= 0) {
+        // NOTE(ingar): The startup packet has no type byte, and is answered with everything a
+        // server that trusts the client sends
+        u32 NtwrkLen;
+        if(!TestSrvRecv(Fd, &NtwrkLen, sizeof(NtwrkLen))
+           || !TestSrvBody(Fd, NtwrkLen, &Body, &BodyCap, &BodyLen)) {
+            close(Fd);
+            continue;
+        }
+
+        u32 AuthOk     = htonl(0);
+        u32 KeyData[2] = { htonl(getpid()), htonl(1) };
+        TestSrvSend(Fd, 'R', &AuthOk, sizeof(AuthOk));
+        TestSrvParam(Fd, "server_version", "15.0");
+        TestSrvParam(Fd, "client_encoding", "UTF8");
+        TestSrvParam(Fd, "standard_conforming_strings", "on");
+        TestSrvParam(Fd, "integer_datetimes", "on");
+        TestSrvSend(Fd, 'K', KeyData, sizeof(KeyData));
+        TestSrvReady(Fd, 'I');
+
+        char TxState = 'I';
+        u64  TxBytes = 0;
+        char Type;
+        while((Type = TestSrvMessage(Fd, &Body, &BodyCap, &BodyLen)) != 0 && Type != 'X') {
+            if(Type != 'Q') {
+                TestSrvError(Fd, "Unexpected message");
+            } else if(strcmp(Body, "BEGIN") == 0) {
+                atomic_fetch_add(&Server->Begins, 1);
+                TxState = 'T';
+                TxBytes = 0;
+                TestSrvSendStr(Fd, 'C', "BEGIN");
+            } else if(strncmp(Body, "COPY ", 5) == 0 && TxState == 'T') {
+                // NOTE(ingar): Binary format, and no column formats, which libpq does not need
+                char CopyIn[3] = { 1, 0, 0 };
+                atomic_fetch_add(&Server->Copies, 1);
+                TestSrvSend(Fd, 'G', CopyIn, sizeof(CopyIn));
+                if(!TestSrvCopy(Server, Fd, &Body, &BodyCap, &TxBytes)) {
+                    TxState = 'E';
+                }
+            } else if(strcmp(Body, "COMMIT") == 0) {
+                if(TxState == 'T' && !atomic_exchange(&Server->FailCommit, false)) {
+                    atomic_fetch_add(&Server->Commits, 1);
+                    atomic_fetch_add(&Server->CommittedBytes, TxBytes);
+                    TestSrvSendStr(Fd, 'C', "COMMIT");
+                } else {
+                    atomic_fetch_add(&Server->Rollbacks, 1);
+                    TestSrvSendStr(Fd, 'C', "ROLLBACK");
+                }
+                TxState = 'I';
+            } else if(strcmp(Body, "ROLLBACK") == 0) {
+                atomic_fetch_add(&Server->Rollbacks, TxState != 'I');
+                TxState = 'I';
+                TestSrvSendStr(Fd, 'C', "ROLLBACK");
+            } else {
+                TestSrvError(Fd, (TxState == 'E') ? "Transaction is aborted" : Body);
+                TxState = (TxState == 'I') ? 'I' : 'E';
+            }
+            TestSrvReady(Fd, TxState);
+        }
+        close(Fd);
+    }
+
+    free(Body);
+    return NULL;
+}
+
+static sdb_errno
+TestSrvStart(test_server *Server)
+{
+    SdbMemZero(Server, sizeof(*Server));
+    struct sockaddr_in Addr    = { .sin_family      = AF_INET,
+                                   .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t          AddrLen = sizeof(Addr);
+
+    Server->ListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if(Server->ListenFd == -1 || bind(Server->ListenFd, (struct sockaddr *)&Addr, AddrLen) != 0
+       || listen(Server->ListenFd, 4) != 0
+       || getsockname(Server->ListenFd, (struct sockaddr *)&Addr, &AddrLen) != 0) {
+        SdbLogError("Failed to listen on the loopback interface: %s", strerror(errno));
+        return -errno;
+    }
+    Server->Port = ntohs(Addr.sin_port);
+
+    return -pthread_create(&Server->Thread, NULL, TestSrvThread, Server);
+}
+
+/**
+ * @brief Stops accepting connections, and waits for the one being served to close
+ */
+static void
+TestSrvStop(test_server *Server)
+{
+    shutdown(Server->ListenFd, SHUT_RDWR);
+    pthread_join(Server->Thread, NULL);
+    close(Server->ListenFd);
+}
+
+/**
+ * @brief Test state shared by every test: the server, and a stream connected to it
+ */
+typedef struct
+{
+    test_server      Server;
+    PGconn          *Conn;
+    pg_copy_stream   Stream;
+    sdb_latency_hist Hist;
+    sdb_arena        Arena;
+    pg_table_info   *TableA; /**< bigint and double precision */
+    pg_table_info   *TableB; /**< smallint */
+    char             Rows[SdbKibiByte(4)];
+} test_ctx;
+
+static test_ctx Ctx;
+
+static pg_table_info *
+TestMakeTable(const char *Name, const char *CopyCommand, const pg_oid *Types, i16 ColCount)
+{
+    pg_table_info *Ti            = SdbPushStructZero(&Ctx.Arena, pg_table_info);
+    Ti->TableName                = SdbStringMake(&Ctx.Arena, Name);
+    Ti->CopyCommand              = SdbStringMake(&Ctx.Arena, CopyCommand);
+    Ti->ColCount                 = ColCount;
+    Ti->ColCountNoAutoIncrements = ColCount;
+    Ti->ColMetadata              = SdbPushArrayZero(&Ctx.Arena, pg_col_metadata, ColCount);
+    for(i16 c = 0; c < ColCount; ++c) {
+        Ti->ColMetadata[c].TypeOid    = Types[c];
+        Ti->ColMetadata[c].TypeLength = (Types[c] == PG_INT2) ? 2 : 8;
+        Ti->ColMetadata[c].Offset     = Ti->RowSize;
+        Ti->ColMetadata[c].ColumnName = SdbStringMake(&Ctx.Arena, "col");
+        Ti->RowSize += Ti->ColMetadata[c].TypeLength;
+    }
+
+    return (PgCompileConvPlan(Ti, &Ctx.Arena) == 0) ? Ti : NULL;
+}
+
+/**
+ * @brief Pumps the stream until it takes rows again
+ *
+ * @return sdb_errno What the last pump returned, -ETIMEDOUT if the stream did not get ready
+ */
+static sdb_errno
+TestPumpUntilReady(void)
+{
+    sdb_errno       Ret = 0;
+    struct timespec Deadline, Now;
+    SdbTimeMonotonic(&Deadline);
+    SdbTimeAdd(&Deadline, TEST_WAIT);
+    while(!PgStreamReady(&Ctx.Stream)) {
+        SdbTimeMonotonic(&Now);
+        if(SdbTimeoutExpired(&Deadline, &Now)) {
+            return -ETIMEDOUT;
+        }
+        struct pollfd ConnPoll = { .fd     = PQsocket(Ctx.Conn),
+                                   .events = PgStreamEvents(&Ctx.Stream) };
+        poll(&ConnPoll, 1, 100);
+        Ret = PgStreamPump(&Ctx.Stream);
+    }
+
+    return Ret;
+}
+
+/**
+ * @brief Appends rows of a table, and pumps the stream until it has taken them
+ */
+static sdb_errno
+TestAppend(pg_table_info *Ti, u64 RowCount, const sdp_stamps *Stamps)
+{
+    SdbAssert(RowCount * Ti->RowSize <= sizeof(Ctx.Rows), "Too many rows");
+    sdb_errno Ret = PgStreamAppend(&Ctx.Stream, Ti, Ctx.Rows, RowCount, Stamps);
+    if(Ret != 0) {
+        return Ret;
+    }
+    return TestPumpUntilReady();
+}
+
+static sdb_errno
+TestSetUp(void)
+{
+    static u8 ArenaMem[SdbMebiByte(1)];
+    SdbArenaInit(&Ctx.Arena, ArenaMem, sizeof(ArenaMem));
+    SdbMemset(Ctx.Rows, 0x5a, sizeof(Ctx.Rows));
+
+    pg_oid TypesA[] = { PG_INT8, PG_FLOAT8 };
+    pg_oid TypesB[] = { PG_INT2 };
+    Ctx.TableA = TestMakeTable("a", "COPY a(x, y) FROM STDIN WITH (FORMAT binary)", TypesA, 2);
+    Ctx.TableB = TestMakeTable("b", "COPY b(z) FROM STDIN WITH (FORMAT binary)", TypesB, 1);
+    SdbTestCheck(Ctx.TableA != NULL && Ctx.TableB != NULL, "Failed to make tables");
+
+    SdbTestCheck(TestSrvStart(&Ctx.Server) == 0, "Failed to start the stand-in server");
+
+    char ConnInfo[256];
+    snprintf(ConnInfo, sizeof(ConnInfo),
+             "host=127.0.0.1 port=%u user=test dbname=test sslmode=disable gssencmode=disable "
+             "connect_timeout=5",
+             Ctx.Server.Port);
+    Ctx.Conn = PQconnectdb(ConnInfo);
+    SdbTestCheck(PQstatus(Ctx.Conn) == CONNECTION_OK, "Failed to connect: %s",
+                 PQerrorMessage(Ctx.Conn));
+    SdbTestCheck(PgStreamInit(&Ctx.Stream, Ctx.Conn, 0, 0, 0, TEST_STAGE_CAP, &Ctx.Hist,
+                              &Ctx.Arena)
+                     == 0,
+                 "Failed to init stream");
+
+    return 0;
+}
+
+static void
+TestTearDown(void)
+{
+    if(Ctx.Conn != NULL) {
+        PQfinish(Ctx.Conn);
+    }
+    TestSrvStop(&Ctx.Server);
+}
+
+/**
+ * @brief Appends to two tables go into one transaction, and every one of them is committed
+ */
+static sdb_errno
+TestCommit(void)
+{
+    pg_copy_stream *Stream = &Ctx.Stream;
+    test_server    *Server = &Ctx.Server;
+    u64             Begins = Server->Begins, Copies = Server->Copies;
+    u64             Bytes  = Server->CommittedBytes;
+
+    struct timespec Now;
+    SdbTimeNow(&Now);
+    sdp_stamps Stamps = { .Count = 2 };
+    Stamps.Stamps[0]  = (sdp_stamp){ SdbTimespecNs(&Now), 0 };
+    Stamps.Stamps[1]  = (sdp_stamp){ SdbTimespecNs(&Now), 3 * Ctx.TableA->RowSize };
+
+    SdbTestCheck(TestAppend(Ctx.TableA, 10, &Stamps) == 0, "Append failed");
+    SdbTestCheck(TestAppend(Ctx.TableA, 20, NULL) == 0, "Append failed");
+    SdbTestCheck(TestAppend(Ctx.TableB, 7, NULL) == 0, "Append failed");
+    SdbTestCheck(TestAppend(Ctx.TableA, 1, NULL) == 0, "Append failed");
+    SdbTestCheck(Stream->CommitCount == 0 && Stream->BatchAppends == 4,
+                 "%lu batches committed, %lu appends in the batch", Stream->CommitCount,
+                 Stream->BatchAppends);
+    SdbTestCheck(PgStreamFinish(Stream, TEST_WAIT) == 0, "Finish failed");
+
+    SdbTestCheck(Stream->CommitCount == 1 && Stream->CommittedRows == 38
+                     && Stream->CommittedAppends == 4,
+                 "Committed %lu batches, %lu rows and %lu appends", Stream->CommitCount,
+                 Stream->CommittedRows, Stream->CommittedAppends);
+    SdbTestCheck(Stream->RollbackCount == 0 && Stream->LostRows == 0, "Rolled back %lu rows",
+                 Stream->LostRows);
+    SdbTestCheck(Server->Begins == Begins + 1 && Server->Copies == Copies + 3,
+                 "Server saw %lu transactions and %lu COPY commands", Server->Begins - Begins,
+                 Server->Copies - Copies);
+    SdbTestCheck(Server->CommittedBytes - Bytes
+                     == 31 * Ctx.TableA->ConvPlan.RowSize + 7 * Ctx.TableB->ConvPlan.RowSize,
+                 "Server committed %lu bytes", Server->CommittedBytes - Bytes);
+    SdbTestCheck(Ctx.Hist.Count == 10, "Latency of %lu rows recorded", Ctx.Hist.Count);
+
+    return 0;
+}
+
+/**
+ * @brief A COPY the server fails rolls back the batch, and the next batch commits
+ */
+static sdb_errno
+TestCopyFails(void)
+{
+    pg_copy_stream *Stream    = &Ctx.Stream;
+    test_server    *Server    = &Ctx.Server;
+    u64             Rollbacks = Stream->RollbackCount, Lost = Stream->LostRows;
+    u64             Appends   = Stream->CommittedAppends, Commits = Stream->CommitCount;
+    u64             Bytes     = Server->CommittedBytes;
+
+    SdbTestCheck(TestAppend(Ctx.TableA, 10, NULL) == 0, "Append failed");
+    SdbTestCheck(TestAppend(Ctx.TableA, 15, NULL) == 0, "Append failed");
+    atomic_store(&Server->FailCopy, true);
+    SdbTestCheck(PgStreamFinish(Stream, TEST_WAIT) == -SDBE_PG_ERR, "Failed COPY committed");
+
+    SdbTestCheck(Stream->RollbackCount == Rollbacks + 1 && Stream->LostRows == Lost + 25,
+                 "Rolled back %lu batches and %lu rows", Stream->RollbackCount - Rollbacks,
+                 Stream->LostRows - Lost);
+    SdbTestCheck(Stream->CommittedAppends == Appends && Stream->CommitCount == Commits,
+                 "Rolled back appends were counted as committed");
+    SdbTestCheck(Stream->Phase == PgStream_Idle && Stream->BatchAppends == 0
+                     && PgStreamReady(Stream),
+                 "Stream was left in phase %d", Stream->Phase);
+    SdbTestCheck(Server->CommittedBytes == Bytes, "Server committed rolled back rows");
+
+    SdbTestCheck(TestAppend(Ctx.TableA, 5, NULL) == 0, "Append after rollback failed");
+    SdbTestCheck(PgStreamFinish(Stream, TEST_WAIT) == 0, "Finish after rollback failed");
+    SdbTestCheck(Stream->CommittedAppends == Appends + 1 && Stream->CommitCount == Commits + 1,
+                 "Committed %lu appends after the rollback", Stream->CommittedAppends - Appends);
+    SdbTestCheck(Server->CommittedBytes - Bytes == 5 * Ctx.TableA->ConvPlan.RowSize,
+                 "Server committed %lu bytes", Server->CommittedBytes - Bytes);
+
+    return 0;
+}
+
+/**
+ * @brief Rows staged for another table are lost along with the batch whose COPY fails
+ */
+static sdb_errno
+TestStagedRowsLost(void)
+{
+    pg_copy_stream *Stream    = &Ctx.Stream;
+    test_server    *Server    = &Ctx.Server;
+    u64             Rollbacks = Stream->RollbackCount, Lost = Stream->LostRows;
+    u64             Appends   = Stream->CommittedAppends, Bytes = Server->CommittedBytes;
+
+    SdbTestCheck(TestAppend(Ctx.TableA, 10, NULL) == 0, "Append failed");
+    atomic_store(&Server->FailCopy, true);
+
+    // NOTE(ingar): The rows for B end the COPY of A, and wait in the stage until it has ended
+    sdb_errno Ret = PgStreamAppend(Stream, Ctx.TableB, Ctx.Rows, 4, NULL);
+    if(Ret == 0) {
+        SdbTestCheck(Stream->StageRows == 4, "Rows for B were not staged");
+        Ret = TestPumpUntilReady();
+    }
+    SdbTestCheck(Ret == -SDBE_PG_ERR, "Failed COPY was not rolled back");
+
+    SdbTestCheck(Stream->RollbackCount == Rollbacks + 1 && Stream->LostRows == Lost + 14,
+                 "Rolled back %lu batches and %lu rows", Stream->RollbackCount - Rollbacks,
+                 Stream->LostRows - Lost);
+    SdbTestCheck(Stream->CommittedAppends == Appends && Stream->StageRows == 0,
+                 "Rolled back appends were kept");
+
+    SdbTestCheck(TestAppend(Ctx.TableB, 4, NULL) == 0, "Append after rollback failed");
+    SdbTestCheck(PgStreamFinish(Stream, TEST_WAIT) == 0, "Finish after rollback failed");
+    SdbTestCheck(Stream->CommittedAppends == Appends + 1, "Committed %lu appends",
+                 Stream->CommittedAppends - Appends);
+    SdbTestCheck(Server->CommittedBytes - Bytes == 4 * Ctx.TableB->ConvPlan.RowSize,
+                 "Server committed %lu bytes", Server->CommittedBytes - Bytes);
+
+    return 0;
+}
+
+/**
+ * @brief A COMMIT that rolls the transaction back loses the batch, though every command
+ * succeeded
+ */
+static sdb_errno
+TestCommitRolledBack(void)
+{
+    pg_copy_stream *Stream    = &Ctx.Stream;
+    test_server    *Server    = &Ctx.Server;
+    u64             Rollbacks = Stream->RollbackCount, Lost = Stream->LostRows;
+    u64             Appends   = Stream->CommittedAppends, Rows = Stream->CommittedRows;
+
+    SdbTestCheck(TestAppend(Ctx.TableA, 8, NULL) == 0, "Append failed");
+    SdbTestCheck(TestAppend(Ctx.TableB, 2, NULL) == 0, "Append failed");
+    atomic_store(&Server->FailCommit, true);
+    SdbTestCheck(PgStreamFinish(Stream, TEST_WAIT) == -SDBE_PG_ERR, "Rolled back COMMIT passed");
+
+    SdbTestCheck(Stream->RollbackCount == Rollbacks + 1 && Stream->LostRows == Lost + 10,
+                 "Rolled back %lu batches and %lu rows", Stream->RollbackCount - Rollbacks,
+                 Stream->LostRows - Lost);
+    SdbTestCheck(Stream->CommittedAppends == Appends && Stream->CommittedRows == Rows,
+                 "Rolled back rows were counted as committed");
+    SdbTestCheck(PQtransactionStatus(Ctx.Conn) == PQTRANS_IDLE,
+                 "Connection was left in a transaction");
+
+    return 0;
+}
+
+int
+main(void)
+{
+    sdb_test Tests[] = {
+        { "appends to two tables commit in one batch", TestCommit },
+        { "failed COPY rolls back the batch only", TestCopyFails },
+        { "staged rows are lost with the batch", TestStagedRowsLost },
+        { "COMMIT that rolls back loses the batch", TestCommitRolledBack },
+    };
+
+    if(TestSetUp() != 0) {
+        TestTearDown();
+        return EXIT_FAILURE;
+    }
+    int Ret = SdbTestRun(Tests, SdbArrayLen(Tests));
+    TestTearDown();
+
+    return Ret;
+}
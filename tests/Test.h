@@ -0,0 +1,54 @@
+/**
+ * @file Test.h
+ * @brief Checks and runner shared by the tests built by `make test`
+ *
+ * Every test program registers its own log module, includes this file, and passes its tests to
+ * SdbTestRun from main. A test returns 0 if it passed, and a failed check logs where and why
+ * and returns -1 from the test.
+ */
+
+#ifndef SDB_TEST_H
+#define SDB_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <src/Sdb.h>
+
+/**
+ * @brief Fails the test it is used in unless Cond holds
+ */
+#define SdbTestCheck(Cond, Fmt, ...)                                                               \
+    do {                                                                                           \
+        if(!(Cond)) {                                                                              \
+            SdbLogError("%s:%d: %s: " Fmt, __func__, __LINE__, #Cond, ##__VA_ARGS__);              \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while(0)
+
+typedef struct
+{
+    const char *Name;
+    sdb_errno (*Run)(void);
+} sdb_test;
+
+/**
+ * @brief Runs every test, and prints a line for each
+ *
+ * @return int EXIT_SUCCESS if every test passed
+ */
+static inline int
+SdbTestRun(const sdb_test *Tests, u64 TestCount)
+{
+    u64 FailedCount = 0;
+    for(u64 t = 0; t < TestCount; ++t) {
+        bool Passed = Tests[t].Run() == 0;
+        FailedCount += !Passed;
+        printf("%-6s %s\n", Passed ? "ok" : "FAILED", Tests[t].Name);
+        fflush(stdout);
+    }
+
+    return (FailedCount == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif